@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fat.h"
+#include "fat_cache.h"
+#include "fat_dir_cache.h"
+#include "image_gen.h"
+#include "reader.h"
+
+/*
+ * Generates reproducible images and measures mount, path open, sequential and
+ * random reads and directory listing on each, without and with the caches.
+ * Device reads are counted through the read callback.
+ * Usage: fat_benchmark [directory for the images]
+ */
+
+#define CACHE_SIZE (256*1024)
+#define DIR_CACHE_SIZE (64*1024)
+#define READ_BUFFER_SIZE (64*1024)
+#define RANDOM_READ_SIZE (4096)
+#define RANDOM_READS (4096)
+#define MOUNTS (200)
+#define LIST_ENTRIES (16)
+
+struct scenario {
+  const char *name;
+  struct image_gen_params params;
+};
+
+static const struct scenario scenarios[] = {
+	{"fat16-2k", {FAT16, 4, 60000, 16, 64, 16384, 0, 1, 0}},
+	{"fat16-2k-frag30", {FAT16, 4, 60000, 16, 64, 16384, 30, 1, 0}},
+	{"fat16-16k", {FAT16, 32, 20000, 16, 64, 65536, 0, 1, 0}},
+	{"fat32-512", {FAT32, 1, 70000, 16, 64, 16384, 0, 1, 0}},
+	{"fat32-4k-frag30", {FAT32, 8, 70000, 16, 64, 16384, 30, 1, 0}},
+	{"fat32-fanout", {FAT32, 8, 70000, 4, 1024, 1024, 0, 1, 0}},
+};
+
+struct counted_reader {
+  reader image;
+  uint64_t reads;
+  uint64_t bytes;
+};
+
+struct result {
+  double mount_us, mount_reads;
+  double geometry_mount_us;
+  double open_us, open_reads;
+  double seq_mb_s, seq_reads_mb;
+  double random_us, random_reads;
+  double list_entries_s, list_reads_dir;
+};
+
+static void *counted_read_bytes(void *ctx, uint64_t address, uint32_t bytes, void *buffer) {
+	struct counted_reader *counted = ctx;
+
+	counted->reads++;
+	counted->bytes += bytes;
+
+	return reader_read_bytes(&counted->image, address, bytes, buffer);
+}
+
+static double now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec*1e6 + (double) ts.tv_nsec/1e3;
+}
+
+static uint32_t next_random(uint32_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
+}
+
+static int setup(fat_drive *drive, struct counted_reader *counted, int cached, fat_cache *cache,
+				 fat_dir_cache *dir_cache, void **fat_table) {
+	static uint8_t cache_memory[CACHE_SIZE], dir_cache_memory[DIR_CACHE_SIZE];
+
+	if (fat.mount(drive, IMAGE_GEN_SECTOR_SIZE, counted_read_bytes, counted))
+		return -1;
+
+	if (!cached)
+		return 0;
+
+	if (fat_cache_init(cache, cache_memory, sizeof(cache_memory), IMAGE_GEN_SECTOR_SIZE) ||
+		fat.attach_cache(drive, cache) || fat_dir_cache_init(dir_cache, dir_cache_memory, sizeof(dir_cache_memory)))
+		return -1;
+	fat.attach_dir_cache(drive, dir_cache);
+
+	if ((*fat_table = malloc(fat.fat_table_size(drive)))==NULL ||
+		fat.attach_fat_table(drive, *fat_table, fat.fat_table_size(drive)))
+		return -1;
+
+	return 0;
+}
+
+static int run(const struct image_gen_params *params, const char *path, int cached, struct result *result) {
+	static uint8_t buffer[READ_BUFFER_SIZE];
+	static fat_dir_entry entries[LIST_ENTRIES];
+	struct counted_reader counted;
+	fat_drive drive;
+	fat_geometry geometry;
+	fat_cache cache;
+	fat_dir_cache dir_cache;
+	void *fat_table = NULL;
+	char file_path[32];
+	fat_file file;
+	fat_dir dir;
+	fat_dir_iter iter;
+	uint32_t dir_index, file_index, i, rng = params->seed, files = params->dirs*params->files_per_dir;
+	uint64_t read_bytes, listed;
+	int32_t count;
+	double start;
+	int ret = -1;
+
+	if (reader_open(&counted.image, path))
+		return -1;
+
+	//Mount
+	counted.reads = 0;
+	start = now_us();
+	for (i = 0; i < MOUNTS; i++)
+		if (fat.mount(&drive, IMAGE_GEN_SECTOR_SIZE, counted_read_bytes, &counted))
+			goto out;
+	result->mount_us = (now_us() - start)/MOUNTS;
+	result->mount_reads = (double) counted.reads/MOUNTS;
+
+	//Mount from the saved geometry
+	fat.geometry_save(&drive, &geometry);
+	start = now_us();
+	for (i = 0; i < MOUNTS; i++)
+		if (fat.mount_geometry(&drive, &geometry, counted_read_bytes, &counted))
+			goto out;
+	result->geometry_mount_us = (now_us() - start)/MOUNTS;
+
+	if (setup(&drive, &counted, cached, &cache, &dir_cache, &fat_table))
+		goto out;
+
+	//Path open
+	counted.reads = 0;
+	start = now_us();
+	for (dir_index = 0; dir_index < params->dirs; dir_index++)
+		for (file_index = 0; file_index < params->files_per_dir; file_index++) {
+			image_gen_file_path(file_path, dir_index, file_index);
+			if (fat.file_open(&drive, file_path, &file))
+				goto out;
+		}
+	result->open_us = (now_us() - start)/files;
+	result->open_reads = (double) counted.reads/files;
+
+	//Sequential reads of whole files
+	counted.reads = 0;
+	read_bytes = 0;
+	start = now_us();
+	for (dir_index = 0; dir_index < params->dirs; dir_index++)
+		for (file_index = 0; file_index < params->files_per_dir; file_index++) {
+			image_gen_file_path(file_path, dir_index, file_index);
+			if (fat.file_open(&drive, file_path, &file))
+				goto out;
+			while ((i = fat.file_read(&drive, &file, buffer, sizeof(buffer))))
+				read_bytes += i;
+		}
+	result->seq_mb_s = (double) read_bytes/(now_us() - start);
+	result->seq_reads_mb = read_bytes ? (double) counted.reads/((double) read_bytes/(1024*1024)) : 0;
+
+	//Random reads inside random files
+	counted.reads = 0;
+	start = now_us();
+	for (i = 0; i < RANDOM_READS; i++) {
+		image_gen_file_path(file_path, next_random(&rng)%params->dirs, next_random(&rng)%params->files_per_dir);
+		if (fat.file_open(&drive, file_path, &file) ||
+			fat.file_seek(&drive, &file, params->file_size ? next_random(&rng)%params->file_size : 0))
+			goto out;
+		fat.file_read(&drive, &file, buffer, RANDOM_READ_SIZE);
+	}
+	result->random_us = (now_us() - start)/RANDOM_READS;
+	result->random_reads = (double) counted.reads/RANDOM_READS;
+
+	//Listing
+	counted.reads = 0;
+	listed = 0;
+	start = now_us();
+	for (dir_index = 0; dir_index < params->dirs; dir_index++) {
+		image_gen_dir_path(file_path, dir_index);
+		fat.dir_get_root(&dir);
+		if (fat.dir_change(&drive, &dir, file_path + 1) ||
+			fat.dir_iter_init(&drive, &dir, &iter, buffer, sizeof(buffer)))
+			goto out;
+		while ((count = fat.dir_read(&drive, &iter, entries, LIST_ENTRIES)) > 0)
+			listed += (uint64_t) count;
+	}
+	result->list_entries_s = (double) listed/((now_us() - start)/1e6);
+	result->list_reads_dir = (double) counted.reads/params->dirs;
+
+	ret = 0;
+
+out:
+	free(fat_table);
+	reader_close(&counted.image);
+
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	const char *directory = argc > 1 ? argv[1] : ".";
+	struct result result;
+	char path[4096];
+	uint32_t i;
+	int cached;
+
+	printf("%-16s %-6s %9s %6s %7s %9s %6s %9s %7s %9s %6s %11s %7s\n", "scenario", "mode",
+		   "mount_us", "rd/op", "geo_us", "open_us", "rd/op", "seq_MB/s", "rd/MB", "rand_us", "rd/op", "list_ent/s", "rd/dir");
+
+	for (i = 0; i < sizeof(scenarios)/sizeof(scenarios[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s.img", directory, scenarios[i].name);
+
+		if (image_gen_write(path, &scenarios[i].params)) {
+			fprintf(stderr, "Can't generate %s\n", path);
+			return 1;
+		}
+
+		for (cached = 0; cached < 2; cached++) {
+			if (run(&scenarios[i].params, path, cached, &result)) {
+				fprintf(stderr, "%s failed\n", scenarios[i].name);
+				unlink(path);
+				return 1;
+			}
+
+			printf("%-16s %-6s %9.2f %6.1f %7.2f %9.2f %6.1f %9.1f %7.1f %9.2f %6.1f %11.0f %7.1f\n", scenarios[i].name,
+				   cached ? "cached" : "plain", result.mount_us, result.mount_reads, result.geometry_mount_us, result.open_us, result.open_reads,
+				   result.seq_mb_s, result.seq_reads_mb, result.random_us, result.random_reads,
+				   result.list_entries_s, result.list_reads_dir);
+		}
+
+		unlink(path);
+	}
+
+	return 0;
+}
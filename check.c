@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "fat.h"
+#include "fat_check.h"
+#include "fat_index.h"
+#include "reader.h"
+
+/*
+ * Read only check of an image: broken, looping and cross-linked chains, sizes not
+ * matching the chains, lost clusters, and how fragmented the files are.
+ * Files in at least threshold pieces are listed (default 8, 0 to list none).
+ * Exits with 1 if the volume has problems, 2 if it could not be checked.
+ * Usage: fat_check <image> [threshold]
+ */
+
+#define INDEX_MIN_SIZE (1024*1024u)
+#define INDEX_MAX_SIZE (1024*1024*1024u)
+#define DEFAULT_THRESHOLD (8)
+#define PATH_SIZE (4096)
+
+static const char *problem_names[] = {
+	[FAT_CHECK_CROSS_LINKED] = "cross-linked",
+	[FAT_CHECK_BROKEN_CHAIN] = "broken chain",
+	[FAT_CHECK_LOOP] = "loop",
+	[FAT_CHECK_SIZE_MISMATCH] = "size mismatch",
+	[FAT_CHECK_FRAGMENTED] = "fragmented",
+	[FAT_CHECK_LOST_CHAIN] = "lost chain",
+};
+
+static int index_volume(fat_drive *drive, fat_index *index, uint8_t **memory) {
+	static uint8_t buffer[64*1024];
+	uint32_t size;
+
+	for (size = INDEX_MIN_SIZE; size <= INDEX_MAX_SIZE; size *= 2) {
+		free(*memory);
+		if ((*memory = malloc(size))==NULL || fat_index_init(index, *memory, size))
+			return -1;
+		if (fat_index_work(drive, index, buffer, sizeof(buffer))==0)
+			return 0;
+	}
+
+	return -1;
+}
+
+static void record_path(const fat_index *index, uint32_t record, char *path) {
+	if (record==FAT_INDEX_ROOT || fat_index_path(index, record, path, PATH_SIZE)==0)
+		snprintf(path, PATH_SIZE, "/");
+}
+
+static int print_issue(void *ctx, const fat_check_issue *issue) {
+	const fat_index *index = ctx;
+	char path[PATH_SIZE], other[PATH_SIZE];
+
+	record_path(index, issue->record, path);
+
+	switch (issue->problem) {
+		case FAT_CHECK_CROSS_LINKED: record_path(index, issue->count, other);
+			printf("%s: %s with %s at cluster %u\n", path, problem_names[issue->problem], other, issue->cluster);
+			break;
+		case FAT_CHECK_SIZE_MISMATCH: printf("%s: %s, %u Bytes in %u clusters\n", path, problem_names[issue->problem],
+											index->records[issue->record].size_bytes, issue->count);
+			break;
+		case FAT_CHECK_FRAGMENTED: printf("%s: %s, %u pieces\n", path, problem_names[issue->problem], issue->count);
+			break;
+		case FAT_CHECK_LOST_CHAIN: printf("%s of %u clusters at cluster %u\n", problem_names[issue->problem],
+										  issue->count, issue->cluster);
+			break;
+		default: printf("%s: %s at cluster %u\n", path, problem_names[issue->problem], issue->cluster);
+			break;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	uint8_t *index_memory = NULL, *check_memory;
+	fat_check_report report;
+	uint32_t threshold = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 10) : DEFAULT_THRESHOLD;
+	fat_index index;
+	fat_drive drive;
+	reader image;
+	char path[PATH_SIZE];
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: fat_check <image> [threshold]\n");
+		return 2;
+	}
+
+	if (reader_open(&image, argv[1]) || fat.mount(&drive, 512, reader_read_bytes, &image)) {
+		fprintf(stderr, "%s: no FAT volume found\n", argv[1]);
+		return 2;
+	}
+
+	if (index_volume(&drive, &index, &index_memory)) {
+		fprintf(stderr, "%s: cannot read all the directories\n", argv[1]);
+		return 2;
+	}
+
+	if ((check_memory = malloc(fat_check_memory_size(&drive)))==NULL ||
+		fat_check_run(&drive, &index, check_memory, fat_check_memory_size(&drive), threshold, &report, print_issue,
+					  &index)) {
+		fprintf(stderr, "%s: cannot read the FAT\n", argv[1]);
+		return 2;
+	}
+
+	printf("%u files, %u directories\n", report.files, report.dirs);
+	printf("Clusters: %u used, %u free, %u bad, %u lost in %u chains\n", report.used_clusters, report.free_clusters,
+		   report.bad_clusters, report.lost_clusters, report.lost_chains);
+	printf("Problems: %u cross-linked, %u broken chains, %u loops, %u size mismatches\n", report.cross_linked,
+		   report.broken_chains, report.loops, report.size_mismatches);
+	printf("Fragmentation: %u of %u files fragmented, %.2f pieces per file", report.fragmented_files, report.files,
+		   report.files ? (double) report.fragments/report.files : 0.0);
+	if (report.max_fragments > 1) {
+		record_path(&index, report.max_fragments_record, path);
+		printf(", at most %u (%s)", report.max_fragments, path);
+	}
+	printf("\n");
+
+	free(check_memory);
+	free(index_memory);
+	reader_close(&image);
+
+	return report.lost_clusters || report.cross_linked || report.broken_chains || report.loops ||
+		report.size_mismatches ? 1 : 0;
+}
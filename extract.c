@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "fat.h"
+#include "fat_extract.h"
+#include "fat_index.h"
+#include "reader.h"
+
+/*
+ * Copies a directory tree (or a single file) out of an image, reading it in disk order.
+ * With -c the bytes are moved by the kernel with copy_file_range, never entering this process.
+ * Usage: fat_extract [-c] <image> <destination directory> [path inside the image]
+ */
+
+#define BUFFER_SIZE (4*1024*1024)
+#define INDEX_MIN_SIZE (1024*1024u)
+#define EXTRACT_MIN_SIZE (1024*1024u)
+#define MAX_MEMORY (1024*1024*1024u) //Index and pieces memory is doubled up to this
+#define PATH_SIZE (4096)
+
+struct output {
+  const fat_index *index;
+  const char *destination;
+  uint32_t prefix_len; //Of the extracted path inside the image, stripped from the output paths
+  uint32_t base; //Record of that path, the names below it are the output ones
+  uint32_t rejected; //Entries whose name can't be a path component, skipped with what they hold
+  reader *image;
+
+  //The file being written, reopened whenever the record changes; fd -1 if its name was rejected
+  uint32_t record;
+  int fd;
+};
+
+static double elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double) (now.tv_sec - start->tv_sec)*1e3 + (double) (now.tv_nsec - start->tv_nsec)/1e6;
+}
+
+static int index_volume(fat_drive *drive, fat_index *index, uint8_t **memory) {
+	static uint8_t buffer[64*1024];
+	uint32_t size;
+
+	for (size = INDEX_MIN_SIZE; size <= MAX_MEMORY; size *= 2) {
+		free(*memory);
+		if ((*memory = malloc(size))==NULL || fat_index_init(index, *memory, size))
+			return -1;
+		if (fat_index_work(drive, index, buffer, sizeof(buffer))==0)
+			return 0;
+	}
+
+	return -1;
+}
+
+//Names come from the image: separators, control characters, . and .. would lead out of the destination
+static int name_allowed(const char *name) {
+	const uint8_t *c = (const uint8_t *) name;
+
+	if (*c=='\0' || strcmp(name, ".")==0 || strcmp(name, "..")==0)
+		return 0;
+
+	for (; *c!='\0'; c++)
+		if (*c=='/' || *c=='\\' || *c < 0x20 || *c==0x7F)
+			return 0;
+
+	return 1;
+}
+
+//Returns -1 if a name below the extracted path is not allowed, or if the path doesn't fit
+static int output_path(const struct output *output, uint32_t record, char *path) {
+	char inside[PATH_SIZE];
+	uint32_t len = record==FAT_INDEX_ROOT ? 0 : fat_index_path(output->index, record, inside, sizeof(inside)), i;
+	int ret;
+
+	for (i = record; i!=output->base && i!=FAT_INDEX_ROOT; i = output->index->records[i].parent)
+		if (!name_allowed(fat_index_name(output->index, i)))
+			return -1;
+
+	ret = snprintf(path, PATH_SIZE, "%s%s", output->destination,
+				   len > output->prefix_len ? inside + output->prefix_len : "");
+
+	return ret < 0 || ret >= PATH_SIZE ? -1 : 0;
+}
+
+//Record the file is written to, opening it if it's not the current one
+static int output_fd(struct output *output, uint32_t record) {
+	char path[PATH_SIZE];
+
+	if (output->record==record)
+		return output->fd;
+
+	if (output->fd!=-1)
+		close(output->fd);
+
+	output->record = record;
+	output->fd = -1;
+	if (output_path(output, record, path))
+		return -1;
+
+	//Never through a link planted in the destination
+	output->fd = open(path, O_WRONLY | O_NOFOLLOW);
+	if (output->fd==-1)
+		perror(path);
+
+	return output->fd;
+}
+
+//Data of the rejected entries is dropped, failing to write the others stops the extraction
+static int output_failed(const struct output *output) {
+	char path[PATH_SIZE];
+
+	return output_path(output, output->record, path)==0 ? -1 : 0;
+}
+
+static int write_data(void *ctx, uint32_t record, uint32_t offset, const void *data, uint32_t bytes) {
+	struct output *output = ctx;
+	int fd = output_fd(output, record);
+
+	if (fd==-1)
+		return output_failed(output);
+
+	if (pwrite(fd, data, bytes, offset)!=(ssize_t) bytes)
+		return -1;
+
+	return 0;
+}
+
+//copy_file_range when the kernel and the filesystems allow it, pread and pwrite otherwise
+static int copy_data(void *ctx, uint32_t record, uint32_t offset, uint64_t address, uint32_t bytes) {
+	static uint8_t buffer[BUFFER_SIZE];
+	struct output *output = ctx;
+	int fd = output_fd(output, record);
+	loff_t in = (loff_t) address, out = offset;
+	ssize_t ret;
+	uint32_t chunk;
+
+	if (fd==-1)
+		return output_failed(output);
+
+	while (bytes) {
+		ret = copy_file_range(output->image->fd, &in, fd, &out, bytes, 0);
+		if (ret > 0) {
+			bytes -= (uint32_t) ret;
+			continue;
+		}
+		if (ret==-1 && errno==EINTR)
+			continue;
+		if (ret==0 || (errno!=EXDEV && errno!=ENOSYS && errno!=EINVAL && errno!=EOPNOTSUPP))
+			return -1;
+
+		chunk = bytes < BUFFER_SIZE ? bytes : BUFFER_SIZE;
+		if (reader_read_bytes(output->image, (uint64_t) in, chunk, buffer)==NULL ||
+			pwrite(fd, buffer, chunk, out)!=(ssize_t) chunk)
+			return -1;
+		in += chunk;
+		out += chunk;
+		bytes -= chunk;
+	}
+
+	return 0;
+}
+
+//Directories and empty files first, data is written later in disk order
+static int create_tree(struct output *output, uint32_t top) {
+	const fat_index *index = output->index;
+	struct stat st;
+	char path[PATH_SIZE];
+	uint32_t i, parent;
+	int fd;
+
+	for (i = 0; i < index->records_count; i++) {
+		if (i!=top) { //Parents come before their children in the index
+			for (parent = index->records[i].parent; parent!=top && parent!=FAT_INDEX_ROOT;
+				 parent = index->records[parent].parent);
+			if (parent!=top)
+				continue;
+		}
+
+		if (output_path(output, i, path)) {
+			output->rejected++;
+			continue;
+		}
+
+		if (index->records[i].attr & ATTR_DIRECTORY) {
+			//An existing one must be a directory, not a link to somewhere else
+			if (mkdir(path, 0755) && (errno!=EEXIST || lstat(path, &st) || !S_ISDIR(st.st_mode)))
+				goto error;
+		} else {
+			//Not sized here: the pieces end exactly where the file does, a broken one stays short
+			if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644))==-1)
+				goto error;
+			close(fd);
+		}
+	}
+
+	return 0;
+
+error:
+	perror(path);
+	return -1;
+}
+
+int main(int argc, char *argv[]) {
+	static uint8_t buffer[BUFFER_SIZE];
+	uint8_t *index_memory = NULL, *extract_memory = NULL;
+	struct output output = {0};
+	fat_extract extract;
+	fat_index index;
+	fat_drive drive;
+	reader image;
+	struct timespec start;
+	uint32_t size, top = FAT_INDEX_ROOT, i;
+	int use_copy = 0, ret;
+	char path[PATH_SIZE];
+	const char *inside;
+
+	if (argc > 1 && strcmp(argv[1], "-c")==0) {
+		use_copy = 1;
+		argv++;
+		argc--;
+	}
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: fat_extract [-c] <image> <destination directory> [path inside the image]\n");
+		return 1;
+	}
+	inside = argc > 3 ? argv[3] : "/";
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (reader_open(&image, argv[1]) || fat.mount(&drive, 512, reader_read_bytes, &image)) {
+		fprintf(stderr, "%s: no FAT volume found\n", argv[1]);
+		return 1;
+	}
+
+	if (index_volume(&drive, &index, &index_memory)) {
+		fprintf(stderr, "%s: cannot index the volume\n", argv[1]);
+		return 1;
+	}
+
+	if (strcmp(inside, "/")!=0) {
+		for (i = 0; i < index.records_count; i++)
+			if (fat_index_path(&index, i, path, sizeof(path)) && strcasecmp(path, inside)==0)
+				break;
+		if (i==index.records_count) {
+			fprintf(stderr, "%s: not found\n", inside);
+			return 1;
+		}
+		top = i;
+	}
+
+	output.index = &index;
+	output.destination = argv[2];
+	output.image = &image;
+	output.record = FAT_INDEX_ROOT;
+	output.fd = -1;
+	//The extracted directory becomes the destination, a file goes inside it
+	output.prefix_len = top==FAT_INDEX_ROOT ? 0 : fat_index_path(&index, top, path, sizeof(path));
+	output.base = top;
+	if (top!=FAT_INDEX_ROOT && !(index.records[top].attr & ATTR_DIRECTORY)) {
+		output.prefix_len -= (uint32_t) strlen(fat_index_name(&index, top)) + 1;
+		output.base = index.records[top].parent;
+	}
+
+	if (mkdir(output.destination, 0755) && errno!=EEXIST) {
+		perror(output.destination);
+		return 1;
+	}
+	if (create_tree(&output, top))
+		return 1;
+
+	for (size = EXTRACT_MIN_SIZE; size <= MAX_MEMORY; size *= 2) {
+		free(extract_memory);
+		if ((extract_memory = malloc(size))==NULL || fat_extract_init(&extract, extract_memory, size, &index))
+			return 1;
+		if (fat_extract_add(&extract, &drive, top)==0)
+			break;
+	}
+	if (size > MAX_MEMORY)
+		return 1;
+
+	if (use_copy)
+		ret = fat_extract_run_copy(&extract, copy_data, &output);
+	else
+		ret = fat_extract_run(&extract, &drive, buffer, sizeof(buffer), write_data, &output);
+
+	if (output.fd!=-1)
+		close(output.fd);
+
+	printf("%u files, %llu Bytes in %u pieces, %u reads, %.1f ms\n", extract.files,
+		   (unsigned long long) extract.bytes, extract.pieces_count, use_copy ? extract.pieces_count : extract.reads,
+		   elapsed_ms(&start));
+	if (extract.broken_files)
+		printf("%u files have a broken cluster chain, their data is missing\n", extract.broken_files);
+	if (output.rejected)
+		printf("%u entries have a name which can't be a path, they were skipped\n", output.rejected);
+
+	free(extract_memory);
+	free(index_memory);
+	reader_close(&image);
+
+	return ret ? 1 : 0;
+}
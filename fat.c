@@ -1,292 +1,2419 @@
 #include "fat.h"
 #include "fat_types.h"
 #include "fat_utils.h"
+#include "fat_cache.h"
+#include "fat_dir_cache.h"
+#include "fat_free_map.h"
 #include <stddef.h>
+#include <string.h>
 
 #define FAT_LIST_ENTRY_CLUSTER_GUARD_VALUE (0xFFFFFFFFu)
+#define FAT_RUN_SCAN_ENTRIES (64) //FAT entries read at once looking for contiguous clusters
+#define FAT_DIR_SCAN_ENTRIES (16) //Directory entries read at once
+#define FAT_DIR_SEARCH_ENTRIES (128) //Directory entries read at once by a search, skipped in bulk
+#define FAT_READAHEAD_MIN_BYTES (16*1024u) //Window of a file just detected as sequential
+#define FAT_READAHEAD_MAX_BYTES (1024*1024u)
+#define FAT_READAHEAD_NO_OFFSET (0xFFFFFFFFu)
+#define FAT_MAX_SECTOR_SIZE (4096u) //Biggest sector the write path can handle
+#define FAT_MAX_CLUSTER_SIZE (64*1024u)
+#define FAT_MAX_LOGICAL_PARTITIONS (128) //EBRs followed at most, a loop in the chain ends there
+#define FAT_MAX_GPT_ENTRIES (1024)
+#define FAT_BATCH_NO_SECTOR (0xFFFFFFFFu)
+#define FAT_SCAN_CHUNK_BYTES (4096u) //FAT bytes read at once when scanning the whole FAT
+
+/*
+ * Called by dir_scan on every used directory entry. A non zero return value stops the scan.
+ */
+typedef int (*dir_visit_func_t)(void *arg, struct fat_entry *entry, const fat_dir_iter *iter);
+
+struct entry_search {
+  const uint8_t *name; //NULL if the searched name is not a valid 8.3 one
+  const uint16_t *long_name; //Uppercase
+  uint32_t long_name_len; //0 if the searched name cannot be a long one
+  struct fat_entry found;
+  uint64_t found_address;
+};
+
+//FAT sector being changed, written to all the FATs at once
+struct fat_batch {
+  uint32_t sector; //Index inside the FAT, FAT_BATCH_NO_SECTOR if none
+  uint8_t dirty;
+  uint8_t data[FAT_MAX_SECTOR_SIZE];
+};
+
+//A directory being indexed, searched at the same time
+struct dir_index {
+  fat_dir_cache *dir_cache;
+  struct fat_dir_cache_dir *dir;
+  struct entry_search *search;
+  uint32_t records; //Needed by the entries seen so far
+  uint8_t dropped; //The directory didn't fit, the scan goes on only to search and count
+  uint8_t found;
+};
+
+//Private functions
+static void *read_metadata(fat_drive *drive, uint64_t address, uint32_t bytes, void *buffer);
+static void *read_cached(fat_drive *drive, enum fat_io_kind kind, uint64_t address, uint32_t bytes, void *buffer);
+static void *read_device(fat_drive *drive, enum fat_io_kind kind, uint64_t address, uint32_t bytes, void *buffer);
+static void *read_device_counted(void *ctx, uint64_t address, uint32_t bytes, void *buffer);
+static enum fat_io_kind io_kind(fat_drive *drive, uint64_t address);
+static void stats_add(uint64_t *counter, uint64_t value);
+static uint32_t stats_bucket(uint64_t value);
+static void stats_io(fat_drive *drive, enum fat_io_kind kind, uint64_t address, uint32_t bytes);
+static uint64_t api_begin(fat_drive *drive);
+static void api_end(fat_drive *drive, enum fat_api api, uint64_t start);
+static void mount_init(fat_drive *drive, fat_read_bytes_func_t read_bytes_func, void *read_ctx);
+static int set_sector_size(fat_drive *drive, uint32_t sector_size);
+static int check_geometry(const fat_geometry *geometry);
+static int read_partition_table(fat_read_bytes_func_t read_bytes_func, void *read_ctx, uint64_t address,
+								struct mbr_partition_entry *entries);
+static void add_partition(fat_partition *partitions, uint32_t max_partitions, uint32_t *count, uint32_t first_sector,
+						  uint32_t sectors, uint8_t type);
+static void logical_partitions(fat_read_bytes_func_t read_bytes_func, void *read_ctx, uint32_t sector_size,
+							   uint32_t extended_first_sector, fat_partition *partitions, uint32_t max_partitions,
+							   uint32_t *count);
+static int32_t gpt_partitions(fat_read_bytes_func_t read_bytes_func, void *read_ctx, uint32_t sector_size,
+							  fat_partition *partitions, uint32_t max_partitions);
+static int get_partition_info(fat_drive *drive);
+static int read_BPB(fat_drive *drive);
+static void read_fs_info(fat_drive *drive, uint16_t fs_info_sector);
+static int scan_free_clusters(fat_drive *drive, fat_free_map *free_map, uint32_t *free_clusters);
+static void fs_info_update(fat_drive *drive);
+static int batch_finish(fat_drive *drive, struct fat_batch *batch);
+static uint32_t first_sector_of_cluster(fat_drive *drive, uint32_t cluster);
+static uint32_t file_next_run(fat_drive *drive, fat_file *file, uint32_t max_len, uint64_t *where);
+static void file_readahead(fat_drive *drive, fat_file *file, uint32_t len);
+static uint32_t count_contiguous_clusters(fat_drive *drive, uint32_t cluster, uint32_t max_clusters);
+static uint32_t fat_entry_at(const void *fat_entries, uint32_t cluster, int fat16);
+static uint32_t run_length(const void *fat_entries, uint32_t cluster, uint32_t max_clusters, int fat16);
+static uint32_t mark_free_entries(const void *fat_entries, uint32_t first, uint32_t count, fat_free_map *free_map,
+								  int fat16);
+static uint32_t file_cluster_index(fat_drive *drive, fat_file *file);
+static uint32_t find_extent(fat_file *file, uint32_t file_cluster);
+static uint32_t find_next_cluster(fat_drive *drive, uint32_t current_cluster);
+static int is_eof(fat_drive *drive, uint32_t cluster);
+static int is_chain_end(fat_drive *drive, uint32_t cluster);
+static int dir_iter_load(fat_drive *drive, fat_dir_iter *iter);
+static int dir_iter_next(fat_drive *drive, fat_dir_iter *iter, struct fat_entry **entry);
+static void lfn_collect(fat_dir_iter *iter, const struct fat_lfn_entry *lfn_entry);
+static int dir_scan(fat_drive *drive, uint32_t dir_cluster, dir_visit_func_t visit, void *arg);
+static uint64_t dir_iter_entry_address(const fat_dir_iter *iter);
+static int search_visit(void *arg, struct fat_entry *entry, const fat_dir_iter *iter);
+static int dir_search(fat_drive *drive, uint32_t dir_cluster, struct entry_search *search);
+static int index_visit(void *arg, struct fat_entry *entry, const fat_dir_iter *iter);
+static int index_dir(fat_drive *drive, struct fat_dir_cache_dir *dir, struct entry_search *search);
+static int dir_cache_search(fat_drive *drive, uint32_t dir_cluster, struct entry_search *search);
+static int find_entry(fat_drive *drive, fat_dir dir, const char *entry_name, struct entry_search *search);
+static int get_entry(fat_drive *drive, fat_dir dir, void *entry, int is_entry_dir, const char *entry_name);
+static uint32_t dir_path_length(const char *path);
+static int walk_path(fat_drive *drive, const char *path, fat_dir *dir, char *name);
+static void entry_info(const struct fat_entry *entry, fat_entry_info *info);
+static int stat_in_dir(fat_drive *drive, fat_dir *dir, const char *name, fat_entry_info *info);
+static int write_device(fat_drive *drive, uint64_t address, uint32_t bytes, const void *buffer);
+static void dir_changed(fat_drive *drive, uint32_t dir_cluster);
+static void batch_init(struct fat_batch *batch);
+static uint32_t batch_get(fat_drive *drive, struct fat_batch *batch, uint32_t cluster);
+static int batch_set(fat_drive *drive, struct fat_batch *batch, uint32_t cluster, uint32_t value);
+static int batch_flush(fat_drive *drive, struct fat_batch *batch);
+static uint32_t find_free_cluster(fat_drive *drive, struct fat_batch *batch, uint32_t last, uint32_t wanted);
+static uint32_t clusters_for(fat_drive *drive, uint32_t bytes);
+static int update_entry(fat_drive *drive, fat_file *file);
+static int dir_free_slot(fat_drive *drive, uint32_t dir_cluster, uint64_t *address);
+static int32_t lfn_parts_before(fat_drive *drive, uint32_t dir_cluster, uint64_t entry_address, uint64_t *addresses);
+
+//Mounts the first partition
+int fat_mount(fat_drive *drive, uint32_t sector_size, fat_read_bytes_func_t read_bytes_func, void *read_ctx) {
+	mount_init(drive, read_bytes_func, read_ctx);
+
+	if (set_sector_size(drive, sector_size) || get_partition_info(drive) || read_BPB(drive))
+		return -1;
+
+	return 0;
+}
+
+int fat_mount_partition(fat_drive *drive, uint32_t sector_size, const fat_partition *partition,
+						fat_read_bytes_func_t read_bytes_func, void *read_ctx) {
+	mount_init(drive, read_bytes_func, read_ctx);
+
+	if (set_sector_size(drive, sector_size))
+		return -1;
+
+	drive->first_partition_sector = partition->first_sector;
+
+	return read_BPB(drive);
+}
+
+/*
+ * Lists the partitions of the device: the GPT ones if the MBR is protective, else the MBR
+ * primary ones and the logical ones inside extended partitions, in disk order of the tables.
+ * Up to max_partitions are stored, returns how many or -1 if there is no valid MBR.
+ */
+int32_t fat_partitions(fat_read_bytes_func_t read_bytes_func, void *read_ctx, uint32_t sector_size,
+					   fat_partition *partitions, uint32_t max_partitions) {
+	struct mbr_partition_entry entries[MBR_PARTITIONS];
+	uint32_t count = 0, i;
+
+	if (read_partition_table(read_bytes_func, read_ctx, 0, entries))
+		return -1;
+
+	for (i = 0; i < MBR_PARTITIONS; i++)
+		if (entries[i].type==MBR_TYPE_GPT_PROTECTIVE)
+			return gpt_partitions(read_bytes_func, read_ctx, sector_size, partitions, max_partitions);
+
+	for (i = 0; i < MBR_PARTITIONS; i++) {
+		if (entries[i].type==0 || entries[i].sectors==0)
+			continue;
+
+		if (entries[i].type==MBR_TYPE_EXTENDED_CHS || entries[i].type==MBR_TYPE_EXTENDED_LBA ||
+			entries[i].type==MBR_TYPE_EXTENDED_LINUX)
+			logical_partitions(read_bytes_func, read_ctx, sector_size, entries[i].lba_begin, partitions,
+							   max_partitions, &count);
+		else
+			add_partition(partitions, max_partitions, &count, entries[i].lba_begin, entries[i].sectors,
+						  entries[i].type);
+	}
+
+	return (int32_t) count;
+}
+
+static int read_partition_table(fat_read_bytes_func_t read_bytes_func, void *read_ctx, uint64_t address,
+								struct mbr_partition_entry *entries) {
+	uint8_t sector[FAT_BOOT_SECTOR_BYTES];
+	uint16_t signature;
+
+	if (read_bytes_func(read_ctx, address, sizeof(sector), sector)==NULL)
+		return -1;
+
+	memcpy(&signature, sector + FAT_BOOT_SIG_OFFSET, sizeof(signature));
+	if (signature!=MBR_BOOT_SIG)
+		return -1;
+
+	memcpy(entries, sector + MBR_BYTE_OFFSET__PARTITION_TABLE, MBR_PARTITIONS*sizeof(struct mbr_partition_entry));
+
+	return 0;
+}
+
+static void add_partition(fat_partition *partitions, uint32_t max_partitions, uint32_t *count, uint32_t first_sector,
+						  uint32_t sectors, uint8_t type) {
+	if (*count >= max_partitions)
+		return;
+
+	partitions[*count].first_sector = first_sector;
+	partitions[*count].sectors = sectors;
+	partitions[*count].type = type;
+	(*count)++;
+}
+
+/*
+ * Follows the chain of EBRs of an extended partition: the first entry of each is a logical partition,
+ * relative to the EBR, the second one points to the next EBR, relative to the extended partition.
+ */
+static void logical_partitions(fat_read_bytes_func_t read_bytes_func, void *read_ctx, uint32_t sector_size,
+							   uint32_t extended_first_sector, fat_partition *partitions, uint32_t max_partitions,
+							   uint32_t *count) {
+	struct mbr_partition_entry entries[MBR_PARTITIONS];
+	uint32_t ebr_sector = extended_first_sector, i;
+
+	for (i = 0; i < FAT_MAX_LOGICAL_PARTITIONS; i++) {
+		if (read_partition_table(read_bytes_func, read_ctx, (uint64_t) ebr_sector*sector_size, entries))
+			return;
+
+		if (entries[0].type!=0 && entries[0].sectors!=0 && entries[0].lba_begin <= 0xFFFFFFFFu - ebr_sector)
+			add_partition(partitions, max_partitions, count, ebr_sector + entries[0].lba_begin, entries[0].sectors,
+						  entries[0].type);
+
+		if (entries[1].type==0 || entries[1].lba_begin==0 ||
+			entries[1].lba_begin > 0xFFFFFFFFu - extended_first_sector)
+			return;
+
+		ebr_sector = extended_first_sector + entries[1].lba_begin;
+	}
+}
+
+//Sectors are addressed with 32 bits: partitions beyond that are skipped
+static int32_t gpt_partitions(fat_read_bytes_func_t read_bytes_func, void *read_ctx, uint32_t sector_size,
+							  fat_partition *partitions, uint32_t max_partitions) {
+	static const uint8_t unused_type[16] = {0};
+	uint8_t chunk[FAT_BOOT_SECTOR_BYTES];
+	struct gpt_header header;
+	struct gpt_entry entry;
+	uint32_t count = 0, i, j, per_chunk;
+
+	if (read_bytes_func(read_ctx, (uint64_t) GPT_HEADER_LBA*sector_size, sizeof(header), &header)==NULL ||
+		memcmp(header.signature, GPT_SIGNATURE, sizeof(header.signature))!=0 ||
+		header.entry_size < sizeof(struct gpt_entry) || header.entry_size > sizeof(chunk) ||
+		header.entries_count > FAT_MAX_GPT_ENTRIES)
+		return -1;
+
+	//Entries are read a few at a time
+	per_chunk = sizeof(chunk)/header.entry_size;
+
+	for (i = 0; i < header.entries_count; i += per_chunk) {
+		if (per_chunk > header.entries_count - i)
+			per_chunk = header.entries_count - i;
+
+		if (read_bytes_func(read_ctx, header.entries_lba*sector_size + (uint64_t) i*header.entry_size,
+							per_chunk*header.entry_size, chunk)==NULL)
+			return -1;
+
+		for (j = 0; j < per_chunk; j++) {
+			memcpy(&entry, chunk + j*header.entry_size, sizeof(entry));
+
+			if (memcmp(entry.type_guid, unused_type, sizeof(unused_type))==0 || entry.last_lba < entry.first_lba ||
+				entry.last_lba > 0xFFFFFFFFu)
+				continue;
+
+			add_partition(partitions, max_partitions, &count, (uint32_t) entry.first_lba,
+						  (uint32_t) (entry.last_lba - entry.first_lba + 1), FAT_PARTITION_TYPE_GPT);
+		}
+	}
+
+	return (int32_t) count;
+}
+
+//Only sizes the boot sector can describe
+static int set_sector_size(fat_drive *drive, uint32_t sector_size) {
+	if (sector_size < FAT_BOOT_SECTOR_BYTES || sector_size > FAT_MAX_CLUSTER_SIZE || (sector_size & (sector_size - 1)))
+		return -1;
+
+	//We store the log2(sector_size)
+	drive->log_bytes_per_sector = fat_log2(sector_size);
+
+	return 0;
+}
+
+/*
+ * Mounts a volume with the geometry saved by fat.geometry_save from a previous mount,
+ * the boot sectors aren't read. Only the volume serial is read back and compared, to catch
+ * a different volume: -1 means that, a geometry from another version or one no boot sector could give,
+ * and a full mount is needed.
+ * The FSInfo hints aren't loaded, the free clusters count is computed if asked.
+ */
+int fat_mount_geometry(fat_drive *drive, const fat_geometry *geometry, fat_read_bytes_func_t read_bytes_func,
+					   void *read_ctx) {
+	uint32_t volume_serial;
+
+	if (geometry->version!=FAT_GEOMETRY_VERSION || check_geometry(geometry))
+		goto error;
+
+	mount_init(drive, read_bytes_func, read_ctx);
+
+	drive->type = geometry->type==FAT16 ? FAT16 : FAT32;
+	if (drive->type==FAT16 ? !FAT_HAS_FAT16 : !FAT_HAS_FAT32)
+		goto error;
+	drive->volume_serial = geometry->volume_serial;
+	drive->log_bytes_per_sector = geometry->log_bytes_per_sector;
+	drive->log_sectors_per_cluster = geometry->log_sectors_per_cluster;
+	drive->cluster_size_bytes = 1u << (uint32_t) (drive->log_bytes_per_sector + drive->log_sectors_per_cluster);
+	drive->entries_per_cluster = drive->cluster_size_bytes/sizeof(struct fat_entry);
+	drive->fat_size_sectors = geometry->fat_size_sectors;
+	drive->number_of_fats = geometry->number_of_fats;
+	drive->clusters_count = geometry->clusters_count;
+	drive->root_entries_count = geometry->root_entries_count;
+	drive->first_partition_sector = geometry->first_partition_sector;
+	drive->first_fat_sector = geometry->first_fat_sector;
+	drive->root_dir.first_sector_v16 = geometry->root_dir;
+	drive->first_data_sector = geometry->first_data_sector;
+	drive->fs_info_sector = geometry->fs_info_sector;
+
+	if (read_metadata(drive, ((uint64_t) drive->first_partition_sector << drive->log_bytes_per_sector) +
+		(FAT_IS_FAT16(drive) ? BPB16_BYTE_OFFSET__VOLUME_ID : BPB32_BYTE_OFFSET__VOLUME_ID),
+					  sizeof(volume_serial), &volume_serial)==NULL || volume_serial!=drive->volume_serial)
+		goto error;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/*
+ * A saved geometry may be stale or corrupt: it must be one read_BPB could have computed,
+ * with the same bounds on the sizes and a layout whose regions follow each other.
+ */
+static int check_geometry(const fat_geometry *geometry) {
+	uint32_t log_cluster_size = (uint32_t) geometry->log_bytes_per_sector + geometry->log_sectors_per_cluster;
+	uint32_t min_clusters, max_clusters, root_dir_sectors;
+	uint64_t fats_end;
+
+	if ((geometry->type!=FAT16 && geometry->type!=FAT32) ||
+		geometry->log_bytes_per_sector < fat_log2(FAT_BOOT_SECTOR_BYTES) ||
+		log_cluster_size > fat_log2(FAT_MAX_CLUSTER_SIZE))
+		goto error;
+
+	root_dir_sectors = (((uint32_t) geometry->root_entries_count << 5u) + ((1u << geometry->log_bytes_per_sector) - 1))
+		>> geometry->log_bytes_per_sector;
+	min_clusters = geometry->type==FAT16 ? 4085 : 65525;
+	max_clusters = geometry->type==FAT16 ? 65524 : 268435444;
+
+	if (geometry->clusters_count < min_clusters || geometry->clusters_count > max_clusters)
+		goto error;
+
+	//Reserved sectors, FATs, FAT16 root dir and data, in this order and inside 32 bit sectors
+	fats_end = geometry->first_fat_sector + (uint64_t) geometry->number_of_fats*geometry->fat_size_sectors;
+	if (geometry->number_of_fats==0 || geometry->fat_size_sectors==0 ||
+		geometry->first_fat_sector <= geometry->first_partition_sector ||
+		fats_end + root_dir_sectors!=geometry->first_data_sector ||
+		geometry->first_data_sector + ((uint64_t) geometry->clusters_count << geometry->log_sectors_per_cluster) >
+			0xFFFFFFFFu)
+		goto error;
+
+	if (geometry->type==FAT16 ?
+		root_dir_sectors==0 || geometry->root_dir!=fats_end :
+		root_dir_sectors!=0 || geometry->root_dir < 2 || geometry->root_dir >= geometry->clusters_count + 2)
+		goto error;
+
+	//The FAT must have an entry for every cluster
+	if (((uint64_t) geometry->clusters_count + 2) << (geometry->type==FAT16 ? 1u : 2u) >
+		(uint64_t) geometry->fat_size_sectors << geometry->log_bytes_per_sector)
+		goto error;
+
+	if (geometry->fs_info_sector!=0 && (geometry->fs_info_sector <= geometry->first_partition_sector ||
+		geometry->fs_info_sector >= geometry->first_fat_sector))
+		goto error;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+void fat_geometry_save(fat_drive *drive, fat_geometry *geometry) {
+	memset(geometry, 0, sizeof(*geometry));
+
+	geometry->version = FAT_GEOMETRY_VERSION;
+	geometry->volume_serial = drive->volume_serial;
+	geometry->type = (uint8_t) drive->type;
+	geometry->log_bytes_per_sector = drive->log_bytes_per_sector;
+	geometry->log_sectors_per_cluster = drive->log_sectors_per_cluster;
+	geometry->number_of_fats = drive->number_of_fats;
+	geometry->fat_size_sectors = drive->fat_size_sectors;
+	geometry->clusters_count = drive->clusters_count;
+	geometry->root_entries_count = drive->root_entries_count;
+	geometry->first_partition_sector = drive->first_partition_sector;
+	geometry->first_fat_sector = drive->first_fat_sector;
+	geometry->root_dir = drive->root_dir.first_sector_v16;
+	geometry->first_data_sector = drive->first_data_sector;
+	geometry->fs_info_sector = drive->fs_info_sector;
+}
+
+//Nothing attached, no hints, no layout until the BPB is read
+static void mount_init(fat_drive *drive, fat_read_bytes_func_t read_bytes_func, void *read_ctx) {
+	drive->first_fat_sector = 0;
+	drive->fat_size_sectors = 0;
+	drive->number_of_fats = 0;
+	drive->read_bytes = read_bytes_func;
+	drive->read_ctx = read_ctx;
+	drive->cache = NULL;
+	drive->map_bytes = NULL;
+	drive->prefetch = NULL;
+	drive->write_bytes = NULL;
+	drive->alloc_hint = 2;
+	drive->fs_info_sector = 0;
+	drive->fs_info_free_count = FS_INFO_UNKNOWN;
+	drive->fat_table = NULL;
+	drive->free_map = NULL;
+	drive->dir_cache = NULL;
+	drive->stats = NULL;
+	drive->clock = NULL;
+	drive->trace = NULL;
+}
+
+int fat_attach_cache(fat_drive *drive, fat_cache *cache) {
+	//The cache must work on sectors as big as the drive ones
+	if (cache!=NULL && cache->log_bytes_per_sector!=drive->log_bytes_per_sector)
+		return -1;
+
+	drive->cache = cache;
+	return 0;
+}
+
+void fat_attach_map(fat_drive *drive, fat_map_bytes_func_t map_bytes_func) {
+	drive->map_bytes = map_bytes_func;
+}
+
+void fat_attach_prefetch(fat_drive *drive, fat_prefetch_func_t prefetch_func) {
+	drive->prefetch = prefetch_func;
+}
+
+/*
+ * Bytes needed to keep the first FAT in memory: just the entries
+ * of the data clusters and of the two reserved ones.
+ */
+uint32_t fat_fat_table_size(fat_drive *drive) {
+	return (drive->clusters_count + 2) << (FAT_IS_FAT16(drive) ? 1u : 2u);
+}
+
+int fat_attach_fat_table(fat_drive *drive, void *buffer, uint32_t buffer_size) {
+	uint32_t size = fat_fat_table_size(drive);
+
+	if (buffer_size < size)
+		goto error;
+
+	if (read_device(drive, FAT_IO_FAT, (uint64_t) drive->first_fat_sector << drive->log_bytes_per_sector,
+					size, buffer)==NULL)
+		goto error;
+
+	drive->fat_table = buffer;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+uint32_t fat_free_map_bytes(fat_drive *drive) {
+	return fat_free_map_size(drive->clusters_count + 2);
+}
+
+/*
+ * Builds the free cluster bitmap reading the whole FAT once.
+ * From now on allocations use it, and keep it up to date.
+ */
+int fat_attach_free_map(fat_drive *drive, fat_free_map *free_map, void *buffer, uint32_t buffer_size) {
+	uint32_t free_clusters;
+
+	if (fat_free_map_init(free_map, buffer, buffer_size, drive->clusters_count + 2) ||
+		scan_free_clusters(drive, free_map, &free_clusters))
+		return -1;
+
+	drive->free_map = free_map;
+
+	return 0;
+}
+
+/*
+ * Free clusters of the volume: known at once with the bitmap, else taken from the FSInfo
+ * on FAT32, which is only a hint and can be out of date, else counted reading the FAT.
+ */
+int fat_free_clusters(fat_drive *drive, uint32_t *free_clusters) {
+	if (drive->free_map!=NULL) {
+		*free_clusters = drive->free_map->free_count;
+		return 0;
+	}
+
+	if (drive->fs_info_free_count!=FS_INFO_UNKNOWN) {
+		*free_clusters = drive->fs_info_free_count;
+		return 0;
+	}
+
+	return scan_free_clusters(drive, NULL, free_clusters);
+}
+
+/*
+ * Starts counting from zero. Latencies are measured only if clock_func is given;
+ * stats NULL stops counting.
+ */
+void fat_attach_stats(fat_drive *drive, fat_stats *stats, fat_clock_func_t clock_func) {
+	if (stats!=NULL)
+		memset(stats, 0, sizeof(*stats));
+
+	drive->clock = clock_func;
+	drive->stats = stats;
+}
+
+void fat_attach_trace(fat_drive *drive, fat_trace_func_t trace_func, void *trace_ctx) {
+	drive->trace_ctx = trace_ctx;
+	drive->trace = trace_func;
+}
+
+/*
+ * Copies the counters of the drive, along with the ones of the attached caches.
+ * Safe while other threads use the drive. Returns -1 if no stats are attached.
+ */
+int fat_stats_get(fat_drive *drive, fat_stats *stats) {
+	const uint64_t *from;
+	uint64_t *to = (uint64_t *) stats;
+	uint32_t i;
+
+	if (drive->stats==NULL)
+		return -1;
+
+	from = (const uint64_t *) drive->stats;
+	for (i = 0; i < sizeof(fat_stats)/sizeof(uint64_t); i++)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+
+	if (drive->cache!=NULL)
+		fat_cache_get_stats(drive->cache, &stats->cache_hits, &stats->cache_misses);
+
+	if (drive->dir_cache!=NULL) {
+		fat_dir_cache_lock(drive->dir_cache);
+		stats->dir_cache_hits = drive->dir_cache->hits;
+		stats->dir_cache_misses = drive->dir_cache->misses;
+		fat_dir_cache_unlock(drive->dir_cache);
+	}
+
+	return 0;
+}
+
+/*
+ * Reads the device around the caches, for the modules reading in bulk:
+ * the read is counted and traced as kind, like the ones of the library.
+ */
+void *fat_read_device(fat_drive *drive, enum fat_io_kind kind, uint64_t address, uint32_t bytes, void *buffer) {
+	return read_device(drive, kind, address, bytes, buffer);
+}
+
+//Counters can be updated by several threads at once
+static inline void stats_add(uint64_t *counter, uint64_t value) {
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t stats_bucket(uint64_t value) {
+	uint32_t bucket = value ? 63u - (uint32_t) __builtin_clzll(value) : 0;
+
+	return bucket < FAT_STATS_BUCKETS ? bucket : FAT_STATS_BUCKETS - 1;
+}
+
+static void stats_io(fat_drive *drive, enum fat_io_kind kind, uint64_t address, uint32_t bytes) {
+	struct fat_trace_event event;
+	fat_stats *stats = drive->stats;
+	uint64_t last_end;
+
+	event.kind = kind;
+	event.address = address;
+	event.bytes = bytes;
+	event.sequential = 0;
+
+	if (stats!=NULL) {
+		last_end = __atomic_exchange_n(&stats->last_read_end, address + bytes, __ATOMIC_RELAXED);
+		event.sequential = last_end==address;
+
+		stats_add(&stats->reads[kind], 1);
+		stats_add(&stats->read_bytes[kind], bytes);
+		stats_add(&stats->read_size_histogram[stats_bucket(bytes)], 1);
+		if (event.sequential)
+			stats_add(&stats->sequential_reads, 1);
+	}
+
+	if (drive->trace!=NULL)
+		drive->trace(drive->trace_ctx, &event);
+}
+
+//Returns the start time of a call, 0 if latencies aren't measured
+static inline uint64_t api_begin(fat_drive *drive) {
+	return drive->stats!=NULL && drive->clock!=NULL ? drive->clock() : 0;
+}
+
+static void api_end(fat_drive *drive, enum fat_api api, uint64_t start) {
+	struct fat_api_stats *api_stats;
+	uint64_t elapsed, max;
+
+	if (start==0 || drive->stats==NULL || drive->clock==NULL)
+		return;
+
+	elapsed = drive->clock() - start;
+	api_stats = &drive->stats->api[api];
+
+	stats_add(&api_stats->calls, 1);
+	stats_add(&api_stats->total_ns, elapsed);
+	stats_add(&api_stats->histogram_ns[stats_bucket(elapsed)], 1);
+
+	max = __atomic_load_n(&api_stats->max_ns, __ATOMIC_RELAXED);
+	while (elapsed > max &&
+		!__atomic_compare_exchange_n(&api_stats->max_ns, &max, elapsed, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * Loops over many FAT entries are written once, in these helpers, and always called with
+ * fat16 constant: every type gets its own copy of the loop, with no test on the type inside.
+ */
+static inline __attribute__((always_inline)) uint32_t fat_entry_at(const void *fat_entries, uint32_t cluster,
+																	 int fat16) {
+	if (fat16)
+		return ((const uint16_t *) fat_entries)[cluster];
+
+	return ((const uint32_t *) fat_entries)[cluster] & CLUSTER_MASK_32;
+}
+
+//How many clusters from cluster point to the next one, up to max_clusters
+static inline __attribute__((always_inline)) uint32_t run_length(const void *fat_entries, uint32_t cluster,
+																   uint32_t max_clusters, int fat16) {
+	uint32_t count = 0;
+
+	while (count < max_clusters && fat_entry_at(fat_entries, cluster + count, fat16)==cluster + count + 1)
+		count++;
+
+	return count;
+}
+
+//Free entries among the count ones starting with the entry of cluster first, which are marked in free_map
+static inline __attribute__((always_inline)) uint32_t mark_free_entries(const void *fat_entries, uint32_t first,
+																		  uint32_t count, fat_free_map *free_map,
+																		  int fat16) {
+	uint32_t i, free_count = 0;
+
+	for (i = first < 2 ? 2 - first : 0; i < count; i++) {
+		if (fat_entry_at(fat_entries, i, fat16)!=CLUSTER_FREE)
+			continue;
+
+		free_count++;
+		if (free_map!=NULL)
+			fat_free_map_set(free_map, first + i, 1);
+	}
+
+	return free_count;
+}
+
+/*
+ * Counts the free clusters reading the FAT a chunk at a time, straight from
+ * the device or from the in memory FAT. They are also marked in free_map, if given.
+ */
+static int scan_free_clusters(fat_drive *drive, fat_free_map *free_map, uint32_t *free_clusters) {
+	union {
+	  uint16_t v16[FAT_SCAN_CHUNK_BYTES/sizeof(uint16_t)];
+	  uint32_t v32[FAT_SCAN_CHUNK_BYTES/sizeof(uint32_t)];
+	} chunk;
+	const void *fat_entries;
+	uint32_t first, count, log_entry_size = FAT_IS_FAT16(drive) ? 1 : 2;
+	uint32_t entries = drive->clusters_count + 2, free_count = 0;
+
+	for (first = 0; first < entries; first += count) {
+		count = FAT_SCAN_CHUNK_BYTES >> log_entry_size;
+		if (count > entries - first)
+			count = entries - first;
+
+		if (drive->fat_table!=NULL) {
+			fat_entries = (const uint8_t *) drive->fat_table + ((size_t) first << log_entry_size);
+		} else {
+			if (read_device(drive, FAT_IO_FAT,
+							((uint64_t) drive->first_fat_sector << drive->log_bytes_per_sector)
+								+ ((uint64_t) first << log_entry_size), count << log_entry_size, &chunk)==NULL)
+				return -1;
+			fat_entries = &chunk;
+		}
+
+		if (FAT_IS_FAT16(drive))
+			free_count += mark_free_entries(fat_entries, first, count, free_map, 1);
+		else
+			free_count += mark_free_entries(fat_entries, first, count, free_map, 0);
+	}
+
+	*free_clusters = free_count;
+
+	return 0;
+}
+
+void fat_attach_dir_cache(fat_drive *drive, fat_dir_cache *dir_cache) {
+	drive->dir_cache = dir_cache;
+}
+
+int fat_attach_writer(fat_drive *drive, fat_write_bytes_func_t write_bytes_func) {
+	//FAT sectors are changed in a buffer
+	if (write_bytes_func!=NULL && (1u << drive->log_bytes_per_sector) > FAT_MAX_SECTOR_SIZE)
+		return -1;
+
+	drive->write_bytes = write_bytes_func;
+	return 0;
+}
+
+/*
+ * Reads of the FAT, of the directories and of the reserved region are the small
+ * and repeated ones: they go through the cache, if any. The MBR and the BPB are read by
+ * the mount, before a cache can be attached, so they always reach the device.
+ */
+static inline void *read_metadata(fat_drive *drive, uint64_t address, uint32_t bytes, void *buffer) {
+	return read_cached(drive, io_kind(drive, address), address, bytes, buffer);
+}
+
+//Context of the read function given to the cache when reads are counted
+struct counted_read {
+  fat_drive *drive;
+  enum fat_io_kind kind;
+};
+
+static inline void *read_cached(fat_drive *drive, enum fat_io_kind kind, uint64_t address, uint32_t bytes,
+								void *buffer) {
+	struct counted_read counted;
+
+	if (drive->cache==NULL)
+		return read_device(drive, kind, address, bytes, buffer);
+
+	if (drive->stats==NULL && drive->trace==NULL)
+		return fat_cache_read(drive->cache, drive->read_bytes, drive->read_ctx, address, bytes, buffer);
+
+	//Only the misses reach the device
+	counted.drive = drive;
+	counted.kind = kind;
+	return fat_cache_read(drive->cache, read_device_counted, &counted, address, bytes, buffer);
+}
+
+//Every read of the device goes through here
+static inline void *read_device(fat_drive *drive, enum fat_io_kind kind, uint64_t address, uint32_t bytes,
+								void *buffer) {
+	if (drive->stats!=NULL || drive->trace!=NULL)
+		stats_io(drive, kind, address, bytes);
+
+	return drive->read_bytes(drive->read_ctx, address, bytes, buffer);
+}
+
+static void *read_device_counted(void *ctx, uint64_t address, uint32_t bytes, void *buffer) {
+	struct counted_read *counted = ctx;
+
+	return read_device(counted->drive, counted->kind, address, bytes, buffer);
+}
+
+//Metadata reads past the FATs are of the root dir or of directory clusters
+static enum fat_io_kind io_kind(fat_drive *drive, uint64_t address) {
+	uint64_t sector = address >> drive->log_bytes_per_sector;
+
+	//While mounting, before the BPB is read, only partition tables and boot sectors are read
+	if (drive->fat_size_sectors==0 || sector < drive->first_fat_sector)
+		return FAT_IO_RESERVED;
+
+	if (sector < drive->first_fat_sector + (uint64_t) drive->fat_size_sectors*drive->number_of_fats)
+		return FAT_IO_FAT;
+
+	return FAT_IO_DIR;
+}
+
+//The first partition, GPT or MBR
+static inline int get_partition_info(fat_drive *drive) {
+	fat_partition partition;
+
+	if (fat_partitions(drive->read_bytes, drive->read_ctx, 1u << drive->log_bytes_per_sector, &partition, 1) < 1)
+		return -1;
+
+	drive->first_partition_sector = partition.first_sector;
+
+	return 0;
+}
+
+/*
+ * Parses the boot sector, read at once, and checks the geometry it describes
+ * before anything else is read: a broken volume fails here.
+ */
+static inline int read_BPB(fat_drive *drive) {
+	uint8_t boot[FAT_BOOT_SECTOR_BYTES];
+	struct fat_BPB bpb;
+	uint32_t root_dir_sectors, data_sectors_cluster, fat_size_sectors, total_sectors, metadata_sectors;
+	uint32_t root_cluster;
+	uint16_t signature, fs_info_sector;
+
+	if (read_metadata(drive, (uint64_t) drive->first_partition_sector << drive->log_bytes_per_sector,
+					  sizeof(boot), boot)==NULL)
+		goto error;
+
+	memcpy(&signature, boot + FAT_BOOT_SIG_OFFSET, sizeof(signature));
+	memcpy(&bpb, boot + BPB_BYTE_OFFSET__FROM_PARTITION_BEGIN, sizeof(bpb));
+
+	//Should be equal to the previous set size
+	if (signature!=MBR_BOOT_SIG || bpb.bytes_per_sector!=(1u << drive->log_bytes_per_sector))
+		goto error;
+
+	//Powers of two only, and clusters up to 64KiB
+	if (bpb.sectors_per_cluster==0 || (bpb.sectors_per_cluster & (bpb.sectors_per_cluster - 1)) ||
+		((uint32_t) bpb.sectors_per_cluster << drive->log_bytes_per_sector) > FAT_MAX_CLUSTER_SIZE)
+		goto error;
+
+	if (bpb.reserved_sectors_count==0 || bpb.number_of_fats==0)
+		goto error;
+
+	//Parse the BPB: save just what we need
+	//Size
+	drive->log_sectors_per_cluster = fat_log2(bpb.sectors_per_cluster);
+
+	//If fat_size_sectors_16==0 the size is in the fat version dependent BPB part
+	if (bpb.fat_size_sectors_16!=0)
+		fat_size_sectors = bpb.fat_size_sectors_16;
+	else
+		memcpy(&fat_size_sectors, boot + BPB32_BYTE_OFFEST__FAT_SIZE_SECTORS_32, sizeof(fat_size_sectors));
+
+	total_sectors = bpb.total_sectors_16 ? bpb.total_sectors_16 : bpb.total_sectors_32;
+
+	//Determine fat version, fatgen pag. 14, we need to be extra careful to avoid overflows
+	//We end up with (at most) 16+5-9+1=13 bits. However total sectors is 32 bit long
+	root_dir_sectors =
+		(((uint32_t) bpb.root_entries_count << 5u) + ((1u << drive->log_bytes_per_sector) - 1)) >> drive->log_bytes_per_sector;
+
+	metadata_sectors = bpb.reserved_sectors_count + root_dir_sectors;
+	if (fat_size_sectors==0 || fat_size_sectors > (0xFFFFFFFFu - metadata_sectors)/bpb.number_of_fats)
+		goto error;
+	metadata_sectors += fat_size_sectors*bpb.number_of_fats;
+
+	if (total_sectors <= metadata_sectors ||
+		drive->first_partition_sector > 0xFFFFFFFFu - total_sectors)
+		goto error;
+
+	data_sectors_cluster = (total_sectors - metadata_sectors) >> drive->log_sectors_per_cluster;
+
+	if (data_sectors_cluster < 4085 || data_sectors_cluster >= 268435445) {
+		goto error; //FAT12 or exFAT
+	} else if (data_sectors_cluster < 65525) {
+		drive->type = FAT16;
+		if (!FAT_HAS_FAT16 || root_dir_sectors==0)
+			goto error;
+	} else {
+		drive->type = FAT32;
+		//On FAT32 the root dir is a cluster chain, whose beginning is in the fat version dependent part of the BPB
+		memcpy(&root_cluster, boot + BPB32_BYTE_OFFEST__ROOT_CLUSTER_32, sizeof(root_cluster));
+		if (!FAT_HAS_FAT32 || root_dir_sectors || root_cluster < 2 || root_cluster >= data_sectors_cluster + 2)
+			goto error;
+	}
+
+	//The FAT must have an entry for every cluster
+	if (((uint64_t) data_sectors_cluster + 2) << (FAT_IS_FAT16(drive) ? 1u : 2u) >
+		(uint64_t) fat_size_sectors << drive->log_bytes_per_sector)
+		goto error;
+
+	drive->cluster_size_bytes = 1u << (uint32_t) (drive->log_bytes_per_sector + drive->log_sectors_per_cluster);
+	drive->entries_per_cluster = drive->cluster_size_bytes/sizeof(struct fat_entry);
+	drive->clusters_count = data_sectors_cluster;
+
+	//Pointers
+	drive->first_fat_sector = drive->first_partition_sector + bpb.reserved_sectors_count;
+	drive->fat_size_sectors = fat_size_sectors;
+	drive->number_of_fats = bpb.number_of_fats;
+	drive->root_entries_count = bpb.root_entries_count;
+	drive->first_data_sector = drive->first_partition_sector + metadata_sectors;
+
+	if (FAT_IS_FAT16(drive)) {
+		drive->root_dir.first_sector_v16 = drive->first_fat_sector + fat_size_sectors*bpb.number_of_fats;
+		memcpy(&drive->volume_serial, boot + BPB16_BYTE_OFFSET__VOLUME_ID, sizeof(drive->volume_serial));
+	} else {
+		drive->root_dir.first_cluster_v32 = root_cluster;
+		memcpy(&drive->volume_serial, boot + BPB32_BYTE_OFFSET__VOLUME_ID, sizeof(drive->volume_serial));
+		memcpy(&fs_info_sector, boot + BPB32_BYTE_OFFEST__FS_INFO_SECTOR, sizeof(fs_info_sector));
+		read_fs_info(drive, fs_info_sector);
+	}
+
+	return 0;
+
+error:
+	return -1;
+}
+
+//The FSInfo hints are used only if they look sane
+static void read_fs_info(fat_drive *drive, uint16_t fs_info_sector) {
+	uint8_t sector[FAT_BOOT_SECTOR_BYTES];
+	struct fat_fs_info_hints hints;
+	uint32_t lead_sig;
+
+	if (fs_info_sector==0 || fs_info_sector==0xFFFFu ||
+		read_metadata(drive, (uint64_t) (drive->first_partition_sector + fs_info_sector) << drive->log_bytes_per_sector,
+					  sizeof(sector), sector)==NULL)
+		return;
+
+	memcpy(&lead_sig, sector, sizeof(lead_sig));
+	memcpy(&hints, sector + FS_INFO_BYTE_OFFSET__STRUCT_SIG, sizeof(hints));
+	if (lead_sig!=FS_INFO_LEAD_SIG || hints.struct_sig!=FS_INFO_STRUCT_SIG)
+		return;
+
+	drive->fs_info_sector = drive->first_partition_sector + fs_info_sector;
+
+	if (hints.free_count <= drive->clusters_count)
+		drive->fs_info_free_count = hints.free_count;
+
+	if (hints.next_free >= 2 && hints.next_free < drive->clusters_count + 2)
+		drive->alloc_hint = hints.next_free;
+}
+
+uint32_t fat_file_read(fat_drive *drive, fat_file *file, void *buffer, uint32_t buffer_len) {
+	uint8_t *byte_buffer = buffer;
+	uint32_t read_size;
+	uint64_t where;
+	fat_file run_start;
+	void *ret;
+
+	//The device starts fetching what comes next before we wait for these bytes
+	if (drive->prefetch!=NULL)
+		file_readahead(drive, file, buffer_len);
+
+	//Every run of contiguous clusters is read at once
+	while (run_start = *file, (read_size = file_next_run(drive, file, buffer_len, &where))) {
+		//Partial sector reads are likely to hit the same sector again (i.e. directories)
+		if (read_size < (1u << drive->log_bytes_per_sector))
+			ret = read_cached(drive, FAT_IO_DATA, where, read_size, byte_buffer);
+		else
+			ret = read_device(drive, FAT_IO_DATA, where, read_size, byte_buffer);
+
+		if (ret==NULL) { //Leave the file where the failed read started
+			*file = run_start;
+			break;
+		}
+
+		byte_buffer += read_size; //Move the buffer pointer forward
+		buffer_len -= read_size;
+	}
+
+	return (uint32_t) (byte_buffer - (uint8_t *) buffer);
+}
+
+uint32_t fat_file_map(fat_drive *drive, fat_file *file, const void **data, uint32_t max_len) {
+	fat_file next = *file;
+	uint32_t run_bytes;
+	uint64_t where;
+
+	*data = NULL;
+
+	if (drive->map_bytes==NULL)
+		return 0;
+
+	if (drive->prefetch!=NULL)
+		file_readahead(drive, file, max_len);
+
+	if ((run_bytes = file_next_run(drive, &next, max_len, &where))==0)
+		return 0;
+
+	//The file is moved forward only if the run can actually be mapped
+	if ((*data = drive->map_bytes(drive->read_ctx, where, run_bytes))==NULL)
+		return 0;
+
+	*file = next;
+
+	return run_bytes;
+}
+
+/*
+ * Finds the next bytes of the file which are contiguous on the device: returns how many they are
+ * (at most max_len) and stores their address in where. The file is moved past them.
+ */
+static uint32_t file_next_run(fat_drive *drive, fat_file *file, uint32_t max_len, uint64_t *where) {
+	uint32_t contiguous_clusters, file_cluster;
+	uint32_t log_cluster_size = drive->log_bytes_per_sector + drive->log_sectors_per_cluster;
+	uint64_t run_bytes;
+	fat_extent *extent;
+
+	if (max_len > file->size_bytes)
+		max_len = file->size_bytes;
+
+	if (max_len==0)
+		return 0;
+
+	if (file->in_cluster_byte_offset==drive->cluster_size_bytes) { //Go to the next cluster?
+		if (file->extents!=NULL) {
+			file_cluster = file_cluster_index(drive, file) + 1;
+			extent = &file->extents[find_extent(file, file_cluster)];
+			file->cluster = extent->first_cluster + (file_cluster - extent->file_cluster);
+		} else {
+			file->cluster = find_next_cluster(drive, file->cluster);
+		}
+		file->in_cluster_byte_offset = 0;
+	}
+
+	if (is_chain_end(drive, file->cluster))
+		return 0;
+
+	*where = ((uint64_t) first_sector_of_cluster(drive, file->cluster) << drive->log_bytes_per_sector)
+		+ file->in_cluster_byte_offset;
+	run_bytes = drive->cluster_size_bytes - file->in_cluster_byte_offset;
+
+	//Extend the run while the chain goes on with the physically following clusters
+	if (run_bytes < max_len) {
+		contiguous_clusters = 1 + ((max_len - run_bytes - 1) >> log_cluster_size);
+
+		if (file->extents!=NULL) { //The extent map already knows how long the run is
+			file_cluster = file_cluster_index(drive, file);
+			extent = &file->extents[find_extent(file, file_cluster)];
+			if (contiguous_clusters > extent->file_cluster + extent->clusters - 1 - file_cluster)
+				contiguous_clusters = extent->file_cluster + extent->clusters - 1 - file_cluster;
+		} else {
+			contiguous_clusters = count_contiguous_clusters(drive, file->cluster, contiguous_clusters);
+		}
+
+		file->cluster += contiguous_clusters;
+		run_bytes += (uint64_t) contiguous_clusters << log_cluster_size;
+	}
+
+	if (run_bytes > max_len)
+		run_bytes = max_len;
+
+	//The run ends inside the last cluster we moved to
+	file->in_cluster_byte_offset = (uint32_t) (*where + run_bytes -
+		((uint64_t) first_sector_of_cluster(drive, file->cluster) << drive->log_bytes_per_sector));
+	file->size_bytes -= (uint32_t) run_bytes;
+
+	return (uint32_t) run_bytes;
+}
+
+int fat_file_seek(fat_drive *drive, fat_file *file, uint32_t offset) {
+	uint32_t file_cluster, current_file_cluster, steps, cluster, in_cluster_byte_offset;
+	uint32_t log_cluster_size = drive->log_bytes_per_sector + drive->log_sectors_per_cluster;
+	fat_extent *extent;
+
+	if (offset > file->total_size_bytes)
+		goto error;
+
+	//On a cluster boundary we stay at the end of the previous cluster, as a read would do
+	file_cluster = offset >> log_cluster_size;
+	in_cluster_byte_offset = offset & (drive->cluster_size_bytes - 1);
+	if (in_cluster_byte_offset==0 && file_cluster > 0) {
+		file_cluster--;
+		in_cluster_byte_offset = drive->cluster_size_bytes;
+	}
+
+	if (file->first_cluster < 2) { //Empty file, there are no clusters to look for
+		cluster = file->first_cluster;
+	} else if (file->extents!=NULL) {
+		extent = &file->extents[find_extent(file, file_cluster)];
+		cluster = extent->first_cluster + (file_cluster - extent->file_cluster);
+	} else {
+		//Walk the chain, from the current cluster if we are moving forward
+		current_file_cluster = file_cluster_index(drive, file);
+		if (file_cluster >= current_file_cluster) {
+			cluster = file->cluster;
+			steps = file_cluster - current_file_cluster;
+		} else {
+			cluster = file->first_cluster;
+			steps = file_cluster;
+		}
+
+		if (drive->stats!=NULL && steps) {
+			stats_add(&drive->stats->seek_walks, 1);
+			stats_add(&drive->stats->seek_walk_histogram[stats_bucket(steps)], 1);
+		}
+
+		for (; steps; steps--) {
+			cluster = find_next_cluster(drive, cluster);
+			if (is_chain_end(drive, cluster))
+				goto error;
+		}
+	}
+
+	if (offset!=file->total_size_bytes - file->size_bytes) { //Not sequential anymore
+		file->readahead_bytes = 0;
+		file->readahead_offset = FAT_READAHEAD_NO_OFFSET;
+	}
+
+	file->cluster = cluster;
+	file->in_cluster_byte_offset = in_cluster_byte_offset;
+	file->size_bytes = file->total_size_bytes - offset;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/*
+ * Hints the device about the bytes of the file following the next len ones.
+ * A file is sequential if every read starts where the previous one ended: its window
+ * doubles each time it moves, up to FAT_READAHEAD_MAX_BYTES. Seeking elsewhere resets it.
+ */
+static void file_readahead(fat_drive *drive, fat_file *file, uint32_t len) {
+	uint32_t start, end, run_bytes, offset = file->total_size_bytes - file->size_bytes;
+	uint64_t where;
+	fat_file ahead;
+
+	if (len > file->size_bytes)
+		len = file->size_bytes;
+
+	if (file->readahead_bytes==0) {
+		if (offset!=file->readahead_offset) {
+			file->readahead_offset = offset + len;
+			return;
+		}
+		file->readahead_bytes = FAT_READAHEAD_MIN_BYTES;
+	}
+
+	//The window moves only when the reader gets close to its end
+	if ((uint64_t) offset + len + file->readahead_bytes/2 <= file->readahead_offset)
+		return;
+
+	start = offset + len > file->readahead_offset ? offset + len : file->readahead_offset;
+	end = file->total_size_bytes - (offset + len) > file->readahead_bytes ?
+		offset + len + file->readahead_bytes : file->total_size_bytes;
+
+	file->readahead_offset = end;
+	if (file->readahead_bytes < FAT_READAHEAD_MAX_BYTES)
+		file->readahead_bytes <<= 1u;
+
+	if (start >= end)
+		return;
+
+	//The chain is walked on a copy, the file stays where it is
+	ahead = *file;
+	if (fat_file_seek(drive, &ahead, start))
+		return;
+
+	while (start < end && (run_bytes = file_next_run(drive, &ahead, end - start, &where))) {
+		drive->prefetch(drive->read_ctx, where, run_bytes);
+		start += run_bytes;
+	}
+}
+
+int fat_file_build_extents(fat_drive *drive, fat_file *file, fat_extent *extents, uint32_t max_extents) {
+	uint32_t clusters, file_cluster = 0, count = 0, cluster = file->first_cluster;
+	uint32_t log_cluster_size = drive->log_bytes_per_sector + drive->log_sectors_per_cluster;
+
+	//Clusters actually used by the file
+	clusters = file->total_size_bytes ? 1 + ((file->total_size_bytes - 1) >> log_cluster_size) : 0;
+
+	while (file_cluster < clusters) {
+		if (count==max_extents || is_chain_end(drive, cluster))
+			goto error;
+
+		extents[count].file_cluster = file_cluster;
+		extents[count].first_cluster = cluster;
+		extents[count].clusters = 1 + count_contiguous_clusters(drive, cluster, clusters - file_cluster - 1);
+
+		file_cluster += extents[count].clusters;
+		cluster = find_next_cluster(drive, cluster + extents[count].clusters - 1);
+		count++;
+	}
+
+	file->extents = extents;
+	file->extents_count = count;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+//Index, inside the file, of the cluster the file is at
+static inline uint32_t file_cluster_index(fat_drive *drive, fat_file *file) {
+	return (file->total_size_bytes - file->size_bytes - file->in_cluster_byte_offset)
+		>> (uint32_t) (drive->log_bytes_per_sector + drive->log_sectors_per_cluster);
+}
+
+//Binary search of the extent holding file_cluster
+static uint32_t find_extent(fat_file *file, uint32_t file_cluster) {
+	uint32_t low = 0, high = file->extents_count - 1, middle;
+
+	while (low < high) {
+		middle = low + (high - low + 1)/2;
+
+		if (file->extents[middle].file_cluster <= file_cluster)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+
+	return low;
+}
+
+/*
+ * Counts how many clusters follow cluster in its chain being also physically after it (at most max_clusters).
+ * The FAT is read a slice at a time rather than one entry at a time.
+ */
+static uint32_t count_contiguous_clusters(fat_drive *drive, uint32_t cluster, uint32_t max_clusters) {
+	union {
+	  uint16_t v16[FAT_RUN_SCAN_ENTRIES];
+	  uint32_t v32[FAT_RUN_SCAN_ENTRIES];
+	} entries;
+	uint32_t count = 0, i, slice, fat_offset, current, log_entry_size = FAT_IS_FAT16(drive) ? 1 : 2;
+	uint32_t sector_size = 1u << drive->log_bytes_per_sector;
+
+	//Both cluster + count and its successor must be in the volume
+	i = cluster < drive->clusters_count + 1 ? drive->clusters_count + 1 - cluster : 0;
+	if (max_clusters > i)
+		max_clusters = i;
+
+	if (drive->fat_table!=NULL) {
+		if (FAT_IS_FAT16(drive))
+			return run_length(drive->fat_table, cluster, max_clusters, 1);
+		else
+			return run_length(drive->fat_table, cluster, max_clusters, 0);
+	}
+
+	while (count < max_clusters) {
+		current = cluster + count;
+		fat_offset = current << log_entry_size;
+
+		//Don't cross the FAT sector boundary, nor read more than needed
+		slice = (sector_size - (fat_offset & (sector_size - 1))) >> log_entry_size;
+		if (slice > FAT_RUN_SCAN_ENTRIES)
+			slice = FAT_RUN_SCAN_ENTRIES;
+		if (slice > max_clusters - count)
+			slice = max_clusters - count;
+
+		if (read_metadata(drive, ((uint64_t) drive->first_fat_sector << drive->log_bytes_per_sector) + fat_offset,
+						  slice << log_entry_size, &entries)==NULL)
+			break;
+
+		//The entries of the slice are the ones of current onwards: shift the buffer back to make them indexed by cluster
+		if (FAT_IS_FAT16(drive))
+			i = run_length(entries.v16 - current, current, slice, 1);
+		else
+			i = run_length(entries.v32 - current, current, slice, 0);
+
+		count += i;
+		if (i < slice)
+			return count;
+	}
+
+	return count;
+}
+
+static inline uint32_t first_sector_of_cluster(fat_drive *drive, uint32_t cluster) {
+	return ((cluster - 2) << drive->log_sectors_per_cluster) + drive->first_data_sector;
+}
+
+static uint32_t find_next_cluster(fat_drive *drive, uint32_t current_cluster) {
+	uint32_t fat_offset, fat_sector_number, fat_entry_offset;
+	union {
+	  uint16_t v16;
+	  uint32_t v32;
+	} entry;
+
+	if (drive->stats!=NULL)
+		stats_add(&drive->stats->chain_steps, 1);
+
+	if (drive->fat_table!=NULL) {
+		if (current_cluster >= drive->clusters_count + 2) //Out of the table: treat it as the end of the chain
+			return FAT_IS_FAT16(drive) ? CLUSTER_EOF_16 : CLUSTER_EOF_32;
+
+		if (FAT_IS_FAT16(drive))
+			return ((uint16_t *) drive->fat_table)[current_cluster];
+		else
+			return ((uint32_t *) drive->fat_table)[current_cluster] & CLUSTER_MASK_32;
+	}
+
+	if (FAT_IS_FAT16(drive))
+		fat_offset = current_cluster << 1u;
+	else
+		fat_offset = current_cluster << 2u;
+
+	fat_sector_number = drive->first_fat_sector + (fat_offset >> drive->log_bytes_per_sector);
+	fat_entry_offset = fat_offset & ((1u << drive->log_bytes_per_sector) - 1);
+
+	//A FAT which cannot be read ends the chain
+	if (FAT_IS_FAT16(drive)) {
+		if (read_metadata(drive,
+			((uint64_t) fat_sector_number << drive->log_bytes_per_sector) + fat_entry_offset, 2, &entry.v16)==NULL)
+			return CLUSTER_EOF_16;
+
+		return entry.v16;
+	} else {
+		if (read_metadata(drive,
+			((uint64_t) fat_sector_number << drive->log_bytes_per_sector) + fat_entry_offset, 4, &entry.v32)==NULL)
+			return CLUSTER_EOF_32;
+
+		return entry.v32 & CLUSTER_MASK_32;
+	}
+}
+
+static inline int is_eof(fat_drive *drive, uint32_t cluster) {
+	return cluster >= (FAT_IS_FAT16(drive) ? CLUSTER_EOF_16 : CLUSTER_EOF_32);
+}
+
+/*
+ * Whether a chain being read stops at cluster: its end, or a broken link to no data cluster,
+ * free, bad, reserved or out of the volume, whose sectors would be somewhere else on the device.
+ */
+static inline int is_chain_end(fat_drive *drive, uint32_t cluster) {
+	return cluster < 2 || cluster > drive->clusters_count + 1;
+}
+
+void fat_dir_get_root(fat_dir *dir) {
+	dir->cluster = FAT_ROOT_DIR_CLUSTER;
+}
+
+int fat_dir_iter_init(fat_drive *drive, fat_dir *dir, fat_dir_iter *iter, void *buffer, uint32_t buffer_size) {
+	if (buffer_size < sizeof(struct fat_entry))
+		return -1;
+
+	iter->cluster = dir->cluster;
+	if (dir->cluster==FAT_ROOT_DIR_CLUSTER && !FAT_IS_FAT16(drive))
+		iter->cluster = drive->root_dir.first_cluster_v32;
+
+	iter->next_entry = 0;
+	iter->done = 0;
+	iter->buffer = buffer;
+	iter->buffer_entries = buffer_size/sizeof(struct fat_entry);
+	iter->loaded_entries = 0;
+	iter->consumed_entries = 0;
+	iter->long_name_len = 0;
+	iter->lfn_order = 0;
+
+	return 0;
+}
+
+int32_t fat_dir_read(fat_drive *drive, fat_dir_iter *iter, fat_dir_entry *entries, uint32_t max_entries) {
+	struct fat_entry *fat_entry;
+	uint32_t count = 0;
+	int ret = 0;
+
+	while (count < max_entries && (ret = dir_iter_next(drive, iter, &fat_entry))==1) {
+		//Volume labels are not listed
+		if (fat_entry->attr & ATTR_VOLUME_ID)
+			continue;
+
+		memcpy(entries[count].name, fat_entry->name.whole, sizeof(entries[count].name));
+		entries[count].attr = fat_entry->attr;
+		entries[count].first_cluster = fat_make_dword(fat_entry->first_cluster_high, fat_entry->first_cluster_low);
+		entries[count].size_bytes = fat_entry->file_size_bytes;
+		entries[count].creation_time_tenth_of_secs = fat_entry->creation.time_tenth_of_secs;
+		entries[count].creation_time = fat_entry->creation.time;
+		entries[count].creation_date = fat_entry->creation.date;
+		entries[count].last_access_date = fat_entry->last_access_date;
+		entries[count].write_time = fat_entry->write.time;
+		entries[count].write_date = fat_entry->write.date;
+		memcpy(entries[count].long_name, iter->long_name, iter->long_name_len*sizeof(uint16_t));
+		entries[count].long_name[iter->long_name_len] = 0;
+		entries[count].long_name_len = iter->long_name_len;
+		count++;
+	}
+
+	if (count==0 && ret < 0)
+		return -1;
+
+	return (int32_t) count;
+}
+
+/*
+ * Loads into the iterator buffer as many entries as possible, without crossing a cluster.
+ * Returns 1 if something has been loaded, 0 at the end of the directory, -1 on read errors.
+ */
+static int dir_iter_load(fat_drive *drive, fat_dir_iter *iter) {
+	uint32_t left_entries, count;
+	uint64_t where;
+	void *ret;
+
+	if (iter->cluster==FAT_ROOT_DIR_CLUSTER) { //The FAT16 root directory has a fixed size
+		left_entries = drive->root_entries_count - iter->next_entry;
+		where = (uint64_t) drive->root_dir.first_sector_v16 << drive->log_bytes_per_sector;
+	} else {
+		if (iter->next_entry==drive->entries_per_cluster) { //Move to the next cluster, if any
+			iter->cluster = find_next_cluster(drive, iter->cluster);
+			iter->next_entry = 0;
+		}
+
+		//The first cluster too: the entry of a directory may point nowhere
+		if (is_chain_end(drive, iter->cluster)) {
+			iter->done = 1;
+			return 0;
+		}
+
+		left_entries = drive->entries_per_cluster - iter->next_entry;
+		where = (uint64_t) first_sector_of_cluster(drive, iter->cluster) << drive->log_bytes_per_sector;
+	}
+
+	if (left_entries==0) {
+		iter->done = 1;
+		return 0;
+	}
+
+	count = left_entries < iter->buffer_entries ? left_entries : iter->buffer_entries;
+	where += iter->next_entry*sizeof(struct fat_entry);
+
+	if (count*sizeof(struct fat_entry) < (1u << drive->log_bytes_per_sector))
+		ret = read_metadata(drive, where, count*sizeof(struct fat_entry), iter->buffer);
+	else
+		ret = read_device(drive, FAT_IO_DIR, where, count*sizeof(struct fat_entry), iter->buffer);
+
+	if (ret==NULL)
+		return -1;
+
+	iter->buffer_address = where;
+	iter->next_entry += count;
+	iter->loaded_entries = count;
+	iter->consumed_entries = 0;
+
+	return 1;
+}
+
+/*
+ * Gives the next used entry of the directory, deleted ones are skipped.
+ * Long name parts are not returned: they are collected in the iterator, which holds
+ * the long name of the returned entry if its checksum matches.
+ * Returns 1 if entry has been set, 0 at the end of the directory, -1 on read errors.
+ */
+static int dir_iter_next(fat_drive *drive, fat_dir_iter *iter, struct fat_entry **entry) {
+	struct fat_entry *fat_entry;
+	int ret;
+
+	while (!iter->done) {
+		if (iter->consumed_entries==iter->loaded_entries && (ret = dir_iter_load(drive, iter))!=1)
+			return ret;
+
+		fat_entry = &iter->buffer[iter->consumed_entries++];
+
+		if (fat_entry->name.whole[0]==FAT_ENTRY_NAME_LAST_ENTRY) {
+			iter->done = 1;
+			return 0;
+		}
+
+		if (fat_entry->name.whole[0]==FAT_ENTRY_NAME_DELETED_ENTRY) {
+			iter->lfn_order = 0;
+			continue;
+		}
+
+		//Checked before the kanji escape, the order of a long name part can be 0x05
+		if ((fat_entry->attr & ATTR_LONG_NAME_MASK)==ATTR_LONG_NAME) {
+			lfn_collect(iter, (const struct fat_lfn_entry *) fat_entry);
+			continue;
+		}
+
+		//The long name belongs to this entry only if it has just been completed, and the checksum matches
+		if (iter->lfn_order!=1 || fat_lfn_checksum(fat_entry->name.whole)!=iter->lfn_checksum)
+			iter->long_name_len = 0;
+		iter->lfn_order = 0;
+
+		if (fat_entry->name.whole[0]==FAT_ENTRY_NAME_KANJI_ENTRY)
+			fat_entry->name.whole[0] = FAT_ENTRY_NAME_DELETED_ENTRY;
+
+		*entry = fat_entry;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Adds a long name part to the name being assembled in the iterator.
+ * Parts are stored backwards: the one flagged as last comes first, then orders go down to 1.
+ * Anything out of sequence drops the name.
+ */
+static void lfn_collect(fat_dir_iter *iter, const struct fat_lfn_entry *lfn_entry) {
+	uint32_t i, order = lfn_entry->order & LFN_ORDER_MASK;
+	uint16_t *chars;
+
+	if (lfn_entry->order & LAST_LONG_ENTRY) {
+		if (order==0 || order > MAX_ORDER_LFS_ENTRIES)
+			goto invalid;
+		iter->lfn_checksum = lfn_entry->checksum;
+	} else if (order==0 || order + 1!=iter->lfn_order || lfn_entry->checksum!=iter->lfn_checksum) {
+		goto invalid;
+	}
+
+	chars = &iter->long_name[(order - 1)*LFN_CHARS_PER_ENTRY];
+	memcpy(chars, &lfn_entry->name1, sizeof(lfn_entry->name1));
+	memcpy(chars + 5, &lfn_entry->name2, sizeof(lfn_entry->name2));
+	memcpy(chars + 11, &lfn_entry->name3, sizeof(lfn_entry->name3));
+
+	if (lfn_entry->order & LAST_LONG_ENTRY) { //A name not filling its last part ends with a 0x0000
+		for (i = 0; i < LFN_CHARS_PER_ENTRY && chars[i]!=0; i++);
+		iter->long_name_len = (uint16_t) ((order - 1)*LFN_CHARS_PER_ENTRY + i);
+	}
+
+	iter->lfn_order = (uint8_t) order;
+	return;
+
+invalid:
+	iter->lfn_order = 0;
+}
+
+/*
+ * Calls visit on every used entry of the directory, reading them a few at a time.
+ * Returns what visit returned if it stopped the scan, 0 if the whole directory
+ * has been scanned, -1 on read errors.
+ */
+static int dir_scan(fat_drive *drive, uint32_t dir_cluster, dir_visit_func_t visit, void *arg) {
+	struct fat_entry entries[FAT_DIR_SCAN_ENTRIES], *entry;
+	fat_dir dir = {dir_cluster};
+	fat_dir_iter iter;
+	int ret;
+
+	fat_dir_iter_init(drive, &dir, &iter, entries, sizeof(entries));
+
+	while ((ret = dir_iter_next(drive, &iter, &entry))==1)
+		if ((ret = visit(arg, entry, &iter)))
+			return ret;
+
+	return ret;
+}
+
+//Device address of the entry last returned by dir_iter_next
+static inline uint64_t dir_iter_entry_address(const fat_dir_iter *iter) {
+	return iter->buffer_address + (uint64_t) (iter->consumed_entries - 1)*sizeof(struct fat_entry);
+}
+
+static int search_visit(void *arg, struct fat_entry *entry, const fat_dir_iter *iter) {
+	struct entry_search *search = arg;
+	const uint16_t *long_name = iter->long_name;
+	uint32_t long_name_len = iter->long_name_len;
+
+	//Either name can match, lengths are compared first to reject most long names cheaply
+	if ((search->name==NULL || memcmp(entry->name.whole, search->name, FAT_ENTRY_WHOLE_NAME_SIZE)) &&
+		(long_name_len==0 || long_name_len!=search->long_name_len ||
+			!fat_lfn_name_equal(search->long_name, long_name, long_name_len)))
+		return 0;
+
+	search->found = *entry;
+	search->found_address = dir_iter_entry_address(iter);
+
+	return 1;
+}
+
+/*
+ * Same as dir_scan with search_visit, but between long names the entries that cannot match
+ * are skipped a buffer at a time by fat_entries_skip, without going through dir_iter_next.
+ */
+static int dir_search(fat_drive *drive, uint32_t dir_cluster, struct entry_search *search) {
+	struct fat_entry entries[FAT_DIR_SEARCH_ENTRIES], *entry;
+	fat_dir dir = {dir_cluster};
+	struct fat_name_key key;
+	fat_dir_iter iter;
+	int ret;
+
+	fat_name_key_init(&key, search->name, search->long_name_len);
+	fat_dir_iter_init(drive, &dir, &iter, entries, sizeof(entries));
+
+	while (!iter.done) {
+		if (iter.consumed_entries==iter.loaded_entries && (ret = dir_iter_load(drive, &iter))!=1)
+			return ret;
+
+		if (iter.lfn_order==0) {
+			iter.consumed_entries += fat_entries_skip(&iter.buffer[iter.consumed_entries],
+													  iter.loaded_entries - iter.consumed_entries, &key);
+			if (iter.consumed_entries==iter.loaded_entries)
+				continue;
+		}
+
+		if ((ret = dir_iter_next(drive, &iter, &entry))!=1)
+			return ret;
+
+		if (search_visit(search, entry, &iter))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int index_visit(void *arg, struct fat_entry *entry, const fat_dir_iter *iter) {
+	struct dir_index *index = arg;
+
+	//Volume labels are not looked up
+	if (entry->attr & ATTR_VOLUME_ID)
+		return 0;
+
+	index->records += fat_dir_cache_records_for(iter->long_name_len);
+	if (!index->found)
+		index->found = (uint8_t) search_visit(index->search, entry, iter);
+
+	if (index->dropped)
+		return 0;
+
+	//Only for the insert: the directory is read unlocked
+	fat_dir_cache_lock(index->dir_cache);
+	if (index->dir->stale || fat_dir_cache_insert(index->dir_cache, index->dir, entry, dir_iter_entry_address(iter),
+												  iter->long_name, iter->long_name_len)) {
+		fat_dir_cache_drop(index->dir_cache, index->dir, 0);
+		index->dropped = 1;
+	}
+	fat_dir_cache_unlock(index->dir_cache);
+
+	return 0;
+}
+
+/*
+ * Puts all the entries of a loading directory in the directory cache while searching it,
+ * the cache unlocked. If they don't fit the directory is left out, and the scan only learns how
+ * many records it needs: the next lookups in it know at once whether to try again.
+ * Returns 1 if the searched name was found, 0 if not, -1 if the directory cannot be read.
+ */
+static int index_dir(fat_drive *drive, struct fat_dir_cache_dir *dir, struct entry_search *search) {
+	struct dir_index index = {drive->dir_cache, dir, search, 0, 0, 0};
+	int ret = dir_scan(drive, dir->cluster, index_visit, &index);
+
+	fat_dir_cache_lock(drive->dir_cache);
+	fat_dir_cache_loaded(drive->dir_cache, dir, ret ? 0 : index.records, !ret && !index.dropped);
+	fat_dir_cache_unlock(drive->dir_cache);
+
+	return ret ? -1 : index.found;
+}
+
+/*
+ * Looks for the searched name in the directory cache, indexing the directory if it may be.
+ * The entry is copied in search->found while the cache is locked, the directory is indexed
+ * with the cache unlocked: other lookups go on meanwhile, and scan the directory if they need it.
+ * Returns 1 if found, 0 if the directory has no such entry, -1 if the directory has to be scanned.
+ */
+static int dir_cache_search(fat_drive *drive, uint32_t dir_cluster, struct entry_search *search) {
+	fat_dir_cache *dir_cache = drive->dir_cache;
+	const struct fat_dir_cache_record *record = NULL;
+	struct fat_dir_cache_dir *dir;
+	int ret = -1, load = 0;
+
+	fat_dir_cache_lock(dir_cache);
+
+	dir = fat_dir_cache_use(dir_cache, dir_cluster);
+	if (dir==NULL) {
+		dir_cache->misses++;
+	} else if (dir->state==FAT_DIR_CACHE_INDEXED) {
+		dir_cache->hits++;
+		if (search->name!=NULL)
+			record = fat_dir_cache_lookup(dir_cache, dir_cluster, search->name);
+		if (record==NULL && search->long_name_len)
+			record = fat_dir_cache_lookup_long(dir_cache, dir_cluster, search->long_name, search->long_name_len);
+
+		ret = 0;
+		if (record!=NULL) {
+			search->found = record->entry;
+			search->found_address = record->entry_address;
+			ret = 1;
+		}
+	} else {
+		dir_cache->misses++;
+		if (dir->state==FAT_DIR_CACHE_SEEN && fat_dir_cache_may_index(dir_cache, dir)) {
+			fat_dir_cache_loading(dir_cache, dir);
+			load = 1;
+		}
+	}
+
+	fat_dir_cache_unlock(dir_cache);
+
+	//The slot is kept by the loading state
+	if (load)
+		ret = index_dir(drive, dir, search);
+
+	return ret;
+}
+
+//Looks for entry_name in dir, leaving the entry found and its address in search
+static int find_entry(fat_drive *drive, fat_dir dir, const char *entry_name, struct entry_search *search) {
+	uint8_t name[FAT_ENTRY_WHOLE_NAME_SIZE];
+	uint16_t long_name[FAT_LFN_MAX_CHARS];
+	int32_t long_name_len;
+
+	//The name is normalised once in both forms, then every entry is compared with them in the same pass
+	search->name = fat_ascii_name_to_entry_name(entry_name, name) ? NULL : name;
+	long_name_len = fat_utf8_to_lfn_name(entry_name, long_name);
+	search->long_name = long_name;
+	search->long_name_len = long_name_len > 0 ? (uint32_t) long_name_len : 0;
+
+	if (search->name==NULL && search->long_name_len==0)
+		goto not_found;
+
+	switch (drive->dir_cache!=NULL ? dir_cache_search(drive, dir.cluster, search) : -1) {
+		case 1: break;
+		case 0: goto not_found;
+		default: //No cache, or the directory is too big for it
+			if (dir_search(drive, dir.cluster, search)!=1)
+				goto not_found;
+			break;
+	}
+
+	//The names are on the stack of this function
+	search->name = NULL;
+	search->long_name = NULL;
+	search->long_name_len = 0;
+
+	return 0;
+
+not_found:
+	return -1;
+}
+
+static int get_entry(fat_drive *drive, fat_dir dir, void *entry, int is_entry_dir, const char *entry_name) {
+	const struct fat_entry *fat_entry;
+	struct entry_search search;
+
+	if (find_entry(drive, dir, entry_name, &search))
+		return -1;
+	fat_entry = &search.found;
+
+	if (is_entry_dir) {
+		((fat_dir *) entry)->cluster =
+			fat_make_dword(fat_entry->first_cluster_high, fat_entry->first_cluster_low);
+	} else {
+		((fat_file *) entry)->cluster =
+			fat_make_dword(fat_entry->first_cluster_high, fat_entry->first_cluster_low);
+		((fat_file *) entry)->first_cluster = ((fat_file *) entry)->cluster;
+		((fat_file *) entry)->size_bytes = fat_entry->file_size_bytes;
+		((fat_file *) entry)->total_size_bytes = fat_entry->file_size_bytes;
+		((fat_file *) entry)->entry_address = search.found_address;
+		((fat_file *) entry)->dir_cluster = dir.cluster;
+	}
+
+	return 0;
+}
+
+int fat_dir_change(fat_drive *drive, fat_dir *dir, const char *dir_name) {
+	if (dir_name[0]=='.' && dir_name[1]=='\0') //same dir?
+		return 1;
+
+	return get_entry(drive, *dir, dir, 1, dir_name);
+}
+
+int fat_file_open_in_dir(fat_drive *drive, fat_dir *dir, const char *filename, fat_file *file) {
+	file->in_cluster_byte_offset = 0;
+	file->extents = NULL;
+	file->extents_count = 0;
+	//Files are usually read from the beginning to the end
+	file->readahead_bytes = FAT_READAHEAD_MIN_BYTES;
+	file->readahead_offset = 0;
+	return get_entry(drive, *dir, file, 0, filename);
+}
+
+//The directory part of the path goes up to the last separator
+static uint32_t dir_path_length(const char *path) {
+	uint32_t i, len = 0;
+
+	for (i = 0; path[i]!='\0'; i++)
+		if (path[i]==FAT_PATH_SEPARATOR_1 || path[i]==FAT_PATH_SEPARATOR_2)
+			len = i;
+
+	return len;
+}
+
+/*
+ * Follows the directories in path, leaving dir at the last one and the
+ * remaining name (the file one) in name, which is FAT_LFN_MAX_NAME_BYTES long.
+ */
+static int walk_path(fat_drive *drive, const char *path, fat_dir *dir, char *name) {
+	const char *dir_path = path;
+	int is_last, split, remember = 0;
+	uint32_t dir_path_len;
+
+	fat_dir_get_root(dir);
+	dir_path_len = dir_path_length(path);
+
+	if (drive->dir_cache!=NULL && dir_path_len) {
+		fat_dir_cache_lock(drive->dir_cache);
+		if (fat_dir_cache_path_lookup(drive->dir_cache, dir_path, dir_path_len, &dir->cluster)==0)
+			path += dir_path_len;
+		else
+			remember = 1;
+		fat_dir_cache_unlock(drive->dir_cache);
+	}
+
+	while (1) {
+		if ((split = fat_split_path(path, name, FAT_LFN_MAX_NAME_BYTES, &is_last)) < 0)
+			return -1;
+		path += split;
+		if (is_last)
+			break;
+		if (fat_dir_change(drive, dir, name) < 0)
+			return -1;
+	}
 
-//Private functions
-static int get_partition_info(fat_drive *drive);
-static int read_BPB(fat_drive *drive);
-static uint32_t first_sector_of_cluster(fat_drive *drive, uint32_t cluster);
-static uint32_t find_next_cluster(fat_drive *drive, uint32_t current_cluster);
-static int is_eof(fat_drive *drive, uint32_t cluster);
-static int get_entry(fat_drive *drive, fat_dir dir, void *entry, int is_entry_dir, const char *entry_name);
+	if (remember) {
+		fat_dir_cache_lock(drive->dir_cache);
+		fat_dir_cache_path_insert(drive->dir_cache, dir_path, dir_path_len, dir->cluster);
+		fat_dir_cache_unlock(drive->dir_cache);
+	}
 
-int fat_mount(fat_drive *drive, uint32_t sector_size, fat_read_bytes_func_t read_bytes_func) {
-	drive->read_bytes = read_bytes_func;
+	return 0;
+}
 
-	if (get_partition_info(drive))
-		goto error;
+int fat_file_open(fat_drive *drive, const char *path, fat_file *file) {
+	char name[FAT_LFN_MAX_NAME_BYTES];
+	fat_dir dir;
 
-	//We store the log2(sector_size)
-	drive->log_bytes_per_sector = fat_log2(sector_size);
+	if (walk_path(drive, path, &dir, name))
+		return -1;
 
-	if (read_BPB(drive))
-		goto error;
+	return fat_file_open_in_dir(drive, &dir, name, file);
+}
+
+static void entry_info(const struct fat_entry *entry, fat_entry_info *info) {
+	struct fat_time no_time = {0};
+
+	info->attr = entry->attr;
+	info->first_cluster = fat_make_dword(entry->first_cluster_high, entry->first_cluster_low);
+	info->size_bytes = entry->file_size_bytes;
+	fat_timestamp_decode(entry->creation.date, entry->creation.time, entry->creation.time_tenth_of_secs,
+						 &info->creation_time);
+	fat_timestamp_decode(entry->write.date, entry->write.time, 0, &info->write_time);
+	fat_timestamp_decode(entry->last_access_date, no_time, 0, &info->access_time);
+}
+
+//The root directory has no entry: it's a directory with no times
+static int stat_in_dir(fat_drive *drive, fat_dir *dir, const char *name, fat_entry_info *info) {
+	struct entry_search search;
+
+	if (name[0]=='\0') {
+		memset(info, 0, sizeof(*info));
+		info->attr = ATTR_DIRECTORY;
+		info->first_cluster = FAT_IS_FAT16(drive) ? 0 : drive->root_dir.first_cluster_v32;
+		return 0;
+	}
+
+	if (find_entry(drive, *dir, name, &search))
+		return -1;
+
+	entry_info(&search.found, info);
 
 	return 0;
+}
 
-error:
-	return -1;
+/*
+ * Attributes, size and times of the file or directory at path. Only its directory entry
+ * is looked up, from the directory cache if attached: nothing is opened or read past it.
+ */
+int fat_stat(fat_drive *drive, const char *path, fat_entry_info *info) {
+	char name[FAT_LFN_MAX_NAME_BYTES];
+	fat_dir dir;
+
+	if (walk_path(drive, path, &dir, name))
+		return -1;
+
+	return stat_in_dir(drive, &dir, name, info);
 }
 
-static inline int get_partition_info(fat_drive *drive) {
-	struct mbr_partition_entry *mbr_partition;
+/*
+ * fat_stat on count paths, found[i] is 1 if infos[i] was filled, 0 if paths[i] doesn't exist.
+ * A path in the same directory as the previous one reuses it, without walking it again:
+ * paths grouped by directory, as a listing gives them, take one walk per directory.
+ * Returns how many paths were found.
+ */
+uint32_t fat_stat_many(fat_drive *drive, const char *const *paths, uint32_t count, fat_entry_info *infos,
+					   uint8_t *found) {
+	char name[FAT_LFN_MAX_NAME_BYTES];
+	const char *dir_path = NULL; //Path whose directory is in dir, NULL if none
+	uint32_t i, dir_path_len = 0, len, found_count = 0;
+	fat_dir dir;
+	int is_last, ret;
 
-	//Get the first entry in the partition table
-	if ((mbr_partition = drive->read_bytes(0x1BEu, sizeof(struct mbr_partition_entry), drive->buffer))==NULL)
-		goto error;
+	for (i = 0; i < count; i++) {
+		len = dir_path_length(paths[i]);
 
-	if (mbr_partition->type==0)
-		goto error;
+		if (dir_path!=NULL && len==dir_path_len && memcmp(paths[i], dir_path, len)==0) {
+			ret = fat_split_path(paths[i] + len, name, sizeof(name), &is_last) < 0 ? -1 : 0;
+		} else {
+			ret = walk_path(drive, paths[i], &dir, name);
+			dir_path = ret==0 ? paths[i] : NULL;
+			dir_path_len = len;
+		}
 
-	drive->first_partition_sector = mbr_partition->lba_begin;
+		found[i] = ret==0 && stat_in_dir(drive, &dir, name, &infos[i])==0;
+		found_count += found[i];
+	}
 
-	//Check the signature
-	if (*((uint16_t *) drive->read_bytes(510, 2, drive->buffer))!=MBR_BOOT_SIG)
-		goto error;
+	return found_count;
+}
+
+//Attributes and times of an open file, from its entry: they include the writes made through it
+int fat_file_stat(fat_drive *drive, fat_file *file, fat_entry_info *info) {
+	struct fat_entry entry;
+
+	if (read_metadata(drive, file->entry_address, sizeof(entry), &entry)==NULL)
+		return -1;
+
+	entry_info(&entry, info);
 
 	return 0;
+}
 
-error:
-	return -1;
+/*
+ * Write path. Writes are write-through: the device is written at once and the
+ * cached copies of the written sectors are updated.
+ */
+static int write_device(fat_drive *drive, uint64_t address, uint32_t bytes, const void *buffer) {
+	if (drive->write_bytes(drive->read_ctx, address, bytes, buffer))
+		return -1;
+
+	if (drive->cache!=NULL)
+		fat_cache_update(drive->cache, address, bytes, buffer);
+
+	return 0;
 }
 
-static inline int read_BPB(fat_drive *drive) {
-	struct fat_BPB *bpb;
-	uint32_t root_dir_sectors, data_sectors_cluster, fat_size_sectors;
+//Entries read from the directory are not up to date anymore
+static void dir_changed(fat_drive *drive, uint32_t dir_cluster) {
+	if (drive->dir_cache!=NULL) {
+		fat_dir_cache_lock(drive->dir_cache);
+		fat_dir_cache_invalidate_dir(drive->dir_cache, dir_cluster);
+		fat_dir_cache_unlock(drive->dir_cache);
+	}
+}
 
-	bpb = drive->read_bytes(((uint64_t) drive->first_partition_sector << drive->log_bytes_per_sector)
-								+ BPB_BYTE_OFFSET__FROM_PARTITION_BEGIN, sizeof(struct fat_BPB), drive->buffer);
+static inline void batch_init(struct fat_batch *batch) {
+	batch->sector = FAT_BATCH_NO_SECTOR;
+	batch->dirty = 0;
+}
 
-	if (bpb==NULL)
-		goto error;
+//Reads a FAT entry, seeing the changes still in the batch
+static uint32_t batch_get(fat_drive *drive, struct fat_batch *batch, uint32_t cluster) {
+	uint32_t fat_offset = cluster << (FAT_IS_FAT16(drive) ? 1u : 2u);
+	uint32_t in_sector_offset = fat_offset & ((1u << drive->log_bytes_per_sector) - 1);
+	uint16_t value16;
+	uint32_t value32;
 
-	//Should be equal to the previous set size
-	if (bpb->bytes_per_sector!=(1u << drive->log_bytes_per_sector))
-		goto error;
+	if (batch->sector!=fat_offset >> drive->log_bytes_per_sector)
+		return find_next_cluster(drive, cluster);
 
-	//Parse the BPB: save just what we need
-	//Size
-	drive->log_sectors_per_cluster = fat_log2(bpb->sectors_per_cluster);
+	if (FAT_IS_FAT16(drive)) {
+		memcpy(&value16, batch->data + in_sector_offset, sizeof(value16));
+		return value16;
+	}
+
+	memcpy(&value32, batch->data + in_sector_offset, sizeof(value32));
+	return value32 & CLUSTER_MASK_32;
+}
+
+/*
+ * Changes a FAT entry. The change is made in the batch, which holds one FAT sector:
+ * moving to another sector flushes it. The in memory FAT, if any, is changed at once.
+ */
+static int batch_set(fat_drive *drive, struct fat_batch *batch, uint32_t cluster, uint32_t value) {
+	uint32_t fat_offset = cluster << (FAT_IS_FAT16(drive) ? 1u : 2u);
+	uint32_t sector = fat_offset >> drive->log_bytes_per_sector;
+	uint32_t in_sector_offset = fat_offset & ((1u << drive->log_bytes_per_sector) - 1);
+	uint16_t value16;
+	uint32_t value32;
+
+	if (batch->sector!=sector) {
+		if (batch_flush(drive, batch))
+			return -1;
+
+		//A sector partly read must not be written back
+		if (read_metadata(drive, (uint64_t) (drive->first_fat_sector + sector) << drive->log_bytes_per_sector,
+						  1u << drive->log_bytes_per_sector, batch->data)==NULL) {
+			batch->sector = FAT_BATCH_NO_SECTOR;
+			return -1;
+		}
 
-	if (bpb->fat_size_sectors_16!=0) {
-		fat_size_sectors = bpb->fat_size_sectors_16;
+		batch->sector = sector;
+	}
+
+	if (FAT_IS_FAT16(drive)) {
+		value16 = (uint16_t) value;
+		memcpy(batch->data + in_sector_offset, &value16, sizeof(value16));
+		if (drive->fat_table!=NULL)
+			((uint16_t *) drive->fat_table)[cluster] = value16;
 	} else {
-		/*
-		 * If fat_size_sectors_16==0 we need to read fat_size_sectors_32, which is stored in the
-		 * fat version dependent BPB part. We read it directly into the variable.
-		 */
-		drive->read_bytes(((uint64_t) drive->first_partition_sector << drive->log_bytes_per_sector)
-							  + BPB32_BYTE_OFFEST__FAT_SIZE_SECTORS_32, sizeof(fat_size_sectors), &fat_size_sectors);
+		//The upper 4 bits are reserved and must be preserved
+		memcpy(&value32, batch->data + in_sector_offset, sizeof(value32));
+		value32 = (value32 & ~CLUSTER_MASK_32) | (value & CLUSTER_MASK_32);
+		memcpy(batch->data + in_sector_offset, &value32, sizeof(value32));
+		if (drive->fat_table!=NULL)
+			((uint32_t *) drive->fat_table)[cluster] = value32;
 	}
 
-	drive->cluster_size_bytes = 1u << (uint32_t) (drive->log_bytes_per_sector + drive->log_sectors_per_cluster);
-	drive->entries_per_cluster = drive->cluster_size_bytes/sizeof(struct fat_entry);
+	if (drive->free_map!=NULL)
+		fat_free_map_set(drive->free_map, cluster, value==CLUSTER_FREE);
 
-	//Pointers
-	drive->first_fat_sector = drive->first_partition_sector + bpb->reserved_sectors_count;
-	drive->root_dir.first_sector_v16 = drive->first_fat_sector + fat_size_sectors*bpb->number_of_fats;
+	batch->dirty = 1;
 
-	//Determine fat version, fatgen pag. 14, we need to be extra careful to avoid overflows
-	//We end up with (at most) 16+5-9+1=13 bits. However total sectors is 32 bit long
-	root_dir_sectors =
-		((bpb->root_entries_count << 5u) + ((1u << drive->log_bytes_per_sector) - 1)) >> drive->log_bytes_per_sector;
+	return 0;
+}
 
-	drive->first_data_sector = drive->root_dir.first_sector_v16 + root_dir_sectors;
+//Flushes the batch at the end of an operation, the FSInfo follows the FAT
+static int batch_finish(fat_drive *drive, struct fat_batch *batch) {
+	if (batch_flush(drive, batch))
+		return -1;
 
-	data_sectors_cluster = ((!bpb->total_sectors_16 ? bpb->total_sectors_32 : bpb->total_sectors_16) -
-		(drive->first_data_sector - drive->first_partition_sector)) >> drive->log_sectors_per_cluster;
+	fs_info_update(drive);
 
-	if (data_sectors_cluster < 4085 || data_sectors_cluster >= 268435445) {
-		goto error; //FAT12 or exFAT
-	} else if (data_sectors_cluster < 65525) {
-		drive->type = FAT16;
-	} else {
-		drive->type = FAT32;
-		//On FAT32 root_dir.first_sector_v16 as previously calculated must be 0
-		//It is actually stored in the fat version dependent part of the BPB and it's the beginning of a cluster chain
-		if (root_dir_sectors)
-			goto error;
+	return 0;
+}
 
-		drive->read_bytes(((uint64_t) drive->first_partition_sector << drive->log_bytes_per_sector)
-							  + BPB32_BYTE_OFFEST__ROOT_CLUSTER_32, 4, &drive->root_dir.first_cluster_v32);
-	}
+/*
+ * Keeps the FSInfo hints true: the free count is the bitmap one if there is a bitmap,
+ * else it's marked unknown since the FAT has just changed.
+ */
+static void fs_info_update(fat_drive *drive) {
+	struct fat_fs_info_hints hints;
 
-	//Check the signature
-	if ((*(uint16_t *) drive->read_bytes(510, 2, drive->buffer))!=MBR_BOOT_SIG)
-		goto error;
+	if (drive->fs_info_sector==0)
+		return;
 
-	return 0;
+	hints.free_count = drive->free_map!=NULL ? drive->free_map->free_count : FS_INFO_UNKNOWN;
+	hints.next_free = drive->alloc_hint;
 
-error:
-	return -1;
+	if (write_device(drive, ((uint64_t) drive->fs_info_sector << drive->log_bytes_per_sector)
+		+ FS_INFO_BYTE_OFFSET__FREE_COUNT, sizeof(hints) - sizeof(hints.struct_sig), &hints.free_count)==0)
+		drive->fs_info_free_count = hints.free_count;
 }
 
-uint32_t fat_file_read(fat_drive *drive, fat_file *file, void *buffer, uint32_t buffer_len) {
-	uint8_t *byte_buffer = buffer;
-	uint32_t read_size, ceil_clusters_to_read, read_clusters;
-	uint64_t where;
+//Writes the batched FAT sector to every copy of the FAT
+static int batch_flush(fat_drive *drive, struct fat_batch *batch) {
+	uint32_t i;
 
-	//https://stackoverflow.com/a/2745086/6441490
-	ceil_clusters_to_read =
-		1 + ((buffer_len - 1) >> (uint32_t) (drive->log_bytes_per_sector + drive->log_sectors_per_cluster));
+	if (!batch->dirty)
+		return 0;
 
-	//Do the data we read span more clusters?
-	for (read_clusters = 0; read_clusters < ceil_clusters_to_read && !is_eof(drive, file->cluster); read_clusters++) {
-		if (file->in_cluster_byte_offset==drive->cluster_size_bytes) { //Go to the next cluster?
-			file->cluster = find_next_cluster(drive, file->cluster);
-			file->in_cluster_byte_offset = 0;
-		}
+	for (i = 0; i < drive->number_of_fats; i++)
+		if (write_device(drive,
+						 (uint64_t) (drive->first_fat_sector + i*drive->fat_size_sectors + batch->sector)
+							 << drive->log_bytes_per_sector, 1u << drive->log_bytes_per_sector, batch->data))
+			return -1;
+
+	batch->dirty = 0;
+
+	return 0;
+}
 
-		read_size = drive->cluster_size_bytes - file->in_cluster_byte_offset; //Bytes till the end of the cluster
-		if (read_size > file->size_bytes)
-			read_size = file->size_bytes;
+/*
+ * Finds a free cluster to append to a chain ending with last (0 for a new chain).
+ * The cluster following last is preferred, then the first run of wanted free clusters
+ * from the allocation hint, then any free cluster. Returns 0 if the volume is full.
+ */
+static uint32_t find_free_cluster(fat_drive *drive, struct fat_batch *batch, uint32_t last, uint32_t wanted) {
+	uint32_t i, cluster, run = 0, run_start = 0, first_free = 0, end = drive->clusters_count + 2;
+
+	if (drive->free_map!=NULL) { //The bitmap is scanned a word at a time
+		if (last >= 2 && fat_free_map_is_free(drive->free_map, last + 1))
+			return last + 1;
+		if ((cluster = fat_free_map_find_run(drive->free_map, drive->alloc_hint, wanted)))
+			return cluster;
+		return fat_free_map_next(drive->free_map, drive->alloc_hint);
+	}
 
-		if (read_size > buffer_len) //Do we have enough room in the buffer?
-			read_size = buffer_len;
+	if (last >= 2 && last + 1 < end && batch_get(drive, batch, last + 1)==CLUSTER_FREE)
+		return last + 1;
 
-		where = (first_sector_of_cluster(drive, file->cluster) << drive->log_bytes_per_sector)
-			+ file->in_cluster_byte_offset;
+	cluster = drive->alloc_hint >= 2 && drive->alloc_hint < end ? drive->alloc_hint : 2;
 
-		drive->read_bytes(where, read_size, byte_buffer);
-		byte_buffer += read_size; //Move the buffer pointer forward
-		file->in_cluster_byte_offset += read_size;
-		file->size_bytes -= read_size; //Remaining file size
-		buffer_len -= read_size;
+	for (i = 0; i < drive->clusters_count; i++, cluster = cluster + 1==end ? 2 : cluster + 1) {
+		if (cluster==2) //Runs don't wrap around the end of the volume
+			run = 0;
+
+		if (batch_get(drive, batch, cluster)!=CLUSTER_FREE) {
+			run = 0;
+			continue;
+		}
+
+		if (run++==0)
+			run_start = cluster;
+		if (first_free==0)
+			first_free = cluster;
+		if (run==wanted)
+			return run_start;
 	}
 
-	return (uint32_t) (byte_buffer - (uint8_t *) buffer);
+	return first_free;
 }
 
-static inline uint32_t first_sector_of_cluster(fat_drive *drive, uint32_t cluster) {
-	return ((cluster - 2) << drive->log_sectors_per_cluster) + drive->first_data_sector;
-}
+static inline uint32_t clusters_for(fat_drive *drive, uint32_t bytes) {
+	uint32_t log_cluster_size = drive->log_bytes_per_sector + drive->log_sectors_per_cluster;
 
-static uint32_t find_next_cluster(fat_drive *drive, uint32_t current_cluster) {
-	uint32_t fat_offset, fat_sector_number, fat_entry_offset;
+	return bytes ? 1 + ((bytes - 1) >> log_cluster_size) : 0;
+}
 
-	if (drive->type==FAT16)
-		fat_offset = current_cluster << 1u;
-	else
-		fat_offset = current_cluster << 2u;
+//Writes the first cluster and the size of the file into its directory entry
+static int update_entry(fat_drive *drive, fat_file *file) {
+	struct fat_entry entry;
 
-	fat_sector_number = drive->first_fat_sector + (fat_offset >> drive->log_bytes_per_sector);
-	fat_entry_offset = fat_offset & ((1u << drive->log_bytes_per_sector) - 1);
+	if (read_metadata(drive, file->entry_address, sizeof(entry), &entry)==NULL)
+		return -1;
 
-	if (drive->type==FAT16) {
-		drive->read_bytes(
-			((uint64_t) fat_sector_number << drive->log_bytes_per_sector) + fat_entry_offset, 2, drive->buffer);
+	entry.first_cluster_high = (uint16_t) (file->first_cluster >> 16u);
+	entry.first_cluster_low = (uint16_t) file->first_cluster;
+	entry.file_size_bytes = file->total_size_bytes;
+	entry.attr |= ATTR_ARCHIVE;
 
-		return *((uint16_t *) drive->buffer);
-	} else {
-		drive->read_bytes(
-			((uint64_t) fat_sector_number << drive->log_bytes_per_sector) + fat_entry_offset, 4, drive->buffer);
+	if (write_device(drive, file->entry_address, sizeof(entry), &entry))
+		return -1;
 
-		return (*((uint32_t *) drive->buffer)) & CLUSTER_MASK_32;
+	//Same names, the records of the entry only need the new values
+	if (drive->dir_cache!=NULL) {
+		fat_dir_cache_lock(drive->dir_cache);
+		fat_dir_cache_update(drive->dir_cache, file->dir_cluster, file->entry_address, &entry);
+		fat_dir_cache_unlock(drive->dir_cache);
 	}
+
+	return 0;
 }
 
-static inline int is_eof(fat_drive *drive, uint32_t cluster) {
-	if (drive->type==FAT16)
-		return (cluster >= CLUSTER_EOF_16);
-	else
-		return (cluster >= CLUSTER_EOF_32);
+/*
+ * Finds a free entry in the directory. A full directory grows by a zeroed
+ * cluster, except the FAT16 root directory, which has a fixed size.
+ */
+static int dir_free_slot(fat_drive *drive, uint32_t dir_cluster, uint64_t *address) {
+	struct fat_entry entries[FAT_DIR_SCAN_ENTRIES];
+	struct fat_batch batch;
+	fat_dir dir = {dir_cluster};
+	fat_dir_iter iter;
+	uint32_t i, last, cluster;
+	int ret;
+
+	fat_dir_iter_init(drive, &dir, &iter, entries, sizeof(entries));
+	last = iter.cluster;
+
+	while ((ret = dir_iter_load(drive, &iter))==1) {
+		last = iter.cluster;
+
+		for (i = 0; i < iter.loaded_entries; i++) {
+			if (entries[i].name.whole[0]==FAT_ENTRY_NAME_LAST_ENTRY ||
+				entries[i].name.whole[0]==FAT_ENTRY_NAME_DELETED_ENTRY) {
+				*address = iter.buffer_address + (uint64_t) i*sizeof(struct fat_entry);
+				return 0;
+			}
+		}
+	}
+
+	if (ret < 0 || last==FAT_ROOT_DIR_CLUSTER)
+		goto error;
+
+	batch_init(&batch);
+	if ((cluster = find_free_cluster(drive, &batch, last, 1))==0)
+		goto error;
+
+	//The new cluster is zeroed before it's linked, so it's never seen with garbage entries
+	*address = (uint64_t) first_sector_of_cluster(drive, cluster) << drive->log_bytes_per_sector;
+	memset(entries, 0, sizeof(entries));
+	for (i = 0; i < drive->cluster_size_bytes; i += sizeof(entries))
+		if (write_device(drive, *address + i, sizeof(entries), entries))
+			goto error;
+
+	drive->alloc_hint = cluster + 1;
+	if (batch_set(drive, &batch, cluster, FAT_IS_FAT16(drive) ? CLUSTER_EOC_MARK_16 : CLUSTER_EOC_MARK_32) ||
+		batch_set(drive, &batch, last, cluster) || batch_finish(drive, &batch))
+		goto error;
+
+	return 0;
+
+error:
+	return -1;
 }
 
-void fat_dir_get_root(fat_dir *dir) {
-	dir->cluster = FAT_ROOT_DIR_CLUSTER;
+int fat_file_create(fat_drive *drive, const char *path, fat_file *file) {
+	char name[FAT_LFN_MAX_NAME_BYTES];
+	struct fat_entry entry;
+	uint64_t address;
+	fat_dir dir;
+
+	if (drive->write_bytes==NULL || walk_path(drive, path, &dir, name))
+		goto error;
+
+	memset(&entry, 0, sizeof(entry));
+
+	//Only new 8.3 names can be created
+	if (name[0]=='\0' || name[0]=='.' || fat_ascii_name_to_entry_name(name, entry.name.whole) ||
+		fat_file_open_in_dir(drive, &dir, name, file)==0)
+		goto error;
+
+	//There is no clock: the timestamps are set to the FAT epoch, 1980-01-01
+	entry.attr = ATTR_ARCHIVE;
+	entry.creation.date.day = entry.write.date.day = entry.last_access_date.day = 1;
+	entry.creation.date.month = entry.write.date.month = entry.last_access_date.month = 1;
+
+	if (dir_free_slot(drive, dir.cluster, &address) || write_device(drive, address, sizeof(entry), &entry))
+		goto error;
+
+	dir_changed(drive, dir.cluster);
+
+	return fat_file_open_in_dir(drive, &dir, name, file);
+
+error:
+	return -1;
 }
 
-int get_entry(fat_drive *drive, fat_dir dir, void *entry, int is_entry_dir, const char *entry_name) {
-	struct fat_entry *fat_entry;
+/*
+ * Writes at the current position of the file, which grows if the write goes past its end.
+ * New clusters are allocated contiguous whenever possible, all the FAT changes are made
+ * before the data is written. Returns the bytes written: less than buffer_len if the volume
+ * is full or the device fails, the clusters linked so far are kept and the entry records
+ * what was written. If the FAT or the entry cannot be written 0 is returned and the file is
+ * left as it was, though the new clusters may stay allocated.
+ */
+uint32_t fat_file_write(fat_drive *drive, fat_file *file, const void *buffer, uint32_t buffer_len) {
+	const uint8_t *byte_buffer = buffer;
+	uint32_t offset, end, clusters, needed, last, cluster, write_size, old_size = file->total_size_bytes;
+	struct fat_batch batch;
+	fat_file run_start, old_file = *file;
 	uint64_t where;
-	uint32_t parsed_entries_per_cluster = 0;
 
-	if (dir.cluster==FAT_ROOT_DIR_CLUSTER) { //Are we in the root dir?
-		if (drive->type==FAT16) {
-			where = drive->root_dir.first_sector_v16 << drive->log_bytes_per_sector;
-		} else {
-			dir.cluster = drive->root_dir.first_cluster_v32;
-			where = first_sector_of_cluster(drive, dir.cluster) << drive->log_bytes_per_sector;
+	if (drive->write_bytes==NULL)
+		return 0;
+
+	offset = file->total_size_bytes - file->size_bytes;
+	if (buffer_len > UINT32_MAX - offset)
+		buffer_len = UINT32_MAX - offset;
+	end = offset + buffer_len;
+
+	clusters = clusters_for(drive, file->total_size_bytes);
+	needed = clusters_for(drive, end);
+
+	if (needed > clusters) {
+		//Find the end of the chain on a copy, the file stays where it is
+		run_start = *file;
+		if (clusters && fat_file_seek(drive, &run_start, file->total_size_bytes))
+			return 0;
+		last = clusters ? run_start.cluster : 0;
+
+		batch_init(&batch);
+		for (; clusters < needed; clusters++) {
+			if ((cluster = find_free_cluster(drive, &batch, last, needed - clusters))==0)
+				break;
+
+			//The chain always ends with an end of chain mark: a failure stops it where it is
+			if (batch_set(drive, &batch, cluster, FAT_IS_FAT16(drive) ? CLUSTER_EOC_MARK_16 : CLUSTER_EOC_MARK_32))
+				break;
+			if (last && batch_set(drive, &batch, last, cluster)) {
+				batch_set(drive, &batch, cluster, CLUSTER_FREE); //Not linked, it's given back
+				break;
+			}
+
+			if (last==0)
+				file->first_cluster = cluster;
+			last = cluster;
+			drive->alloc_hint = cluster + 1;
 		}
-	} else {
-		where = first_sector_of_cluster(drive, dir.cluster) << drive->log_bytes_per_sector;
-	}
 
-	while (1) {
-		fat_entry = drive->read_bytes(where, sizeof(struct fat_entry), drive->buffer);
-
-		switch (fat_entry->name.whole[0]) {
-			case FAT_ENTRY_NAME_LAST_ENTRY: goto not_found;
-			case FAT_ENTRY_NAME_DELETED_ENTRY: break;
-			case FAT_ENTRY_NAME_KANJI_ENTRY: fat_entry->name.whole[0] = FAT_ENTRY_NAME_DELETED_ENTRY;
-			default:
-				if (!fat_entry_ascii_name_equals(*fat_entry, entry_name))
-					break;
-
-				//Found
-				if (is_entry_dir) {
-					((fat_dir *) entry)->cluster =
-						fat_make_dword(fat_entry->first_cluster_high, fat_entry->first_cluster_low);
-				} else {
-					((fat_file *) entry)->cluster =
-						fat_make_dword(fat_entry->first_cluster_high, fat_entry->first_cluster_low);
-					((fat_file *) entry)->size_bytes = fat_entry->file_size_bytes;
-				}
-				return 0;
+		if (batch_finish(drive, &batch)) {
+			*file = old_file;
+			return 0;
 		}
 
-		//If we are parsing the root directory on FAT16 every entry is contiguous, or
-		//are there still entries in the cluster?
-		if ((parsed_entries_per_cluster < drive->entries_per_cluster) ||
-			(drive->type==FAT16 && dir.cluster==FAT_ROOT_DIR_CLUSTER)) {
-			where += sizeof(struct fat_entry);
-			parsed_entries_per_cluster++;
-		} else {
-			//Should we move to the next cluster?
-			if (is_eof(drive, dir.cluster)) { //Nope, if this is the last cluster
-				goto not_found;
-			} else { //Move to the next cluster
-				dir.cluster = find_next_cluster(drive, dir.cluster);
-				where = first_sector_of_cluster(drive, dir.cluster) << drive->log_bytes_per_sector;
-				parsed_entries_per_cluster = 0;
-			}
+		//The file was empty: it now starts in its first cluster
+		if (file->cluster < 2)
+			file->cluster = file->first_cluster;
+
+		//The extent map doesn't know about the new clusters
+		file->extents = NULL;
+		file->extents_count = 0;
+
+		if (end > (clusters << (drive->log_bytes_per_sector + drive->log_sectors_per_cluster)))
+			end = clusters << (drive->log_bytes_per_sector + drive->log_sectors_per_cluster);
+	}
+
+	//The file is made as long as the write, so runs are found as for a read
+	if (end > file->total_size_bytes)
+		file->total_size_bytes = end;
+	file->size_bytes = file->total_size_bytes - offset;
+
+	while (offset < end && (run_start = *file, (write_size = file_next_run(drive, file, end - offset, &where)))) {
+		if (write_device(drive, where, write_size, byte_buffer)) {
+			*file = run_start;
+			break;
 		}
+
+		byte_buffer += write_size;
+		offset += write_size;
 	}
 
-not_found:
-	return -1;
-}
+	//Only the bytes actually written count
+	file->total_size_bytes = offset > old_size ? offset : old_size;
+	file->size_bytes = file->total_size_bytes - offset;
 
-int fat_dir_change(fat_drive *drive, fat_dir *dir, const char *dir_name) {
-	if (dir_name[0]=='.' && dir_name[1]=='\0') //same dir?
-		return 1;
+	if ((file->total_size_bytes!=old_size || clusters_for(drive, old_size)==0) && update_entry(drive, file)) {
+		*file = old_file;
+		return 0;
+	}
 
-	return get_entry(drive, *dir, dir, 1, dir_name);
+	return (uint32_t) (byte_buffer - (const uint8_t *) buffer);
 }
 
-int fat_file_open_in_dir(fat_drive *drive, fat_dir *dir, const char *filename, fat_file *file) {
+/*
+ * Shrinks the file to size bytes, freeing the clusters not needed anymore.
+ * The position is kept, unless it's past the new end.
+ * The chain is checked before anything is written: if it's broken, or shorter than size,
+ * the volume is left untouched. The entry is written first, then the chain is cut and the
+ * rest freed, so if the device fails meanwhile the volume stays consistent: -1 is returned,
+ * the file is truncated anyway but some of its old clusters may stay allocated, unreachable.
+ */
+int fat_file_truncate(fat_drive *drive, fat_file *file, uint32_t size) {
+	uint32_t i, cluster, next, keep, last = 0, freed = 0, offset = file->total_size_bytes - file->size_bytes;
+	fat_file old_file = *file;
+	struct fat_batch batch;
+	int ret = 0;
+
+	if (drive->write_bytes==NULL || size > file->total_size_bytes)
+		goto error;
+
+	//Every link must be in range, the loop check stops a chain looping back on itself
+	keep = clusters_for(drive, size);
+	for (i = 0, cluster = file->first_cluster; file->first_cluster && !is_eof(drive, cluster); i++) {
+		if (cluster < 2 || cluster >= drive->clusters_count + 2 || i==drive->clusters_count)
+			goto error;
+
+		if (i + 1==keep)
+			last = cluster;
+		else if (i==keep)
+			freed = cluster;
+		cluster = find_next_cluster(drive, cluster);
+	}
+	if (i < keep)
+		goto error;
+
+	//The entry never points to freed clusters
+	file->total_size_bytes = size;
+	if (keep==0)
+		file->first_cluster = 0;
+	if (update_entry(drive, file)) {
+		*file = old_file;
+		goto error;
+	}
+
+	//The end of chain mark goes first: the clusters after it are freed only once it's written
+	batch_init(&batch);
+	if (keep && batch_set(drive, &batch, last, FAT_IS_FAT16(drive) ? CLUSTER_EOC_MARK_16 : CLUSTER_EOC_MARK_32))
+		ret = -1;
+
+	for (cluster = freed; ret==0 && i > keep; i--) {
+		next = batch_get(drive, &batch, cluster);
+		if (batch_set(drive, &batch, cluster, CLUSTER_FREE))
+			ret = -1;
+		cluster = next;
+	}
+
+	if (batch_finish(drive, &batch))
+		ret = -1;
+
+	file->extents = NULL;
+	file->extents_count = 0;
+
+	//Back to the beginning, then where the file was
+	file->cluster = file->first_cluster;
 	file->in_cluster_byte_offset = 0;
-	return get_entry(drive, *dir, file, 0, filename);
+	file->size_bytes = size;
+
+	if (fat_file_seek(drive, file, offset < size ? offset : size))
+		ret = -1;
+
+	return ret;
+
+error:
+	return -1;
 }
 
-int fat_file_open(fat_drive *drive, const char *path, fat_file *file) {
-	int is_last;
-	fat_dir dir;
-	char buffer[FAT_ENTRY_WHOLE_NAME_SIZE + 2]; //plus '.' and '\0'
+/*
+ * Frees the clusters of the file and marks its entry as deleted, together
+ * with the long name parts before it in the same cluster. Directories cannot be deleted.
+ */
+int fat_file_delete(fat_drive *drive, const char *path) {
+	uint8_t deleted = FAT_ENTRY_NAME_DELETED_ENTRY;
+	uint64_t parts[MAX_ORDER_LFS_ENTRIES];
+	struct fat_entry entry;
+	int32_t parts_count, i;
+	fat_file file;
+
+	if (drive->write_bytes==NULL || fat_file_open(drive, path, &file))
+		goto error;
 
-	fat_dir_get_root(&dir);
+	if (read_metadata(drive, file.entry_address, sizeof(entry), &entry)==NULL ||
+		(entry.attr & (ATTR_DIRECTORY | ATTR_VOLUME_ID)))
+		goto error;
 
-	while (1) {
-		path += fat_split_path(path, buffer, &is_last);
-		if (is_last)
-			break;
-		fat_dir_change(drive, &dir, buffer);
+	//Found before anything is written, a failed scan leaves the file as it was
+	if ((parts_count = lfn_parts_before(drive, file.dir_cluster, file.entry_address, parts)) < 0)
+		goto error;
+
+	if (fat_file_truncate(drive, &file, 0) || write_device(drive, file.entry_address, 1, &deleted))
+		goto error;
+
+	for (i = 0; i < parts_count; i++)
+		if (write_device(drive, parts[i], 1, &deleted))
+			goto error;
+
+	dir_changed(drive, file.dir_cluster);
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/*
+ * Finds the long name parts right before the entry at entry_address, going through the
+ * directory as the iterator does, so that they are found in any of its clusters.
+ * Stores their addresses and returns how many they are, -1 if the entry cannot be reached.
+ */
+static int32_t lfn_parts_before(fat_drive *drive, uint32_t dir_cluster, uint64_t entry_address, uint64_t *addresses) {
+	struct fat_entry entries[FAT_DIR_SCAN_ENTRIES];
+	fat_dir dir = {dir_cluster};
+	fat_dir_iter iter;
+	uint32_t count = 0, i;
+	uint64_t address;
+
+	fat_dir_iter_init(drive, &dir, &iter, entries, sizeof(entries));
+
+	while (dir_iter_load(drive, &iter)==1) {
+		for (i = 0; i < iter.loaded_entries; i++) {
+			address = iter.buffer_address + (uint64_t) i*sizeof(struct fat_entry);
+			if (address==entry_address)
+				return (int32_t) (count < MAX_ORDER_LFS_ENTRIES ? count : MAX_ORDER_LFS_ENTRIES);
+
+			if (entries[i].name.whole[0]==FAT_ENTRY_NAME_LAST_ENTRY)
+				goto error;
+
+			//A longer run than a name can have keeps its last parts
+			if ((entries[i].attr & ATTR_LONG_NAME_MASK)==ATTR_LONG_NAME &&
+				entries[i].name.whole[0]!=FAT_ENTRY_NAME_DELETED_ENTRY)
+				addresses[count++%MAX_ORDER_LFS_ENTRIES] = address;
+			else
+				count = 0;
+		}
 	}
 
-	return fat_file_open_in_dir(drive, &dir, buffer, file);
+error:
+	return -1;
 }
 
 void fat_list_make_empty_entry(fat_list_entry *list_entry) {
@@ -296,13 +2423,19 @@ void fat_list_make_empty_entry(fat_list_entry *list_entry) {
 int fat_list_get_next_entry_in_dir(fat_drive *drive, fat_dir *current_dir, fat_list_entry *list_entry) {
 	if (list_entry->next_entry.cluster==FAT_LIST_ENTRY_CLUSTER_GUARD_VALUE) {
 		list_entry->next_entry.cluster = current_dir->cluster;
+		if (current_dir->cluster==FAT_ROOT_DIR_CLUSTER && !FAT_IS_FAT16(drive))
+			list_entry->next_entry.cluster = drive->root_dir.first_cluster_v32;
 		list_entry->next_entry.in_cluster_byte_offset = offsetof(struct fat_entry, name);
 		list_entry->next_entry.size_bytes = sizeof(list_entry->name);
+		list_entry->next_entry.total_size_bytes = sizeof(list_entry->name);
+		list_entry->next_entry.extents = NULL;
+		list_entry->next_entry.readahead_bytes = 0;
+		list_entry->next_entry.readahead_offset = FAT_READAHEAD_NO_OFFSET;
 	}
 
-	if (list_entry->next_entry.cluster==FAT_ROOT_DIR_CLUSTER && drive->type==FAT16) {
-		drive->read_bytes(
-			(drive->root_dir.first_sector_v16 << drive->log_bytes_per_sector)
+	if (list_entry->next_entry.cluster==FAT_ROOT_DIR_CLUSTER && FAT_IS_FAT16(drive)) {
+		read_metadata(drive,
+			((uint64_t) drive->root_dir.first_sector_v16 << drive->log_bytes_per_sector)
 				+ list_entry->next_entry.in_cluster_byte_offset, sizeof(list_entry->name), list_entry->name);
 	} else {
 		fat_file_read(drive, &list_entry->next_entry, list_entry->name, sizeof(list_entry->name));
@@ -317,15 +2450,133 @@ int fat_list_get_next_entry_in_dir(fat_drive *drive, fat_dir *current_dir, fat_l
 	return (list_entry->name[0]!=FAT_ENTRY_NAME_LAST_ENTRY);
 }
 
+/*
+ * Entry points of the API whose latency is measured, when a clock is attached.
+ * Internal calls go straight to the functions above.
+ */
+static int timed_file_open(fat_drive *drive, const char *path, fat_file *file) {
+	uint64_t start = api_begin(drive);
+	int ret = fat_file_open(drive, path, file);
+
+	api_end(drive, FAT_API_FILE_OPEN, start);
+	return ret;
+}
+
+static int timed_file_open_in_dir(fat_drive *drive, fat_dir *dir, const char *filename, fat_file *file) {
+	uint64_t start = api_begin(drive);
+	int ret = fat_file_open_in_dir(drive, dir, filename, file);
+
+	api_end(drive, FAT_API_FILE_OPEN, start);
+	return ret;
+}
+
+static uint32_t timed_file_read(fat_drive *drive, fat_file *file, void *buffer, uint32_t buffer_len) {
+	uint64_t start = api_begin(drive);
+	uint32_t ret = fat_file_read(drive, file, buffer, buffer_len);
+
+	api_end(drive, FAT_API_FILE_READ, start);
+	return ret;
+}
+
+static uint32_t timed_file_map(fat_drive *drive, fat_file *file, const void **data, uint32_t max_len) {
+	uint64_t start = api_begin(drive);
+	uint32_t ret = fat_file_map(drive, file, data, max_len);
+
+	api_end(drive, FAT_API_FILE_MAP, start);
+	return ret;
+}
+
+static int timed_file_seek(fat_drive *drive, fat_file *file, uint32_t offset) {
+	uint64_t start = api_begin(drive);
+	int ret = fat_file_seek(drive, file, offset);
+
+	api_end(drive, FAT_API_FILE_SEEK, start);
+	return ret;
+}
+
+static uint32_t timed_file_write(fat_drive *drive, fat_file *file, const void *buffer, uint32_t buffer_len) {
+	uint64_t start = api_begin(drive);
+	uint32_t ret = fat_file_write(drive, file, buffer, buffer_len);
+
+	api_end(drive, FAT_API_FILE_WRITE, start);
+	return ret;
+}
+
+static int timed_dir_change(fat_drive *drive, fat_dir *dir, const char *dir_name) {
+	uint64_t start = api_begin(drive);
+	int ret = fat_dir_change(drive, dir, dir_name);
+
+	api_end(drive, FAT_API_DIR_CHANGE, start);
+	return ret;
+}
+
+static int32_t timed_dir_read(fat_drive *drive, fat_dir_iter *iter, fat_dir_entry *entries, uint32_t max_entries) {
+	uint64_t start = api_begin(drive);
+	int32_t ret = fat_dir_read(drive, iter, entries, max_entries);
+
+	api_end(drive, FAT_API_DIR_READ, start);
+	return ret;
+}
+
+static int timed_stat(fat_drive *drive, const char *path, fat_entry_info *info) {
+	uint64_t start = api_begin(drive);
+	int ret = fat_stat(drive, path, info);
+
+	api_end(drive, FAT_API_STAT, start);
+	return ret;
+}
+
+//A single call for the whole batch, its paths are not timed one by one
+static uint32_t timed_stat_many(fat_drive *drive, const char *const *paths, uint32_t count, fat_entry_info *infos,
+								uint8_t *found) {
+	uint64_t start = api_begin(drive);
+	uint32_t ret = fat_stat_many(drive, paths, count, infos, found);
+
+	api_end(drive, FAT_API_STAT_MANY, start);
+	return ret;
+}
+
 const struct m_fat fat = {
 	.mount = fat_mount,
-
-	.file_open = fat_file_open,
-	.file_open_in_dir = fat_file_open_in_dir,
-	.file_read = fat_file_read,
+	.mount_geometry = fat_mount_geometry,
+	.geometry_save = fat_geometry_save,
+	.partitions = fat_partitions,
+	.mount_partition = fat_mount_partition,
+	.attach_cache = fat_attach_cache,
+	.attach_map = fat_attach_map,
+	.attach_prefetch = fat_attach_prefetch,
+	.fat_table_size = fat_fat_table_size,
+	.attach_fat_table = fat_attach_fat_table,
+	.attach_dir_cache = fat_attach_dir_cache,
+	.attach_writer = fat_attach_writer,
+	.free_map_size = fat_free_map_bytes,
+	.attach_free_map = fat_attach_free_map,
+	.free_clusters = fat_free_clusters,
+	.attach_stats = fat_attach_stats,
+	.attach_trace = fat_attach_trace,
+	.stats_get = fat_stats_get,
+	.read_device = fat_read_device,
+
+	.file_open = timed_file_open,
+	.file_open_in_dir = timed_file_open_in_dir,
+	.file_read = timed_file_read,
+	.file_map = timed_file_map,
+	.file_seek = timed_file_seek,
+	.file_build_extents = fat_file_build_extents,
+	.file_stat = fat_file_stat,
+
+	.file_create = fat_file_create,
+	.file_write = timed_file_write,
+	.file_truncate = fat_file_truncate,
+	.file_delete = fat_file_delete,
 
 	.dir_get_root = fat_dir_get_root,
-	.dir_change = fat_dir_change,
+	.dir_change = timed_dir_change,
+	.dir_iter_init = fat_dir_iter_init,
+	.dir_read = timed_dir_read,
+
+	.stat = timed_stat,
+	.stat_many = timed_stat_many,
 
 	.list_make_empty_entry = fat_list_make_empty_entry,
 	.list_get_next_entry_in_dir = fat_list_get_next_entry_in_dir
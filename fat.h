@@ -2,17 +2,75 @@
 #define FAT_H
 
 #include <stdint.h>
-#define FAT_INTERNAL_BUFFER_SIZE 32
+#include "fat_types.h"
+#include "fat_stats.h"
 
-typedef void *(*fat_read_bytes_func_t)(uint64_t address, uint32_t bytes, void *buffer);
+/*
+ * Reads bytes bytes at address into buffer, ctx is the pointer given at mount time.
+ * Returns buffer, or NULL on failure.
+ */
+typedef void *(*fat_read_bytes_func_t)(void *ctx, uint64_t address, uint32_t bytes, void *buffer);
+
+/*
+ * Optional: writes bytes bytes from buffer at address, ctx is the pointer given at mount time.
+ * Returns 0, or -1 on failure.
+ */
+typedef int (*fat_write_bytes_func_t)(void *ctx, uint64_t address, uint32_t bytes, const void *buffer);
+
+/*
+ * Optional: returns a pointer to bytes bytes of the device at address, without copying them.
+ * Returns NULL if that region cannot be addressed directly.
+ */
+typedef const void *(*fat_map_bytes_func_t)(void *ctx, uint64_t address, uint32_t bytes);
+
+/*
+ * Optional: hints that bytes bytes at address are going to be read soon. It must not wait
+ * for them: the device is expected to fetch them while the caller works on the previous ones.
+ */
+typedef void (*fat_prefetch_func_t)(void *ctx, uint64_t address, uint32_t bytes);
+
+/*
+ * Optional: locks (or unlocks) the lock identified by lock_ctx. Given to the caches
+ * shared by several threads.
+ */
+typedef void (*fat_lock_func_t)(void *lock_ctx);
+
+struct fat_cache;
+struct fat_dir_cache;
+struct fat_free_map;
 
 enum fat_version {
   FAT16, FAT32
 } __attribute__ ((packed));
 
+/*
+ * Building with FAT_ONLY_FAT16 or FAT_ONLY_FAT32 defined leaves the other type out:
+ * its volumes are not mounted, and every test on the type is resolved at compile time.
+ */
+#if defined(FAT_ONLY_FAT16) && defined(FAT_ONLY_FAT32)
+#error "FAT_ONLY_FAT16 and FAT_ONLY_FAT32 exclude each other"
+#elif defined(FAT_ONLY_FAT16)
+#define FAT_HAS_FAT16 (1)
+#define FAT_HAS_FAT32 (0)
+#elif defined(FAT_ONLY_FAT32)
+#define FAT_HAS_FAT16 (0)
+#define FAT_HAS_FAT32 (1)
+#else
+#define FAT_HAS_FAT16 (1)
+#define FAT_HAS_FAT32 (1)
+#endif
+
+#define FAT_IS_FAT16(drive) (FAT_HAS_FAT16 && (!FAT_HAS_FAT32 || (drive)->type==FAT16))
+
 /*
  * The structs are typedefed since the user is not meant to directly
  * write into them
+ *
+ * Once mounted and with everything attached, a fat_drive is only read: threads
+ * can share it as long as read_bytes can be called concurrently and the caches
+ * have a lock. Every thread works on its own fat_file, fat_dir and fat_dir_iter.
+ * Writes are the exception: while one runs, nothing else may use the drive, and
+ * other handles of the written file become stale.
  */
 
 typedef struct {
@@ -23,6 +81,11 @@ typedef struct {
   uint8_t log_sectors_per_cluster;
   uint16_t entries_per_cluster;
   uint32_t cluster_size_bytes;
+  uint32_t fat_size_sectors;
+  uint8_t number_of_fats;
+  uint32_t clusters_count; //Data clusters, numbered from 2
+  uint16_t root_entries_count; //FAT16 only
+  uint32_t volume_serial; //From the boot sector
 
   //Pointers
   uint32_t first_partition_sector; //AKA reserved region start, AKA lba begin in MBR
@@ -35,18 +98,59 @@ typedef struct {
 
   //Function pointers
   fat_read_bytes_func_t read_bytes;
+  void *read_ctx;
+  fat_map_bytes_func_t map_bytes; //NULL if not attached
+  fat_prefetch_func_t prefetch; //NULL if not attached
+  fat_write_bytes_func_t write_bytes; //NULL if the drive is read only
+
+  uint32_t alloc_hint; //Where the search for free clusters starts
+  uint32_t fs_info_sector; //FAT32 FSInfo sector, 0 if none
+  uint32_t fs_info_free_count; //Free clusters according to the FSInfo, FS_INFO_UNKNOWN if not known
+
+  //Optional sector cache, NULL if not attached
+  struct fat_cache *cache;
+
+  //Optional directory cache, NULL if not attached
+  struct fat_dir_cache *dir_cache;
+
+  //Optional in memory copy of the first FAT, NULL if not attached
+  void *fat_table;
 
-  //Data
-  uint8_t buffer[FAT_INTERNAL_BUFFER_SIZE];
+  //Optional free cluster bitmap, NULL if not attached
+  struct fat_free_map *free_map;
+
+  //Optional instrumentation, NULL if not attached
+  fat_stats *stats;
+  fat_clock_func_t clock;
+  fat_trace_func_t trace;
+  void *trace_ctx;
 } __attribute__ ((packed)) fat_drive;
 
+typedef struct {
+  uint32_t file_cluster; //Index of the first cluster of the extent inside the file
+  uint32_t first_cluster;
+  uint32_t clusters;
+} fat_extent;
+
 typedef struct {
   //Coordinates
   uint32_t cluster;
   uint32_t in_cluster_byte_offset;
 
   //File size
-  uint32_t size_bytes;
+  uint32_t size_bytes; //Bytes left to read
+  uint32_t total_size_bytes;
+  uint32_t first_cluster;
+  uint64_t entry_address; //Device address of the directory entry
+  uint32_t dir_cluster; //Of the directory holding the entry
+
+  //Optional extent map, sorted by file_cluster. NULL if not built
+  fat_extent *extents;
+  uint32_t extents_count;
+
+  //Readahead, used only if the drive has a prefetch function
+  uint32_t readahead_bytes; //Window, 0 until the file is read sequentially
+  uint32_t readahead_offset; //Where the window ends, or where the last read ended while it's 0
 } fat_file;
 
 typedef struct {
@@ -59,17 +163,145 @@ typedef struct {
   fat_file next_entry;
 } fat_list_entry;
 
+/*
+ * Directory iterator: entries are read from the device a buffer at a time,
+ * the buffer is supplied by the caller and should be as big as a cluster.
+ */
+typedef struct {
+  uint32_t cluster; //Cluster of the entries to load next, FAT_ROOT_DIR_CLUSTER for the FAT16 root dir
+  uint32_t next_entry; //Index, inside the cluster (or the FAT16 root dir), of the entry to load next
+  uint8_t done;
+
+  struct fat_entry *buffer;
+  uint64_t buffer_address; //Device address of the first loaded entry
+  uint32_t buffer_entries;
+  uint32_t loaded_entries;
+  uint32_t consumed_entries;
+
+  //Long name of the last returned entry, assembled while its parts are read
+  uint16_t long_name[FAT_LFN_MAX_CHARS];
+  uint16_t long_name_len; //0 if the entry has no (valid) long name
+  uint8_t lfn_checksum;
+  uint8_t lfn_order; //Order of the last long name part read, 0 if none
+} fat_dir_iter;
+
+//A decoded directory entry
+typedef struct {
+  uint8_t name[11];
+  uint8_t attr;
+  uint32_t first_cluster;
+  uint32_t size_bytes;
+
+  //Raw timestamps
+  uint8_t creation_time_tenth_of_secs;
+  struct fat_time creation_time;
+  struct fat_date creation_date;
+  struct fat_date last_access_date;
+  struct fat_time write_time;
+  struct fat_date write_date;
+
+  //UTF-16 long name, '\0' terminated. long_name_len is 0 if the entry has none
+  uint16_t long_name[FAT_LFN_MAX_CHARS + 1];
+  uint16_t long_name_len;
+} fat_dir_entry;
+
+//Attributes, size and times of an entry, as returned by fat.stat
+typedef struct {
+  uint8_t attr;
+  uint32_t first_cluster;
+  uint32_t size_bytes;
+
+  struct fat_timestamp creation_time;
+  struct fat_timestamp write_time;
+  struct fat_timestamp access_time; //The date only
+} fat_entry_info;
+
+/*
+ * A partition of the device, as found by fat.partitions. Any of them can be given to
+ * fat.mount_partition: several drives can share the backend and a sector cache,
+ * while directory caches, FAT tables and free maps belong to a single drive.
+ */
+#define FAT_PARTITION_TYPE_GPT MBR_TYPE_GPT_PROTECTIVE
+
+typedef struct {
+  uint32_t first_sector;
+  uint32_t sectors;
+  uint8_t type; //MBR partition type, FAT_PARTITION_TYPE_GPT for the GPT ones
+} fat_partition;
+
+/*
+ * Geometry of a mounted volume, as computed from its boot sectors. It can be stored
+ * (e.g. keyed by volume serial) and given back to fat.mount_geometry to mount
+ * the same volume again without parsing anything.
+ */
+#define FAT_GEOMETRY_VERSION (1u)
+
+typedef struct {
+  uint32_t version;
+  uint32_t volume_serial;
+  uint8_t type;
+  uint8_t log_bytes_per_sector;
+  uint8_t log_sectors_per_cluster;
+  uint8_t number_of_fats;
+  uint32_t fat_size_sectors;
+  uint32_t clusters_count;
+  uint16_t root_entries_count;
+  uint32_t first_partition_sector;
+  uint32_t first_fat_sector;
+  uint32_t root_dir; //First sector on FAT16, first cluster on FAT32
+  uint32_t first_data_sector;
+  uint32_t fs_info_sector;
+} __attribute__ ((packed)) fat_geometry;
+
 struct m_fat {
-  int (*mount)(fat_drive *drive, uint32_t sector_size, fat_read_bytes_func_t read_bytes_func);
+  int (*mount)(fat_drive *drive, uint32_t sector_size, fat_read_bytes_func_t read_bytes_func, void *read_ctx);
+  int (*mount_geometry)(fat_drive *drive, const fat_geometry *geometry, fat_read_bytes_func_t read_bytes_func,
+						void *read_ctx);
+  void (*geometry_save)(fat_drive *drive, fat_geometry *geometry);
+  int32_t (*partitions)(fat_read_bytes_func_t read_bytes_func, void *read_ctx, uint32_t sector_size,
+						fat_partition *partitions, uint32_t max_partitions);
+  int (*mount_partition)(fat_drive *drive, uint32_t sector_size, const fat_partition *partition,
+						 fat_read_bytes_func_t read_bytes_func, void *read_ctx);
+  int (*attach_cache)(fat_drive *drive, struct fat_cache *cache);
+  void (*attach_map)(fat_drive *drive, fat_map_bytes_func_t map_bytes_func);
+  void (*attach_prefetch)(fat_drive *drive, fat_prefetch_func_t prefetch_func);
+  uint32_t (*fat_table_size)(fat_drive *drive);
+  int (*attach_fat_table)(fat_drive *drive, void *buffer, uint32_t buffer_size);
+  void (*attach_dir_cache)(fat_drive *drive, struct fat_dir_cache *dir_cache);
+  int (*attach_writer)(fat_drive *drive, fat_write_bytes_func_t write_bytes_func);
+  uint32_t (*free_map_size)(fat_drive *drive);
+  int (*attach_free_map)(fat_drive *drive, struct fat_free_map *free_map, void *buffer, uint32_t buffer_size);
+  int (*free_clusters)(fat_drive *drive, uint32_t *free_clusters);
+  void (*attach_stats)(fat_drive *drive, fat_stats *stats, fat_clock_func_t clock_func);
+  void (*attach_trace)(fat_drive *drive, fat_trace_func_t trace_func, void *trace_ctx);
+  int (*stats_get)(fat_drive *drive, fat_stats *stats);
+  void *(*read_device)(fat_drive *drive, enum fat_io_kind kind, uint64_t address, uint32_t bytes, void *buffer);
 
   //File related
   int (*file_open)(fat_drive *drive, const char *path, fat_file *file);
   int (*file_open_in_dir)(fat_drive *drive, fat_dir *dir, const char *filename, fat_file *file);
   uint32_t (*file_read)(fat_drive *drive, fat_file *file, void *buffer, uint32_t buffer_len);
+  uint32_t (*file_map)(fat_drive *drive, fat_file *file, const void **data, uint32_t max_len);
+  int (*file_seek)(fat_drive *drive, fat_file *file, uint32_t offset);
+  int (*file_build_extents)(fat_drive *drive, fat_file *file, fat_extent *extents, uint32_t max_extents);
+  int (*file_stat)(fat_drive *drive, fat_file *file, fat_entry_info *info);
+
+  //Write related
+  int (*file_create)(fat_drive *drive, const char *path, fat_file *file);
+  uint32_t (*file_write)(fat_drive *drive, fat_file *file, const void *buffer, uint32_t buffer_len);
+  int (*file_truncate)(fat_drive *drive, fat_file *file, uint32_t size);
+  int (*file_delete)(fat_drive *drive, const char *path);
 
   //Dir related
   void (*dir_get_root)(fat_dir *dir);
   int (*dir_change)(fat_drive *drive, fat_dir *dir, const char *dir_name);
+  int (*dir_iter_init)(fat_drive *drive, fat_dir *dir, fat_dir_iter *iter, void *buffer, uint32_t buffer_size);
+  int32_t (*dir_read)(fat_drive *drive, fat_dir_iter *iter, fat_dir_entry *entries, uint32_t max_entries);
+
+  //Entry info related
+  int (*stat)(fat_drive *drive, const char *path, fat_entry_info *info);
+  uint32_t (*stat_many)(fat_drive *drive, const char *const *paths, uint32_t count, fat_entry_info *infos,
+						uint8_t *found);
 
   //Dir list related
   void (*list_make_empty_entry)(fat_list_entry *list_entry);
@@ -0,0 +1,275 @@
+#include "fat_cache.h"
+#include "fat_utils.h"
+#include <stddef.h>
+#include <string.h>
+
+#define FAT_CACHE_NO_SLOT (0xFFFFFFFFu)
+#define FAT_CACHE_ALIGNMENT (sizeof(uint64_t))
+
+//Private functions
+static void cache_lock(fat_cache *cache);
+static void cache_unlock(fat_cache *cache);
+static uint32_t hash_sector(fat_cache *cache, uint64_t sector);
+static uint32_t find_slot(fat_cache *cache, uint64_t sector);
+static uint32_t evict_slot(fat_cache *cache);
+static void *load_slot(fat_cache *cache, uint32_t slot, uint64_t sector, fat_read_bytes_func_t read_bytes,
+					   void *read_ctx);
+static void unlink_slot(fat_cache *cache, uint32_t slot);
+
+int fat_cache_init(fat_cache *cache, void *memory, uint32_t memory_size, uint32_t sector_size) {
+	uint8_t *mem = memory;
+	uint32_t padding, slot_cost, i;
+
+	if (sector_size==0 || (sector_size & (sector_size - 1)))
+		goto error;
+
+	//Align the beginning of the memory, the data slots go first
+	padding = (uint32_t) ((FAT_CACHE_ALIGNMENT - ((uintptr_t) mem & (FAT_CACHE_ALIGNMENT - 1))) &
+		(FAT_CACHE_ALIGNMENT - 1));
+	if (memory_size < padding)
+		goto error;
+	mem += padding;
+	memory_size -= padding;
+
+	slot_cost = sector_size + sizeof(struct fat_cache_slot) + sizeof(uint32_t);
+	cache->slots_count = memory_size/slot_cost;
+	if (cache->slots_count==0)
+		goto error;
+
+	cache->log_bytes_per_sector = fat_log2(sector_size);
+	cache->data = mem;
+	cache->slots = (struct fat_cache_slot *) (mem + (size_t) cache->slots_count*sector_size);
+	cache->buckets = (uint32_t *) (cache->slots + cache->slots_count);
+
+	//The number of buckets is the biggest power of 2 not greater than the number of slots
+	cache->buckets_mask = (1u << fat_log2(cache->slots_count)) - 1;
+
+	cache->lock = NULL;
+	cache->unlock = NULL;
+	for (i = 0; i < cache->slots_count; i++)
+		cache->slots[i].loading = 0;
+	fat_cache_invalidate(cache);
+	cache->hits = 0;
+	cache->misses = 0;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+void fat_cache_set_lock(fat_cache *cache, fat_lock_func_t lock, fat_lock_func_t unlock, void *lock_ctx) {
+	cache->lock = lock;
+	cache->unlock = unlock;
+	cache->lock_ctx = lock_ctx;
+}
+
+void fat_cache_invalidate(fat_cache *cache) {
+	uint32_t i;
+
+	cache_lock(cache);
+
+	for (i = 0; i < cache->slots_count; i++) {
+		//The slots being loaded stay reserved, they are dropped when loaded
+		cache->slots[i].valid = 0;
+		cache->slots[i].referenced = 0;
+	}
+
+	for (i = 0; i <= cache->buckets_mask; i++)
+		cache->buckets[i] = FAT_CACHE_NO_SLOT;
+
+	cache->clock_hand = 0;
+
+	cache_unlock(cache);
+}
+
+void *fat_cache_read(fat_cache *cache, fat_read_bytes_func_t read_bytes, void *read_ctx,
+					 uint64_t address, uint32_t bytes, void *buffer) {
+	uint8_t *byte_buffer = buffer, *data;
+	uint64_t sector;
+	uint32_t slot, in_sector_offset, chunk, sector_size = 1u << cache->log_bytes_per_sector;
+
+	cache_lock(cache);
+
+	while (bytes) {
+		sector = address >> cache->log_bytes_per_sector;
+		in_sector_offset = (uint32_t) (address & (sector_size - 1));
+
+		chunk = sector_size - in_sector_offset;
+		if (chunk > bytes)
+			chunk = bytes;
+
+		if ((slot = find_slot(cache, sector))!=FAT_CACHE_NO_SLOT && !cache->slots[slot].loading) {
+			cache->hits++;
+		} else {
+			cache->misses++;
+
+			//Loaded by another thread, or no slot to load it in as they all are: read around the cache
+			if (slot!=FAT_CACHE_NO_SLOT || (slot = evict_slot(cache))==FAT_CACHE_NO_SLOT) {
+				slot = FAT_CACHE_NO_SLOT;
+				cache_unlock(cache);
+				data = read_bytes(read_ctx, address, chunk, byte_buffer);
+				cache_lock(cache);
+			} else {
+				data = load_slot(cache, slot, sector, read_bytes, read_ctx);
+			}
+
+			if (data==NULL) {
+				buffer = NULL;
+				break;
+			}
+		}
+
+		if (slot!=FAT_CACHE_NO_SLOT) {
+			cache->slots[slot].referenced = 1;
+			data = cache->data + ((size_t) slot << cache->log_bytes_per_sector);
+			memcpy(byte_buffer, data + in_sector_offset, chunk);
+		}
+
+		byte_buffer += chunk;
+		address += chunk;
+		bytes -= chunk;
+	}
+
+	cache_unlock(cache);
+
+	return buffer;
+}
+
+/*
+ * Copies bytes just written to the device into the cached sectors they belong to.
+ * Sectors not in the cache are not loaded.
+ */
+void fat_cache_update(fat_cache *cache, uint64_t address, uint32_t bytes, const void *buffer) {
+	const uint8_t *byte_buffer = buffer;
+	uint64_t sector;
+	uint32_t slot, in_sector_offset, chunk, sector_size = 1u << cache->log_bytes_per_sector;
+
+	cache_lock(cache);
+
+	while (bytes) {
+		sector = address >> cache->log_bytes_per_sector;
+		in_sector_offset = (uint32_t) (address & (sector_size - 1));
+
+		chunk = sector_size - in_sector_offset;
+		if (chunk > bytes)
+			chunk = bytes;
+
+		//A sector being loaded may be read before the write: it's dropped once loaded
+		if ((slot = find_slot(cache, sector))!=FAT_CACHE_NO_SLOT) {
+			if (cache->slots[slot].loading)
+				unlink_slot(cache, slot);
+			else
+				memcpy(cache->data + ((size_t) slot << cache->log_bytes_per_sector) + in_sector_offset, byte_buffer, chunk);
+		}
+
+		byte_buffer += chunk;
+		address += chunk;
+		bytes -= chunk;
+	}
+
+	cache_unlock(cache);
+}
+
+void fat_cache_get_stats(fat_cache *cache, uint64_t *hits, uint64_t *misses) {
+	cache_lock(cache);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	cache_unlock(cache);
+}
+
+static inline void cache_lock(fat_cache *cache) {
+	if (cache->lock!=NULL)
+		cache->lock(cache->lock_ctx);
+}
+
+static inline void cache_unlock(fat_cache *cache) {
+	if (cache->unlock!=NULL)
+		cache->unlock(cache->lock_ctx);
+}
+
+static inline uint32_t hash_sector(fat_cache *cache, uint64_t sector) {
+	//Fibonacci hashing, consecutive sectors end up in different buckets
+	return (uint32_t) ((sector*0x9E3779B97F4A7C15ull) >> 32u) & cache->buckets_mask;
+}
+
+static uint32_t find_slot(fat_cache *cache, uint64_t sector) {
+	uint32_t slot;
+
+	for (slot = cache->buckets[hash_sector(cache, sector)]; slot!=FAT_CACHE_NO_SLOT; slot = cache->slots[slot].next)
+		if (cache->slots[slot].sector==sector)
+			return slot;
+
+	return FAT_CACHE_NO_SLOT;
+}
+
+//Returns FAT_CACHE_NO_SLOT if all the slots are being loaded
+static uint32_t evict_slot(fat_cache *cache) {
+	uint32_t slot, steps;
+
+	//CLOCK: skip (and clear) the recently referenced slots, two rounds clear them all
+	for (steps = 0; steps < 2*cache->slots_count; steps++) {
+		slot = cache->clock_hand;
+		cache->clock_hand = (cache->clock_hand + 1)%cache->slots_count;
+
+		if (cache->slots[slot].loading)
+			continue;
+
+		if (!cache->slots[slot].valid)
+			return slot;
+
+		if (cache->slots[slot].referenced) {
+			cache->slots[slot].referenced = 0;
+		} else {
+			unlink_slot(cache, slot);
+			return slot;
+		}
+	}
+
+	return FAT_CACHE_NO_SLOT;
+}
+
+/*
+ * Reads the sector in the slot, reserved while the cache is unlocked, and returns its data.
+ * If the sector was invalidated or written meanwhile the data is still returned, as read,
+ * but the slot is left free. NULL if the read failed.
+ */
+static void *load_slot(fat_cache *cache, uint32_t slot, uint64_t sector, fat_read_bytes_func_t read_bytes,
+					   void *read_ctx) {
+	uint8_t *data = cache->data + ((size_t) slot << cache->log_bytes_per_sector);
+	void *ret;
+
+	cache->slots[slot].sector = sector;
+	cache->slots[slot].valid = 1;
+	cache->slots[slot].loading = 1;
+	cache->slots[slot].next = cache->buckets[hash_sector(cache, sector)];
+	cache->buckets[hash_sector(cache, sector)] = slot;
+
+	cache_unlock(cache);
+	ret = read_bytes(read_ctx, sector << cache->log_bytes_per_sector, 1u << cache->log_bytes_per_sector, data);
+	cache_lock(cache);
+
+	//An invalidated or written sector has already been unlinked
+	cache->slots[slot].loading = 0;
+	if (ret==NULL) {
+		if (cache->slots[slot].valid)
+			unlink_slot(cache, slot);
+		return NULL;
+	}
+
+	return data;
+}
+
+static void unlink_slot(fat_cache *cache, uint32_t slot) {
+	uint32_t *link;
+
+	for (link = &cache->buckets[hash_sector(cache, cache->slots[slot].sector)];
+		 *link!=FAT_CACHE_NO_SLOT; link = &cache->slots[*link].next) {
+		if (*link==slot) {
+			*link = cache->slots[slot].next;
+			break;
+		}
+	}
+
+	cache->slots[slot].valid = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef FAT_CACHE_H
+#define FAT_CACHE_H
+
+#include <stdint.h>
+#include "fat.h"
+
+/*
+ * Sector-aligned read cache. All the memory is supplied by the caller:
+ * it's split into sector sized data slots, their descriptors and a small
+ * hash table used to find a sector. Slots are recycled with the CLOCK algorithm.
+ * With a lock set, the cache can be shared by threads reading the same drive.
+ * The lock is not held while reading the device: a sector is loaded in a slot
+ * marked as loading, the other threads needing it meanwhile read it themselves.
+ */
+
+struct fat_cache_slot {
+  uint64_t sector;
+  uint32_t next; //Next slot in the same hash bucket
+  uint8_t valid;
+  uint8_t referenced;
+  uint8_t loading; //Being read from the device, the data is not there yet
+};
+
+typedef struct fat_cache {
+  uint8_t log_bytes_per_sector;
+  uint32_t slots_count;
+  uint32_t buckets_mask;
+  uint32_t clock_hand;
+
+  struct fat_cache_slot *slots;
+  uint32_t *buckets;
+  uint8_t *data;
+
+  //Optional, NULL if not set
+  fat_lock_func_t lock;
+  fat_lock_func_t unlock;
+  void *lock_ctx;
+
+  //Statistics
+  uint64_t hits;
+  uint64_t misses;
+} fat_cache;
+
+int fat_cache_init(fat_cache *cache, void *memory, uint32_t memory_size, uint32_t sector_size);
+void fat_cache_set_lock(fat_cache *cache, fat_lock_func_t lock, fat_lock_func_t unlock, void *lock_ctx);
+void fat_cache_invalidate(fat_cache *cache);
+void *fat_cache_read(fat_cache *cache, fat_read_bytes_func_t read_bytes, void *read_ctx,
+					 uint64_t address, uint32_t bytes, void *buffer);
+void fat_cache_update(fat_cache *cache, uint64_t address, uint32_t bytes, const void *buffer);
+void fat_cache_get_stats(fat_cache *cache, uint64_t *hits, uint64_t *misses);
+
+#endif
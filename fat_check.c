@@ -0,0 +1,284 @@
+#include "fat_check.h"
+#include <stddef.h>
+#include <string.h>
+
+#define FAT_CHECK_ALIGNMENT (sizeof(uint32_t))
+#define FAT_CHECK_READ_BYTES (1024*1024u) //FAT bytes read at once
+#define FAT_CHECK_OK (-1)
+
+//Owners: record + 1 of the entry whose chain holds the cluster, or one of these
+#define FAT_CHECK_NO_OWNER (0)
+#define FAT_CHECK_ROOT_OWNER (0xFFFFFFFFu) //The FAT32 root directory
+#define FAT_CHECK_LOST_BODY (0xFFFFFFFEu) //Lost, and some other lost cluster points to it
+#define FAT_CHECK_LOST_SEEN (0xFFFFFFFDu) //Lost, and already counted in a chain
+
+struct check {
+  fat_drive *drive;
+  const fat_index *index;
+  uint32_t *next; //FAT entries, the FAT16 ones widened to the FAT32 values
+  uint32_t *owner;
+  uint32_t end; //First cluster number past the volume
+  uint32_t threshold;
+  fat_check_report *report;
+  fat_check_issue_func_t issue_func;
+  void *issue_ctx;
+};
+
+//Private functions
+static int load_fat(struct check *check);
+static int is_used(uint32_t next);
+static int walk(struct check *check, uint32_t owner, uint32_t cluster, uint32_t *length, uint32_t *fragments,
+				uint32_t *at);
+static int issue(struct check *check, enum fat_check_problem problem, uint32_t record, uint32_t cluster,
+				 uint32_t count);
+static int check_entry(struct check *check, uint32_t record);
+static int check_lost(struct check *check);
+
+//Memory fat_check_run needs for the volume
+uint32_t fat_check_memory_size(fat_drive *drive) {
+	return (drive->clusters_count + 2)*2*(uint32_t) sizeof(uint32_t) + FAT_CHECK_ALIGNMENT;
+}
+
+/*
+ * Checks every chain of the volume against the entries of a complete index. Problems are
+ * counted in report and given to issue_func, if not NULL; files in fragmented_threshold
+ * pieces or more are reported as fragmented, 0 disables that.
+ * Returns 0 once the whole volume has been checked, whatever was found; -1 if the FAT
+ * cannot be read, the memory is not enough, the index is incomplete or issue_func asked to stop.
+ */
+int fat_check_run(fat_drive *drive, const fat_index *index, void *memory, uint32_t memory_size,
+				  uint32_t fragmented_threshold, fat_check_report *report, fat_check_issue_func_t issue_func,
+				  void *issue_ctx) {
+	struct check check;
+	uint8_t *mem = memory;
+	uint32_t padding, i, length, fragments, at;
+	int problem;
+
+	padding = (uint32_t) ((FAT_CHECK_ALIGNMENT - ((uintptr_t) mem & (FAT_CHECK_ALIGNMENT - 1))) &
+		(FAT_CHECK_ALIGNMENT - 1));
+	if (index->failed || memory_size < fat_check_memory_size(drive) - FAT_CHECK_ALIGNMENT + padding)
+		goto error;
+
+	check.drive = drive;
+	check.index = index;
+	check.end = drive->clusters_count + 2;
+	check.next = (uint32_t *) (mem + padding);
+	check.owner = check.next + check.end;
+	check.threshold = fragmented_threshold;
+	check.report = report;
+	check.issue_func = issue_func;
+	check.issue_ctx = issue_ctx;
+
+	memset(report, 0, sizeof(*report));
+	memset(check.owner, 0, check.end*sizeof(uint32_t));
+
+	if (load_fat(&check))
+		goto error;
+
+	//Branch free, so that the compiler can vectorize it
+	for (i = 2; i < check.end; i++) {
+		report->free_clusters += check.next[i]==CLUSTER_FREE;
+		report->bad_clusters += check.next[i]==CLUSTER_BAD_32;
+	}
+	report->used_clusters = drive->clusters_count - report->free_clusters - report->bad_clusters;
+
+	//The root first: entries running into it are the cross-linked ones
+	if (!FAT_IS_FAT16(drive) &&
+		(problem = walk(&check, FAT_CHECK_ROOT_OWNER, drive->root_dir.first_cluster_v32, &length, &fragments, &at))!=
+			FAT_CHECK_OK &&
+		issue(&check, (enum fat_check_problem) problem, FAT_INDEX_ROOT, at, length))
+		goto error;
+
+	for (i = 0; i < index->records_count; i++)
+		if (check_entry(&check, i))
+			goto error;
+
+	if (check_lost(&check))
+		goto error;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/*
+ * The FAT entries of all the clusters are read into next, from the start of the first FAT.
+ * FAT16 entries are read into the first half, then widened from the last one: an entry
+ * is always written at or after where it was read, over entries already widened.
+ */
+static int load_fat(struct check *check) {
+	fat_drive *drive = check->drive;
+	uint32_t entry_size = FAT_IS_FAT16(drive) ? 2 : 4, bytes = check->end*entry_size, done, chunk, i;
+	uint64_t address = (uint64_t) drive->first_fat_sector << drive->log_bytes_per_sector;
+	uint16_t *next16 = (uint16_t *) check->next;
+
+	for (done = 0; done < bytes; done += chunk) {
+		chunk = bytes - done < FAT_CHECK_READ_BYTES ? bytes - done : FAT_CHECK_READ_BYTES;
+		if (fat.read_device(drive, FAT_IO_FAT, address + done, chunk, (uint8_t *) check->next + done)==NULL)
+			return -1;
+	}
+
+	if (FAT_IS_FAT16(drive)) {
+		for (i = check->end; i > 0; i--) {
+			check->next[i - 1] = next16[i - 1];
+			if (check->next[i - 1] >= CLUSTER_BAD_16)
+				check->next[i - 1] |= CLUSTER_MASK_32 & ~0xFFFFu;
+		}
+	} else {
+		for (i = 0; i < check->end; i++)
+			check->next[i] &= CLUSTER_MASK_32;
+	}
+
+	return 0;
+}
+
+static inline int is_used(uint32_t next) {
+	return next!=CLUSTER_FREE && next!=CLUSTER_BAD_32;
+}
+
+/*
+ * Follows a chain from cluster, marking its clusters with owner. The length is counted
+ * up to where the chain ends or goes wrong, fragments are its contiguous pieces.
+ * Returns FAT_CHECK_OK, or the problem found with at set to the cluster it was found at.
+ */
+static int walk(struct check *check, uint32_t owner, uint32_t cluster, uint32_t *length, uint32_t *fragments,
+				uint32_t *at) {
+	uint32_t next;
+
+	*length = 0;
+	*fragments = cluster!=CLUSTER_FREE;
+	*at = cluster;
+
+	while (cluster!=CLUSTER_FREE) {
+		*at = cluster;
+		if (cluster < 2 || cluster >= check->end || !is_used(check->next[cluster]))
+			return FAT_CHECK_BROKEN_CHAIN;
+		if (check->owner[cluster]==owner)
+			return FAT_CHECK_LOOP;
+		if (check->owner[cluster]!=FAT_CHECK_NO_OWNER)
+			return FAT_CHECK_CROSS_LINKED;
+
+		check->owner[cluster] = owner;
+		(*length)++;
+
+		if ((next = check->next[cluster]) >= CLUSTER_EOF_32)
+			break;
+		if (next!=cluster + 1)
+			(*fragments)++;
+		cluster = next;
+	}
+
+	return FAT_CHECK_OK;
+}
+
+static int issue(struct check *check, enum fat_check_problem problem, uint32_t record, uint32_t cluster,
+				 uint32_t count) {
+	fat_check_issue found = {problem, record, cluster, count};
+	fat_check_report *report = check->report;
+
+	switch (problem) {
+		case FAT_CHECK_CROSS_LINKED: report->cross_linked++;
+			break;
+		case FAT_CHECK_BROKEN_CHAIN: report->broken_chains++;
+			break;
+		case FAT_CHECK_LOOP: report->loops++;
+			break;
+		case FAT_CHECK_SIZE_MISMATCH: report->size_mismatches++;
+			break;
+		case FAT_CHECK_LOST_CHAIN: report->lost_chains++;
+			break;
+		default: break;
+	}
+
+	if (check->issue_func!=NULL)
+		return check->issue_func(check->issue_ctx, &found);
+
+	return 0;
+}
+
+static int check_entry(struct check *check, uint32_t record) {
+	const fat_index_record *entry = &check->index->records[record];
+	uint32_t log_cluster_size = check->drive->log_bytes_per_sector + check->drive->log_sectors_per_cluster;
+	uint32_t length, fragments, at, expected, other;
+	fat_check_report *report = check->report;
+	int problem, is_dir = entry->attr & ATTR_DIRECTORY;
+
+	if (is_dir)
+		report->dirs++;
+	else
+		report->files++;
+
+	problem = walk(check, record + 1, entry->first_cluster, &length, &fragments, &at);
+
+	if (problem==FAT_CHECK_OK && is_dir && entry->first_cluster==CLUSTER_FREE)
+		problem = FAT_CHECK_BROKEN_CHAIN; //Only the FAT16 root dir has no clusters
+
+	if (problem==FAT_CHECK_CROSS_LINKED) { //count is the record of the other entry
+		other = check->owner[at];
+		if (issue(check, FAT_CHECK_CROSS_LINKED, record, at, other==FAT_CHECK_ROOT_OWNER ? FAT_INDEX_ROOT : other - 1))
+			return -1;
+	} else if (problem!=FAT_CHECK_OK) {
+		if (issue(check, (enum fat_check_problem) problem, record, at, length))
+			return -1;
+	}
+
+	if (is_dir)
+		return 0;
+
+	//Wrong chains have the wrong length anyway, their size is not looked at
+	expected = entry->size_bytes ? ((entry->size_bytes - 1) >> log_cluster_size) + 1 : 0;
+	if (problem==FAT_CHECK_OK && length!=expected && issue(check, FAT_CHECK_SIZE_MISMATCH, record, at, length))
+		return -1;
+
+	if (length) {
+		report->fragments += fragments;
+		if (fragments > 1)
+			report->fragmented_files++;
+		if (fragments > report->max_fragments) {
+			report->max_fragments = fragments;
+			report->max_fragments_record = record;
+		}
+		if (check->threshold && fragments >= check->threshold &&
+			issue(check, FAT_CHECK_FRAGMENTED, record, entry->first_cluster, fragments))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Used clusters no entry reached. Those no other lost cluster points to start a lost chain,
+ * lost loops are only counted as clusters.
+ */
+static int check_lost(struct check *check) {
+	uint32_t i, cluster, next, length;
+
+	for (i = 2; i < check->end; i++) {
+		if (!is_used(check->next[i]) || (check->owner[i]!=FAT_CHECK_NO_OWNER && check->owner[i]!=FAT_CHECK_LOST_BODY))
+			continue;
+
+		check->report->lost_clusters++;
+		next = check->next[i];
+		if (next >= 2 && next < check->end && check->owner[next]==FAT_CHECK_NO_OWNER)
+			check->owner[next] = FAT_CHECK_LOST_BODY;
+	}
+
+	for (i = 2; i < check->end; i++) {
+		if (!is_used(check->next[i]) || check->owner[i]!=FAT_CHECK_NO_OWNER)
+			continue;
+
+		length = 0;
+		for (cluster = i; cluster >= 2 && cluster < check->end && is_used(check->next[cluster]) &&
+			(check->owner[cluster]==FAT_CHECK_NO_OWNER || check->owner[cluster]==FAT_CHECK_LOST_BODY);
+			 cluster = check->next[cluster]) {
+			check->owner[cluster] = FAT_CHECK_LOST_SEEN;
+			length++;
+		}
+
+		if (issue(check, FAT_CHECK_LOST_CHAIN, FAT_INDEX_ROOT, i, length))
+			return -1;
+	}
+
+	return 0;
+}
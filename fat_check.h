@@ -0,0 +1,63 @@
+#ifndef FAT_CHECK_H
+#define FAT_CHECK_H
+
+#include <stdint.h>
+#include "fat.h"
+#include "fat_index.h"
+
+/*
+ * Read only consistency check of a volume, using the index of all its entries.
+ * The first FAT is loaded once into caller memory, next to an owner per cluster;
+ * every chain is then walked once, from the entry it belongs to. What's found wrong
+ * is both counted in the report and given, entry by entry, to an optional callback.
+ */
+
+enum fat_check_problem {
+  FAT_CHECK_CROSS_LINKED, //The chain runs into the one of another entry, at cluster
+  FAT_CHECK_BROKEN_CHAIN, //The chain reaches cluster, which is free, bad or out of the volume
+  FAT_CHECK_LOOP, //The chain comes back to cluster
+  FAT_CHECK_SIZE_MISMATCH, //The chain has count clusters, not as many as the size needs
+  FAT_CHECK_FRAGMENTED, //The file is in count pieces, at least the threshold given
+  FAT_CHECK_LOST_CHAIN, //count clusters from cluster are used but belong to no entry; record is FAT_INDEX_ROOT
+};
+
+typedef struct {
+  enum fat_check_problem problem;
+  uint32_t record; //FAT_INDEX_ROOT for the FAT32 root directory and lost chains
+  uint32_t cluster;
+  uint32_t count;
+} fat_check_issue;
+
+//Gets every issue found, returns 0 to go on
+typedef int (*fat_check_issue_func_t)(void *ctx, const fat_check_issue *issue);
+
+typedef struct {
+  uint32_t files;
+  uint32_t dirs;
+
+  //Clusters, by FAT content
+  uint32_t used_clusters;
+  uint32_t free_clusters;
+  uint32_t bad_clusters;
+
+  //Problems
+  uint32_t lost_clusters;
+  uint32_t lost_chains;
+  uint32_t cross_linked;
+  uint32_t broken_chains;
+  uint32_t loops;
+  uint32_t size_mismatches;
+
+  //Fragmentation of the files
+  uint32_t fragmented_files; //In more than one piece
+  uint64_t fragments; //Pieces of all the files
+  uint32_t max_fragments;
+  uint32_t max_fragments_record;
+} fat_check_report;
+
+uint32_t fat_check_memory_size(fat_drive *drive);
+int fat_check_run(fat_drive *drive, const fat_index *index, void *memory, uint32_t memory_size,
+				  uint32_t fragmented_threshold, fat_check_report *report, fat_check_issue_func_t issue_func,
+				  void *issue_ctx);
+
+#endif
@@ -0,0 +1,496 @@
+#include "fat_dir_cache.h"
+#include "fat_utils.h"
+#include <stddef.h>
+#include <string.h>
+
+#define FAT_DIR_CACHE_NO_RECORD (0xFFFFFFFFu)
+#define FAT_DIR_CACHE_ALIGNMENT (sizeof(uint64_t))
+
+//Private functions
+static uint32_t hash_name(fat_dir_cache *cache, uint32_t dir_cluster, const uint8_t *name);
+static void long_name_key(uint64_t long_name_hash, uint32_t len, uint8_t *name);
+static int long_name_equal(fat_dir_cache *cache, const struct fat_dir_cache_record *record,
+						   const uint16_t *folded_name, uint32_t len);
+static uint32_t add_record(fat_dir_cache *cache, struct fat_dir_cache_dir *dir, const struct fat_entry *entry,
+						   uint64_t entry_address);
+static void free_record(fat_dir_cache *cache, uint32_t record);
+static void evict(fat_dir_cache *cache, struct fat_dir_cache_dir *dir);
+static struct fat_dir_cache_dir *victim(fat_dir_cache *cache, const struct fat_dir_cache_dir *dir);
+static int32_t path_fold(const char *path, uint32_t len, char *folded);
+static uint32_t uses_now(fat_dir_cache *cache, const struct fat_dir_cache_dir *dir);
+
+int fat_dir_cache_init(fat_dir_cache *cache, void *memory, uint32_t memory_size) {
+	uint8_t *mem = memory;
+	uint32_t padding;
+
+	padding = (uint32_t) ((FAT_DIR_CACHE_ALIGNMENT - ((uintptr_t) mem & (FAT_DIR_CACHE_ALIGNMENT - 1))) &
+		(FAT_DIR_CACHE_ALIGNMENT - 1));
+	if (memory_size < padding)
+		goto error;
+	mem += padding;
+	memory_size -= padding;
+
+	cache->records_count = memory_size/(sizeof(struct fat_dir_cache_record) + sizeof(uint32_t));
+	if (cache->records_count==0)
+		goto error;
+
+	cache->records = (struct fat_dir_cache_record *) mem;
+	cache->buckets = (uint32_t *) (cache->records + cache->records_count);
+	cache->buckets_mask = (1u << fat_log2(cache->records_count)) - 1;
+
+	cache->lock = NULL;
+	cache->unlock = NULL;
+
+	fat_dir_cache_invalidate(cache);
+	cache->hits = 0;
+	cache->misses = 0;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+void fat_dir_cache_invalidate(fat_dir_cache *cache) {
+	uint32_t i;
+
+	for (i = 0; i <= cache->buckets_mask; i++)
+		cache->buckets[i] = FAT_DIR_CACHE_NO_RECORD;
+
+	for (i = 0; i < cache->records_count; i++)
+		cache->records[i].next = i + 1;
+	cache->records[cache->records_count - 1].next = FAT_DIR_CACHE_NO_RECORD;
+	cache->free_list = 0;
+	cache->free_records = cache->records_count;
+
+	//A directory loading keeps its slot, the records it had are gone with the others
+	for (i = 0; i < FAT_DIR_CACHE_DIRS; i++) {
+		if (cache->dirs[i].state==FAT_DIR_CACHE_LOADING) {
+			cache->dirs[i].first_record = FAT_DIR_CACHE_NO_RECORD;
+			cache->dirs[i].stale = 1;
+		} else {
+			cache->dirs[i].state = FAT_DIR_CACHE_FREE;
+		}
+	}
+	cache->lookups = 0;
+
+	for (i = 0; i < FAT_DIR_CACHE_PATHS; i++)
+		cache->paths[i].hash = 0;
+}
+
+void fat_dir_cache_set_lock(fat_dir_cache *cache, fat_lock_func_t lock, fat_lock_func_t unlock, void *lock_ctx) {
+	cache->lock = lock;
+	cache->unlock = unlock;
+	cache->lock_ctx = lock_ctx;
+}
+
+void fat_dir_cache_lock(fat_dir_cache *cache) {
+	if (cache->lock!=NULL)
+		cache->lock(cache->lock_ctx);
+}
+
+void fat_dir_cache_unlock(fat_dir_cache *cache) {
+	if (cache->unlock!=NULL)
+		cache->unlock(cache->lock_ctx);
+}
+
+/*
+ * Counts a lookup in the directory of dir_cluster and returns its slot. A directory
+ * not followed yet takes a free slot, else the one of the least recently used
+ * directory, preferring those not indexed. NULL if every other slot is loading.
+ */
+struct fat_dir_cache_dir *fat_dir_cache_use(fat_dir_cache *cache, uint32_t dir_cluster) {
+	struct fat_dir_cache_dir *dir = NULL, *free_dir = NULL, *seen = NULL, *indexed = NULL, *slot;
+	uint32_t i;
+
+	cache->lookups++;
+
+	for (i = 0; i < FAT_DIR_CACHE_DIRS && dir==NULL; i++) {
+		slot = &cache->dirs[i];
+		if (slot->state==FAT_DIR_CACHE_FREE) {
+			if (free_dir==NULL)
+				free_dir = slot;
+		} else if (slot->cluster==dir_cluster) {
+			dir = slot;
+		} else if (slot->state==FAT_DIR_CACHE_LOADING) {
+			continue;
+		} else if (slot->state==FAT_DIR_CACHE_SEEN) {
+			if (seen==NULL || slot->last_used < seen->last_used)
+				seen = slot;
+		} else if (indexed==NULL || slot->last_used < indexed->last_used) {
+			indexed = slot;
+		}
+	}
+
+	if (dir==NULL) {
+		dir = free_dir!=NULL ? free_dir : seen!=NULL ? seen : indexed;
+		if (dir==NULL)
+			return NULL;
+		if (dir->state==FAT_DIR_CACHE_INDEXED)
+			evict(cache, dir);
+
+		dir->cluster = dir_cluster;
+		dir->first_record = FAT_DIR_CACHE_NO_RECORD;
+		dir->records = 0;
+		dir->uses = 0;
+		dir->state = FAT_DIR_CACHE_SEEN;
+	}
+
+	dir->uses = uses_now(cache, dir) + 1;
+	dir->last_used = cache->lookups;
+
+	return dir;
+}
+
+/*
+ * Whether the directory, not indexed, can be: its records fit in the free ones plus those
+ * of the directories it may evict. A directory of unknown size is always tried.
+ */
+int fat_dir_cache_may_index(fat_dir_cache *cache, struct fat_dir_cache_dir *dir) {
+	uint32_t i, available = cache->free_records;
+
+	if (dir->records==0)
+		return 1;
+
+	for (i = 0; i < FAT_DIR_CACHE_DIRS && available < dir->records; i++)
+		if (&cache->dirs[i]!=dir && cache->dirs[i].state==FAT_DIR_CACHE_INDEXED &&
+			uses_now(cache, &cache->dirs[i]) < dir->uses)
+			available += cache->dirs[i].records;
+
+	return available >= dir->records;
+}
+
+//The directory, not indexed, is going to be read unlocked while its entries are inserted
+void fat_dir_cache_loading(fat_dir_cache *cache, struct fat_dir_cache_dir *dir) {
+	(void) cache;
+
+	dir->state = FAT_DIR_CACHE_LOADING;
+	dir->stale = 0;
+}
+
+/*
+ * The load of the directory is over. If complete, all its entries, taking records, have been
+ * inserted and it's indexed, unless it changed meanwhile. If not, it's dropped and records
+ * is what it needs (0 if not known).
+ */
+void fat_dir_cache_loaded(fat_dir_cache *cache, struct fat_dir_cache_dir *dir, uint32_t records, int complete) {
+	if (complete && !dir->stale) {
+		dir->state = FAT_DIR_CACHE_INDEXED;
+		dir->records = records;
+		return;
+	}
+
+	evict(cache, dir);
+	dir->state = FAT_DIR_CACHE_SEEN;
+	dir->records = dir->stale ? 0 : records;
+}
+
+/*
+ * Indexing the directory was given up: its records are freed, records is what it needs (0 if not known).
+ * One loading stays so until fat_dir_cache_loaded.
+ */
+void fat_dir_cache_drop(fat_dir_cache *cache, struct fat_dir_cache_dir *dir, uint32_t records) {
+	evict(cache, dir);
+	if (dir->state!=FAT_DIR_CACHE_LOADING)
+		dir->state = FAT_DIR_CACHE_SEEN;
+	dir->records = records;
+}
+
+//The entries of the directory changed: it's indexed again, if needed, at the next lookup
+void fat_dir_cache_invalidate_dir(fat_dir_cache *cache, uint32_t dir_cluster) {
+	uint32_t i;
+
+	for (i = 0; i < FAT_DIR_CACHE_DIRS; i++) {
+		if (cache->dirs[i].state==FAT_DIR_CACHE_FREE || cache->dirs[i].cluster!=dir_cluster)
+			continue;
+
+		if (cache->dirs[i].state==FAT_DIR_CACHE_LOADING)
+			cache->dirs[i].stale = 1;
+		fat_dir_cache_drop(cache, &cache->dirs[i], 0);
+		return;
+	}
+}
+
+//Records taken by an entry: itself, and with a long name its key and the name
+uint32_t fat_dir_cache_records_for(uint32_t long_name_len) {
+	if (long_name_len==0)
+		return 1;
+
+	return 2 + (long_name_len + FAT_DIR_CACHE_NAME_UNITS - 1)/FAT_DIR_CACHE_NAME_UNITS;
+}
+
+/*
+ * Inserts an entry of the directory, evicting other directories if they may be.
+ * Returns -1 if there is no room for it: the directory is then to be dropped.
+ */
+int fat_dir_cache_insert(fat_dir_cache *cache, struct fat_dir_cache_dir *dir, const struct fat_entry *entry,
+						 uint64_t entry_address, const uint16_t *long_name, uint32_t long_name_len) {
+	uint32_t record, part, i, units, *link;
+	struct fat_entry keyed_entry;
+	struct fat_dir_cache_dir *evicted;
+
+	while (cache->free_records < fat_dir_cache_records_for(long_name_len)) {
+		if ((evicted = victim(cache, dir))==NULL)
+			return -1;
+		evict(cache, evicted);
+		evicted->state = FAT_DIR_CACHE_SEEN;
+	}
+
+	add_record(cache, dir, entry, entry_address);
+	if (long_name_len==0)
+		return 0;
+
+	keyed_entry = *entry;
+	long_name_key(fat_lfn_name_hash(long_name, long_name_len), long_name_len, keyed_entry.name.whole);
+	record = add_record(cache, dir, &keyed_entry, entry_address);
+
+	link = &cache->records[record].long_name;
+	for (i = 0; i < long_name_len; i += units) {
+		part = cache->free_list;
+		cache->free_list = cache->records[part].next;
+		cache->free_records--;
+
+		units = long_name_len - i < FAT_DIR_CACHE_NAME_UNITS ? long_name_len - i : FAT_DIR_CACHE_NAME_UNITS;
+		memset(&cache->records[part].entry, 0, sizeof(cache->records[part].entry));
+		memcpy(&cache->records[part].entry, long_name + i, units*sizeof(uint16_t));
+
+		*link = part;
+		link = &cache->records[part].next;
+	}
+	*link = FAT_DIR_CACHE_NO_RECORD;
+
+	return 0;
+}
+
+const struct fat_dir_cache_record *fat_dir_cache_lookup(fat_dir_cache *cache, uint32_t dir_cluster,
+														const uint8_t *name) {
+	uint32_t i;
+
+	for (i = cache->buckets[hash_name(cache, dir_cluster, name)]; i!=FAT_DIR_CACHE_NO_RECORD; i = cache->records[i].next)
+		if (cache->records[i].dir_cluster==dir_cluster &&
+			!memcmp(cache->records[i].entry.name.whole, name, FAT_ENTRY_WHOLE_NAME_SIZE))
+			return &cache->records[i];
+
+	return NULL;
+}
+
+/*
+ * The record of a long name stores its key in place of the short name: a leading 0x00,
+ * which no real entry has, followed by the hash and the length. Only cluster, size,
+ * attributes and times are meaningful. folded_name is the searched name, uppercase.
+ */
+const struct fat_dir_cache_record *fat_dir_cache_lookup_long(fat_dir_cache *cache, uint32_t dir_cluster,
+															 const uint16_t *folded_name, uint32_t len) {
+	uint8_t name[FAT_ENTRY_WHOLE_NAME_SIZE];
+	uint32_t i;
+
+	long_name_key(fat_lfn_name_hash(folded_name, len), len, name);
+
+	//Different names can have the same key
+	for (i = cache->buckets[hash_name(cache, dir_cluster, name)]; i!=FAT_DIR_CACHE_NO_RECORD; i = cache->records[i].next)
+		if (cache->records[i].dir_cluster==dir_cluster &&
+			!memcmp(cache->records[i].entry.name.whole, name, FAT_ENTRY_WHOLE_NAME_SIZE) &&
+			long_name_equal(cache, &cache->records[i], folded_name, len))
+			return &cache->records[i];
+
+	return NULL;
+}
+
+//The entry at entry_address was rewritten: its records, if any, are given the new one
+void fat_dir_cache_update(fat_dir_cache *cache, uint32_t dir_cluster, uint64_t entry_address,
+						  const struct fat_entry *entry) {
+	struct fat_dir_cache_record *record;
+	uint32_t i;
+
+	for (i = 0; i < FAT_DIR_CACHE_DIRS; i++)
+		if (cache->dirs[i].state!=FAT_DIR_CACHE_FREE && cache->dirs[i].cluster==dir_cluster)
+			break;
+	if (i==FAT_DIR_CACHE_DIRS || cache->dirs[i].state==FAT_DIR_CACHE_SEEN)
+		return;
+
+	//The entry may have been read before it was written
+	if (cache->dirs[i].state==FAT_DIR_CACHE_LOADING) {
+		cache->dirs[i].stale = 1;
+		return;
+	}
+
+	//The names, which are the keys, stay the same
+	for (i = cache->dirs[i].first_record; i!=FAT_DIR_CACHE_NO_RECORD; i = record->dir_next) {
+		record = &cache->records[i];
+		if (record->entry_address!=entry_address)
+			continue;
+
+		memcpy((uint8_t *) &record->entry + FAT_ENTRY_WHOLE_NAME_SIZE, (const uint8_t *) entry + FAT_ENTRY_WHOLE_NAME_SIZE,
+			   sizeof(*entry) - FAT_ENTRY_WHOLE_NAME_SIZE);
+	}
+}
+
+//path is the directory part of a path, with no file name
+int fat_dir_cache_path_lookup(fat_dir_cache *cache, const char *path, uint32_t len, uint32_t *cluster) {
+	char folded[FAT_DIR_CACHE_PATH_BYTES];
+	int32_t folded_len = path_fold(path, len, folded);
+	struct fat_dir_cache_path *slot;
+	uint64_t hash;
+
+	if (folded_len < 0)
+		return -1;
+
+	hash = fat_path_hash(folded, (uint32_t) folded_len);
+	slot = &cache->paths[hash%FAT_DIR_CACHE_PATHS];
+
+	//The hash only picks the slot, the path has to be the same
+	if (slot->hash!=hash || slot->len!=(uint32_t) folded_len || memcmp(slot->path, folded, slot->len))
+		return -1;
+
+	*cluster = slot->cluster;
+
+	return 0;
+}
+
+void fat_dir_cache_path_insert(fat_dir_cache *cache, const char *path, uint32_t len, uint32_t cluster) {
+	char folded[FAT_DIR_CACHE_PATH_BYTES];
+	int32_t folded_len = path_fold(path, len, folded);
+	struct fat_dir_cache_path *slot;
+	uint64_t hash;
+
+	if (folded_len < 0)
+		return;
+
+	hash = fat_path_hash(folded, (uint32_t) folded_len);
+	slot = &cache->paths[hash%FAT_DIR_CACHE_PATHS];
+	slot->hash = hash;
+	slot->cluster = cluster;
+	slot->len = (uint32_t) folded_len;
+	memcpy(slot->path, folded, slot->len);
+}
+
+static uint32_t hash_name(fat_dir_cache *cache, uint32_t dir_cluster, const uint8_t *name) {
+	uint32_t i, hash = 2166136261u ^ dir_cluster; //FNV-1a
+
+	for (i = 0; i < FAT_ENTRY_WHOLE_NAME_SIZE; i++)
+		hash = (hash ^ name[i])*16777619u;
+
+	return hash & cache->buckets_mask;
+}
+
+static void long_name_key(uint64_t long_name_hash, uint32_t len, uint8_t *name) {
+	name[0] = FAT_ENTRY_NAME_LAST_ENTRY;
+	memcpy(name + 1, &long_name_hash, sizeof(long_name_hash));
+	name[9] = (uint8_t) len;
+	name[10] = (uint8_t) (len >> 8u);
+}
+
+static int long_name_equal(fat_dir_cache *cache, const struct fat_dir_cache_record *record,
+						   const uint16_t *folded_name, uint32_t len) {
+	uint16_t units[FAT_DIR_CACHE_NAME_UNITS];
+	uint32_t i, count, part = record->long_name;
+
+	//The key holds the length, every part is there
+	for (i = 0; i < len; i += count, part = cache->records[part].next) {
+		count = len - i < FAT_DIR_CACHE_NAME_UNITS ? len - i : FAT_DIR_CACHE_NAME_UNITS;
+		memcpy(units, &cache->records[part].entry, count*sizeof(uint16_t));
+		if (!fat_lfn_name_equal(folded_name + i, units, count))
+			return 0;
+	}
+
+	return 1;
+}
+
+//Takes a free record for the entry, linked in its bucket and in its directory
+static uint32_t add_record(fat_dir_cache *cache, struct fat_dir_cache_dir *dir, const struct fat_entry *entry,
+						   uint64_t entry_address) {
+	uint32_t index = cache->free_list, bucket;
+	struct fat_dir_cache_record *record = &cache->records[index];
+
+	cache->free_list = record->next;
+	cache->free_records--;
+
+	record->dir_cluster = dir->cluster;
+	record->entry_address = entry_address;
+	record->entry = *entry;
+	record->long_name = FAT_DIR_CACHE_NO_RECORD;
+
+	bucket = hash_name(cache, dir->cluster, entry->name.whole);
+	record->next = cache->buckets[bucket];
+	cache->buckets[bucket] = index;
+
+	record->dir_next = dir->first_record;
+	dir->first_record = index;
+
+	return index;
+}
+
+static inline void free_record(fat_dir_cache *cache, uint32_t record) {
+	cache->records[record].next = cache->free_list;
+	cache->free_list = record;
+	cache->free_records++;
+}
+
+//Frees all the records of the directory, its state is left to the caller
+static void evict(fat_dir_cache *cache, struct fat_dir_cache_dir *dir) {
+	uint32_t i, next, part, next_part, *link;
+	struct fat_dir_cache_record *record;
+
+	for (i = dir->first_record; i!=FAT_DIR_CACHE_NO_RECORD; i = next) {
+		record = &cache->records[i];
+		next = record->dir_next;
+
+		for (link = &cache->buckets[hash_name(cache, record->dir_cluster, record->entry.name.whole)]; *link!=i;
+			 link = &cache->records[*link].next);
+		*link = record->next;
+
+		for (part = record->long_name; part!=FAT_DIR_CACHE_NO_RECORD; part = next_part) {
+			next_part = cache->records[part].next;
+			free_record(cache, part);
+		}
+		free_record(cache, i);
+	}
+
+	dir->first_record = FAT_DIR_CACHE_NO_RECORD;
+}
+
+//The uses of the directory as seen now, halved every FAT_DIR_CACHE_HALF_LIFE lookups since its last one
+static inline uint32_t uses_now(fat_dir_cache *cache, const struct fat_dir_cache_dir *dir) {
+	uint64_t halvings = (cache->lookups - dir->last_used)/FAT_DIR_CACHE_HALF_LIFE;
+
+	return halvings >= 32 ? 0 : dir->uses >> halvings;
+}
+
+//The least recently used indexed directory, among those looked up less often than dir lately
+static struct fat_dir_cache_dir *victim(fat_dir_cache *cache, const struct fat_dir_cache_dir *dir) {
+	struct fat_dir_cache_dir *found = NULL, *slot;
+	uint32_t i;
+
+	for (i = 0; i < FAT_DIR_CACHE_DIRS; i++) {
+		slot = &cache->dirs[i];
+		if (slot!=dir && slot->state==FAT_DIR_CACHE_INDEXED && uses_now(cache, slot) < dir->uses &&
+			(found==NULL || slot->last_used < found->last_used))
+			found = slot;
+	}
+
+	return found;
+}
+
+/*
+ * The path as fat_path_hash sees it: no separators around it, a single kind of separator
+ * and ASCII letters uppercase. Returns its length, -1 if it's too long to be remembered.
+ */
+static int32_t path_fold(const char *path, uint32_t len, char *folded) {
+	uint32_t i;
+
+	while (len && (path[0]==FAT_PATH_SEPARATOR_1 || path[0]==FAT_PATH_SEPARATOR_2)) {
+		path++;
+		len--;
+	}
+
+	while (len && (path[len - 1]==FAT_PATH_SEPARATOR_1 || path[len - 1]==FAT_PATH_SEPARATOR_2))
+		len--;
+
+	if (len > FAT_DIR_CACHE_PATH_BYTES)
+		return -1;
+
+	for (i = 0; i < len; i++)
+		folded[i] = path[i]==FAT_PATH_SEPARATOR_1 ? FAT_PATH_SEPARATOR_2 : fat_ascii_to_upper(path[i]);
+
+	return (int32_t) len;
+}
@@ -0,0 +1,119 @@
+#ifndef FAT_DIR_CACHE_H
+#define FAT_DIR_CACHE_H
+
+#include <stdint.h>
+#include "fat.h"
+
+/*
+ * Directory cache. The first time a directory is searched all its entries are
+ * indexed in a hash table keyed by (directory cluster, 8.3 name), so following
+ * lookups in it don't touch the device. Entries with a long name are indexed
+ * a second time, keyed by the hash of the long name, which is kept too: a hit is
+ * always checked against the whole name. A small direct mapped table remembers
+ * the cluster of the directories reached by a path, with the path itself.
+ * The memory of the index is supplied by the caller. Directories are evicted one at
+ * a time, least recently used first, and only by a directory looked up more often
+ * lately: lookups spread over more directories than fit don't keep replacing each other,
+ * while moving from a directory to another one soon replaces it.
+ * A directory which doesn't fit is left out, and always scanned.
+ * The functions below don't lock: when the cache is shared by threads
+ * they are called between fat_dir_cache_lock and fat_dir_cache_unlock.
+ * A directory is read unlocked while it's loading: lookups in it meanwhile miss,
+ * and the lock is only taken to insert each entry and to publish the result.
+ */
+
+#define FAT_DIR_CACHE_DIRS (128) //Directories followed at once, indexed or not
+#define FAT_DIR_CACHE_PATHS (64)
+#define FAT_DIR_CACHE_PATH_BYTES (128) //Longer directory paths are not remembered
+#define FAT_DIR_CACHE_NAME_UNITS (16) //UTF-16 units of a long name kept by a record
+#define FAT_DIR_CACHE_HALF_LIFE (16) //Lookups after which the past uses of a directory count half
+
+struct fat_dir_cache_record {
+  uint32_t next; //Next record in the same hash bucket, in the free list, or holding the same long name
+  uint32_t dir_next; //Next record of the same directory
+  uint32_t long_name; //First record holding the long name, for the records keyed by it
+  uint32_t dir_cluster;
+  uint64_t entry_address; //Device address of the entry
+  struct fat_entry entry; //The records holding a long name keep FAT_DIR_CACHE_NAME_UNITS of it here
+};
+
+enum fat_dir_cache_state {
+  FAT_DIR_CACHE_FREE, //Slot not used
+  FAT_DIR_CACHE_SEEN, //Looked up, but not indexed
+  FAT_DIR_CACHE_LOADING, //Being indexed by a thread, the slot isn't taken by another directory
+  FAT_DIR_CACHE_INDEXED
+};
+
+struct fat_dir_cache_dir {
+  uint32_t cluster;
+  uint32_t first_record; //Of the directory, chained by dir_next
+  uint32_t records; //Records it takes indexed, 0 if not known
+  uint32_t uses; //Lookups in it up to last_used, fading with FAT_DIR_CACHE_HALF_LIFE
+  uint64_t last_used;
+  uint8_t state;
+  uint8_t stale; //Changed while loading: what was read is dropped
+};
+
+struct fat_dir_cache_path {
+  uint64_t hash; //0 if unused
+  uint32_t cluster;
+  uint32_t len;
+  char path[FAT_DIR_CACHE_PATH_BYTES]; //As compared, see path_fold
+};
+
+typedef struct fat_dir_cache {
+  uint32_t records_count;
+  uint32_t free_records;
+  uint32_t free_list;
+  uint32_t buckets_mask;
+
+  struct fat_dir_cache_record *records;
+  uint32_t *buckets;
+
+  struct fat_dir_cache_dir dirs[FAT_DIR_CACHE_DIRS];
+  uint64_t lookups;
+
+  struct fat_dir_cache_path paths[FAT_DIR_CACHE_PATHS];
+
+  //Optional, NULL if not set
+  fat_lock_func_t lock;
+  fat_lock_func_t unlock;
+  void *lock_ctx;
+
+  //Statistics
+  uint64_t hits;
+  uint64_t misses;
+} fat_dir_cache;
+
+int fat_dir_cache_init(fat_dir_cache *cache, void *memory, uint32_t memory_size);
+void fat_dir_cache_invalidate(fat_dir_cache *cache);
+
+//Locking
+void fat_dir_cache_set_lock(fat_dir_cache *cache, fat_lock_func_t lock, fat_lock_func_t unlock, void *lock_ctx);
+void fat_dir_cache_lock(fat_dir_cache *cache);
+void fat_dir_cache_unlock(fat_dir_cache *cache);
+
+//Directories
+struct fat_dir_cache_dir *fat_dir_cache_use(fat_dir_cache *cache, uint32_t dir_cluster);
+int fat_dir_cache_may_index(fat_dir_cache *cache, struct fat_dir_cache_dir *dir);
+void fat_dir_cache_loading(fat_dir_cache *cache, struct fat_dir_cache_dir *dir);
+void fat_dir_cache_loaded(fat_dir_cache *cache, struct fat_dir_cache_dir *dir, uint32_t records, int complete);
+void fat_dir_cache_drop(fat_dir_cache *cache, struct fat_dir_cache_dir *dir, uint32_t records);
+void fat_dir_cache_invalidate_dir(fat_dir_cache *cache, uint32_t dir_cluster);
+uint32_t fat_dir_cache_records_for(uint32_t long_name_len);
+
+//Entries
+int fat_dir_cache_insert(fat_dir_cache *cache, struct fat_dir_cache_dir *dir, const struct fat_entry *entry,
+						 uint64_t entry_address, const uint16_t *long_name, uint32_t long_name_len);
+const struct fat_dir_cache_record *fat_dir_cache_lookup(fat_dir_cache *cache, uint32_t dir_cluster,
+														const uint8_t *name);
+const struct fat_dir_cache_record *fat_dir_cache_lookup_long(fat_dir_cache *cache, uint32_t dir_cluster,
+															 const uint16_t *folded_name, uint32_t len);
+void fat_dir_cache_update(fat_dir_cache *cache, uint32_t dir_cluster, uint64_t entry_address,
+						  const struct fat_entry *entry);
+
+//Paths
+int fat_dir_cache_path_lookup(fat_dir_cache *cache, const char *path, uint32_t len, uint32_t *cluster);
+void fat_dir_cache_path_insert(fat_dir_cache *cache, const char *path, uint32_t len, uint32_t cluster);
+
+#endif
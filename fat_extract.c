@@ -0,0 +1,240 @@
+#include "fat_extract.h"
+#include <stddef.h>
+#include <string.h>
+
+#define FAT_EXTRACT_ALIGNMENT (8u)
+
+//Private functions
+static int is_below(const fat_index *index, uint32_t record, uint32_t ancestor);
+static int add_file(fat_extract *extract, fat_drive *drive, uint32_t record);
+static int piece_before(const fat_extract_piece *a, const fat_extract_piece *b);
+static void sift_down(fat_extract_piece *pieces, uint32_t root, uint32_t count);
+static void sort_pieces(fat_extract_piece *pieces, uint32_t count);
+static int deliver(fat_extract *extract, fat_drive *drive, const fat_extract_piece *piece, uint8_t *buffer,
+				   uint32_t buffer_size, fat_extract_data_func_t data_func, void *data_ctx);
+
+int fat_extract_init(fat_extract *extract, void *memory, uint32_t memory_size, const fat_index *index) {
+	uint8_t *mem = memory;
+	uint32_t padding;
+
+	padding = (uint32_t) ((FAT_EXTRACT_ALIGNMENT - ((uintptr_t) mem & (FAT_EXTRACT_ALIGNMENT - 1))) &
+		(FAT_EXTRACT_ALIGNMENT - 1));
+	if (memory_size < padding + sizeof(fat_extract_piece))
+		return -1;
+
+	extract->index = index;
+	extract->pieces = (fat_extract_piece *) (mem + padding);
+	extract->pieces_count = 0;
+	extract->max_pieces = (memory_size - padding)/sizeof(fat_extract_piece);
+	extract->files = 0;
+	extract->broken_files = 0;
+	extract->bytes = 0;
+	extract->reads = 0;
+
+	return 0;
+}
+
+/*
+ * Adds the file of record, or every file below it if it's a directory:
+ * FAT_INDEX_ROOT adds the whole volume. Returns -1 if the memory is over.
+ */
+int fat_extract_add(fat_extract *extract, fat_drive *drive, uint32_t record) {
+	const fat_index *index = extract->index;
+	uint32_t i;
+
+	if (record!=FAT_INDEX_ROOT && !(index->records[record].attr & ATTR_DIRECTORY))
+		return add_file(extract, drive, record);
+
+	for (i = 0; i < index->records_count; i++)
+		if (!(index->records[i].attr & ATTR_DIRECTORY) && is_below(index, i, record) && add_file(extract, drive, i))
+			return -1;
+
+	return 0;
+}
+
+static int is_below(const fat_index *index, uint32_t record, uint32_t ancestor) {
+	if (ancestor==FAT_INDEX_ROOT)
+		return 1;
+
+	for (record = index->records[record].parent; record!=FAT_INDEX_ROOT; record = index->records[record].parent)
+		if (record==ancestor)
+			return 1;
+
+	return 0;
+}
+
+static int add_file(fat_extract *extract, fat_drive *drive, uint32_t record) {
+	const fat_index_record *index_record = &extract->index->records[record];
+	uint32_t i, free_pieces = extract->max_pieces - extract->pieces_count;
+	uint32_t log_cluster_size = drive->log_bytes_per_sector + drive->log_sectors_per_cluster;
+	fat_extract_piece *pieces = &extract->pieces[extract->pieces_count];
+	fat_extent *extents, extent;
+	uint64_t offset, bytes;
+	fat_file file;
+
+	extract->files++;
+	if (index_record->size_bytes==0)
+		return 0;
+
+	/*
+	 * Extents are built at the end of the free memory, then turned into pieces from its start:
+	 * a piece takes at least twice the room of an extent, so no extent is overwritten before being read
+	 */
+	extents = (fat_extent *) ((uint8_t *) (pieces + free_pieces) - (size_t) free_pieces*sizeof(fat_extent));
+
+	memset(&file, 0, sizeof(file));
+	file.cluster = index_record->first_cluster;
+	file.first_cluster = index_record->first_cluster;
+	file.size_bytes = index_record->size_bytes;
+	file.total_size_bytes = index_record->size_bytes;
+	if (fat.file_build_extents(drive, &file, extents, free_pieces)) {
+		//With a piece for every cluster the memory was enough: the chain is broken
+		if (free_pieces > ((index_record->size_bytes - 1) >> log_cluster_size)) {
+			extract->broken_files++;
+			return 0;
+		}
+		return -1;
+	}
+
+	for (i = 0; i < file.extents_count; i++) {
+		extent = extents[i];
+		offset = (uint64_t) extent.file_cluster << log_cluster_size;
+		bytes = (uint64_t) extent.clusters << log_cluster_size;
+		if (bytes > index_record->size_bytes - offset)
+			bytes = index_record->size_bytes - offset;
+
+		pieces[i].address = ((uint64_t) (((extent.first_cluster - 2) << drive->log_sectors_per_cluster) +
+			drive->first_data_sector)) << drive->log_bytes_per_sector;
+		pieces[i].record = record;
+		pieces[i].offset = (uint32_t) offset;
+		pieces[i].bytes = (uint32_t) bytes;
+	}
+
+	extract->pieces_count += file.extents_count;
+	extract->bytes += index_record->size_bytes;
+
+	return 0;
+}
+
+static inline int piece_before(const fat_extract_piece *a, const fat_extract_piece *b) {
+	return a->address < b->address;
+}
+
+static void sift_down(fat_extract_piece *pieces, uint32_t root, uint32_t count) {
+	fat_extract_piece swap;
+	uint32_t child;
+
+	while ((child = 2*root + 1) < count) {
+		if (child + 1 < count && piece_before(&pieces[child], &pieces[child + 1]))
+			child++;
+		if (!piece_before(&pieces[root], &pieces[child]))
+			return;
+
+		swap = pieces[root];
+		pieces[root] = pieces[child];
+		pieces[child] = swap;
+		root = child;
+	}
+}
+
+//Heapsort by address: no recursion and no extra memory
+static void sort_pieces(fat_extract_piece *pieces, uint32_t count) {
+	fat_extract_piece swap;
+	uint32_t i;
+
+	for (i = count/2; i > 0; i--)
+		sift_down(pieces, i - 1, count);
+
+	for (i = count; i > 1; i--) {
+		swap = pieces[0];
+		pieces[0] = pieces[i - 1];
+		pieces[i - 1] = swap;
+		sift_down(pieces, 0, i - 1);
+	}
+}
+
+/*
+ * Reads all the added pieces in address order, buffer should be a few MB.
+ * Pieces closer than FAT_EXTRACT_MAX_GAP_BYTES share a read while they fit the buffer,
+ * bigger ones are read a buffer at a time.
+ * Returns 0 once everything has been given, -1 on read errors or if data_func asked to stop.
+ */
+int fat_extract_run(fat_extract *extract, fat_drive *drive, void *buffer, uint32_t buffer_size,
+					fat_extract_data_func_t data_func, void *data_ctx) {
+	fat_extract_piece *pieces = extract->pieces;
+	uint64_t run_begin, run_end, end;
+	uint32_t i, j, k;
+	uint8_t *data = buffer;
+
+	sort_pieces(pieces, extract->pieces_count);
+
+	for (i = 0; i < extract->pieces_count; i = j) {
+		run_begin = pieces[i].address;
+		run_end = run_begin + pieces[i].bytes;
+
+		for (j = i + 1; j < extract->pieces_count && pieces[j].address <= run_end + FAT_EXTRACT_MAX_GAP_BYTES; j++) {
+			end = pieces[j].address + pieces[j].bytes;
+			if ((end > run_end ? end : run_end) - run_begin > buffer_size)
+				break;
+			if (end > run_end)
+				run_end = end;
+		}
+
+		if (run_end - run_begin > buffer_size) { //A single piece bigger than the buffer
+			if (deliver(extract, drive, &pieces[i], data, buffer_size, data_func, data_ctx))
+				goto error;
+			continue;
+		}
+
+		if (fat.read_device(drive, FAT_IO_DATA, run_begin, (uint32_t) (run_end - run_begin), data)==NULL)
+			goto error;
+		extract->reads++;
+
+		for (k = i; k < j; k++)
+			if (data_func(data_ctx, pieces[k].record, pieces[k].offset, data + (pieces[k].address - run_begin),
+						  pieces[k].bytes))
+				goto error;
+	}
+
+	return 0;
+
+error:
+	return -1;
+}
+
+static int deliver(fat_extract *extract, fat_drive *drive, const fat_extract_piece *piece, uint8_t *buffer,
+				   uint32_t buffer_size, fat_extract_data_func_t data_func, void *data_ctx) {
+	uint32_t done, bytes;
+
+	for (done = 0; done < piece->bytes; done += bytes) {
+		bytes = piece->bytes - done < buffer_size ? piece->bytes - done : buffer_size;
+
+		if (fat.read_device(drive, FAT_IO_DATA, piece->address + done, bytes, buffer)==NULL)
+			return -1;
+		extract->reads++;
+
+		if (data_func(data_ctx, piece->record, piece->offset + done, buffer, bytes))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Same as fat_extract_run, but the data is not read: copy_func gets the device address
+ * of every piece, in address order, and moves the bytes itself.
+ */
+int fat_extract_run_copy(fat_extract *extract, fat_extract_copy_func_t copy_func, void *copy_ctx) {
+	const fat_extract_piece *piece;
+	uint32_t i;
+
+	sort_pieces(extract->pieces, extract->pieces_count);
+
+	for (i = 0; i < extract->pieces_count; i++) {
+		piece = &extract->pieces[i];
+		if (copy_func(copy_ctx, piece->record, piece->offset, piece->address, piece->bytes))
+			return -1;
+	}
+
+	return 0;
+}
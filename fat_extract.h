@@ -0,0 +1,55 @@
+#ifndef FAT_EXTRACT_H
+#define FAT_EXTRACT_H
+
+#include <stdint.h>
+#include "fat.h"
+#include "fat_index.h"
+
+/*
+ * Bulk extraction of files found in an index. The extents of every file are resolved
+ * first, as pieces kept in caller memory; the pieces are then sorted by device address
+ * and read in a single sweep, merging neighbours into reads as big as the buffer.
+ * Data is handed out with its record and offset, in disk order rather than file order.
+ */
+
+//Gets the data at offset of the file of record, returns 0 to go on
+typedef int (*fat_extract_data_func_t)(void *ctx, uint32_t record, uint32_t offset, const void *data, uint32_t bytes);
+
+/*
+ * Copies bytes bytes at the device address into the file of record at offset, e.g. with
+ * copy_file_range from the image. Returns 0 to go on.
+ */
+typedef int (*fat_extract_copy_func_t)(void *ctx, uint32_t record, uint32_t offset, uint64_t address, uint32_t bytes);
+
+#define FAT_EXTRACT_MAX_GAP_BYTES (64*1024u) //Read through, rather than seek over, gaps up to this size
+
+typedef struct {
+  uint64_t address; //On the device
+  uint32_t record;
+  uint32_t offset; //Inside the file
+  uint32_t bytes;
+} fat_extract_piece;
+
+typedef struct fat_extract {
+  const fat_index *index;
+
+  //Caller memory
+  fat_extract_piece *pieces;
+  uint32_t pieces_count;
+  uint32_t max_pieces;
+
+  //Added so far
+  uint32_t files;
+  uint32_t broken_files; //Whose cluster chain ends early, their data is left out
+  uint64_t bytes;
+
+  uint32_t reads; //Device reads done by fat_extract_run
+} fat_extract;
+
+int fat_extract_init(fat_extract *extract, void *memory, uint32_t memory_size, const fat_index *index);
+int fat_extract_add(fat_extract *extract, fat_drive *drive, uint32_t record);
+int fat_extract_run(fat_extract *extract, fat_drive *drive, void *buffer, uint32_t buffer_size,
+					fat_extract_data_func_t data_func, void *data_ctx);
+int fat_extract_run_copy(fat_extract *extract, fat_extract_copy_func_t copy_func, void *copy_ctx);
+
+#endif
@@ -0,0 +1,134 @@
+#include "fat_free_map.h"
+#include <stddef.h>
+#include <string.h>
+
+#define FAT_FREE_MAP_ALIGNMENT (sizeof(uint64_t))
+#define FAT_FREE_MAP_NONE (0xFFFFFFFFu)
+
+//Private functions
+static uint32_t find_bit(fat_free_map *map, uint32_t from, uint32_t end, int is_free);
+
+uint32_t fat_free_map_size(uint32_t entries_count) {
+	//Plus the alignment padding
+	return ((entries_count + 63)/64)*sizeof(uint64_t) + FAT_FREE_MAP_ALIGNMENT - 1;
+}
+
+int fat_free_map_init(fat_free_map *map, void *memory, uint32_t memory_size, uint32_t entries_count) {
+	uint8_t *mem = memory;
+	uint32_t padding;
+
+	padding = (uint32_t) ((FAT_FREE_MAP_ALIGNMENT - ((uintptr_t) mem & (FAT_FREE_MAP_ALIGNMENT - 1))) &
+		(FAT_FREE_MAP_ALIGNMENT - 1));
+	if (memory_size < padding)
+		goto error;
+
+	map->words_count = (entries_count + 63)/64;
+	if ((uint64_t) map->words_count*sizeof(uint64_t) > memory_size - padding)
+		goto error;
+
+	//Everything is used until it's known to be free
+	map->words = (uint64_t *) (mem + padding);
+	map->entries_count = entries_count;
+	map->free_count = 0;
+	memset(map->words, 0, (size_t) map->words_count*sizeof(uint64_t));
+
+	return 0;
+
+error:
+	return -1;
+}
+
+void fat_free_map_set(fat_free_map *map, uint32_t cluster, int is_free) {
+	uint64_t bit = 1ull << (cluster & 63u);
+	uint64_t *word = &map->words[cluster >> 6u];
+
+	if (cluster < 2 || cluster >= map->entries_count || !(*word & bit)==!is_free)
+		return;
+
+	if (is_free) {
+		*word |= bit;
+		map->free_count++;
+	} else {
+		*word &= ~bit;
+		map->free_count--;
+	}
+}
+
+int fat_free_map_is_free(fat_free_map *map, uint32_t cluster) {
+	if (cluster >= map->entries_count)
+		return 0;
+
+	return (map->words[cluster >> 6u] >> (cluster & 63u)) & 1u;
+}
+
+//First free cluster from from on, wrapping around. Returns 0 if there are none
+uint32_t fat_free_map_next(fat_free_map *map, uint32_t from) {
+	uint32_t cluster;
+
+	if (map->free_count==0)
+		return 0;
+
+	if (from < 2 || from >= map->entries_count)
+		from = 2;
+
+	if ((cluster = find_bit(map, from, map->entries_count, 1))==FAT_FREE_MAP_NONE &&
+		(cluster = find_bit(map, 2, from, 1))==FAT_FREE_MAP_NONE)
+		return 0;
+
+	return cluster;
+}
+
+/*
+ * First cluster of a run of wanted free clusters, looking from from on and then from the beginning.
+ * Returns 0 if there is no such run.
+ */
+uint32_t fat_free_map_find_run(fat_free_map *map, uint32_t from, uint32_t wanted) {
+	uint32_t start, end, pass;
+
+	if (wanted==0 || wanted > map->free_count)
+		return 0;
+
+	if (from < 2 || from >= map->entries_count)
+		from = 2;
+
+	for (pass = 0; pass < 2; pass++, from = 2) {
+		start = from;
+
+		while ((start = find_bit(map, start, map->entries_count, 1))!=FAT_FREE_MAP_NONE) {
+			end = find_bit(map, start, map->entries_count, 0);
+			if (end==FAT_FREE_MAP_NONE)
+				end = map->entries_count;
+
+			if (end - start >= wanted)
+				return start;
+
+			start = end;
+		}
+	}
+
+	return 0;
+}
+
+//First bit in [from, end) equal to is_free, a word at a time
+static uint32_t find_bit(fat_free_map *map, uint32_t from, uint32_t end, int is_free) {
+	uint32_t index = from >> 6u, cluster;
+	uint64_t word;
+
+	if (from >= end)
+		return FAT_FREE_MAP_NONE;
+
+	//Bits before from are masked out of the first word
+	word = (is_free ? map->words[index] : ~map->words[index]) & (~0ull << (from & 63u));
+
+	while (1) {
+		if (word) {
+			cluster = (index << 6u) + (uint32_t) __builtin_ctzll(word);
+			return cluster < end ? cluster : FAT_FREE_MAP_NONE;
+		}
+
+		if (++index >= map->words_count || (index << 6u) >= end)
+			return FAT_FREE_MAP_NONE;
+
+		word = is_free ? map->words[index] : ~map->words[index];
+	}
+}
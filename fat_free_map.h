@@ -0,0 +1,26 @@
+#ifndef FAT_FREE_MAP_H
+#define FAT_FREE_MAP_H
+
+#include <stdint.h>
+
+/*
+ * Free cluster bitmap: one bit per FAT entry, set if the cluster is free.
+ * The memory is supplied by the caller and it's scanned a 64 bit word at a time,
+ * so finding a free cluster, or a run of them, skips 64 used clusters per step.
+ */
+
+typedef struct fat_free_map {
+  uint64_t *words;
+  uint32_t words_count;
+  uint32_t entries_count; //FAT entries, the two reserved ones included
+  uint32_t free_count;
+} fat_free_map;
+
+uint32_t fat_free_map_size(uint32_t entries_count);
+int fat_free_map_init(fat_free_map *map, void *memory, uint32_t memory_size, uint32_t entries_count);
+void fat_free_map_set(fat_free_map *map, uint32_t cluster, int is_free);
+int fat_free_map_is_free(fat_free_map *map, uint32_t cluster);
+uint32_t fat_free_map_next(fat_free_map *map, uint32_t from);
+uint32_t fat_free_map_find_run(fat_free_map *map, uint32_t from, uint32_t wanted);
+
+#endif
@@ -0,0 +1,461 @@
+/*
+ * Read only FUSE frontend: fat_fuse <image> <mountpoint> [FUSE options]
+ *
+ * The volume is indexed once, before mounting: lookups, getattr, readdir and open are
+ * then answered from the index without touching the image. Files are read through the
+ * library with the sector cache, the FAT table and an extent map per open file.
+ * The image cannot change while mounted, so the kernel is allowed to cache everything.
+ */
+#define FUSE_USE_VERSION 31
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "fat.h"
+#include "fat_cache.h"
+#include "fat_dir_cache.h"
+#include "fat_free_map.h"
+#include "fat_index.h"
+#include "fat_utils.h"
+#include "reader.h"
+
+#define BUFFER_SIZE (64*1024) //A directory cluster at most
+#define CACHE_SIZE (1024*1024)
+#define DIR_CACHE_SIZE (256*1024)
+#define INDEX_MIN_SIZE (1024*1024u)
+#define INDEX_MAX_SIZE (1024*1024*1024u) //Doubled from INDEX_MIN_SIZE until the volume fits
+#define INDEX_WORKERS 4
+#define EXTENTS_MIN (16u)
+#define CACHE_TIMEOUT_SECS (86400.0)
+
+struct volume {
+  reader image;
+  fat_drive drive;
+  fat_cache cache;
+  fat_dir_cache dir_cache;
+  pthread_mutex_t cache_mutex, dir_cache_mutex;
+
+  fat_index index;
+  uint8_t *index_memory;
+
+  //Path lookup: open addressing on the path hash, slots hold record + 1 (0 is empty)
+  uint64_t *hashes; //Per record
+  uint32_t *slots;
+  uint32_t slots_mask;
+
+  //Children of every directory, grouped: those of record r are children[first_child[r]..first_child[r + 1]).
+  //The root directory is record records_count
+  uint32_t *first_child;
+  uint32_t *children;
+};
+
+struct open_file {
+  pthread_mutex_t mutex; //Reads of the same handle share the position and the readahead state
+  fat_file file;
+  uint32_t offset; //Where file is
+  fat_extent *extents;
+};
+
+static struct volume volume;
+
+static void mutex_lock(void *lock_ctx) {
+	pthread_mutex_lock(lock_ctx);
+}
+
+static void mutex_unlock(void *lock_ctx) {
+	pthread_mutex_unlock(lock_ctx);
+}
+
+//Waiting on the condition of the index, its mutex being the lock of the index
+struct index_sync {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static void index_wait(void *wait_ctx) {
+	struct index_sync *sync = wait_ctx;
+
+	pthread_cond_wait(&sync->cond, &sync->mutex);
+}
+
+static void index_notify(void *wait_ctx) {
+	pthread_cond_broadcast(&((struct index_sync *) wait_ctx)->cond);
+}
+
+static void *worker_index(void *arg) {
+	static _Thread_local uint8_t buffer[BUFFER_SIZE];
+
+	fat_index_work(&volume.drive, arg, buffer, BUFFER_SIZE);
+
+	return NULL;
+}
+
+//Indexes the whole volume, with as much memory as it takes
+static int build_index(void) {
+	static struct index_sync index_sync = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+	pthread_t workers[INDEX_WORKERS];
+	uint32_t size, i;
+
+	for (size = INDEX_MIN_SIZE; size <= INDEX_MAX_SIZE; size *= 2) {
+		free(volume.index_memory);
+		if ((volume.index_memory = malloc(size))==NULL || fat_index_init(&volume.index, volume.index_memory, size))
+			goto error;
+		fat_index_set_lock(&volume.index, mutex_lock, mutex_unlock, &index_sync.mutex);
+		fat_index_set_wait(&volume.index, index_wait, index_notify, &index_sync);
+
+		for (i = 0; i < INDEX_WORKERS; i++)
+			if (pthread_create(&workers[i], NULL, worker_index, &volume.index))
+				break;
+		while (i)
+			pthread_join(workers[--i], NULL);
+
+		if (!volume.index.failed)
+			return 0;
+	}
+
+error:
+	return -1;
+}
+
+//Hash table of the paths and lists of children, from the index
+static int build_lookup(void) {
+	const fat_index *index = &volume.index;
+	uint32_t i, r, slots, parent, *fill;
+	char path[4096];
+
+	for (slots = 1; slots < 2*index->records_count; slots *= 2);
+
+	volume.hashes = malloc(sizeof(uint64_t)*(index->records_count + 1));
+	volume.slots = calloc(slots, sizeof(uint32_t));
+	volume.first_child = calloc(index->records_count + 2, sizeof(uint32_t));
+	volume.children = malloc(sizeof(uint32_t)*(index->records_count + 1));
+	fill = calloc(index->records_count + 1, sizeof(uint32_t));
+	if (volume.hashes==NULL || volume.slots==NULL || volume.first_child==NULL || volume.children==NULL || fill==NULL)
+		goto error;
+	volume.slots_mask = slots - 1;
+
+	for (r = 0; r < index->records_count; r++) {
+		fat_index_path(index, r, path, sizeof(path));
+		volume.hashes[r] = fat_path_hash(path, (uint32_t) strlen(path));
+		for (i = (uint32_t) volume.hashes[r] & volume.slots_mask; volume.slots[i]; i = (i + 1) & volume.slots_mask);
+		volume.slots[i] = r + 1;
+
+		parent = index->records[r].parent==FAT_INDEX_ROOT ? index->records_count : index->records[r].parent;
+		volume.first_child[parent + 1]++;
+	}
+
+	//Counts become offsets, then every record is put in its parent group
+	for (r = 0; r <= index->records_count; r++)
+		volume.first_child[r + 1] += volume.first_child[r];
+	for (r = 0; r < index->records_count; r++) {
+		parent = index->records[r].parent==FAT_INDEX_ROOT ? index->records_count : index->records[r].parent;
+		volume.children[volume.first_child[parent] + fill[parent]++] = r;
+	}
+
+	free(fill);
+	return 0;
+
+error:
+	free(fill);
+	return -1;
+}
+
+/*
+ * Record of path, FAT_INDEX_ROOT for the root directory.
+ * Returns -1 if there is no such file or directory.
+ */
+static int lookup(const char *path, uint32_t *record) {
+	uint64_t hash;
+	uint32_t i, r;
+	char found[4096];
+
+	if (path[0]=='/' && path[1]=='\0') {
+		*record = FAT_INDEX_ROOT;
+		return 0;
+	}
+
+	hash = fat_path_hash(path, (uint32_t) strlen(path));
+	for (i = (uint32_t) hash & volume.slots_mask; volume.slots[i]; i = (i + 1) & volume.slots_mask) {
+		r = volume.slots[i] - 1;
+		if (volume.hashes[r]!=hash)
+			continue;
+
+		fat_index_path(&volume.index, r, found, sizeof(found));
+		if (strcasecmp(found, path)==0) {
+			*record = r;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+//FAT timestamps are local time, 0 if not set
+static time_t fat_to_time(struct fat_date date, struct fat_time time) {
+	struct tm tm;
+
+	if (date.day==0 || date.month==0)
+		return 0;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = date.years_from_1980 + 80;
+	tm.tm_mon = date.month - 1;
+	tm.tm_mday = date.day;
+	tm.tm_hour = time.hours;
+	tm.tm_min = time.mins;
+	tm.tm_sec = time.sec_gran_2*2;
+	tm.tm_isdst = -1;
+
+	return mktime(&tm);
+}
+
+static void fill_stat(uint32_t record, struct stat *st) {
+	const fat_index_record *r;
+
+	memset(st, 0, sizeof(*st));
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_blksize = volume.drive.cluster_size_bytes;
+
+	if (record==FAT_INDEX_ROOT) {
+		st->st_ino = 1;
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+		return;
+	}
+
+	r = &volume.index.records[record];
+	st->st_ino = record + 2;
+	st->st_mode = r->attr & ATTR_DIRECTORY ? S_IFDIR | 0555 : S_IFREG | 0444;
+	st->st_nlink = r->attr & ATTR_DIRECTORY ? 2 : 1;
+	st->st_size = r->attr & ATTR_DIRECTORY ? 0 : r->size_bytes;
+	st->st_blocks = (st->st_size + 511)/512;
+	st->st_mtime = fat_to_time(r->write_date, r->write_time);
+	st->st_ctime = fat_to_time(r->creation_date, r->creation_time);
+	st->st_atime = st->st_mtime;
+}
+
+static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+	(void) conn;
+
+	//Nothing changes behind the kernel back
+	cfg->use_ino = 1;
+	cfg->kernel_cache = 1;
+	cfg->entry_timeout = CACHE_TIMEOUT_SECS;
+	cfg->attr_timeout = CACHE_TIMEOUT_SECS;
+	cfg->negative_timeout = CACHE_TIMEOUT_SECS;
+
+	return NULL;
+}
+
+static int fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+	uint32_t record;
+
+	(void) fi;
+
+	if (lookup(path, &record))
+		return -ENOENT;
+
+	fill_stat(record, st);
+
+	return 0;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi,
+					  enum fuse_readdir_flags flags) {
+	uint32_t record, group, i;
+	struct stat st;
+
+	(void) offset;
+	(void) fi;
+	(void) flags;
+
+	if (lookup(path, &record))
+		return -ENOENT;
+	if (record!=FAT_INDEX_ROOT && !(volume.index.records[record].attr & ATTR_DIRECTORY))
+		return -ENOTDIR;
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+
+	group = record==FAT_INDEX_ROOT ? volume.index.records_count : record;
+	for (i = volume.first_child[group]; i < volume.first_child[group + 1]; i++) {
+		fill_stat(volume.children[i], &st);
+		if (filler(buf, fat_index_name(&volume.index, volume.children[i]), &st, 0, FUSE_FILL_DIR_PLUS))
+			break;
+	}
+
+	return 0;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi) {
+	uint32_t record, max_extents, clusters;
+	const fat_index_record *r;
+	struct open_file *open_file;
+
+	if ((fi->flags & O_ACCMODE)!=O_RDONLY)
+		return -EROFS;
+
+	if (lookup(path, &record))
+		return -ENOENT;
+	if (record==FAT_INDEX_ROOT || (volume.index.records[record].attr & ATTR_DIRECTORY))
+		return -EISDIR;
+
+	if ((open_file = calloc(1, sizeof(*open_file)))==NULL)
+		return -ENOMEM;
+
+	//The record has all a read needs, the path is not walked again: nothing is written through the entry
+	r = &volume.index.records[record];
+	open_file->file.cluster = r->first_cluster;
+	open_file->file.first_cluster = r->first_cluster;
+	open_file->file.size_bytes = r->size_bytes;
+	open_file->file.total_size_bytes = r->size_bytes;
+
+	//Seeks are frequent, the kernel reads in any order: map the whole file if memory allows
+	clusters = open_file->file.total_size_bytes/volume.drive.cluster_size_bytes + 1;
+	for (max_extents = EXTENTS_MIN; max_extents/2 < clusters; max_extents *= 2) {
+		free(open_file->extents);
+		if ((open_file->extents = malloc(sizeof(fat_extent)*max_extents))==NULL)
+			break;
+		if (fat.file_build_extents(&volume.drive, &open_file->file, open_file->extents, max_extents)==0)
+			break;
+	}
+
+	pthread_mutex_init(&open_file->mutex, NULL);
+	fi->fh = (uint64_t) (uintptr_t) open_file;
+	fi->keep_cache = 1;
+
+	return 0;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct open_file *open_file = (struct open_file *) (uintptr_t) fi->fh;
+	uint32_t done = 0, ret;
+
+	(void) path;
+
+	if (offset < 0 || (uint64_t) offset >= open_file->file.total_size_bytes)
+		return 0;
+
+	pthread_mutex_lock(&open_file->mutex);
+
+	if (open_file->offset!=(uint64_t) offset && fat.file_seek(&volume.drive, &open_file->file, (uint32_t) offset)) {
+		pthread_mutex_unlock(&open_file->mutex);
+		return -EIO;
+	}
+
+	while (done < size && (ret = fat.file_read(&volume.drive, &open_file->file, buf + done, (uint32_t) (size - done))))
+		done += ret;
+	open_file->offset = (uint32_t) offset + done;
+
+	pthread_mutex_unlock(&open_file->mutex);
+
+	//Stopped before the end of the file: the chain is broken or the image cannot be read
+	if (done < size && (uint64_t) offset + done < open_file->file.total_size_bytes)
+		return -EIO;
+
+	return (int) done;
+}
+
+static int fs_release(const char *path, struct fuse_file_info *fi) {
+	struct open_file *open_file = (struct open_file *) (uintptr_t) fi->fh;
+
+	(void) path;
+
+	pthread_mutex_destroy(&open_file->mutex);
+	free(open_file->extents);
+	free(open_file);
+
+	return 0;
+}
+
+static int fs_statfs(const char *path, struct statvfs *st) {
+	uint32_t free_clusters = 0;
+
+	(void) path;
+
+	fat.free_clusters(&volume.drive, &free_clusters);
+
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = volume.drive.cluster_size_bytes;
+	st->f_frsize = volume.drive.cluster_size_bytes;
+	st->f_blocks = volume.drive.clusters_count;
+	st->f_bfree = free_clusters;
+	st->f_bavail = free_clusters;
+	st->f_files = volume.index.records_count;
+	st->f_namemax = FAT_LFN_MAX_CHARS;
+
+	return 0;
+}
+
+static const struct fuse_operations operations = {
+	.init = fs_init,
+	.getattr = fs_getattr,
+	.readdir = fs_readdir,
+	.open = fs_open,
+	.read = fs_read,
+	.release = fs_release,
+	.statfs = fs_statfs,
+};
+
+//The image is the first argument, everything else goes to FUSE
+int main(int argc, char *argv[]) {
+	static uint8_t cache_memory[CACHE_SIZE], dir_cache_memory[DIR_CACHE_SIZE];
+	void *fat_table;
+	int i;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <image> <mountpoint> [FUSE options]\n", argv[0]);
+		goto error;
+	}
+
+	if (reader_open_mmap(&volume.image, argv[1]) && reader_open(&volume.image, argv[1])) {
+		perror(argv[1]);
+		goto error;
+	}
+
+	if (fat.mount(&volume.drive, 512, reader_read_bytes, &volume.image)) {
+		fprintf(stderr, "%s: no FAT volume found\n", argv[1]);
+		goto error;
+	}
+
+	pthread_mutex_init(&volume.cache_mutex, NULL);
+	pthread_mutex_init(&volume.dir_cache_mutex, NULL);
+
+	if (fat_cache_init(&volume.cache, cache_memory, sizeof(cache_memory), 1u << volume.drive.log_bytes_per_sector) ||
+		fat.attach_cache(&volume.drive, &volume.cache))
+		goto error;
+	fat_cache_set_lock(&volume.cache, mutex_lock, mutex_unlock, &volume.cache_mutex);
+
+	if (fat_dir_cache_init(&volume.dir_cache, dir_cache_memory, sizeof(dir_cache_memory)))
+		goto error;
+	fat_dir_cache_set_lock(&volume.dir_cache, mutex_lock, mutex_unlock, &volume.dir_cache_mutex);
+	fat.attach_dir_cache(&volume.drive, &volume.dir_cache);
+
+	if ((fat_table = malloc(fat.fat_table_size(&volume.drive)))!=NULL)
+		fat.attach_fat_table(&volume.drive, fat_table, fat.fat_table_size(&volume.drive));
+
+	fat.attach_map(&volume.drive, reader_map_bytes);
+	fat.attach_prefetch(&volume.drive, reader_prefetch);
+
+	if (build_index() || build_lookup()) {
+		fprintf(stderr, "%s: cannot index the volume\n", argv[1]);
+		goto error;
+	}
+
+	//Drop the image path, FUSE sees the mountpoint as its first argument
+	for (i = 1; i < argc - 1; i++)
+		argv[i] = argv[i + 1];
+
+	return fuse_main(argc - 1, argv, &operations, NULL);
+
+error:
+	return 1;
+}
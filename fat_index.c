@@ -0,0 +1,258 @@
+#include "fat_index.h"
+#include "fat_utils.h"
+#include <stddef.h>
+#include <string.h>
+
+#define FAT_INDEX_ALIGNMENT (sizeof(uint32_t))
+#define FAT_INDEX_READ_ENTRIES (16) //Entries decoded, and then added under the lock, at once
+#define FAT_INDEX_NO_DIR (0xFFFFFFFEu)
+
+//Private functions
+static void index_lock(fat_index *index);
+static void index_unlock(fat_index *index);
+static void index_wait(fat_index *index);
+static void index_notify(fat_index *index);
+static uint32_t take_dir(fat_index *index, uint32_t *dir_cluster);
+static uint32_t entry_name(const fat_dir_entry *entry, char *name, uint32_t name_size);
+
+int fat_index_init(fat_index *index, void *memory, uint32_t memory_size) {
+	uint8_t *mem = memory;
+	uint32_t padding;
+
+	padding = (uint32_t) ((FAT_INDEX_ALIGNMENT - ((uintptr_t) mem & (FAT_INDEX_ALIGNMENT - 1))) &
+		(FAT_INDEX_ALIGNMENT - 1));
+	if (memory_size < padding + sizeof(fat_index_record))
+		goto error;
+
+	index->memory = mem + padding;
+	index->memory_size = memory_size - padding;
+	index->records = (fat_index_record *) index->memory;
+	index->records_count = 0;
+	index->names_begin = index->memory_size;
+
+	index->next_dir = 0;
+	index->active_workers = 0;
+	index->root_taken = 0;
+	index->failed = 0;
+
+	index->lock = NULL;
+	index->unlock = NULL;
+	index->wait = NULL;
+	index->notify = NULL;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+void fat_index_set_lock(fat_index *index, fat_lock_func_t lock, fat_lock_func_t unlock, void *lock_ctx) {
+	index->lock = lock;
+	index->unlock = unlock;
+	index->lock_ctx = lock_ctx;
+}
+
+void fat_index_set_wait(fat_index *index, fat_lock_func_t wait, fat_lock_func_t notify, void *wait_ctx) {
+	index->wait = wait;
+	index->notify = notify;
+	index->wait_ctx = wait_ctx;
+}
+
+/*
+ * Reads directories until there are none left, starting from the root. Their entries are
+ * added to the index, their subdirectories become work for any thread calling this function.
+ * buffer is where directories are read, a cluster is a good size for it.
+ * Returns 0 once the whole volume has been indexed, -1 if the index is incomplete.
+ */
+int fat_index_work(fat_drive *drive, fat_index *index, void *buffer, uint32_t buffer_size) {
+	fat_dir_entry entries[FAT_INDEX_READ_ENTRIES];
+	fat_dir_iter iter;
+	fat_dir dir;
+	uint32_t parent;
+	int32_t count;
+	int failed;
+
+	index_lock(index);
+
+	while (1) {
+		//A failed walk is over for every worker: the index cannot be completed
+		if (index->failed)
+			break;
+
+		if ((parent = take_dir(index, &dir.cluster))==FAT_INDEX_NO_DIR) {
+			//Nothing to read: done if nobody else can find new directories
+			if (index->active_workers==0)
+				break;
+
+			index_wait(index);
+			continue;
+		}
+
+		index->active_workers++;
+		index_unlock(index);
+
+		count = fat.dir_iter_init(drive, &dir, &iter, buffer, buffer_size);
+		while (count==0 && (count = fat.dir_read(drive, &iter, entries, FAT_INDEX_READ_ENTRIES)) > 0) {
+			index_lock(index);
+			//Checked before adding: another worker may have failed while this one was reading
+			count = index->failed || fat_index_add(index, parent, entries, (uint32_t) count) ? -1 : 0;
+			index_notify(index); //There may be new directories
+			index_unlock(index);
+		}
+
+		index_lock(index);
+		if (count < 0)
+			index->failed = 1;
+		index->active_workers--;
+		index_notify(index); //The last worker, or a failed one, ends the walk
+	}
+
+	failed = index->failed;
+	index_unlock(index);
+
+	return failed ? -1 : 0;
+}
+
+/*
+ * Adds the entries of a directory read by the caller, parent is its record.
+ * Returns -1 if the index memory is over.
+ */
+int fat_index_add(fat_index *index, uint32_t parent, fat_dir_entry *entries, uint32_t count) {
+	char name[FAT_LFN_MAX_NAME_BYTES];
+	fat_index_record *record;
+	uint32_t i, name_size, records_end;
+
+	for (i = 0; i < count; i++) {
+		//. and .. would make the walk go round in circles
+		if (entries[i].name[0]=='.')
+			continue;
+
+		name_size = entry_name(&entries[i], name, sizeof(name)) + 1;
+		records_end = (index->records_count + 1)*sizeof(fat_index_record);
+
+		if (records_end > index->names_begin || index->names_begin - records_end < name_size) {
+			index->failed = 1;
+			return -1;
+		}
+
+		index->names_begin -= name_size;
+		memcpy(index->memory + index->names_begin, name, name_size);
+
+		record = &index->records[index->records_count++];
+		record->parent = parent;
+		record->name_offset = index->names_begin;
+		record->first_cluster = entries[i].first_cluster;
+		record->size_bytes = entries[i].size_bytes;
+		record->attr = entries[i].attr;
+		record->creation_time = entries[i].creation_time;
+		record->creation_date = entries[i].creation_date;
+		record->write_time = entries[i].write_time;
+		record->write_date = entries[i].write_date;
+	}
+
+	return 0;
+}
+
+//Name of a record, the long one if the entry has it
+const char *fat_index_name(const fat_index *index, uint32_t record) {
+	return (const char *) index->memory + index->records[record].name_offset;
+}
+
+/*
+ * Writes the full path of a record in buffer, as "/dir/file".
+ * Returns its length, or 0 if it doesn't fit.
+ */
+uint32_t fat_index_path(const fat_index *index, uint32_t record, char *buffer, uint32_t buffer_size) {
+	uint32_t i, len = 0, name_len, position;
+
+	for (i = record; i!=FAT_INDEX_ROOT; i = index->records[i].parent)
+		len += 1 + (uint32_t) strlen(fat_index_name(index, i));
+
+	if (len >= buffer_size)
+		return 0;
+
+	//Names are written backwards, from the record up to the root
+	position = len;
+	buffer[position] = '\0';
+	for (i = record; i!=FAT_INDEX_ROOT; i = index->records[i].parent) {
+		name_len = (uint32_t) strlen(fat_index_name(index, i));
+		position -= name_len;
+		memcpy(buffer + position, fat_index_name(index, i), name_len);
+		buffer[--position] = FAT_PATH_SEPARATOR_2;
+	}
+
+	return len;
+}
+
+static inline void index_lock(fat_index *index) {
+	if (index->lock!=NULL)
+		index->lock(index->lock_ctx);
+}
+
+static inline void index_unlock(fat_index *index) {
+	if (index->unlock!=NULL)
+		index->unlock(index->lock_ctx);
+}
+
+//Lets the other workers go on until there may be something new, called with the lock held
+static void index_wait(fat_index *index) {
+	if (index->wait!=NULL) {
+		index->wait(index->wait_ctx);
+	} else {
+		index_unlock(index);
+		index_lock(index);
+	}
+}
+
+static inline void index_notify(fat_index *index) {
+	if (index->notify!=NULL)
+		index->notify(index->wait_ctx);
+}
+
+/*
+ * Gives the next directory to read, the root first and then the directory records in order,
+ * so the volume is read breadth first. Returns its record, or FAT_INDEX_NO_DIR if there is none now.
+ */
+static uint32_t take_dir(fat_index *index, uint32_t *dir_cluster) {
+	fat_index_record *record;
+
+	if (!index->root_taken) {
+		index->root_taken = 1;
+		*dir_cluster = FAT_ROOT_DIR_CLUSTER;
+		return FAT_INDEX_ROOT;
+	}
+
+	for (; index->next_dir < index->records_count; index->next_dir++) {
+		record = &index->records[index->next_dir];
+
+		//A directory starting at cluster 0 would be the root again
+		if ((record->attr & ATTR_DIRECTORY) && record->first_cluster >= 2) {
+			*dir_cluster = record->first_cluster;
+			return index->next_dir++;
+		}
+	}
+
+	return FAT_INDEX_NO_DIR;
+}
+
+
+//The long name, or the 8.3 one as "NAME.EXT". Returns its length
+static uint32_t entry_name(const fat_dir_entry *entry, char *name, uint32_t name_size) {
+	uint32_t i, len = 0;
+
+	if (entry->long_name_len)
+		return fat_lfn_name_to_utf8(entry->long_name, entry->long_name_len, name, name_size);
+
+	for (i = 0; i < 8 && entry->name[i]!=' '; i++)
+		name[len++] = (char) entry->name[i];
+
+	if (entry->name[8]!=' ') {
+		name[len++] = '.';
+		for (i = 8; i < FAT_ENTRY_WHOLE_NAME_SIZE && entry->name[i]!=' '; i++)
+			name[len++] = (char) entry->name[i];
+	}
+
+	name[len] = '\0';
+
+	return len;
+}
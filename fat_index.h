@@ -0,0 +1,70 @@
+#ifndef FAT_INDEX_H
+#define FAT_INDEX_H
+
+#include <stdint.h>
+#include "fat.h"
+
+/*
+ * Flat index of a whole volume. Every file and directory gets a fixed size
+ * record pointing to its parent, names are kept apart in a pool; the memory
+ * of both is supplied by the caller.
+ * The volume is walked by fat_index_work: any number of threads can call it on
+ * the same index, each taking the next directory to read, as long as a lock is set.
+ * A thread finding no directory to read while others may still find some waits for
+ * them with the wait callback, if set, else it retries at once. Once the index memory
+ * is over or a directory cannot be read, every thread stops reading.
+ */
+
+#define FAT_INDEX_ROOT (0xFFFFFFFFu) //Parent of the entries in the root directory
+
+typedef struct {
+  uint32_t parent; //Record of the directory holding the entry, FAT_INDEX_ROOT for the root one
+  uint32_t name_offset; //Of the '\0' terminated UTF-8 name, inside the index memory
+  uint32_t first_cluster;
+  uint32_t size_bytes;
+  uint8_t attr;
+  struct fat_time creation_time;
+  struct fat_date creation_date;
+  struct fat_time write_time;
+  struct fat_date write_date;
+} __attribute__ ((packed)) fat_index_record;
+
+typedef struct fat_index {
+  uint8_t *memory;
+  uint32_t memory_size;
+
+  //Records grow from the beginning of the memory, names from its end
+  fat_index_record *records;
+  uint32_t records_count;
+  uint32_t names_begin;
+
+  //Walk state
+  uint32_t next_dir; //Record the search of the next directory to read starts from
+  uint32_t active_workers;
+  uint8_t root_taken;
+  uint8_t failed; //Out of memory or read errors, the index is incomplete
+
+  //Optional, NULL if not set
+  fat_lock_func_t lock;
+  fat_lock_func_t unlock;
+  void *lock_ctx;
+  fat_lock_func_t wait;
+  fat_lock_func_t notify;
+  void *wait_ctx;
+} fat_index;
+
+int fat_index_init(fat_index *index, void *memory, uint32_t memory_size);
+void fat_index_set_lock(fat_index *index, fat_lock_func_t lock, fat_lock_func_t unlock, void *lock_ctx);
+
+/*
+ * wait is called with the lock held: it releases it until notify is called, then takes it back.
+ * notify wakes all the waiting threads. They are pthread_cond_wait and pthread_cond_broadcast
+ * on a condition variable used with the mutex of the lock.
+ */
+void fat_index_set_wait(fat_index *index, fat_lock_func_t wait, fat_lock_func_t notify, void *wait_ctx);
+int fat_index_add(fat_index *index, uint32_t parent, fat_dir_entry *entries, uint32_t count);
+int fat_index_work(fat_drive *drive, fat_index *index, void *buffer, uint32_t buffer_size);
+const char *fat_index_name(const fat_index *index, uint32_t record);
+uint32_t fat_index_path(const fat_index *index, uint32_t record, char *buffer, uint32_t buffer_size);
+
+#endif
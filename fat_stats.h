@@ -0,0 +1,67 @@
+#ifndef FAT_STATS_H
+#define FAT_STATS_H
+
+#include <stdint.h>
+
+/*
+ * Per drive instrumentation. Device reads are told apart by the region they hit:
+ * directories in the data region count as FAT_IO_DIR, only file contents as FAT_IO_DATA.
+ * Histograms have a bucket per power of two: bucket i counts values in [2^i, 2^(i+1)),
+ * bucket 0 also counts 0.
+ */
+
+enum fat_io_kind {
+  FAT_IO_RESERVED, FAT_IO_FAT, FAT_IO_DIR, FAT_IO_DATA, FAT_IO_KINDS
+};
+
+enum fat_api {
+  FAT_API_FILE_OPEN, FAT_API_FILE_READ, FAT_API_FILE_MAP, FAT_API_FILE_SEEK, FAT_API_FILE_WRITE,
+  FAT_API_DIR_CHANGE, FAT_API_DIR_READ, FAT_API_STAT, FAT_API_STAT_MANY, FAT_API_COUNT
+};
+
+#define FAT_STATS_BUCKETS (32)
+
+//Optional: a monotonic time in nanoseconds, enables the latency stats
+typedef uint64_t (*fat_clock_func_t)(void);
+
+struct fat_trace_event {
+  enum fat_io_kind kind;
+  uint8_t sequential; //The read starts where the previous one ended
+  uint64_t address;
+  uint32_t bytes;
+};
+
+//Optional: called before every device read. It can be called by several threads at once
+typedef void (*fat_trace_func_t)(void *ctx, const struct fat_trace_event *event);
+
+struct fat_api_stats {
+  uint64_t calls;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t histogram_ns[FAT_STATS_BUCKETS];
+};
+
+//Only counters: every field is an uint64_t, updated atomically
+typedef struct fat_stats {
+  //Device reads, cache misses included
+  uint64_t reads[FAT_IO_KINDS];
+  uint64_t read_bytes[FAT_IO_KINDS];
+  uint64_t sequential_reads;
+  uint64_t read_size_histogram[FAT_STATS_BUCKETS];
+  uint64_t last_read_end;
+
+  //Chain walks
+  uint64_t chain_steps; //FAT lookups of the next cluster
+  uint64_t seek_walks; //Seeks which walked the chain
+  uint64_t seek_walk_histogram[FAT_STATS_BUCKETS]; //By steps
+
+  //Copied from the attached caches by fat.stats_get
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t dir_cache_hits;
+  uint64_t dir_cache_misses;
+
+  struct fat_api_stats api[FAT_API_COUNT];
+} fat_stats;
+
+#endif
@@ -0,0 +1,409 @@
+#include "fat_stream.h"
+#include <stddef.h>
+#include <string.h>
+
+#define FAT_STREAM_ALIGNMENT (8u)
+#define FAT_STREAM_MOUNT_TRIES (8) //Mount reads a handful of sectors, each try keeps the next one it missed
+#define FAT_STREAM_NO_OWNER (0xFFFFFFFEu)
+#define FAT_STREAM_NO_SLOT (0xFFFFFFFFu)
+#define FAT_STREAM_SKIP_BYTES (512u)
+
+//Private functions
+static void *stream_serve(void *ctx, uint64_t address, uint32_t bytes, void *buffer);
+static const uint8_t *stream_find(fat_stream *stream, uint64_t address, uint32_t bytes);
+static int stream_fill(fat_stream *stream, void *buffer, uint32_t bytes);
+static int stream_skip_to(fat_stream *stream, uint64_t address);
+static uint8_t *stream_alloc(fat_stream *stream, uint32_t bytes);
+static int stream_keep(fat_stream *stream, uint64_t address, uint32_t bytes);
+static int stream_mount(fat_stream *stream, uint32_t sector_size);
+static uint32_t next_cluster(fat_stream *stream, uint32_t cluster);
+static int is_data_cluster(fat_stream *stream, uint32_t cluster);
+static int is_dir_owner(fat_stream *stream, uint32_t owner);
+static uint32_t dir_first_cluster(fat_stream *stream, uint32_t record);
+static uint8_t *slot_data(fat_stream *stream, uint32_t slot);
+static uint32_t slot_take(fat_stream *stream);
+static void slot_release(fat_stream *stream, uint32_t slot);
+static int emit(fat_stream *stream, uint32_t record, uint32_t file_cluster, const void *data);
+static int claim(fat_stream *stream, uint32_t record, uint32_t first_cluster);
+static int dir_parse_if_complete(fat_stream *stream, uint32_t record);
+static int cluster_arrived(fat_stream *stream, uint32_t cluster);
+
+int fat_stream_init(fat_stream *stream, void *memory, uint32_t memory_size, fat_index *index) {
+	uint8_t *mem = memory;
+	uint32_t padding;
+
+	padding = (uint32_t) ((FAT_STREAM_ALIGNMENT - ((uintptr_t) mem & (FAT_STREAM_ALIGNMENT - 1))) &
+		(FAT_STREAM_ALIGNMENT - 1));
+	if (memory_size < padding)
+		return -1;
+
+	stream->memory = mem + padding;
+	stream->memory_size = memory_size - padding;
+	stream->index = index;
+
+	return 0;
+}
+
+/*
+ * Reads the whole stream once, the sector size is the one of the image.
+ * Returns 0 if every directory could be read and all the data of its files given,
+ * -1 if the memory wasn't enough, the stream ended early or data_func asked to stop.
+ */
+int fat_stream_extract(fat_stream *stream, uint32_t sector_size, fat_stream_read_func_t read_func, void *read_ctx,
+					   fat_stream_data_func_t data_func, void *data_ctx) {
+	fat_drive *drive = &stream->drive;
+	uint32_t i, clusters, slots_count, cluster_size;
+	uint64_t fat_address, root_address;
+
+	stream->read = read_func;
+	stream->read_ctx = read_ctx;
+	stream->position = 0;
+	stream->data = data_func;
+	stream->data_ctx = data_ctx;
+	stream->memory_used = 0;
+	stream->regions_count = 0;
+	stream->data_address = 0;
+	stream->pending_dirs = 0;
+
+	if (stream_mount(stream, sector_size))
+		goto error;
+
+	//The first FAT and the FAT16 root dir, the other FATs are skipped
+	fat_address = (uint64_t) drive->first_fat_sector << drive->log_bytes_per_sector;
+	if (stream_keep(stream, fat_address, drive->fat_size_sectors << drive->log_bytes_per_sector) ||
+		(stream->fat = stream_find(stream, fat_address, 1))==NULL)
+		goto error;
+
+	if (FAT_IS_FAT16(drive)) {
+		root_address = (uint64_t) drive->root_dir.first_sector_v16 << drive->log_bytes_per_sector;
+		if (stream_keep(stream, root_address, (uint32_t) drive->root_entries_count*sizeof(struct fat_entry)))
+			goto error;
+	}
+
+	//Cluster tables, the scratch cluster and as many slots as the memory left allows
+	clusters = drive->clusters_count + 2;
+	cluster_size = drive->cluster_size_bytes;
+	if ((stream->owner = (uint32_t *) stream_alloc(stream, clusters*sizeof(uint32_t)))==NULL ||
+		(stream->where = (uint32_t *) stream_alloc(stream, clusters*sizeof(uint32_t)))==NULL ||
+		(stream->scratch = stream_alloc(stream, cluster_size))==NULL)
+		goto error;
+
+	for (i = 0; i < clusters; i++) {
+		stream->owner[i] = FAT_STREAM_NO_OWNER;
+		stream->where[i] = FAT_STREAM_NO_SLOT;
+	}
+
+	slots_count = (stream->memory_size - stream->memory_used)/cluster_size;
+	stream->slots = stream->memory + stream->memory_used;
+	stream->free_slot = FAT_STREAM_NO_SLOT;
+	for (i = slots_count; i > 0; i--)
+		slot_release(stream, i - 1);
+
+	//The root dir can be read now on FAT16, it's a chain of clusters to wait for on FAT32
+	if (FAT_IS_FAT16(drive)) {
+		stream->pending_dirs++;
+		if (dir_parse_if_complete(stream, FAT_INDEX_ROOT))
+			goto error;
+	} else if (claim(stream, FAT_INDEX_ROOT, drive->root_dir.first_cluster_v32)) {
+		goto error;
+	}
+
+	//Data region, a cluster at a time
+	if (stream_skip_to(stream, (uint64_t) drive->first_data_sector << drive->log_bytes_per_sector))
+		goto error;
+	stream->data_address = stream->position;
+
+	for (i = 2; i < clusters && stream_fill(stream, stream->scratch, cluster_size)==0; i++)
+		if (cluster_arrived(stream, i))
+			goto error;
+
+	//Directories never completed: the stream ended early or their chain is broken
+	if (stream->pending_dirs)
+		goto error;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+//Read callback of the drive: serves only what has been kept
+static void *stream_serve(void *ctx, uint64_t address, uint32_t bytes, void *buffer) {
+	fat_stream *stream = ctx;
+	const uint8_t *data = stream_find(stream, address, bytes);
+
+	if (data==NULL) {
+		if (!stream->missing_bytes) {
+			stream->missing_address = address;
+			stream->missing_bytes = bytes;
+		}
+		return NULL;
+	}
+
+	memmove(buffer, data, bytes);
+	return buffer;
+}
+
+static const uint8_t *stream_find(fat_stream *stream, uint64_t address, uint32_t bytes) {
+	struct fat_stream_region *region;
+	uint32_t i, cluster, offset;
+
+	for (i = 0; i < stream->regions_count; i++) {
+		region = &stream->regions[i];
+		if (address >= region->address && address - region->address <= region->bytes &&
+			bytes <= region->bytes - (address - region->address))
+			return region->data + (address - region->address);
+	}
+
+	//Buffered clusters
+	if (stream->data_address==0 || address < stream->data_address)
+		return NULL;
+
+	cluster = (uint32_t) ((address - stream->data_address) >> (stream->drive.log_bytes_per_sector +
+		stream->drive.log_sectors_per_cluster)) + 2;
+	offset = (uint32_t) (address - stream->data_address) & (stream->drive.cluster_size_bytes - 1);
+
+	if (!is_data_cluster(stream, cluster) || offset + bytes > stream->drive.cluster_size_bytes ||
+		!is_dir_owner(stream, stream->owner[cluster]) || stream->where[cluster]==FAT_STREAM_NO_SLOT)
+		return NULL;
+
+	return slot_data(stream, stream->where[cluster]) + offset;
+}
+
+static int stream_fill(fat_stream *stream, void *buffer, uint32_t bytes) {
+	uint32_t read = stream->read(stream->read_ctx, buffer, bytes);
+
+	stream->position += read;
+
+	return read==bytes ? 0 : -1;
+}
+
+static int stream_skip_to(fat_stream *stream, uint64_t address) {
+	uint8_t sink[FAT_STREAM_SKIP_BYTES];
+	uint64_t left;
+
+	if (address < stream->position)
+		return -1;
+
+	while ((left = address - stream->position) > 0)
+		if (stream_fill(stream, sink, left < sizeof(sink) ? (uint32_t) left : (uint32_t) sizeof(sink)))
+			return -1;
+
+	return 0;
+}
+
+static uint8_t *stream_alloc(fat_stream *stream, uint32_t bytes) {
+	uint8_t *data;
+
+	bytes = (bytes + FAT_STREAM_ALIGNMENT - 1) & ~(FAT_STREAM_ALIGNMENT - 1);
+	if (bytes > stream->memory_size - stream->memory_used)
+		return NULL;
+
+	data = stream->memory + stream->memory_used;
+	stream->memory_used += bytes;
+
+	return data;
+}
+
+//Reads the bytes at address from the stream into a new kept region
+static int stream_keep(fat_stream *stream, uint64_t address, uint32_t bytes) {
+	struct fat_stream_region *region;
+	uint8_t *data;
+
+	if (stream->regions_count==FAT_STREAM_MAX_REGIONS || stream_skip_to(stream, address) ||
+		(data = stream_alloc(stream, bytes))==NULL || stream_fill(stream, data, bytes))
+		return -1;
+
+	region = &stream->regions[stream->regions_count++];
+	region->address = address;
+	region->bytes = bytes;
+	region->data = data;
+
+	return 0;
+}
+
+/*
+ * Mount asks for a few sectors, which are not known before parsing the previous ones:
+ * it's tried again keeping, every time, the sectors holding the first read it missed.
+ */
+static int stream_mount(fat_stream *stream, uint32_t sector_size) {
+	uint64_t begin, end;
+	uint32_t tries;
+
+	for (tries = 0; tries < FAT_STREAM_MOUNT_TRIES; tries++) {
+		stream->missing_bytes = 0;
+
+		if (fat.mount(&stream->drive, sector_size, stream_serve, stream)==0)
+			return 0;
+
+		if (!stream->missing_bytes)
+			break; //Not a missing read: not a FAT volume
+
+		begin = stream->missing_address & ~((uint64_t) sector_size - 1);
+		end = (stream->missing_address + stream->missing_bytes + sector_size - 1) & ~((uint64_t) sector_size - 1);
+
+		//The beginning of the range could be the end of a kept region
+		if (begin < stream->position)
+			begin = stream->position;
+
+		if (begin >= end || stream_keep(stream, begin, (uint32_t) (end - begin)))
+			break;
+	}
+
+	return -1;
+}
+
+static uint32_t next_cluster(fat_stream *stream, uint32_t cluster) {
+	if (FAT_IS_FAT16(&stream->drive))
+		return ((const uint16_t *) stream->fat)[cluster];
+
+	return ((const uint32_t *) stream->fat)[cluster] & CLUSTER_MASK_32;
+}
+
+//Free, bad and end of chain values are not data clusters
+static inline int is_data_cluster(fat_stream *stream, uint32_t cluster) {
+	return cluster >= 2 && cluster < stream->drive.clusters_count + 2;
+}
+
+static inline int is_dir_owner(fat_stream *stream, uint32_t owner) {
+	return owner==FAT_INDEX_ROOT ||
+		(owner!=FAT_STREAM_NO_OWNER && (stream->index->records[owner].attr & ATTR_DIRECTORY));
+}
+
+static uint32_t dir_first_cluster(fat_stream *stream, uint32_t record) {
+	if (record==FAT_INDEX_ROOT)
+		return FAT_IS_FAT16(&stream->drive) ? FAT_ROOT_DIR_CLUSTER : stream->drive.root_dir.first_cluster_v32;
+
+	return stream->index->records[record].first_cluster;
+}
+
+static inline uint8_t *slot_data(fat_stream *stream, uint32_t slot) {
+	return stream->slots + (size_t) slot*stream->drive.cluster_size_bytes;
+}
+
+//Free slots are linked through their first bytes
+static uint32_t slot_take(fat_stream *stream) {
+	uint32_t slot = stream->free_slot;
+
+	if (slot!=FAT_STREAM_NO_SLOT)
+		memcpy(&stream->free_slot, slot_data(stream, slot), sizeof(stream->free_slot));
+
+	return slot;
+}
+
+static void slot_release(fat_stream *stream, uint32_t slot) {
+	memcpy(slot_data(stream, slot), &stream->free_slot, sizeof(stream->free_slot));
+	stream->free_slot = slot;
+}
+
+//Gives a cluster of a file, cut to the file size
+static int emit(fat_stream *stream, uint32_t record, uint32_t file_cluster, const void *data) {
+	uint32_t size = stream->index->records[record].size_bytes, offset, bytes;
+
+	offset = file_cluster*stream->drive.cluster_size_bytes;
+	if (offset >= size)
+		return 0;
+
+	bytes = size - offset < stream->drive.cluster_size_bytes ? size - offset : stream->drive.cluster_size_bytes;
+
+	return stream->data(stream->data_ctx, record, offset, data, bytes);
+}
+
+/*
+ * Marks the chain starting at first_cluster as belonging to record. File clusters already
+ * buffered are given at once, a directory is read as soon as all its clusters are there.
+ * A cluster belonging to someone else ends the chain: cross linked chains are read once.
+ */
+static int claim(fat_stream *stream, uint32_t record, uint32_t first_cluster) {
+	uint32_t cluster, i, slot;
+	int is_dir = is_dir_owner(stream, record);
+
+	for (cluster = first_cluster, i = 0; is_data_cluster(stream, cluster) && i < stream->drive.clusters_count;
+		 cluster = next_cluster(stream, cluster), i++) {
+		if (stream->owner[cluster]!=FAT_STREAM_NO_OWNER)
+			break;
+
+		stream->owner[cluster] = record;
+		if (is_dir)
+			continue; //Its slot, if any, stays where it is
+
+		slot = stream->where[cluster];
+		stream->where[cluster] = i;
+
+		if (slot!=FAT_STREAM_NO_SLOT) {
+			if (emit(stream, record, i, slot_data(stream, slot)))
+				return -1;
+			slot_release(stream, slot);
+		}
+	}
+
+	if (is_dir && i > 0) {
+		stream->pending_dirs++;
+		return dir_parse_if_complete(stream, record);
+	}
+
+	return 0;
+}
+
+/*
+ * Reads a directory whose clusters are all buffered, adds its entries to the index
+ * and claims their chains. Its slots are released afterwards.
+ */
+static int dir_parse_if_complete(fat_stream *stream, uint32_t record) {
+	uint32_t cluster, i, first_record, last_record;
+	fat_dir_iter iter;
+	fat_dir dir;
+	int32_t count;
+
+	dir.cluster = dir_first_cluster(stream, record);
+
+	for (cluster = dir.cluster, i = 0; is_data_cluster(stream, cluster) && i < stream->drive.clusters_count;
+		 cluster = next_cluster(stream, cluster), i++)
+		if (stream->owner[cluster]==record && stream->where[cluster]==FAT_STREAM_NO_SLOT)
+			return 0;
+
+	first_record = stream->index->records_count;
+
+	count = fat.dir_iter_init(&stream->drive, &dir, &iter, stream->scratch, stream->drive.cluster_size_bytes);
+	while (count==0 && (count = fat.dir_read(&stream->drive, &iter, stream->entries, FAT_STREAM_READ_ENTRIES)) > 0)
+		count = fat_index_add(stream->index, record, stream->entries, (uint32_t) count);
+
+	if (count < 0)
+		return -1;
+
+	stream->pending_dirs--;
+
+	for (cluster = dir.cluster, i = 0; is_data_cluster(stream, cluster) && i < stream->drive.clusters_count;
+		 cluster = next_cluster(stream, cluster), i++)
+		if (stream->owner[cluster]==record && stream->where[cluster]!=FAT_STREAM_NO_SLOT) {
+			slot_release(stream, stream->where[cluster]);
+			stream->where[cluster] = FAT_STREAM_NO_SLOT;
+		}
+
+	last_record = stream->index->records_count;
+	for (i = first_record; i < last_record; i++)
+		if (stream->index->records[i].first_cluster >= 2 && claim(stream, i, stream->index->records[i].first_cluster))
+			return -1;
+
+	return 0;
+}
+
+//Handles the cluster just read in the scratch buffer
+static int cluster_arrived(fat_stream *stream, uint32_t cluster) {
+	uint32_t owner = stream->owner[cluster], slot;
+
+	if (next_cluster(stream, cluster)==CLUSTER_FREE)
+		return 0;
+
+	if (owner!=FAT_STREAM_NO_OWNER && !is_dir_owner(stream, owner))
+		return emit(stream, owner, stream->where[cluster], stream->scratch);
+
+	//A directory cluster, or one of a file not known yet
+	if ((slot = slot_take(stream))==FAT_STREAM_NO_SLOT)
+		return -1;
+
+	memcpy(slot_data(stream, slot), stream->scratch, stream->drive.cluster_size_bytes);
+	stream->where[cluster] = slot;
+
+	return owner==FAT_STREAM_NO_OWNER ? 0 : dir_parse_if_complete(stream, owner);
+}
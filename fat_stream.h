@@ -0,0 +1,71 @@
+#ifndef FAT_STREAM_H
+#define FAT_STREAM_H
+
+#include <stdint.h>
+#include "fat.h"
+#include "fat_index.h"
+
+/*
+ * Extraction of a whole image arriving as a one pass stream (a pipe, a decompressor),
+ * when fat_read_bytes_func_t can't be given. Only what mount needs, the first FAT and
+ * the FAT16 root dir are kept from the beginning of the stream; then data clusters are
+ * handed to the caller as they pass, in disk order. The only clusters buffered are the
+ * directory ones and those whose file is not known yet, since their directory comes later.
+ * Every entry found ends up in an index, file data is given with its record and offset.
+ */
+
+//Reads the next bytes of the stream, returns how many were read: less than asked only at its end
+typedef uint32_t (*fat_stream_read_func_t)(void *ctx, void *buffer, uint32_t bytes);
+
+//Gets the data at offset of the file of record, returns 0 to go on
+typedef int (*fat_stream_data_func_t)(void *ctx, uint32_t record, uint32_t offset, const void *data, uint32_t bytes);
+
+#define FAT_STREAM_MAX_REGIONS (8)
+#define FAT_STREAM_READ_ENTRIES (16)
+
+struct fat_stream_region {
+  uint64_t address;
+  uint32_t bytes;
+  uint8_t *data;
+};
+
+typedef struct fat_stream {
+  fat_drive drive; //Mounted on what has been kept of the stream
+  fat_index *index;
+
+  //Source
+  fat_stream_read_func_t read;
+  void *read_ctx;
+  uint64_t position; //Stream bytes read so far
+
+  //Consumer
+  fat_stream_data_func_t data;
+  void *data_ctx;
+
+  //Caller memory: kept regions first, then the cluster tables and the buffer slots
+  uint8_t *memory;
+  uint32_t memory_size;
+  uint32_t memory_used;
+
+  struct fat_stream_region regions[FAT_STREAM_MAX_REGIONS];
+  uint32_t regions_count;
+  uint64_t missing_address; //First read of the drive that couldn't be served
+  uint32_t missing_bytes; //0 if none
+
+  const uint8_t *fat;
+  uint64_t data_address; //Of cluster 2, 0 until the data region is reached
+  uint32_t *owner; //Record of the file or directory each cluster belongs to
+  uint32_t *where; //Index inside the file for file clusters, buffer slot for the others
+  uint8_t *scratch; //A cluster
+  uint8_t *slots;
+  uint32_t free_slot; //Head of the free slots list
+  uint32_t pending_dirs; //Known directories not read yet
+
+  fat_dir_entry entries[FAT_STREAM_READ_ENTRIES];
+} fat_stream;
+
+int fat_stream_init(fat_stream *stream, void *memory, uint32_t memory_size, fat_index *index);
+int fat_stream_extract(fat_stream *stream, uint32_t sector_size, fat_stream_read_func_t read_func, void *read_ctx,
+					   fat_stream_data_func_t data_func, void *data_ctx);
+
+#endif
@@ -21,6 +21,27 @@ struct fat_BPB {
 //FAT32-specific BPB offsets
 #define BPB32_BYTE_OFFEST__FAT_SIZE_SECTORS_32 (BPB_BYTE_OFFSET__FROM_PARTITION_BEGIN + sizeof(struct fat_BPB) + 0)
 #define BPB32_BYTE_OFFEST__ROOT_CLUSTER_32 (BPB_BYTE_OFFSET__FROM_PARTITION_BEGIN + sizeof(struct fat_BPB) + 4 + 2 + 2)
+#define BPB32_BYTE_OFFEST__FS_INFO_SECTOR (BPB_BYTE_OFFSET__FROM_PARTITION_BEGIN + sizeof(struct fat_BPB) + 4 + 2 + 2 + 4)
+#define BPB32_BYTE_OFFSET__VOLUME_ID (67)
+#define BPB16_BYTE_OFFSET__VOLUME_ID (39)
+
+//MBR and boot sector
+#define FAT_BOOT_SECTOR_BYTES (512)
+#define FAT_BOOT_SIG_OFFSET (510)
+#define MBR_BYTE_OFFSET__PARTITION_TABLE (0x1BE)
+
+//FAT32 FSInfo sector, fatgen pag. 21
+#define FS_INFO_LEAD_SIG (0x41615252u)
+#define FS_INFO_STRUCT_SIG (0x61417272u)
+#define FS_INFO_BYTE_OFFSET__STRUCT_SIG (484)
+#define FS_INFO_BYTE_OFFSET__FREE_COUNT (488)
+#define FS_INFO_UNKNOWN (0xFFFFFFFFu)
+
+struct fat_fs_info_hints {
+  uint32_t struct_sig;
+  uint32_t free_count;
+  uint32_t next_free;
+} __attribute__((packed));
 
 //FAT specific types
 struct fat_date {
@@ -35,6 +56,17 @@ struct fat_time {
 	  hours: 5;
 } __attribute__((packed));
 
+//A date and time decoded by fat_timestamp_decode, all 0 if the entry doesn't have it
+struct fat_timestamp {
+  uint16_t year;
+  uint8_t month; //1 to 12
+  uint8_t day; //1 to 31
+  uint8_t hours;
+  uint8_t mins;
+  uint8_t secs;
+  uint16_t msecs; //Only creation times are finer than 2 seconds
+};
+
 #define FAT_ENTRY_WHOLE_NAME_SIZE 11
 
 #define FAT_ENTRY_NAME_LAST_ENTRY 0x00u
@@ -87,6 +119,41 @@ struct mbr_partition_entry {
 } __attribute__((packed));
 
 #define MBR_BOOT_SIG ((uint16_t)(0xAA55u))
+#define MBR_PARTITIONS (4)
+#define MBR_TYPE_EXTENDED_CHS (0x05u)
+#define MBR_TYPE_EXTENDED_LBA (0x0Fu)
+#define MBR_TYPE_EXTENDED_LINUX (0x85u)
+#define MBR_TYPE_GPT_PROTECTIVE (0xEEu)
+
+//GPT, UEFI spec chapter 5.3
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_HEADER_LBA (1)
+
+struct gpt_header {
+  char signature[8];
+  uint32_t revision;
+  uint32_t header_size;
+  uint32_t header_crc32;
+  uint32_t reserved;
+  uint64_t my_lba;
+  uint64_t alternate_lba;
+  uint64_t first_usable_lba;
+  uint64_t last_usable_lba;
+  uint8_t disk_guid[16];
+  uint64_t entries_lba;
+  uint32_t entries_count;
+  uint32_t entry_size;
+  uint32_t entries_crc32;
+} __attribute__((packed));
+
+struct gpt_entry {
+  uint8_t type_guid[16];
+  uint8_t unique_guid[16];
+  uint64_t first_lba;
+  uint64_t last_lba; //Inclusive
+  uint64_t attributes;
+  uint16_t name[36];
+} __attribute__((packed));
 
 //fat_entry attrib masks
 #define ATTR_READ_ONLY ((uint8_t)(0x01u))
@@ -103,6 +170,11 @@ struct mbr_partition_entry {
 #define CLUSTER_MASK_32 (0x0FFFFFFFu)
 #define CLUSTER_EOF_16 (0xFFF8u)
 #define CLUSTER_EOF_32 (0x0FFFFFF8u)
+#define CLUSTER_EOC_MARK_16 (0xFFFFu) //Written to end a chain
+#define CLUSTER_EOC_MARK_32 (0x0FFFFFFFu)
+#define CLUSTER_FREE (0)
+#define CLUSTER_BAD_16 (0xFFF7u)
+#define CLUSTER_BAD_32 (0x0FFFFFF7u)
 
 #define LAST_LONG_ENTRY (0x40u)
 
@@ -111,6 +183,10 @@ struct mbr_partition_entry {
  * each lfn entry contains 13 char => ceil(255/13)=20.
  */
 #define MAX_ORDER_LFS_ENTRIES (20)
+#define LFN_CHARS_PER_ENTRY (13)
+#define LFN_ORDER_MASK (0x1Fu)
+#define FAT_LFN_MAX_CHARS (MAX_ORDER_LFS_ENTRIES*LFN_CHARS_PER_ENTRY)
+#define FAT_LFN_MAX_NAME_BYTES (FAT_LFN_MAX_CHARS*3 + 1) //Worst case UTF-8 encoding, plus '\0'
 
 #define FAT_ROOT_DIR_CLUSTER 0
 #define FAT_PATH_SEPARATOR_1 '\\'
@@ -2,6 +2,12 @@
 #include "fat.h"
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 uint32_t fat_log2(uint32_t x) {
 	uint32_t ret = 0;
 
@@ -22,41 +28,78 @@ inline char fat_ascii_to_upper(char c) {
 	return c;
 }
 
-int fat_entry_ascii_name_equals(struct fat_entry entry, const char *name) {
+/*
+ * Converts name into the padded uppercase form it has in a fat_entry.
+ * Returns -1 if it cannot be an 8.3 name.
+ */
+int fat_ascii_name_to_entry_name(const char *name, uint8_t *entry_name) {
 	uint8_t i, j;
-	char fat_name[sizeof(entry.name)];
 
 	if (name[0]=='.') { //A file can start with a . only if it's either "." or ".."
-		if (name[1]=='.')
-			memcpy(fat_name, FAT_PARENT_DIR_NAME, sizeof(fat_name));
+		if (name[1]=='.' && name[2]=='\0')
+			memcpy(entry_name, FAT_PARENT_DIR_NAME, FAT_ENTRY_WHOLE_NAME_SIZE);
+		else if (name[1]=='\0')
+			memcpy(entry_name, FAT_CURRENT_DIR_NAME, FAT_ENTRY_WHOLE_NAME_SIZE);
 		else
-			memcpy(fat_name, FAT_CURRENT_DIR_NAME, sizeof(fat_name));
-	} else {
-		//base
-		for (i = 0; name[i]!='.' && name[i]!='\0'; i++)
-			fat_name[i] = fat_ascii_to_upper(name[i]);
-
-		j = i; //j points at the next name char
-		if (name[j]=='.') //did we stop for the '.'?
-			j++;
-
-		for (; i < (uint8_t) sizeof(entry.name.splitted.base); i++)
-			fat_name[i] = ' ';
-		//i point at the next fat_name char
-
-		//ext
-		for (; name[j]!='\0'; j++, i++)
-			fat_name[i] = fat_ascii_to_upper(name[j]);
-
-		for (; i < (uint8_t) sizeof(fat_name); i++)
-			fat_name[i] = ' ';
+			return -1;
+
+		return 0;
+	}
+
+	//base
+	for (i = 0; name[i]!='.' && name[i]!='\0'; i++) {
+		if (i==sizeof(((struct fat_entry *) 0)->name.splitted.base))
+			return -1;
+		entry_name[i] = (uint8_t) fat_ascii_to_upper(name[i]);
+	}
+
+	j = i; //j points at the next name char
+	if (name[j]=='.') //did we stop for the '.'?
+		j++;
+
+	for (; i < (uint8_t) sizeof(((struct fat_entry *) 0)->name.splitted.base); i++)
+		entry_name[i] = ' ';
+	//i point at the next entry_name char
+
+	//ext
+	for (; name[j]!='\0'; j++, i++) {
+		if (i==FAT_ENTRY_WHOLE_NAME_SIZE)
+			return -1;
+		entry_name[i] = (uint8_t) fat_ascii_to_upper(name[j]);
+	}
+
+	for (; i < FAT_ENTRY_WHOLE_NAME_SIZE; i++)
+		entry_name[i] = ' ';
+
+	return 0;
+}
+
+/*
+ * Hash of the first len chars of path, case and separator insensitive.
+ * Leading and trailing separators are ignored. Never returns 0.
+ */
+uint64_t fat_path_hash(const char *path, uint32_t len) {
+	uint64_t hash = 14695981039346656037ull; //FNV-1a
+	char c;
+
+	while (len && (path[0]==FAT_PATH_SEPARATOR_1 || path[0]==FAT_PATH_SEPARATOR_2)) {
+		path++;
+		len--;
 	}
 
-	return !memcmp(entry.name.whole, fat_name, sizeof(fat_name));
+	while (len && (path[len - 1]==FAT_PATH_SEPARATOR_1 || path[len - 1]==FAT_PATH_SEPARATOR_2))
+		len--;
+
+	for (; len; len--, path++) {
+		c = *path==FAT_PATH_SEPARATOR_1 ? FAT_PATH_SEPARATOR_2 : fat_ascii_to_upper(*path);
+		hash = (hash ^ (uint8_t) c)*1099511628211ull;
+	}
+
+	return hash ? hash : 1;
 }
 
-int fat_split_path(const char *path, char *buffer, int *is_last) {
-	int i, j;
+int fat_split_path(const char *path, char *buffer, uint32_t buffer_size, int *is_last) {
+	uint32_t i, j;
 
 	if (path[0]=='\0') {
 		*is_last = 1;
@@ -69,11 +112,293 @@ int fat_split_path(const char *path, char *buffer, int *is_last) {
 	else
 		i = 0;
 
-	for (j = 0; path[i]!=FAT_PATH_SEPARATOR_1 && path[i]!=FAT_PATH_SEPARATOR_2 && path[i]!='\0'; i++, j++)
+	for (j = 0; path[i]!=FAT_PATH_SEPARATOR_1 && path[i]!=FAT_PATH_SEPARATOR_2 && path[i]!='\0'; i++, j++) {
+		if (j==buffer_size - 1) //No room for the '\0': the name cannot exist
+			return -1;
 		buffer[j] = path[i];
+	}
 
 	buffer[j] = '\0';
 	*is_last = (path[i]=='\0');
 
-	return i;
+	return (int) i;
+}
+
+/*
+ * fatgen pag. 25: dates count years from 1980, times have a 2 seconds granularity and
+ * creation times add up to 199 units of 10 ms. Out of range values (e.g. a 0 date,
+ * which many tools write when they don't keep the time) give a timestamp all 0.
+ */
+void fat_timestamp_decode(struct fat_date date, struct fat_time time, uint8_t time_10ms,
+						  struct fat_timestamp *timestamp) {
+	memset(timestamp, 0, sizeof(*timestamp));
+
+	if (date.day==0 || date.month==0 || date.month > 12 || time.hours > 23 || time.mins > 59 || time.sec_gran_2 > 29 ||
+		time_10ms > 199)
+		return;
+
+	timestamp->year = (uint16_t) (1980 + date.years_from_1980);
+	timestamp->month = (uint8_t) date.month;
+	timestamp->day = (uint8_t) date.day;
+	timestamp->hours = (uint8_t) time.hours;
+	timestamp->mins = (uint8_t) time.mins;
+	timestamp->secs = (uint8_t) (time.sec_gran_2*2 + time_10ms/100);
+	timestamp->msecs = (uint16_t) (time_10ms%100*10);
+}
+
+/*
+ * Seconds from 1970-01-01 00:00, 0 if the timestamp is not set. FAT keeps local times
+ * with no time zone: the result is that local time read as UTC, good to compare timestamps
+ * of the same volume but off by the zone of the writer as an absolute time.
+ */
+int64_t fat_timestamp_to_unix(const struct fat_timestamp *timestamp) {
+	int64_t year = timestamp->year, month = timestamp->month, days;
+
+	if (month==0)
+		return 0;
+
+	//Years start in March, so that the leap day is the last one of its year
+	if (month <= 2) {
+		year--;
+		month += 12;
+	}
+
+	days = 365*year + year/4 - year/100 + year/400 + (153*(month - 3) + 2)/5 + timestamp->day - 1
+		- 719468; //Days from 0000-03-01 to 1970-01-01
+
+	return days*86400 + timestamp->hours*3600 + timestamp->mins*60 + timestamp->secs;
+}
+
+//fatgen pag. 28: rotate right and add, over the 11 chars of the short name
+uint8_t fat_lfn_checksum(const uint8_t *entry_name) {
+	uint8_t i, sum = 0;
+
+	for (i = 0; i < FAT_ENTRY_WHOLE_NAME_SIZE; i++)
+		sum = (uint8_t) (((sum & 1u) << 7u) + (sum >> 1u) + entry_name[i]);
+
+	return sum;
+}
+
+/*
+ * Simple case folding: ASCII and Latin-1 letters only,
+ * every other UTF-16 unit is compared as it is.
+ */
+inline uint16_t fat_utf16_to_upper(uint16_t c) {
+	if ((c >= 'a' && c <= 'z') || (c >= 0xE0u && c <= 0xFEu && c!=0xF7u))
+		return (uint16_t) (c - 0x20);
+
+	if (c==0xFFu)
+		return 0x178u;
+
+	return c;
+}
+
+/*
+ * Converts the UTF-8 name into uppercase UTF-16, the form long names are compared in.
+ * lfn_name must hold FAT_LFN_MAX_CHARS units. Returns the length of the converted name,
+ * or -1 if name is empty, too long or not valid UTF-8.
+ */
+int32_t fat_utf8_to_lfn_name(const char *name, uint16_t *lfn_name) {
+	const uint8_t *s = (const uint8_t *) name;
+	uint32_t code_point, len = 0, continuation;
+
+	while (*s!='\0') {
+		if (*s < 0x80u) {
+			code_point = *s;
+			continuation = 0;
+		} else if ((*s & 0xE0u)==0xC0u) {
+			code_point = *s & 0x1Fu;
+			continuation = 1;
+		} else if ((*s & 0xF0u)==0xE0u) {
+			code_point = *s & 0x0Fu;
+			continuation = 2;
+		} else if ((*s & 0xF8u)==0xF0u) {
+			code_point = *s & 0x07u;
+			continuation = 3;
+		} else {
+			return -1;
+		}
+
+		for (s++; continuation; continuation--, s++) {
+			if ((*s & 0xC0u)!=0x80u)
+				return -1;
+			code_point = (code_point << 6u) | (*s & 0x3Fu);
+		}
+
+		if (code_point > 0xFFFFu) { //Surrogate pair
+			if (code_point > 0x10FFFFu || len + 2 > FAT_LFN_MAX_CHARS)
+				return -1;
+			code_point -= 0x10000u;
+			lfn_name[len++] = (uint16_t) (0xD800u | (code_point >> 10u));
+			lfn_name[len++] = (uint16_t) (0xDC00u | (code_point & 0x3FFu));
+		} else {
+			if (len==FAT_LFN_MAX_CHARS)
+				return -1;
+			lfn_name[len++] = fat_utf16_to_upper((uint16_t) code_point);
+		}
+	}
+
+	return len ? (int32_t) len : -1;
+}
+
+/*
+ * Converts len UTF-16 units into a '\0' terminated UTF-8 string.
+ * Conversion stops when buffer is full. Returns the bytes written, '\0' excluded.
+ */
+uint32_t fat_lfn_name_to_utf8(const uint16_t *lfn_name, uint32_t len, char *buffer, uint32_t buffer_size) {
+	uint32_t i, code_point, bytes, written = 0;
+
+	if (buffer_size==0)
+		return 0;
+
+	for (i = 0; i < len; i++) {
+		code_point = lfn_name[i];
+		if (code_point >= 0xD800u && code_point < 0xDC00u && i + 1 < len &&
+			lfn_name[i + 1] >= 0xDC00u && lfn_name[i + 1] < 0xE000u) {
+			code_point = 0x10000u + ((code_point - 0xD800u) << 10u) + (lfn_name[i + 1] - 0xDC00u);
+			i++;
+		}
+
+		bytes = code_point < 0x80u ? 1 : code_point < 0x800u ? 2 : code_point < 0x10000u ? 3 : 4;
+		if (written + bytes >= buffer_size)
+			break;
+
+		switch (bytes) {
+			case 1: buffer[written++] = (char) code_point;
+				break;
+			case 2: buffer[written++] = (char) (0xC0u | (code_point >> 6u));
+				buffer[written++] = (char) (0x80u | (code_point & 0x3Fu));
+				break;
+			case 3: buffer[written++] = (char) (0xE0u | (code_point >> 12u));
+				buffer[written++] = (char) (0x80u | ((code_point >> 6u) & 0x3Fu));
+				buffer[written++] = (char) (0x80u | (code_point & 0x3Fu));
+				break;
+			default: buffer[written++] = (char) (0xF0u | (code_point >> 18u));
+				buffer[written++] = (char) (0x80u | ((code_point >> 12u) & 0x3Fu));
+				buffer[written++] = (char) (0x80u | ((code_point >> 6u) & 0x3Fu));
+				buffer[written++] = (char) (0x80u | (code_point & 0x3Fu));
+				break;
+		}
+	}
+
+	buffer[written] = '\0';
+
+	return written;
+}
+
+//Compares an on disk long name with one already converted by fat_utf8_to_lfn_name
+int fat_lfn_name_equal(const uint16_t *folded_name, const uint16_t *lfn_name, uint32_t len) {
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		if (folded_name[i]!=fat_utf16_to_upper(lfn_name[i]))
+			return 0;
+
+	return 1;
+}
+
+//Case insensitive hash of a long name. Never returns 0.
+uint64_t fat_lfn_name_hash(const uint16_t *lfn_name, uint32_t len) {
+	uint64_t hash = 14695981039346656037ull; //FNV-1a
+	uint16_t c;
+
+	for (; len; len--, lfn_name++) {
+		c = fat_utf16_to_upper(*lfn_name);
+		hash = (hash ^ (uint8_t) c)*1099511628211ull;
+		hash = (hash ^ (uint8_t) (c >> 8u))*1099511628211ull;
+	}
+
+	return hash ? hash : 1;
+}
+
+/*
+ * Prepares a search for fat_entries_skip. entry_name is the padded 8.3 name, NULL if there is none;
+ * long_name_len is 0 if the searched name cannot be a long one.
+ */
+void fat_name_key_init(struct fat_name_key *key, const uint8_t *entry_name, uint32_t long_name_len) {
+	memset(key, 0, sizeof(*key));
+
+	if (entry_name!=NULL) {
+		memcpy(key->name, entry_name, FAT_ENTRY_WHOLE_NAME_SIZE);
+		key->has_name = 1;
+
+		//Compared with the raw entries, where a name starting with 0xE5 is stored as 0x05
+		if (key->name[0]==FAT_ENTRY_NAME_DELETED_ENTRY)
+			key->name[0] = FAT_ENTRY_NAME_KANJI_ENTRY;
+	}
+
+	if (long_name_len && long_name_len <= FAT_LFN_MAX_CHARS)
+		key->lfn_order = (uint8_t) ((long_name_len + LFN_CHARS_PER_ENTRY - 1)/LFN_CHARS_PER_ENTRY);
+}
+
+/*
+ * Counts the entries at the start of the array that cannot be the searched one: the first entry
+ * not counted is either the end of the directory, an entry with the searched 8.3 name, or the first
+ * part of a long name with as many parts as the searched one.
+ * The caller must not be in the middle of a long name, since its parts may be skipped.
+ */
+uint32_t fat_entries_skip(const struct fat_entry *entries, uint32_t count, const struct fat_name_key *key) {
+	const uint32_t name_bits = key->has_name ? 0x7FFu : 0; //The 11 name bytes of an entry
+	const uint32_t lfn_bits = 0x801u; //Order and attr
+	uint32_t i = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+	//The first 16 bytes of an entry hold the name, the order of a long name part and attr
+	const __m128i name = _mm_loadu_si128((const __m128i *) key->name);
+	const __m128i lfn_mask = _mm_setr_epi8((char) (LAST_LONG_ENTRY | LFN_ORDER_MASK), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+										   (char) ATTR_LONG_NAME_MASK, 0, 0, 0, 0);
+	//With no long name the order is compared with 0xFF, which masked orders never are
+	const __m128i lfn_value = _mm_setr_epi8((char) (key->lfn_order ? LAST_LONG_ENTRY | key->lfn_order : 0xFFu),
+											0, 0, 0, 0, 0, 0, 0, 0, 0, 0, (char) ATTR_LONG_NAME, 0, 0, 0, 0);
+	uint32_t eq, lfn, end;
+#endif
+
+#if defined(__AVX2__)
+	//Two entries at a time, one per 128 bit lane
+	const __m256i name2 = _mm256_broadcastsi128_si256(name);
+	const __m256i lfn_mask2 = _mm256_broadcastsi128_si256(lfn_mask);
+	const __m256i lfn_value2 = _mm256_broadcastsi128_si256(lfn_value);
+	__m256i v2;
+
+	for (; i + 2 <= count; i += 2) {
+		v2 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) &entries[i])),
+									 _mm_loadu_si128((const __m128i *) &entries[i + 1]), 1);
+		eq = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v2, name2));
+		lfn = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v2, lfn_mask2), lfn_value2));
+		end = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v2, _mm256_setzero_si256()));
+
+		if ((name_bits && (eq & name_bits)==name_bits) || (lfn & lfn_bits)==lfn_bits || (end & 1u))
+			return i;
+		eq >>= 16u;
+		lfn >>= 16u;
+		end >>= 16u;
+		if ((name_bits && (eq & name_bits)==name_bits) || (lfn & lfn_bits)==lfn_bits || (end & 1u))
+			return i + 1;
+	}
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+	for (; i < count; i++) {
+		const __m128i v = _mm_loadu_si128((const __m128i *) &entries[i]);
+
+		eq = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, name));
+		lfn = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, lfn_mask), lfn_value));
+		end = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+
+		if ((name_bits && (eq & name_bits)==name_bits) || (lfn & lfn_bits)==lfn_bits || (end & 1u))
+			return i;
+	}
+#else
+	for (; i < count; i++) {
+		const uint8_t *entry_name = entries[i].name.whole;
+
+		if (entry_name[0]==FAT_ENTRY_NAME_LAST_ENTRY ||
+			(name_bits && memcmp(entry_name, key->name, FAT_ENTRY_WHOLE_NAME_SIZE)==0) ||
+			(key->lfn_order && (entries[i].attr & ATTR_LONG_NAME_MASK)==ATTR_LONG_NAME &&
+				(entry_name[0] & (LAST_LONG_ENTRY | LFN_ORDER_MASK))==(LAST_LONG_ENTRY | key->lfn_order)))
+			return i;
+	}
+#endif
+
+	return count;
 }
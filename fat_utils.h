@@ -8,7 +8,31 @@ uint32_t fat_log2(uint32_t x);
 uint32_t fat_make_dword(uint16_t high, uint16_t low);
 
 char fat_ascii_to_upper(char c);
-int fat_entry_ascii_name_equals(struct fat_entry entry, const char *name);
-int fat_split_path(const char *path, char *buffer, int *is_last);
+int fat_ascii_name_to_entry_name(const char *name, uint8_t *entry_name);
+uint64_t fat_path_hash(const char *path, uint32_t len);
+int fat_split_path(const char *path, char *buffer, uint32_t buffer_size, int *is_last);
+
+//Timestamps
+void fat_timestamp_decode(struct fat_date date, struct fat_time time, uint8_t time_10ms,
+						  struct fat_timestamp *timestamp);
+int64_t fat_timestamp_to_unix(const struct fat_timestamp *timestamp);
+
+//Long names
+uint8_t fat_lfn_checksum(const uint8_t *entry_name);
+uint16_t fat_utf16_to_upper(uint16_t c);
+int32_t fat_utf8_to_lfn_name(const char *name, uint16_t *lfn_name);
+uint32_t fat_lfn_name_to_utf8(const uint16_t *lfn_name, uint32_t len, char *buffer, uint32_t buffer_size);
+int fat_lfn_name_equal(const uint16_t *folded_name, const uint16_t *lfn_name, uint32_t len);
+uint64_t fat_lfn_name_hash(const uint16_t *lfn_name, uint32_t len);
+
+//Directory scanning
+struct fat_name_key {
+  uint8_t name[16]; //Padded 8.3 name, the bytes after the 11th are never compared
+  uint8_t has_name;
+  uint8_t lfn_order; //Parts of a long name as long as the searched one, 0 if none
+};
+
+void fat_name_key_init(struct fat_name_key *key, const uint8_t *entry_name, uint32_t long_name_len);
+uint32_t fat_entries_skip(const struct fat_entry *entries, uint32_t count, const struct fat_name_key *key);
 
 #endif
@@ -0,0 +1,419 @@
+#include "image_gen.h"
+#include "fat_types.h"
+#include "fat_utils.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE_GEN_PARTITION_LBA (2048u)
+#define IMAGE_GEN_NUMBER_OF_FATS (2u)
+#define IMAGE_GEN_ROOT_ENTRIES_16 (512u)
+#define IMAGE_GEN_MAX_GAP (16u) //Clusters skipped at most by a fragmented allocation
+#define IMAGE_GEN_PATH_SIZE (32u)
+
+struct image_gen {
+  const struct image_gen_params *params;
+  int fd;
+  uint32_t rng;
+
+  uint32_t *fat; //Always 32 bit entries, shrunk when written on FAT16
+  uint32_t next_cluster; //Where the next allocation starts
+  uint32_t free_clusters;
+  uint32_t root_cluster; //FAT32 only
+
+  uint32_t cluster_size;
+  uint32_t reserved_sectors;
+  uint32_t fat_size_sectors;
+  uint32_t root_dir_sectors;
+  uint64_t first_fat_address;
+  uint64_t root_dir_address; //FAT16 only
+  uint64_t first_data_address;
+
+  uint8_t *cluster_buffer;
+};
+
+//Private functions
+static uint32_t gen_random(struct image_gen *gen);
+static int gen_write(struct image_gen *gen, uint64_t address, const void *buffer, uint32_t bytes);
+static uint64_t cluster_address(struct image_gen *gen, uint32_t cluster);
+static uint32_t alloc_chain(struct image_gen *gen, uint32_t clusters);
+static int write_chain(struct image_gen *gen, uint32_t first_cluster, const uint8_t *data, uint32_t bytes);
+static void make_entry(struct fat_entry *entry, const char *name, uint8_t attr, uint32_t first_cluster, uint32_t size);
+static void make_long_name(char *name, uint32_t file, uint32_t len);
+static uint32_t make_long_entries(struct fat_entry *entries, const char *short_name, uint32_t file, uint32_t len);
+static int write_boot(struct image_gen *gen);
+static int write_fats(struct image_gen *gen);
+static int write_dirs(struct image_gen *gen);
+
+int image_gen_write(const char *path, const struct image_gen_params *params) {
+	struct image_gen gen;
+	uint32_t fat_entry_size = params->type==FAT16 ? 2 : 4;
+	uint64_t total_sectors;
+	int ret = -1;
+
+	gen.params = params;
+	gen.rng = params->seed ? params->seed : 1;
+	gen.cluster_size = params->sectors_per_cluster*IMAGE_GEN_SECTOR_SIZE;
+	gen.reserved_sectors = params->type==FAT16 ? 4 : 32;
+	gen.root_dir_sectors = params->type==FAT16 ? IMAGE_GEN_ROOT_ENTRIES_16*sizeof(struct fat_entry)/IMAGE_GEN_SECTOR_SIZE : 0;
+	gen.fat_size_sectors = ((params->clusters + 2)*fat_entry_size + IMAGE_GEN_SECTOR_SIZE - 1)/IMAGE_GEN_SECTOR_SIZE;
+	gen.first_fat_address = (uint64_t) (IMAGE_GEN_PARTITION_LBA + gen.reserved_sectors)*IMAGE_GEN_SECTOR_SIZE;
+	gen.root_dir_address = gen.first_fat_address +
+		(uint64_t) IMAGE_GEN_NUMBER_OF_FATS*gen.fat_size_sectors*IMAGE_GEN_SECTOR_SIZE;
+	gen.first_data_address = gen.root_dir_address + (uint64_t) gen.root_dir_sectors*IMAGE_GEN_SECTOR_SIZE;
+	gen.next_cluster = 2;
+	gen.free_clusters = params->clusters;
+	gen.root_cluster = 0;
+
+	total_sectors = gen.reserved_sectors + IMAGE_GEN_NUMBER_OF_FATS*gen.fat_size_sectors + gen.root_dir_sectors +
+		(uint64_t) params->clusters*params->sectors_per_cluster;
+
+	if ((params->type==FAT16 && params->dirs > IMAGE_GEN_ROOT_ENTRIES_16) ||
+		(params->long_name_len && (params->long_name_len < 13 || params->long_name_len > 255)))
+		return -1;
+
+	gen.fat = calloc(params->clusters + 2, sizeof(uint32_t));
+	gen.cluster_buffer = malloc(gen.cluster_size);
+	if (gen.fat==NULL || gen.cluster_buffer==NULL)
+		goto out;
+
+	gen.fat[0] = params->type==FAT16 ? 0xFFF8u : 0x0FFFFFF8u;
+	gen.fat[1] = params->type==FAT16 ? CLUSTER_EOC_MARK_16 : CLUSTER_EOC_MARK_32;
+
+	if ((gen.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		goto out;
+
+	if (ftruncate(gen.fd, (off_t) ((IMAGE_GEN_PARTITION_LBA + total_sectors)*IMAGE_GEN_SECTOR_SIZE))==0 &&
+		write_dirs(&gen)==0 && write_fats(&gen)==0 && write_boot(&gen)==0)
+		ret = 0;
+
+	close(gen.fd);
+
+out:
+	free(gen.fat);
+	free(gen.cluster_buffer);
+
+	return ret;
+}
+
+void image_gen_dir_path(char *path, uint32_t dir) {
+	snprintf(path, IMAGE_GEN_PATH_SIZE, "/DIR%05u", dir%100000u);
+}
+
+void image_gen_file_path(char *path, uint32_t dir, uint32_t file) {
+	snprintf(path, IMAGE_GEN_PATH_SIZE, "/DIR%05u/F%07u.BIN", dir%100000u, file%10000000u);
+}
+
+void image_gen_long_file_path(char *path, uint32_t dir, uint32_t file, uint32_t long_name_len) {
+	char name[256];
+
+	make_long_name(name, file, long_name_len);
+	snprintf(path, IMAGE_GEN_LONG_PATH_SIZE, "/DIR%05u/%s", dir%100000u, name);
+}
+
+//xorshift32
+static uint32_t gen_random(struct image_gen *gen) {
+	gen->rng ^= gen->rng << 13;
+	gen->rng ^= gen->rng >> 17;
+	gen->rng ^= gen->rng << 5;
+
+	return gen->rng;
+}
+
+static int gen_write(struct image_gen *gen, uint64_t address, const void *buffer, uint32_t bytes) {
+	const uint8_t *byte_buffer = buffer;
+	ssize_t ret;
+
+	while (bytes) {
+		if ((ret = pwrite(gen->fd, byte_buffer, bytes, (off_t) address)) <= 0)
+			return -1;
+
+		byte_buffer += ret;
+		address += (uint64_t) ret;
+		bytes -= (uint32_t) ret;
+	}
+
+	return 0;
+}
+
+static uint64_t cluster_address(struct image_gen *gen, uint32_t cluster) {
+	return gen->first_data_address + (uint64_t) (cluster - 2)*gen->cluster_size;
+}
+
+//Links clusters free clusters, returns the first one or 0 if there aren't enough
+static uint32_t alloc_chain(struct image_gen *gen, uint32_t clusters) {
+	uint32_t first = 0, last = 0, cluster, end = gen->params->clusters + 2;
+
+	if (clusters > gen->free_clusters)
+		return 0;
+
+	while (clusters--) {
+		if (gen->params->fragmentation && gen_random(gen)%100 < gen->params->fragmentation)
+			gen->next_cluster += 1 + gen_random(gen)%IMAGE_GEN_MAX_GAP;
+
+		for (cluster = gen->next_cluster < end ? gen->next_cluster : 2; gen->fat[cluster]!=CLUSTER_FREE;)
+			cluster = cluster + 1 < end ? cluster + 1 : 2;
+
+		gen->fat[cluster] = gen->params->type==FAT16 ? CLUSTER_EOC_MARK_16 : CLUSTER_EOC_MARK_32;
+		gen->free_clusters--;
+		gen->next_cluster = cluster + 1;
+
+		if (last)
+			gen->fat[last] = cluster;
+		else
+			first = cluster;
+		last = cluster;
+	}
+
+	return first;
+}
+
+//Writes bytes of data along the chain, or a fill pattern if data is NULL
+static int write_chain(struct image_gen *gen, uint32_t first_cluster, const uint8_t *data, uint32_t bytes) {
+	uint32_t cluster, chunk, i;
+
+	for (cluster = first_cluster; bytes; cluster = gen->fat[cluster]) {
+		chunk = bytes < gen->cluster_size ? bytes : gen->cluster_size;
+
+		if (data==NULL) {
+			for (i = 0; i < chunk; i++)
+				gen->cluster_buffer[i] = (uint8_t) (cluster + i);
+		} else {
+			memcpy(gen->cluster_buffer, data, chunk);
+			data += chunk;
+		}
+
+		if (gen_write(gen, cluster_address(gen, cluster), gen->cluster_buffer, chunk))
+			return -1;
+
+		bytes -= chunk;
+	}
+
+	return 0;
+}
+
+static void make_entry(struct fat_entry *entry, const char *name, uint8_t attr, uint32_t first_cluster, uint32_t size) {
+	memset(entry, 0, sizeof(*entry));
+	memcpy(entry->name.whole, name, FAT_ENTRY_WHOLE_NAME_SIZE);
+	entry->attr = attr;
+	entry->creation.date.years_from_1980 = 40;
+	entry->creation.date.month = 1;
+	entry->creation.date.day = 1;
+	entry->last_access_date = entry->creation.date;
+	entry->write.date = entry->creation.date;
+	entry->first_cluster_high = (uint16_t) (first_cluster >> 16);
+	entry->first_cluster_low = (uint16_t) first_cluster;
+	entry->file_size_bytes = size;
+}
+
+//f0000012-abcd...bin, len characters
+static void make_long_name(char *name, uint32_t file, uint32_t len) {
+	uint32_t i;
+
+	snprintf(name, 10, "f%07u-", file%10000000u);
+	for (i = 9; i < len - 4; i++)
+		name[i] = (char) ('a' + (i - 9)%26);
+	memcpy(name + len - 4, ".bin", 5);
+}
+
+//The long name entries of the file, last part first, as they precede its 8.3 entry. Returns their number
+static uint32_t make_long_entries(struct fat_entry *entries, const char *short_name, uint32_t file, uint32_t len) {
+	uint32_t parts = (len + LFN_CHARS_PER_ENTRY - 1)/LFN_CHARS_PER_ENTRY, part, i;
+	uint16_t chars[LFN_CHARS_PER_ENTRY];
+	struct fat_lfn_entry *lfn;
+	char name[256];
+
+	make_long_name(name, file, len);
+
+	for (part = 0; part < parts; part++) {
+		//A name not filling its last part ends with a 0x0000, then 0xFFFF padding
+		for (i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+			uint32_t at = part*LFN_CHARS_PER_ENTRY + i;
+
+			chars[i] = at < len ? (uint16_t) name[at] : at==len ? 0x0000u : 0xFFFFu;
+		}
+
+		lfn = (struct fat_lfn_entry *) &entries[parts - 1 - part];
+		memset(lfn, 0, sizeof(*lfn));
+		lfn->order = (uint8_t) ((part + 1) | (part + 1==parts ? LAST_LONG_ENTRY : 0));
+		lfn->attr = ATTR_LONG_NAME;
+		lfn->checksum = fat_lfn_checksum((const uint8_t *) short_name);
+		memcpy(lfn->name1, chars, sizeof(lfn->name1));
+		memcpy(lfn->name2, chars + 5, sizeof(lfn->name2));
+		memcpy(lfn->name3, chars + 11, sizeof(lfn->name3));
+	}
+
+	return parts;
+}
+
+static int write_boot(struct image_gen *gen) {
+	const struct image_gen_params *params = gen->params;
+	uint8_t sector[IMAGE_GEN_SECTOR_SIZE];
+	struct mbr_partition_entry partition;
+	struct fat_fs_info_hints hints;
+	struct fat_BPB bpb;
+	uint32_t value32, total_sectors;
+	uint16_t value16;
+
+	total_sectors = gen->reserved_sectors + IMAGE_GEN_NUMBER_OF_FATS*gen->fat_size_sectors + gen->root_dir_sectors +
+		params->clusters*params->sectors_per_cluster;
+
+	//MBR
+	memset(sector, 0, sizeof(sector));
+	memset(&partition, 0, sizeof(partition));
+	partition.type = params->type==FAT16 ? 0x06 : 0x0C;
+	partition.lba_begin = IMAGE_GEN_PARTITION_LBA;
+	partition.sectors = total_sectors;
+	memcpy(sector + 0x1BE, &partition, sizeof(partition));
+	value16 = MBR_BOOT_SIG;
+	memcpy(sector + 510, &value16, sizeof(value16));
+
+	if (gen_write(gen, 0, sector, sizeof(sector)))
+		return -1;
+
+	//Boot sector
+	memset(sector, 0, sizeof(sector));
+	memcpy(sector, "\xEB\x58\x90" "FATBENCH", 11);
+	memset(&bpb, 0, sizeof(bpb));
+	bpb.bytes_per_sector = IMAGE_GEN_SECTOR_SIZE;
+	bpb.sectors_per_cluster = (uint8_t) params->sectors_per_cluster;
+	bpb.reserved_sectors_count = (uint16_t) gen->reserved_sectors;
+	bpb.number_of_fats = IMAGE_GEN_NUMBER_OF_FATS;
+	bpb.unused1 = 0xF8;
+
+	//The volume serial comes from the seed too
+	value32 = params->seed*2654435761u;
+
+	if (params->type==FAT16) {
+		memcpy(sector + BPB16_BYTE_OFFSET__VOLUME_ID, &value32, 4);
+		bpb.root_entries_count = IMAGE_GEN_ROOT_ENTRIES_16;
+		bpb.fat_size_sectors_16 = (uint16_t) gen->fat_size_sectors;
+	} else {
+		memcpy(sector + BPB32_BYTE_OFFSET__VOLUME_ID, &value32, 4);
+		memcpy(sector + BPB32_BYTE_OFFEST__FAT_SIZE_SECTORS_32, &gen->fat_size_sectors, 4);
+		memcpy(sector + BPB32_BYTE_OFFEST__ROOT_CLUSTER_32, &gen->root_cluster, 4);
+		value16 = 1;
+		memcpy(sector + BPB32_BYTE_OFFEST__FS_INFO_SECTOR, &value16, 2);
+	}
+
+	if (total_sectors < 0x10000u)
+		bpb.total_sectors_16 = (uint16_t) total_sectors;
+	else
+		bpb.total_sectors_32 = total_sectors;
+
+	memcpy(sector + BPB_BYTE_OFFSET__FROM_PARTITION_BEGIN, &bpb, sizeof(bpb));
+	value16 = MBR_BOOT_SIG;
+	memcpy(sector + 510, &value16, sizeof(value16));
+
+	if (gen_write(gen, (uint64_t) IMAGE_GEN_PARTITION_LBA*IMAGE_GEN_SECTOR_SIZE, sector, sizeof(sector)))
+		return -1;
+
+	if (params->type==FAT16)
+		return 0;
+
+	//FSInfo
+	memset(sector, 0, sizeof(sector));
+	value32 = FS_INFO_LEAD_SIG;
+	memcpy(sector, &value32, 4);
+	hints.struct_sig = FS_INFO_STRUCT_SIG;
+	hints.free_count = gen->free_clusters;
+	hints.next_free = gen->next_cluster;
+	memcpy(sector + FS_INFO_BYTE_OFFSET__STRUCT_SIG, &hints, sizeof(hints));
+	value32 = 0xAA550000u;
+	memcpy(sector + 508, &value32, 4);
+
+	return gen_write(gen, (uint64_t) (IMAGE_GEN_PARTITION_LBA + 1)*IMAGE_GEN_SECTOR_SIZE, sector, sizeof(sector));
+}
+
+static int write_fats(struct image_gen *gen) {
+	uint32_t entries = gen->params->clusters + 2, i, k, fat_bytes;
+	uint8_t *fat;
+	uint16_t *fat16;
+	int ret = 0;
+
+	fat_bytes = gen->fat_size_sectors*IMAGE_GEN_SECTOR_SIZE;
+	if ((fat = calloc(1, fat_bytes))==NULL)
+		return -1;
+
+	if (gen->params->type==FAT16) {
+		fat16 = (uint16_t *) fat;
+		for (i = 0; i < entries; i++)
+			fat16[i] = (uint16_t) gen->fat[i];
+	} else {
+		memcpy(fat, gen->fat, entries*sizeof(uint32_t));
+	}
+
+	for (k = 0; k < IMAGE_GEN_NUMBER_OF_FATS && ret==0; k++)
+		ret = gen_write(gen, gen->first_fat_address + (uint64_t) k*fat_bytes, fat, fat_bytes);
+
+	free(fat);
+
+	return ret;
+}
+
+/*
+ * Allocates every directory right before its files, like a tool
+ * copying a tree would, then writes the entries.
+ */
+static int write_dirs(struct image_gen *gen) {
+	const struct image_gen_params *params = gen->params;
+	uint32_t dir_cluster, dir_clusters, file_clusters, dir, file, dir_bytes, entry, file_entries = 1;
+	struct fat_entry *root, *entries;
+	char name[IMAGE_GEN_PATH_SIZE];
+	int ret = -1;
+
+	root = calloc(params->dirs + 1, sizeof(struct fat_entry));
+	if (params->long_name_len)
+		file_entries += (params->long_name_len + LFN_CHARS_PER_ENTRY - 1)/LFN_CHARS_PER_ENTRY;
+	entries = calloc(params->files_per_dir*file_entries + 2, sizeof(struct fat_entry));
+	if (root==NULL || entries==NULL)
+		goto out;
+
+	if (params->type==FAT32 &&
+		(gen->root_cluster = alloc_chain(gen, (params->dirs*sizeof(struct fat_entry))/gen->cluster_size + 1))==0)
+		goto out;
+
+	dir_bytes = (params->files_per_dir*file_entries + 2)*sizeof(struct fat_entry);
+	dir_clusters = (dir_bytes + gen->cluster_size - 1)/gen->cluster_size;
+	file_clusters = (params->file_size + gen->cluster_size - 1)/gen->cluster_size;
+
+	for (dir = 0; dir < params->dirs; dir++) {
+		if ((dir_cluster = alloc_chain(gen, dir_clusters))==0)
+			goto out;
+
+		snprintf(name, sizeof(name), "DIR%05u   ", dir%100000u);
+		make_entry(&root[dir], name, ATTR_DIRECTORY, dir_cluster, 0);
+		make_entry(&entries[0], ".          ", ATTR_DIRECTORY, dir_cluster, 0);
+		make_entry(&entries[1], "..         ", ATTR_DIRECTORY, 0, 0);
+
+		for (file = 0, entry = 2; file < params->files_per_dir; file++) {
+			uint32_t first = 0;
+
+			if (file_clusters && ((first = alloc_chain(gen, file_clusters))==0 ||
+				write_chain(gen, first, NULL, params->file_size)))
+				goto out;
+
+			snprintf(name, sizeof(name), "F%07uBIN", file%10000000u);
+			if (params->long_name_len)
+				entry += make_long_entries(&entries[entry], name, file, params->long_name_len);
+			make_entry(&entries[entry++], name, ATTR_ARCHIVE, first, params->file_size);
+		}
+
+		if (write_chain(gen, dir_cluster, (const uint8_t *) entries, dir_bytes))
+			goto out;
+	}
+
+	//The entry after the last one is left zeroed: end of directory
+	if (params->type==FAT16)
+		ret = gen_write(gen, gen->root_dir_address, root, (params->dirs + 1)*sizeof(struct fat_entry));
+	else
+		ret = write_chain(gen, gen->root_cluster, (const uint8_t *) root, (params->dirs + 1)*sizeof(struct fat_entry));
+
+out:
+	free(root);
+	free(entries);
+
+	return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef IMAGE_GEN_H
+#define IMAGE_GEN_H
+
+#include <stdint.h>
+#include "fat.h"
+
+/*
+ * Synthetic disk images for the benchmark: an MBR with a single FAT16 or FAT32
+ * partition, dirs directories in the root, each with files_per_dir files of
+ * file_size bytes. The same params, seed included, always give the same image.
+ * fragmentation is the percentage of clusters allocated after a random gap
+ * instead of right after the previous one. With long_name_len the files also
+ * get a long name of that many characters, from 13 to 255.
+ * The image is sparse: only the metadata and the file data are written.
+ */
+struct image_gen_params {
+  enum fat_version type;
+  uint32_t sectors_per_cluster;
+  uint32_t clusters; //Data clusters, they must be in the range of type
+  uint32_t dirs;
+  uint32_t files_per_dir;
+  uint32_t file_size;
+  uint32_t fragmentation;
+  uint32_t seed;
+  uint32_t long_name_len; //0 for 8.3 names only
+};
+
+#define IMAGE_GEN_SECTOR_SIZE (512u)
+#define IMAGE_GEN_LONG_PATH_SIZE (288u) //For image_gen_long_file_path
+
+int image_gen_write(const char *path, const struct image_gen_params *params);
+void image_gen_dir_path(char *path, uint32_t dir);
+void image_gen_file_path(char *path, uint32_t dir, uint32_t file);
+void image_gen_long_file_path(char *path, uint32_t dir, uint32_t file, uint32_t long_name_len);
+
+#endif
@@ -1,21 +1,204 @@
+#include <pthread.h>
 #include <stdio.h>
+#include <time.h>
 #include "fat.h"
+#include "fat_cache.h"
+#include "fat_dir_cache.h"
+#include "fat_free_map.h"
+#include "fat_index.h"
+#include "fat_stream.h"
+#include "fat_utils.h"
 #include "reader.h"
 #define BUFFER_SIZE (16384 + 20)
+#define CACHE_SIZE (64*1024)
+#define DIR_CACHE_SIZE (16*1024)
+#define FAT_TABLE_SIZE (128*1024)
+#define FREE_MAP_SIZE (16*1024)
+#define DEFAULT_IMAGE "../image.img"
+#define WORKERS 4
+#define INDEX_SIZE (64*1024)
+#define STREAM_SIZE (2*1024*1024)
+#define MAX_PARTITIONS 8
 
-int main() {
+struct worker {
+  pthread_t thread;
+  fat_drive *drive;
+  const char *path;
+  uint32_t read_bytes;
+};
+
+static uint64_t monotonic_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void mutex_lock(void *lock_ctx) {
+	pthread_mutex_lock(lock_ctx);
+}
+
+static void mutex_unlock(void *lock_ctx) {
+	pthread_mutex_unlock(lock_ctx);
+}
+
+//Waiting on the condition of the index, its mutex being the lock of the index
+struct index_sync {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static void index_wait(void *wait_ctx) {
+	struct index_sync *sync = wait_ctx;
+
+	pthread_cond_wait(&sync->cond, &sync->mutex);
+}
+
+static void index_notify(void *wait_ctx) {
+	pthread_cond_broadcast(&((struct index_sync *) wait_ctx)->cond);
+}
+
+//Every worker has its own file handle and buffer, the drive is shared
+static void *worker_read(void *arg) {
+	struct worker *worker = arg;
+	uint8_t buffer[4096];
+	fat_file file;
+	uint32_t size;
+
+	worker->read_bytes = 0;
+	if (fat.file_open(worker->drive, worker->path, &file))
+		return NULL;
+
+	while ((size = fat.file_read(worker->drive, &file, buffer, sizeof(buffer))))
+		worker->read_bytes += size;
+
+	return NULL;
+}
+
+static uint32_t stream_read(void *ctx, void *buffer, uint32_t bytes) {
+	return (uint32_t) fread(buffer, 1, bytes, ctx);
+}
+
+//Just counts what would be written to the extracted files
+static int stream_data(void *ctx, uint32_t record, uint32_t offset, const void *data, uint32_t bytes) {
+	uint64_t *total = ctx;
+
+	(void) record;
+	(void) offset;
+	(void) data;
+	*total += bytes;
+
+	return 0;
+}
+
+struct volume {
+  pthread_t thread;
+  reader *image;
+  fat_cache *cache;
+  fat_partition partition;
+  int mounted;
+  uint32_t root_entries;
+};
+
+//Every partition is an independent drive, only the image and the sector cache are shared
+static void *worker_volume(void *arg) {
+	struct volume *volume = arg;
+	static _Thread_local uint8_t buffer[BUFFER_SIZE];
+	static _Thread_local fat_dir_entry entries[8];
+	fat_drive drive;
+	fat_dir dir;
+	fat_dir_iter iter;
+	int32_t count;
+
+	volume->mounted = 0;
+	volume->root_entries = 0;
+	if (fat.mount_partition(&drive, 512, &volume->partition, reader_read_bytes, volume->image) ||
+		fat.attach_cache(&drive, volume->cache))
+		return NULL;
+	volume->mounted = 1;
+
+	fat.dir_get_root(&dir);
+	if (fat.dir_iter_init(&drive, &dir, &iter, buffer, BUFFER_SIZE)==0)
+		while ((count = fat.dir_read(&drive, &iter, entries, 8)) > 0)
+			volume->root_entries += (uint32_t) count;
+
+	return NULL;
+}
+
+struct indexer {
+  pthread_t thread;
+  fat_drive *drive;
+  fat_index *index;
+};
+
+//Indexing workers share the index and read directories in their own buffer
+static void *worker_index(void *arg) {
+	struct indexer *indexer = arg;
+	static _Thread_local uint8_t buffer[BUFFER_SIZE];
+
+	fat_index_work(indexer->drive, indexer->index, buffer, BUFFER_SIZE);
+
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
 	FILE *f;
+	reader image;
 	uint32_t size;
 	fat_file file;
 	fat_drive drive;
 	uint8_t buffer[BUFFER_SIZE];
+	fat_cache cache;
+	static uint8_t cache_memory[CACHE_SIZE];
+	static uint32_t fat_table[FAT_TABLE_SIZE/sizeof(uint32_t)];
+	fat_dir_cache dir_cache;
+	static uint8_t dir_cache_memory[DIR_CACHE_SIZE];
+	static fat_stats stats, stats_copy;
+	fat_free_map free_map;
+	static uint8_t free_map_memory[FREE_MAP_SIZE];
+	uint32_t free_clusters;
+	static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER, dir_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-	if (fat.mount(&drive, 512, debug_read_bytes))
+	if (reader_open_mmap(&image, argc > 1 ? argv[1] : DEFAULT_IMAGE))
 		goto error;
 
+	if (fat.mount(&drive, 512, reader_read_bytes, &image))
+		goto error;
+	fat.attach_stats(&drive, &stats, monotonic_ns);
+
+	{ //Mount again from the saved geometry: only the volume serial is read
+		fat_geometry geometry;
+		fat_drive again;
+
+		fat.geometry_save(&drive, &geometry);
+		if (fat.mount_geometry(&again, &geometry, reader_read_bytes, &image)==0)
+			printf("Remounted volume %08X from its geometry\n", (unsigned) again.volume_serial);
+	}
+
+	if (fat_dir_cache_init(&dir_cache, dir_cache_memory, sizeof(dir_cache_memory)))
+		goto error;
+	fat_dir_cache_set_lock(&dir_cache, mutex_lock, mutex_unlock, &dir_cache_mutex);
+	fat.attach_dir_cache(&drive, &dir_cache);
+
+	fat.attach_map(&drive, reader_map_bytes);
+	fat.attach_prefetch(&drive, reader_prefetch);
+
+	if (fat.fat_table_size(&drive) <= sizeof(fat_table))
+		fat.attach_fat_table(&drive, fat_table, sizeof(fat_table));
+
+	if (fat_cache_init(&cache, cache_memory, sizeof(cache_memory), 512) || fat.attach_cache(&drive, &cache))
+		goto error;
+	fat_cache_set_lock(&cache, mutex_lock, mutex_unlock, &cache_mutex);
+
 	printf("Block size: %d Bytes\n", 1u << drive.log_bytes_per_sector);
 	printf("LBA begin: %d\n", drive.first_partition_sector);
 
+	if (fat.free_map_size(&drive) <= sizeof(free_map_memory))
+		fat.attach_free_map(&drive, &free_map, free_map_memory, sizeof(free_map_memory));
+
+	if (fat.free_clusters(&drive, &free_clusters)==0)
+		printf("Free: %llu Bytes\n", (unsigned long long) free_clusters*drive.cluster_size_bytes);
+
 	{ //Save hamlet.txt, incremental dir change
 		fat_dir cd;
 		fat.dir_get_root(&cd);
@@ -33,13 +216,15 @@ int main() {
 		fclose(f);
 	}
 
-	{ //Save 1.txt
+	{ //Save 1.txt, zero-copy
+		const void *data;
+
 		f = fopen("../1.txt", "wb");
 		if (fat.file_open(&drive, "/subdir/1.txt", &file))
 			goto error;
 
-		while ((size = fat.file_read(&drive, &file, buffer, BUFFER_SIZE)))
-			fwrite(buffer, size, 1, f);
+		while ((size = fat.file_map(&drive, &file, &data, UINT32_MAX)))
+			fwrite(data, size, 1, f);
 
 		fclose(f);
 	}
@@ -56,6 +241,184 @@ int main() {
 			printf("%.11s\n", entry.name);
 	}
 
+	{ //Batched listing, with the entries metadata
+		fat_dir dir;
+		fat_dir_iter iter;
+		static fat_dir_entry entries[8];
+		char long_name[FAT_LFN_MAX_NAME_BYTES];
+		int32_t i, count;
+
+		fat.dir_get_root(&dir);
+		fat.dir_change(&drive, &dir, "subdir");
+
+		if (fat.dir_iter_init(&drive, &dir, &iter, buffer, BUFFER_SIZE))
+			goto error;
+
+		while ((count = fat.dir_read(&drive, &iter, entries, 8)) > 0)
+			for (i = 0; i < count; i++) {
+				fat_lfn_name_to_utf8(entries[i].long_name, entries[i].long_name_len, long_name, sizeof(long_name));
+				printf("%.11s %c %u %s\n", entries[i].name, entries[i].attr & ATTR_DIRECTORY ? 'd' : 'f',
+					   entries[i].size_bytes, long_name);
+			}
+	}
+
+	{ //Lookup by long name, case insensitive
+		if (fat.file_open(&drive, "/hamlet, prince of DENMARK.txt", &file)==0)
+			printf("Long name lookup: %u Bytes\n", file.total_size_bytes);
+	}
+
+	{ //Entry info without opening the files, one path and then many
+		const char *paths[] = {"/subdir/1.txt", "/subdir/2.txt", "/subdir/missing.txt", "/hamlet.txt"};
+		fat_entry_info info, infos[4];
+		uint8_t found[4];
+		uint32_t i;
+
+		if (fat.stat(&drive, "/subdir/3.txt", &info)==0)
+			printf("Written %04u-%02u-%02u %02u:%02u:%02u, %u Bytes\n", info.write_time.year, info.write_time.month,
+				   info.write_time.day, info.write_time.hours, info.write_time.mins, info.write_time.secs,
+				   info.size_bytes);
+
+		printf("Found %u of 4\n", fat.stat_many(&drive, paths, 4, infos, found));
+		for (i = 0; i < 4; i++)
+			if (found[i])
+				printf("%s: mtime %lld\n", paths[i], (long long) fat_timestamp_to_unix(&infos[i].write_time));
+	}
+
+	{ //Concurrent reads of the same drive
+		struct worker workers[WORKERS];
+		int i;
+
+		for (i = 0; i < WORKERS; i++) {
+			workers[i].drive = &drive;
+			workers[i].path = i%2 ? "/subdir/1.txt" : "/hamlet.txt";
+			if (pthread_create(&workers[i].thread, NULL, worker_read, &workers[i]))
+				goto error;
+		}
+
+		for (i = 0; i < WORKERS; i++) {
+			pthread_join(workers[i].thread, NULL);
+			printf("Worker %d read %s: %u Bytes\n", i, workers[i].path, workers[i].read_bytes);
+		}
+	}
+
+	{ //Every partition mounted at once, sharing the sector cache
+		static struct volume volumes[MAX_PARTITIONS];
+		fat_partition partitions[MAX_PARTITIONS];
+		int32_t i, count;
+
+		count = fat.partitions(reader_read_bytes, &image, 512, partitions, MAX_PARTITIONS);
+
+		for (i = 0; i < count; i++) {
+			volumes[i].image = &image;
+			volumes[i].cache = &cache;
+			volumes[i].partition = partitions[i];
+			if (pthread_create(&volumes[i].thread, NULL, worker_volume, &volumes[i]))
+				goto error;
+		}
+
+		for (i = 0; i < count; i++) {
+			pthread_join(volumes[i].thread, NULL);
+			printf("Partition %d: type %02X, %u sectors from %u, %s, %u root entries\n", i,
+				   volumes[i].partition.type, volumes[i].partition.sectors, volumes[i].partition.first_sector,
+				   volumes[i].mounted ? "FAT" : "not FAT", volumes[i].root_entries);
+		}
+	}
+
+	{ //Index the whole volume with all the workers
+		static uint8_t index_memory[INDEX_SIZE];
+		static struct index_sync index_sync = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+		struct indexer indexers[WORKERS];
+		fat_index index;
+		char path[256];
+		uint32_t i;
+
+		if (fat_index_init(&index, index_memory, INDEX_SIZE))
+			goto error;
+		fat_index_set_lock(&index, mutex_lock, mutex_unlock, &index_sync.mutex);
+		fat_index_set_wait(&index, index_wait, index_notify, &index_sync);
+
+		for (i = 0; i < WORKERS; i++) {
+			indexers[i].drive = &drive;
+			indexers[i].index = &index;
+			if (pthread_create(&indexers[i].thread, NULL, worker_index, &indexers[i]))
+				goto error;
+		}
+
+		for (i = 0; i < WORKERS; i++)
+			pthread_join(indexers[i].thread, NULL);
+
+		for (i = 0; i < index.records_count; i++)
+			if (fat_index_path(&index, i, path, sizeof(path)))
+				printf("%c %10u %s\n", index.records[i].attr & ATTR_DIRECTORY ? 'd' : 'f',
+					   index.records[i].size_bytes, path);
+		printf("Indexed: %u entries%s\n", index.records_count, index.failed ? ", incomplete" : "");
+	}
+
+	{ //Extract reading the image once from the beginning, as it was a pipe
+		static uint8_t index_memory[INDEX_SIZE], stream_memory[STREAM_SIZE];
+		static fat_stream stream;
+		fat_index index;
+		uint64_t total = 0;
+		FILE *source;
+
+		if ((source = fopen(argc > 1 ? argv[1] : DEFAULT_IMAGE, "rb"))==NULL)
+			goto error;
+
+		if (fat_index_init(&index, index_memory, INDEX_SIZE) ||
+			fat_stream_init(&stream, stream_memory, STREAM_SIZE, &index) ||
+			fat_stream_extract(&stream, 512, stream_read, source, stream_data, &total)) {
+			fclose(source);
+			goto error;
+		}
+
+		fclose(source);
+		printf("Streamed: %u entries, %llu Bytes\n", index.records_count, (unsigned long long) total);
+	}
+
+	if (argc > 2) { //Write to a scratch image: create, append, truncate and delete a file
+		reader scratch;
+		fat_drive scratch_drive;
+		const char line[] = "Something is rotten in the state of Denmark.\n";
+		int i;
+
+		if (reader_open_rw(&scratch, argv[2]) || fat.mount(&scratch_drive, 512, reader_read_bytes, &scratch) ||
+			fat.attach_writer(&scratch_drive, reader_write_bytes))
+			goto error;
+
+		if (fat.file_create(&scratch_drive, "/subdir/log.txt", &file))
+			goto error;
+
+		for (i = 0; i < 1000; i++)
+			fat.file_write(&scratch_drive, &file, line, sizeof(line) - 1);
+		printf("Written: %u Bytes\n", file.total_size_bytes);
+
+		fat.file_truncate(&scratch_drive, &file, 100);
+		printf("Truncated: %u Bytes\n", file.total_size_bytes);
+
+		if (fat.file_delete(&scratch_drive, "/subdir/log.txt"))
+			goto error;
+
+		reader_close(&scratch);
+	}
+
+	if (fat.stats_get(&drive, &stats_copy)==0) {
+		const char *kinds[FAT_IO_KINDS] = {"reserved", "FAT", "dir", "data"};
+		int i;
+
+		for (i = 0; i < FAT_IO_KINDS; i++)
+			printf("Reads of %s: %llu, %llu Bytes\n", kinds[i], (unsigned long long) stats_copy.reads[i],
+				   (unsigned long long) stats_copy.read_bytes[i]);
+		printf("Sequential reads: %llu, chain steps: %llu\n", (unsigned long long) stats_copy.sequential_reads,
+			   (unsigned long long) stats_copy.chain_steps);
+		printf("Cache hits: %llu, misses: %llu\n", (unsigned long long) stats_copy.cache_hits,
+			   (unsigned long long) stats_copy.cache_misses);
+		printf("Dir cache hits: %llu, misses: %llu\n", (unsigned long long) stats_copy.dir_cache_hits,
+			   (unsigned long long) stats_copy.dir_cache_misses);
+		printf("file_open: %llu calls, %llu ns max\n", (unsigned long long) stats_copy.api[FAT_API_FILE_OPEN].calls,
+			   (unsigned long long) stats_copy.api[FAT_API_FILE_OPEN].max_ns);
+	}
+
+	reader_close(&image);
 
 	return 0;
 
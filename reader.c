@@ -1,19 +1,156 @@
-#include <stdint.h>
-#include <stdio.h>
+#define _XOPEN_SOURCE 700
+#include "reader.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-//#define IMAGE "/mnt/tmp/king4.img"
-#define IMAGE "../image.img"
+//Private functions
+static int open_image(reader *r, const char *path, int flags);
 
-void *debug_read_bytes(uint64_t address, uint32_t bytes, void *buffer) {
-	FILE *f;
+int reader_open(reader *r, const char *path) {
+	return open_image(r, path, O_RDONLY);
+}
 
-	if ((f = fopen(IMAGE, "rb"))==NULL)
-		return NULL;
+int reader_open_rw(reader *r, const char *path) {
+	return open_image(r, path, O_RDWR);
+}
 
-	fseek(f, address, SEEK_SET);
-	if (fread(buffer, bytes, 1, f)!=1)
-		return NULL;
-	fclose(f);
+static int open_image(reader *r, const char *path, int flags) {
+	struct stat st;
+
+	r->map = NULL;
+
+	if ((r->fd = open(path, flags))==-1)
+		goto error;
+
+	if (fstat(r->fd, &st)==-1)
+		goto error_close;
+
+	r->size_bytes = (uint64_t) st.st_size;
+
+	return 0;
+
+error_close:
+	close(r->fd);
+	r->fd = -1;
+error:
+	return -1;
+}
+
+int reader_open_mmap(reader *r, const char *path) {
+	void *map;
+
+	if (reader_open(r, path))
+		goto error;
+
+	if (r->size_bytes==0 || r->size_bytes!=(size_t) r->size_bytes)
+		goto error_close;
+
+	map = mmap(NULL, (size_t) r->size_bytes, PROT_READ, MAP_SHARED, r->fd, 0);
+	if (map==MAP_FAILED)
+		goto error_close;
+
+	r->map = map;
+
+	return 0;
+
+error_close:
+	reader_close(r);
+error:
+	return -1;
+}
+
+void reader_close(reader *r) {
+	if (r->map!=NULL)
+		munmap((void *) r->map, (size_t) r->size_bytes);
+
+	r->map = NULL;
+
+	if (r->fd!=-1)
+		close(r->fd);
+
+	r->fd = -1;
+}
+
+void *reader_read_bytes(void *ctx, uint64_t address, uint32_t bytes, void *buffer) {
+	reader *r = ctx;
+	uint8_t *byte_buffer = buffer;
+	ssize_t ret;
+
+	if (r->map!=NULL) {
+		if (address > r->size_bytes || bytes > r->size_bytes - address)
+			return NULL;
+
+		memcpy(buffer, r->map + address, bytes);
+		return buffer;
+	}
+
+	//pread can return less than requested: loop until everything has been read
+	while (bytes) {
+		ret = pread(r->fd, byte_buffer, bytes, (off_t) address);
+
+		if (ret==-1 && errno==EINTR)
+			continue;
+
+		if (ret <= 0) //Error or past the end of the image
+			return NULL;
+
+		byte_buffer += ret;
+		address += (uint64_t) ret;
+		bytes -= (uint32_t) ret;
+	}
 
 	return buffer;
 }
+
+int reader_write_bytes(void *ctx, uint64_t address, uint32_t bytes, const void *buffer) {
+	reader *r = ctx;
+	const uint8_t *byte_buffer = buffer;
+	ssize_t ret;
+
+	while (bytes) {
+		ret = pwrite(r->fd, byte_buffer, bytes, (off_t) address);
+
+		if (ret==-1 && errno==EINTR)
+			continue;
+
+		if (ret <= 0)
+			return -1;
+
+		byte_buffer += ret;
+		address += (uint64_t) ret;
+		bytes -= (uint32_t) ret;
+	}
+
+	return 0;
+}
+
+const void *reader_map_bytes(void *ctx, uint64_t address, uint32_t bytes) {
+	reader *r = ctx;
+
+	if (r->map==NULL || address > r->size_bytes || bytes > r->size_bytes - address)
+		return NULL;
+
+	return r->map + address;
+}
+
+void reader_prefetch(void *ctx, uint64_t address, uint32_t bytes) {
+	reader *r = ctx;
+	uintptr_t page_mask = (uintptr_t) sysconf(_SC_PAGESIZE) - 1;
+	uintptr_t begin;
+
+	if (address > r->size_bytes)
+		return;
+	if (bytes > r->size_bytes - address)
+		bytes = (uint32_t) (r->size_bytes - address);
+
+	if (r->map!=NULL) { //madvise wants a page aligned address
+		begin = (uintptr_t) (r->map + address) & ~page_mask;
+		posix_madvise((void *) begin, (uintptr_t) (r->map + address + bytes) - begin, POSIX_MADV_WILLNEED);
+	} else {
+		posix_fadvise(r->fd, (off_t) address, (off_t) bytes, POSIX_FADV_WILLNEED);
+	}
+}
@@ -3,6 +3,27 @@
 
 #include <stdint.h>
 
-void *debug_read_bytes(uint64_t address, uint32_t bytes, void *buffer);
+/*
+ * Disk image backend: the file descriptor is kept open for the whole life
+ * of the reader, reads are positional so several drives can share it.
+ * If the image is opened with reader_open_mmap it is also mapped in memory,
+ * reads become copies and reader_map_bytes can hand out pointers into it.
+ * reader_prefetch asks the kernel to start reading ahead, without waiting for it.
+ * reader_write_bytes needs the image to be opened with reader_open_rw.
+ */
+typedef struct {
+  int fd;
+  uint64_t size_bytes;
+  const uint8_t *map; //NULL if not mapped
+} reader;
+
+int reader_open(reader *r, const char *path);
+int reader_open_mmap(reader *r, const char *path);
+int reader_open_rw(reader *r, const char *path);
+void reader_close(reader *r);
+void *reader_read_bytes(void *ctx, uint64_t address, uint32_t bytes, void *buffer);
+int reader_write_bytes(void *ctx, uint64_t address, uint32_t bytes, const void *buffer);
+const void *reader_map_bytes(void *ctx, uint64_t address, uint32_t bytes);
+void reader_prefetch(void *ctx, uint64_t address, uint32_t bytes);
 
 #endif
@@ -0,0 +1,22 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+/*
+ * Minimal checks for the regression tests: a failed check is reported
+ * and counted, the test goes on and main returns TEST_RESULT.
+ */
+
+static int test_failures;
+
+#define TEST_CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			test_failures++; \
+		} \
+	} while (0)
+
+#define TEST_RESULT (test_failures ? 1 : 0)
+
+#endif
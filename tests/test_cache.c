@@ -0,0 +1,121 @@
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include "../fat_cache.h"
+#include "../image_gen.h"
+#include "../reader.h"
+#include "test.h"
+
+/*
+ * Threads read random ranges of an image through a cache with fewer slots
+ * than threads, while another one keeps invalidating it: the device reads
+ * run unlocked, every range must still match the image.
+ */
+
+#define IMAGE "test_cache.img"
+#define THREADS (8)
+#define SLOTS (4)
+#define READS (20000)
+#define MAX_READ (1500)
+
+static const struct image_gen_params params = {FAT16, 4, 8000, 4, 32, 9000, 0, 1, 0};
+
+static reader image;
+static fat_cache cache;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int done;
+static int mismatches;
+
+static void lock(void *ctx) {
+	pthread_mutex_lock(ctx);
+}
+
+static void unlock(void *ctx) {
+	pthread_mutex_unlock(ctx);
+}
+
+//Gives the other threads the time to find the sector being loaded
+static void *slow_read_bytes(void *ctx, uint64_t address, uint32_t bytes, void *buffer) {
+	sched_yield();
+
+	return reader_read_bytes(ctx, address, bytes, buffer);
+}
+
+static void *reader_thread(void *arg) {
+	uint8_t cached[MAX_READ], direct[MAX_READ];
+	uint32_t state = (uint32_t) (uintptr_t) arg, i, bytes;
+	uint64_t address;
+	int bad = 0;
+
+	for (i = 0; i < READS; i++) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+
+		//A few sectors only, so the threads meet on them
+		address = 2048*IMAGE_GEN_SECTOR_SIZE + state%(16*IMAGE_GEN_SECTOR_SIZE);
+		bytes = 1 + (state >> 8)%MAX_READ;
+
+		if (fat_cache_read(&cache, slow_read_bytes, &image, address, bytes, cached)==NULL ||
+			reader_read_bytes(&image, address, bytes, direct)==NULL || memcmp(cached, direct, bytes))
+			bad++;
+	}
+
+	lock(&mutex);
+	mismatches += bad;
+	unlock(&mutex);
+
+	return NULL;
+}
+
+static void *invalidate_thread(void *arg) {
+	int stop = 0;
+
+	(void) arg;
+
+	while (!stop) {
+		fat_cache_invalidate(&cache);
+		usleep(100);
+
+		lock(&mutex);
+		stop = done;
+		unlock(&mutex);
+	}
+
+	return NULL;
+}
+
+int main(void) {
+	static uint8_t memory[SLOTS*(IMAGE_GEN_SECTOR_SIZE + sizeof(struct fat_cache_slot) + sizeof(uint32_t)) + 8];
+	pthread_t threads[THREADS], invalidator;
+	uint64_t hits, misses;
+	uintptr_t i;
+
+	if (image_gen_write(IMAGE, &params) || reader_open(&image, IMAGE)) {
+		fprintf(stderr, "Cannot create %s\n", IMAGE);
+		return 1;
+	}
+
+	TEST_CHECK(fat_cache_init(&cache, memory, sizeof(memory), IMAGE_GEN_SECTOR_SIZE)==0);
+	fat_cache_set_lock(&cache, lock, unlock, &mutex);
+
+	pthread_create(&invalidator, NULL, invalidate_thread, NULL);
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&threads[i], NULL, reader_thread, (void *) (i + 1));
+	for (i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+	lock(&mutex);
+	done = 1;
+	unlock(&mutex);
+	pthread_join(invalidator, NULL);
+
+	fat_cache_get_stats(&cache, &hits, &misses);
+	TEST_CHECK(mismatches==0);
+	TEST_CHECK(hits > 0 && misses > 0);
+
+	reader_close(&image);
+	unlink(IMAGE);
+
+	return TEST_RESULT;
+}
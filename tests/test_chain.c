@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../fat_types.h"
+#include "test.h"
+#include "test_image.h"
+
+/*
+ * Reads files of images made by image_gen, of each FAT type built, whose chains were made
+ * to leave the volume behind the back of the drive: to a cluster past its end, which the
+ * device still has, and to a bad cluster. With and without the FAT table attached, reading
+ * stops at the break, never giving bytes from past the volume, and seeking past the break
+ * or building the extents of the file fails.
+ */
+
+#define IMAGE "test_chain.img"
+#define FILE_SIZE (100*1024u) //200 clusters
+#define CLUSTER_SIZE (512u)
+#define BROKEN_AFTER (4) //Clusters read before the break
+#define OUTSIDE_CLUSTERS (64)
+#define OUTSIDE_BYTE (0xA5)
+#define EXTENTS (16)
+
+static uint8_t expected[2][FILE_SIZE], data[FILE_SIZE];
+
+static void check_broken(fat_drive *drive, uint32_t file_index) {
+	fat_extent extents[EXTENTS];
+	char path[32];
+	fat_file file;
+
+	image_gen_file_path(path, 0, file_index);
+
+	memset(data, 0, sizeof(data));
+	TEST_CHECK(fat.file_open(drive, path, &file)==0);
+	TEST_CHECK(fat.file_read(drive, &file, data, FILE_SIZE)==BROKEN_AFTER*CLUSTER_SIZE);
+	TEST_CHECK(memcmp(data, expected[file_index], BROKEN_AFTER*CLUSTER_SIZE)==0);
+	TEST_CHECK(data[BROKEN_AFTER*CLUSTER_SIZE]==0 && fat.file_read(drive, &file, data, FILE_SIZE)==0);
+
+	TEST_CHECK(fat.file_open(drive, path, &file)==0);
+	TEST_CHECK(fat.file_seek(drive, &file, BROKEN_AFTER*CLUSTER_SIZE - 1)==0);
+	TEST_CHECK(fat.file_open(drive, path, &file)==0);
+	TEST_CHECK(fat.file_seek(drive, &file, 10*CLUSTER_SIZE)!=0);
+
+	TEST_CHECK(fat.file_open(drive, path, &file)==0);
+	TEST_CHECK(fat.file_build_extents(drive, &file, extents, EXTENTS)!=0);
+}
+
+static void test_type(enum fat_version type) {
+	struct image_gen_params params = {type, 1, type==FAT16 ? 4200 : 65600, 1, 4, FILE_SIZE, 0, 1, 0};
+	uint32_t bad = type==FAT16 ? 0xFFF7 : 0x0FFFFFF7, i;
+	static uint8_t outside[OUTSIDE_CLUSTERS*CLUSTER_SIZE];
+	struct test_device device;
+	fat_drive drive;
+	uint64_t volume_end;
+	uint8_t *table;
+	char path[32];
+	fat_file file;
+
+	if (test_device_create(&device, IMAGE, &params) || test_mount(&drive, &device)) {
+		TEST_CHECK(!"image");
+		return;
+	}
+
+	//The device goes on past the volume, with bytes no file has
+	volume_end = (uint64_t) (drive.first_data_sector + (drive.clusters_count << drive.log_sectors_per_cluster)) <<
+		drive.log_bytes_per_sector;
+	memset(outside, OUTSIDE_BYTE, sizeof(outside));
+	TEST_CHECK(reader_write_bytes(&device.image, volume_end, sizeof(outside), outside)==0);
+
+	for (i = 0; i < 2; i++) {
+		image_gen_file_path(path, 0, i);
+		TEST_CHECK(fat.file_open(&drive, path, &file)==0 && fat.file_read(&drive, &file, expected[i], FILE_SIZE)==FILE_SIZE);
+		test_set_link(&drive, &device, file.first_cluster + BROKEN_AFTER - 1, i==0 ? drive.clusters_count + 10 : bad);
+	}
+
+	//A new mount, with nothing of the chains cached
+	TEST_CHECK(test_mount(&drive, &device)==0);
+	check_broken(&drive, 0);
+	check_broken(&drive, 1);
+
+	table = malloc(fat.fat_table_size(&drive));
+	TEST_CHECK(table!=NULL && test_mount(&drive, &device)==0 &&
+			   fat.attach_fat_table(&drive, table, fat.fat_table_size(&drive))==0);
+	check_broken(&drive, 0);
+	check_broken(&drive, 1);
+	free(table);
+
+	reader_close(&device.image);
+}
+
+int main(void) {
+	enum fat_version types[] = {FAT16, FAT32};
+	uint32_t i;
+
+	for (i = 0; i < sizeof(types)/sizeof(types[0]); i++)
+		if (types[i]==FAT16 ? FAT_HAS_FAT16 : FAT_HAS_FAT32)
+			test_type(types[i]);
+
+	unlink(IMAGE);
+
+	return TEST_RESULT;
+}
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../fat_index.h"
+#include "../fat_types.h"
+#include "test.h"
+#include "test_image.h"
+
+/*
+ * Checks images made by image_gen, of each FAT type built: a clean one, a fragmented one,
+ * and ones where the FAT was changed behind the back of the drive to give a loop, chains
+ * leaving the volume or reaching a free cluster, a short chain, a cross link and lost
+ * clusters. Every problem is found where it was made, and the whole FAT is read once,
+ * counted in the drive stats.
+ */
+
+#define IMAGE "test_check.img"
+#define FILE_SIZE (100*1024u) //200 clusters
+#define FILE_CLUSTERS (200)
+#define DIRS (2)
+#define FILES_PER_DIR (4)
+#define INDEX_SIZE (1024*1024u)
+
+static fat_check_issue seen[FAT_CHECK_LOST_CHAIN + 1]; //The last one of each problem
+static uint32_t seen_count[FAT_CHECK_LOST_CHAIN + 1];
+
+static int collect(void *ctx, const fat_check_issue *issue) {
+	(void) ctx;
+
+	seen[issue->problem] = *issue;
+	seen_count[issue->problem]++;
+
+	return 0;
+}
+
+static void check(fat_drive *drive, uint32_t threshold, fat_check_report *report) {
+	static uint8_t index_memory[INDEX_SIZE], buffer[64*1024];
+	uint32_t memory_size = fat_check_memory_size(drive), entry_size = drive->type==FAT16 ? 2 : 4;
+	uint8_t *memory = malloc(memory_size);
+	fat_index index;
+	fat_stats stats;
+
+	memset(seen, 0, sizeof(seen));
+	memset(seen_count, 0, sizeof(seen_count));
+
+	TEST_CHECK(memory!=NULL && fat_index_init(&index, index_memory, sizeof(index_memory))==0 &&
+			   fat_index_work(drive, &index, buffer, sizeof(buffer))==0);
+
+	fat.attach_stats(drive, &stats, NULL);
+	TEST_CHECK(fat_check_run(drive, &index, memory, memory_size, threshold, report, collect, NULL)==0);
+	TEST_CHECK(fat.stats_get(drive, &stats)==0);
+	TEST_CHECK(stats.reads[FAT_IO_FAT]==1 && stats.read_bytes[FAT_IO_FAT]==(drive->clusters_count + 2)*entry_size);
+	fat.attach_stats(drive, NULL, NULL);
+
+	TEST_CHECK(report->files==DIRS*FILES_PER_DIR && report->dirs==DIRS);
+	TEST_CHECK(report->used_clusters + report->free_clusters + report->bad_clusters==drive->clusters_count);
+	TEST_CHECK(seen_count[FAT_CHECK_CROSS_LINKED]==report->cross_linked &&
+			   seen_count[FAT_CHECK_BROKEN_CHAIN]==report->broken_chains &&
+			   seen_count[FAT_CHECK_LOOP]==report->loops &&
+			   seen_count[FAT_CHECK_SIZE_MISMATCH]==report->size_mismatches &&
+			   seen_count[FAT_CHECK_LOST_CHAIN]==report->lost_chains &&
+			   seen_count[FAT_CHECK_FRAGMENTED]==(threshold ? report->fragmented_files : 0));
+
+	free(memory);
+}
+
+static int problems(const fat_check_report *report) {
+	return (report->cross_linked + report->broken_chains + report->loops + report->size_mismatches +
+		report->lost_chains + report->lost_clusters)!=0;
+}
+
+static int open_image(enum fat_version type, uint32_t fragmentation, struct test_device *device, fat_drive *drive) {
+	struct image_gen_params params = {type, 1, type==FAT16 ? 4200 : 65600, DIRS, FILES_PER_DIR, FILE_SIZE,
+									  fragmentation, 1, 0};
+
+	if (test_device_create(device, IMAGE, &params) || test_mount(drive, device)) {
+		TEST_CHECK(!"image");
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint32_t first_cluster(fat_drive *drive, uint32_t file) {
+	char path[32];
+	fat_file found;
+
+	image_gen_file_path(path, 0, file);
+	TEST_CHECK(fat.file_open(drive, path, &found)==0);
+
+	return found.first_cluster;
+}
+
+static void test_clean(enum fat_version type) {
+	struct test_device device;
+	fat_check_report report;
+	fat_drive drive;
+
+	if (open_image(type, 0, &device, &drive))
+		return;
+
+	check(&drive, 2, &report);
+	TEST_CHECK(!problems(&report) && report.fragmented_files==0);
+	TEST_CHECK(report.fragments==DIRS*FILES_PER_DIR && report.free_clusters > 0 && report.bad_clusters==0);
+	reader_close(&device.image);
+
+	if (open_image(type, 30, &device, &drive))
+		return;
+
+	check(&drive, 2, &report);
+	TEST_CHECK(!problems(&report) && report.fragmented_files > 0 && report.max_fragments > 1);
+	reader_close(&device.image);
+}
+
+static void test_problems(enum fat_version type) {
+	uint32_t eoc = type==FAT16 ? CLUSTER_EOC_MARK_16 : CLUSTER_EOC_MARK_32, first;
+	struct test_device device;
+	fat_check_report report;
+	fat_drive drive;
+
+	//Loop: the 10th cluster goes back to the 3rd, what followed is lost
+	if (open_image(type, 0, &device, &drive))
+		return;
+	first = first_cluster(&drive, 0);
+	test_set_link(&drive, &device, first + 9, first + 2);
+	check(&drive, 0, &report);
+	TEST_CHECK(report.loops==1 && seen[FAT_CHECK_LOOP].cluster==first + 2 && seen[FAT_CHECK_LOOP].count==10);
+	TEST_CHECK(report.lost_chains==1 && report.lost_clusters==FILE_CLUSTERS - 10 &&
+			   seen[FAT_CHECK_LOST_CHAIN].cluster==first + 10);
+	TEST_CHECK(report.cross_linked==0 && report.broken_chains==0 && report.size_mismatches==0);
+	reader_close(&device.image);
+
+	//Leaving the volume, and reaching its free last cluster
+	if (open_image(type, 0, &device, &drive))
+		return;
+	first = first_cluster(&drive, 0);
+	test_set_link(&drive, &device, first + 3, drive.clusters_count + 10);
+	first = first_cluster(&drive, 1);
+	test_set_link(&drive, &device, first + 3, drive.clusters_count + 1);
+	check(&drive, 0, &report);
+	TEST_CHECK(report.broken_chains==2 && seen[FAT_CHECK_BROKEN_CHAIN].cluster==drive.clusters_count + 1 &&
+			   seen[FAT_CHECK_BROKEN_CHAIN].count==4);
+	TEST_CHECK(report.lost_chains==2 && report.lost_clusters==2*(FILE_CLUSTERS - 4));
+	TEST_CHECK(report.loops==0 && report.cross_linked==0 && report.size_mismatches==0);
+	reader_close(&device.image);
+
+	//Short chain: 10 clusters, the size needs 200
+	if (open_image(type, 0, &device, &drive))
+		return;
+	first = first_cluster(&drive, 0);
+	test_set_link(&drive, &device, first + 9, eoc);
+	check(&drive, 0, &report);
+	TEST_CHECK(report.size_mismatches==1 && seen[FAT_CHECK_SIZE_MISMATCH].count==10);
+	TEST_CHECK(report.lost_chains==1 && report.lost_clusters==FILE_CLUSTERS - 10);
+	TEST_CHECK(report.loops==0 && report.cross_linked==0 && report.broken_chains==0);
+	reader_close(&device.image);
+
+	//Cross link: the end of a file runs into the next one
+	if (open_image(type, 0, &device, &drive))
+		return;
+	first = first_cluster(&drive, 2);
+	test_set_link(&drive, &device, first_cluster(&drive, 1) + FILE_CLUSTERS - 1, first);
+	check(&drive, 0, &report);
+	TEST_CHECK(report.cross_linked==1 && seen[FAT_CHECK_CROSS_LINKED].cluster==first);
+	TEST_CHECK(report.lost_clusters==0 && report.loops==0 && report.broken_chains==0);
+	reader_close(&device.image);
+
+	//Lost: a single cluster, and a loop of two which only counts as clusters
+	if (open_image(type, 0, &device, &drive))
+		return;
+	test_set_link(&drive, &device, drive.clusters_count + 1, eoc);
+	test_set_link(&drive, &device, drive.clusters_count, drive.clusters_count - 1);
+	test_set_link(&drive, &device, drive.clusters_count - 1, drive.clusters_count);
+	check(&drive, 0, &report);
+	TEST_CHECK(report.lost_chains==1 && report.lost_clusters==3 &&
+			   seen[FAT_CHECK_LOST_CHAIN].cluster==drive.clusters_count + 1 && seen[FAT_CHECK_LOST_CHAIN].count==1);
+	TEST_CHECK(report.cross_linked==0 && report.loops==0 && report.broken_chains==0 && report.size_mismatches==0);
+	reader_close(&device.image);
+}
+
+int main(void) {
+	enum fat_version types[] = {FAT16, FAT32};
+	uint32_t i;
+
+	for (i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+		if (types[i]==FAT16 ? !FAT_HAS_FAT16 : !FAT_HAS_FAT32)
+			continue;
+
+		test_clean(types[i]);
+		test_problems(types[i]);
+	}
+
+	unlink(IMAGE);
+
+	return TEST_RESULT;
+}
@@ -0,0 +1,237 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../fat_utils.h"
+
+/*
+ * The dir cache is built with only 2 bits of the long name and path hashes,
+ * so most lookups meet other names with the same key and have to tell them
+ * apart by the names themselves. A path hash is never 0, which marks unused slots.
+ */
+#define fat_lfn_name_hash(name, len) (fat_lfn_name_hash(name, len) & 0x3u)
+#define fat_path_hash(path, len) ((fat_path_hash(path, len) & 0x3u) + 1)
+#include "../fat_dir_cache.c"
+#undef fat_lfn_name_hash
+#undef fat_path_hash
+
+#include "../fat.h"
+#include "../image_gen.h"
+#include "../reader.h"
+#include "test.h"
+
+/*
+ * Opens every file of an image by its long name, its 8.3 name and a near miss,
+ * directory after directory, on a drive with a dir cache and on one without,
+ * with the cache large enough for every directory, for about one and for none.
+ * Then creates, grows and deletes a file through the cached drive.
+ * With a locked cache: threads doing the same lookups never read the device holding
+ * the lock, and a directory changed while it's loading is not indexed.
+ */
+
+#define IMAGE "test_dir_cache.img"
+#define DIRS (6)
+#define FILES_PER_DIR (40)
+#define LONG_NAME_LEN (40) //3 long name entries and the 8.3 one: with 512 byte clusters some span two clusters
+#define ROUNDS (2)
+#define THREADS (4)
+
+//FAT32 unless the library is built for FAT16 only
+static const struct image_gen_params params = {FAT_HAS_FAT32 ? FAT32 : FAT16, 1, FAT_HAS_FAT32 ? 70000 : 60000, DIRS,
+											   FILES_PER_DIR, 600, 0, 1, LONG_NAME_LEN};
+
+static void check_open(fat_drive *cached, fat_drive *plain, const char *path) {
+	fat_file cached_file, plain_file;
+	int ret = fat.file_open(plain, path, &plain_file);
+
+	TEST_CHECK(fat.file_open(cached, path, &cached_file)==ret);
+	if (ret==0)
+		TEST_CHECK(cached_file.first_cluster==plain_file.first_cluster &&
+				   cached_file.total_size_bytes==plain_file.total_size_bytes &&
+				   cached_file.entry_address==plain_file.entry_address);
+}
+
+static void check_lookups(fat_drive *cached, fat_drive *plain) {
+	char path[IMAGE_GEN_LONG_PATH_SIZE];
+	uint32_t round, file, dir, i;
+
+	//Moving to another directory at every lookup
+	for (round = 0; round < ROUNDS; round++) {
+		for (file = 0; file < FILES_PER_DIR; file++) {
+			for (dir = 0; dir < DIRS; dir++) {
+				image_gen_long_file_path(path, dir, file, LONG_NAME_LEN);
+				check_open(cached, plain, path);
+
+				for (i = 0; path[i]!='\0'; i++)
+					path[i] = fat_ascii_to_upper(path[i]);
+				check_open(cached, plain, path);
+
+				path[strlen(path) - 1] = 'X';
+				check_open(cached, plain, path);
+
+				image_gen_file_path(path, dir, file);
+				check_open(cached, plain, path);
+			}
+		}
+	}
+}
+
+static void check_writes(fat_drive *cached, fat_drive *plain) {
+	static const char path[] = "/DIR00002/NEW.TXT";
+	static uint8_t data[1500];
+	fat_file file;
+
+	TEST_CHECK(fat.file_create(cached, path, &file)==0);
+	check_open(cached, plain, path);
+
+	TEST_CHECK(fat.file_write(cached, &file, data, sizeof(data))==sizeof(data));
+	check_open(cached, plain, path);
+	TEST_CHECK(fat.file_open(cached, path, &file)==0 && file.total_size_bytes==sizeof(data));
+
+	TEST_CHECK(fat.file_delete(cached, path)==0);
+	check_open(cached, plain, path);
+	TEST_CHECK(fat.file_open(cached, path, &file)!=0);
+}
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local int holding;
+static uint32_t locked_reads;
+
+//A directory invalidated at the next device read, as a writer running meanwhile would
+static fat_dir_cache *invalidate_cache;
+static uint32_t invalidate_cluster;
+
+static void lock(void *ctx) {
+	pthread_mutex_lock(ctx);
+	holding = 1;
+}
+
+static void unlock(void *ctx) {
+	holding = 0;
+	pthread_mutex_unlock(ctx);
+}
+
+static void *checked_read_bytes(void *ctx, uint64_t address, uint32_t bytes, void *buffer) {
+	fat_dir_cache *cache = invalidate_cache;
+
+	if (holding)
+		__atomic_add_fetch(&locked_reads, 1, __ATOMIC_RELAXED);
+
+	//Holding the lock a writer would wait for it: the check above already failed
+	if (cache!=NULL && !holding) {
+		invalidate_cache = NULL;
+		fat_dir_cache_lock(cache);
+		fat_dir_cache_invalidate_dir(cache, invalidate_cluster);
+		fat_dir_cache_unlock(cache);
+	}
+
+	return reader_read_bytes(ctx, address, bytes, buffer);
+}
+
+struct lookups {
+  fat_drive *cached;
+  fat_drive *plain;
+};
+
+static void *lookups_thread(void *arg) {
+	struct lookups *lookups = arg;
+
+	check_lookups(lookups->cached, lookups->plain);
+
+	return NULL;
+}
+
+static uint8_t dir_state(fat_dir_cache *dir_cache, uint32_t cluster) {
+	uint32_t i;
+
+	for (i = 0; i < FAT_DIR_CACHE_DIRS; i++)
+		if (dir_cache->dirs[i].state!=FAT_DIR_CACHE_FREE && dir_cache->dirs[i].cluster==cluster)
+			return dir_cache->dirs[i].state;
+
+	return FAT_DIR_CACHE_FREE;
+}
+
+static void run_locked(reader *image) {
+	static uint8_t memory[128*1024];
+	char path[IMAGE_GEN_LONG_PATH_SIZE];
+	struct lookups lookups;
+	fat_dir_cache dir_cache;
+	fat_drive cached, plain;
+	pthread_t threads[THREADS];
+	fat_file file;
+	uint32_t i;
+
+	if (fat.mount(&cached, IMAGE_GEN_SECTOR_SIZE, checked_read_bytes, image) ||
+		fat.mount(&plain, IMAGE_GEN_SECTOR_SIZE, reader_read_bytes, image) ||
+		fat_dir_cache_init(&dir_cache, memory, sizeof(memory))) {
+		TEST_CHECK(!"mount");
+		return;
+	}
+	fat_dir_cache_set_lock(&dir_cache, lock, unlock, &mutex);
+	fat.attach_dir_cache(&cached, &dir_cache);
+
+	lookups.cached = &cached;
+	lookups.plain = &plain;
+	for (i = 0; i < THREADS; i++)
+		TEST_CHECK(pthread_create(&threads[i], NULL, lookups_thread, &lookups)==0);
+	for (i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	TEST_CHECK(locked_reads==0 && dir_cache.hits > 0);
+
+	//Invalidated while loading: found, but left to be indexed again
+	fat_dir_cache_invalidate(&dir_cache);
+	image_gen_long_file_path(path, 0, 0, LONG_NAME_LEN);
+	check_open(&cached, &plain, path);
+	image_gen_long_file_path(path, 1, 0, LONG_NAME_LEN);
+	TEST_CHECK(fat.file_open(&plain, path, &file)==0);
+	invalidate_cluster = file.dir_cluster;
+	invalidate_cache = &dir_cache;
+	check_open(&cached, &plain, path);
+	TEST_CHECK(invalidate_cache==NULL && dir_state(&dir_cache, file.dir_cluster)==FAT_DIR_CACHE_SEEN);
+	check_open(&cached, &plain, path);
+	TEST_CHECK(dir_state(&dir_cache, file.dir_cluster)==FAT_DIR_CACHE_INDEXED);
+	TEST_CHECK(locked_reads==0);
+}
+
+//Returns the lookups which found their directory not indexed
+static uint64_t run(reader *image, uint32_t memory_size) {
+	static uint8_t memory[128*1024];
+	fat_dir_cache dir_cache;
+	fat_drive cached, plain;
+
+	if (fat.mount(&cached, IMAGE_GEN_SECTOR_SIZE, reader_read_bytes, image) ||
+		fat.mount(&plain, IMAGE_GEN_SECTOR_SIZE, reader_read_bytes, image) ||
+		fat.attach_writer(&cached, reader_write_bytes) ||
+		fat_dir_cache_init(&dir_cache, memory, memory_size)) {
+		TEST_CHECK(!"mount");
+		return 0;
+	}
+	fat.attach_dir_cache(&cached, &dir_cache);
+
+	check_lookups(&cached, &plain);
+	check_writes(&cached, &plain);
+	check_lookups(&cached, &plain);
+
+	return dir_cache.misses;
+}
+
+int main(void) {
+	reader image;
+
+	if (image_gen_write(IMAGE, &params) || reader_open_rw(&image, IMAGE)) {
+		fprintf(stderr, "Cannot create %s\n", IMAGE);
+		return 1;
+	}
+
+	//Every directory fits: each is scanned once, and once more after it changes
+	TEST_CHECK(run(&image, 128*1024) < 2*(DIRS + 1));
+	run(&image, 16*1024); //About one does
+	run(&image, 8*1024); //Only the root does
+	run_locked(&image);
+
+	reader_close(&image);
+	unlink(IMAGE);
+
+	return TEST_RESULT;
+}
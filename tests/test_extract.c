@@ -0,0 +1,199 @@
+#define main extract_main
+#include "../extract.c"
+#undef main
+
+#include <ftw.h>
+#include "test.h"
+#include "test_image.h"
+
+/*
+ * Extracts an image made by image_gen with fragmented files and long names:
+ * - through the library, with a buffer smaller than some pieces: every byte matches
+ *   what fat.file_read gives, and every read is counted in the drive stats;
+ * - with the tool, in both modes, after some long names were made to lead out of the
+ *   destination and with a link planted in it: nothing is written outside.
+ */
+
+#define IMAGE "test_extract.img"
+#define DESTINATION "test_extract.out"
+#define ESCAPED "escaped" //Where the patched names lead, next to the destination
+#define VICTIM "test_extract.victim"
+#define DIRS (3)
+#define FILES_PER_DIR (10)
+#define FILE_SIZE (5000u)
+#define LONG_NAME_LEN (13) //A single long name entry
+#define READ_BUFFER_SIZE (4096)
+#define INDEX_SIZE (1024*1024u)
+#define EXTRACT_SIZE (1024*1024u)
+
+static const struct image_gen_params params = {FAT_HAS_FAT32 ? FAT32 : FAT16, 1, FAT_HAS_FAT32 ? 70000 : 60000, DIRS,
+											   FILES_PER_DIR, FILE_SIZE, 30, 1, LONG_NAME_LEN};
+
+static uint8_t extracted[DIRS*(FILES_PER_DIR + 1)][FILE_SIZE];
+static uint32_t extracted_bytes[DIRS*(FILES_PER_DIR + 1)];
+
+static int gather(void *ctx, uint32_t record, uint32_t offset, const void *data, uint32_t bytes) {
+	(void) ctx;
+
+	if (record >= DIRS*(FILES_PER_DIR + 1) || offset + bytes > FILE_SIZE)
+		return -1;
+
+	memcpy(extracted[record] + offset, data, bytes);
+	extracted_bytes[record] += bytes;
+
+	return 0;
+}
+
+static void test_library(fat_drive *drive) {
+	static uint8_t index_memory[INDEX_SIZE], extract_memory[EXTRACT_SIZE], buffer[READ_BUFFER_SIZE], data[FILE_SIZE];
+	char path[PATH_SIZE];
+	fat_extract extract;
+	fat_index index;
+	fat_stats stats;
+	fat_file file;
+	uint32_t i;
+
+	TEST_CHECK(fat_index_init(&index, index_memory, sizeof(index_memory))==0 &&
+			   fat_index_work(drive, &index, buffer, sizeof(buffer))==0);
+	TEST_CHECK(fat_extract_init(&extract, extract_memory, sizeof(extract_memory), &index)==0 &&
+			   fat_extract_add(&extract, drive, FAT_INDEX_ROOT)==0);
+	TEST_CHECK(extract.files==DIRS*FILES_PER_DIR && extract.broken_files==0);
+
+	fat.attach_stats(drive, &stats, NULL);
+	TEST_CHECK(fat_extract_run(&extract, drive, buffer, sizeof(buffer), gather, NULL)==0);
+	TEST_CHECK(fat.stats_get(drive, &stats)==0);
+	TEST_CHECK(extract.reads > 0 && stats.reads[FAT_IO_DATA]==extract.reads);
+	TEST_CHECK(stats.read_bytes[FAT_IO_DATA] >= (uint64_t) DIRS*FILES_PER_DIR*FILE_SIZE);
+	fat.attach_stats(drive, NULL, NULL);
+
+	for (i = 0; i < index.records_count; i++) {
+		if (index.records[i].attr & ATTR_DIRECTORY)
+			continue;
+
+		TEST_CHECK(fat_index_path(&index, i, path, sizeof(path)) &&
+				   fat.file_open(drive, path, &file)==0 && fat.file_read(drive, &file, data, FILE_SIZE)==FILE_SIZE);
+		TEST_CHECK(extracted_bytes[i]==FILE_SIZE && memcmp(extracted[i], data, FILE_SIZE)==0);
+	}
+}
+
+//Gives the only long name entry of the file another name, of up to 13 characters
+static void set_long_name(fat_drive *drive, struct test_device *device, uint32_t dir, uint32_t file,
+						  const char *name) {
+	static const uint8_t offsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+	char path[IMAGE_GEN_LONG_PATH_SIZE];
+	uint8_t entry[32];
+	uint16_t c;
+	fat_file found;
+	uint32_t i;
+
+	image_gen_long_file_path(path, dir, file, LONG_NAME_LEN);
+	TEST_CHECK(fat.file_open(drive, path, &found)==0);
+	TEST_CHECK(reader_read_bytes(&device->image, found.entry_address - 32, sizeof(entry), entry)!=NULL);
+	TEST_CHECK(entry[0]==0x41 && entry[11]==ATTR_LONG_NAME);
+
+	for (i = 0; i < 13; i++) {
+		c = i < strlen(name) ? (uint8_t) name[i] : i==strlen(name) ? 0 : 0xFFFF;
+		memcpy(entry + offsets[i], &c, sizeof(c));
+	}
+	TEST_CHECK(reader_write_bytes(&device->image, found.entry_address - 32, sizeof(entry), entry)==0);
+}
+
+static int file_matches(fat_drive *drive, uint32_t dir, uint32_t file) {
+	static uint8_t expected[FILE_SIZE], data[FILE_SIZE + 1];
+	char path[IMAGE_GEN_LONG_PATH_SIZE], output[PATH_SIZE];
+	fat_file found;
+	FILE *f;
+	size_t bytes;
+
+	image_gen_long_file_path(path, dir, file, LONG_NAME_LEN);
+	snprintf(output, sizeof(output), "%s%s", DESTINATION, path);
+	if (fat.file_open(drive, path, &found) || fat.file_read(drive, &found, expected, FILE_SIZE)!=FILE_SIZE ||
+		(f = fopen(output, "rb"))==NULL)
+		return 0;
+
+	bytes = fread(data, 1, sizeof(data), f);
+	fclose(f);
+
+	return bytes==FILE_SIZE && memcmp(data, expected, FILE_SIZE)==0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	(void) st;
+	(void) flag;
+	(void) ftw;
+
+	return remove(path);
+}
+
+static void remove_outputs(void) {
+	nftw(DESTINATION, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	unlink(ESCAPED);
+	unlink(VICTIM);
+}
+
+static int run_tool(int use_copy) {
+	char *argv[] = {"fat_extract", IMAGE, DESTINATION, NULL};
+	char *copy_argv[] = {"fat_extract", "-c", IMAGE, DESTINATION, NULL};
+
+	return use_copy ? extract_main(4, copy_argv) : extract_main(3, argv);
+}
+
+static void test_tool(fat_drive *drive, struct test_device *device) {
+	char path[IMAGE_GEN_LONG_PATH_SIZE], output[PATH_SIZE];
+	struct stat st;
+	FILE *victim;
+	int use_copy;
+	uint32_t dir, file;
+
+	set_long_name(drive, device, 0, 1, "../../" ESCAPED);
+	set_long_name(drive, device, 1, 2, "..");
+	set_long_name(drive, device, 2, 3, "a\\b");
+	set_long_name(drive, device, 2, 4, "tab\there");
+
+	for (use_copy = 0; use_copy <= 1; use_copy++) {
+		remove_outputs();
+		TEST_CHECK(run_tool(use_copy)==0);
+		TEST_CHECK(access(ESCAPED, F_OK)!=0);
+
+		for (dir = 0; dir < DIRS; dir++)
+			for (file = 0; file < FILES_PER_DIR; file++)
+				if (!(dir==0 && file==1) && !(dir==1 && file==2) && !(dir==2 && (file==3 || file==4)))
+					TEST_CHECK(file_matches(drive, dir, file));
+
+		TEST_CHECK(access(DESTINATION "/DIR00002/a\\b", F_OK)!=0);
+		TEST_CHECK(access(DESTINATION "/DIR00002/tab\there", F_OK)!=0);
+	}
+
+	//A link in place of an output file is not followed: the extraction stops
+	victim = fopen(VICTIM, "wb");
+	TEST_CHECK(victim!=NULL && fputs("untouched", victim) >= 0);
+	if (victim!=NULL)
+		fclose(victim);
+
+	image_gen_long_file_path(path, 1, 5, LONG_NAME_LEN);
+	snprintf(output, sizeof(output), "%s%s", DESTINATION, path);
+	TEST_CHECK(unlink(output)==0 && symlink("../../" VICTIM, output)==0);
+	TEST_CHECK(run_tool(0)!=0);
+	TEST_CHECK(stat(VICTIM, &st)==0 && st.st_size==(off_t) strlen("untouched"));
+
+	remove_outputs();
+}
+
+int main(void) {
+	struct test_device device;
+	fat_drive drive;
+
+	remove_outputs();
+	if (test_device_create(&device, IMAGE, &params) || test_mount(&drive, &device)) {
+		fprintf(stderr, "Cannot create %s\n", IMAGE);
+		return 1;
+	}
+
+	test_library(&drive);
+	test_tool(&drive, &device);
+
+	reader_close(&device.image);
+	unlink(IMAGE);
+
+	return TEST_RESULT;
+}
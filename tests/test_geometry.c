@@ -0,0 +1,88 @@
+#include <string.h>
+#include <unistd.h>
+#include "test.h"
+#include "test_image.h"
+
+/*
+ * fat.mount_geometry with the geometry saved from a mount of an image made by image_gen,
+ * of each FAT type built: as saved it mounts and reads like the full mount, tampered with
+ * in any of its sizes or positions it is refused, so that the caller mounts from the boot sector.
+ */
+
+#define IMAGE "test_geometry.img"
+
+static void check_mounts(const fat_geometry *geometry, reader *image, int expected) {
+	fat_drive drive;
+
+	TEST_CHECK(fat.mount_geometry(&drive, geometry, reader_read_bytes, image)==expected);
+}
+
+static void test_type(enum fat_version type) {
+	struct image_gen_params params = {type, 1, type==FAT16 ? 4200 : 65600, 2, 4, 3000, 0, 1, 0};
+	fat_geometry saved, tampered;
+	fat_drive drive, again;
+	fat_file file, file_again;
+	uint8_t data[3000], data_again[3000];
+	reader image;
+	char path[32];
+
+	if (image_gen_write(IMAGE, &params) || reader_open(&image, IMAGE) ||
+		fat.mount(&drive, IMAGE_GEN_SECTOR_SIZE, reader_read_bytes, &image)) {
+		TEST_CHECK(!"image");
+		return;
+	}
+
+	fat.geometry_save(&drive, &saved);
+	TEST_CHECK(fat.mount_geometry(&again, &saved, reader_read_bytes, &image)==0);
+	image_gen_file_path(path, 1, 3);
+	TEST_CHECK(fat.file_open(&drive, path, &file)==0 && fat.file_read(&drive, &file, data, sizeof(data))==sizeof(data));
+	TEST_CHECK(fat.file_open(&again, path, &file_again)==0 &&
+			   fat.file_read(&again, &file_again, data_again, sizeof(data_again))==sizeof(data_again));
+	TEST_CHECK(memcmp(data, data_again, sizeof(data))==0);
+
+#define TAMPERED(field, value) do { \
+		tampered = saved; \
+		tampered.field = value; \
+		check_mounts(&tampered, &image, -1); \
+	} while (0)
+
+	TAMPERED(version, FAT_GEOMETRY_VERSION + 1);
+	TAMPERED(type, 12);
+	TAMPERED(type, type==FAT16 ? FAT32 : FAT16);
+	TAMPERED(log_bytes_per_sector, 8);
+	TAMPERED(log_bytes_per_sector, 17);
+	TAMPERED(log_sectors_per_cluster, 20); //Its shift would overflow
+	TAMPERED(log_sectors_per_cluster, 8); //128KiB clusters
+	TAMPERED(number_of_fats, 0);
+	TAMPERED(number_of_fats, saved.number_of_fats + 1);
+	TAMPERED(fat_size_sectors, 0);
+	TAMPERED(fat_size_sectors, 1);
+	TAMPERED(clusters_count, 100);
+	TAMPERED(clusters_count, saved.clusters_count*16); //More than the FAT holds
+	TAMPERED(clusters_count, 0xFFFFFFFFu);
+	TAMPERED(first_fat_sector, saved.first_partition_sector);
+	TAMPERED(first_fat_sector, saved.first_fat_sector + 1);
+	TAMPERED(first_data_sector, saved.first_data_sector - 1);
+	TAMPERED(first_data_sector, 0xFFFFFFF0u);
+	TAMPERED(root_dir, type==FAT16 ? saved.root_dir + 1 : saved.clusters_count + 2);
+	TAMPERED(root_entries_count, type==FAT16 ? 0 : 512);
+	TAMPERED(fs_info_sector, saved.first_fat_sector);
+	TAMPERED(volume_serial, saved.volume_serial + 1);
+
+#undef TAMPERED
+
+	reader_close(&image);
+}
+
+int main(void) {
+	enum fat_version types[] = {FAT16, FAT32};
+	uint32_t i;
+
+	for (i = 0; i < sizeof(types)/sizeof(types[0]); i++)
+		if (types[i]==FAT16 ? FAT_HAS_FAT16 : FAT_HAS_FAT32)
+			test_type(types[i]);
+
+	unlink(IMAGE);
+
+	return TEST_RESULT;
+}
@@ -0,0 +1,72 @@
+#include "test_image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "../fat_index.h"
+
+#define TEST_INDEX_SIZE (4*1024*1024u)
+
+int test_device_create(struct test_device *device, const char *path, const struct image_gen_params *params) {
+	device->writes_left = -1;
+
+	if (image_gen_write(path, params) || reader_open_rw(&device->image, path))
+		return -1;
+
+	return 0;
+}
+
+void *test_device_read(void *ctx, uint64_t address, uint32_t bytes, void *buffer) {
+	struct test_device *device = ctx;
+
+	return reader_read_bytes(&device->image, address, bytes, buffer);
+}
+
+int test_device_write(void *ctx, uint64_t address, uint32_t bytes, const void *buffer) {
+	struct test_device *device = ctx;
+
+	if (device->writes_left==0)
+		return -1;
+	if (device->writes_left > 0)
+		device->writes_left--;
+
+	return reader_write_bytes(&device->image, address, bytes, buffer);
+}
+
+int test_mount(fat_drive *drive, struct test_device *device) {
+	if (fat.mount(drive, IMAGE_GEN_SECTOR_SIZE, test_device_read, device) ||
+		fat.attach_writer(drive, test_device_write))
+		return -1;
+
+	return 0;
+}
+
+int test_check(fat_drive *drive, fat_check_report *report, fat_check_issue_func_t issue_func) {
+	static uint8_t buffer[64*1024];
+	uint8_t *index_memory, *check_memory;
+	fat_index index;
+	int ret = -1;
+
+	index_memory = malloc(TEST_INDEX_SIZE);
+	check_memory = malloc(fat_check_memory_size(drive));
+
+	if (index_memory!=NULL && check_memory!=NULL && fat_index_init(&index, index_memory, TEST_INDEX_SIZE)==0 &&
+		fat_index_work(drive, &index, buffer, sizeof(buffer))==0 &&
+		fat_check_run(drive, &index, check_memory, fat_check_memory_size(drive), 0, report, issue_func, &index)==0)
+		ret = 0;
+
+	free(index_memory);
+	free(check_memory);
+
+	return ret;
+}
+
+void test_set_link(fat_drive *drive, struct test_device *device, uint32_t cluster, uint32_t next) {
+	uint32_t i, entry_size = drive->type==FAT16 ? 2 : 4;
+	uint64_t address;
+
+	for (i = 0; i < drive->number_of_fats; i++) {
+		address = ((uint64_t) (drive->first_fat_sector + i*drive->fat_size_sectors) << drive->log_bytes_per_sector) +
+			(uint64_t) cluster*entry_size;
+		if (reader_write_bytes(&device->image, address, entry_size, &next))
+			fprintf(stderr, "Cannot write the FAT entry of cluster %u\n", cluster);
+	}
+}
@@ -0,0 +1,31 @@
+#ifndef TEST_IMAGE_H
+#define TEST_IMAGE_H
+
+#include <stdint.h>
+#include "../fat.h"
+#include "../fat_check.h"
+#include "../image_gen.h"
+#include "../reader.h"
+
+/*
+ * Helpers of the tests working on images made by image_gen: a device whose
+ * writes can be made to fail after a number of them, and a whole volume check.
+ */
+
+struct test_device {
+  reader image;
+  int32_t writes_left; //Writes done before all the next ones fail, -1 for no limit
+};
+
+int test_device_create(struct test_device *device, const char *path, const struct image_gen_params *params);
+void *test_device_read(void *ctx, uint64_t address, uint32_t bytes, void *buffer);
+int test_device_write(void *ctx, uint64_t address, uint32_t bytes, const void *buffer);
+int test_mount(fat_drive *drive, struct test_device *device);
+
+//Makes the FAT entry of cluster point to next, in every FAT, behind the back of the drive
+void test_set_link(fat_drive *drive, struct test_device *device, uint32_t cluster, uint32_t next);
+
+//Indexes and checks the volume, issue_func gets the index as its context
+int test_check(fat_drive *drive, fat_check_report *report, fat_check_issue_func_t issue_func);
+
+#endif
@@ -0,0 +1,124 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../fat_index.h"
+#include "test.h"
+#include "test_image.h"
+
+/*
+ * Indexes an image made by image_gen with several threads, waiting on a condition
+ * when there is no directory to read, and with a single one: both find every entry.
+ * With too little memory for the index, both stop reading at once: no directory
+ * is read after the failure, counted in the drive stats.
+ */
+
+#define IMAGE "test_index.img"
+#define WORKERS (4)
+#define INDEX_SIZE (4*1024*1024u)
+#define SMALL_INDEX_SIZE (2048u) //Part of the root directory only
+#define BUFFER_SIZE (4096)
+
+static const struct image_gen_params params = {FAT_HAS_FAT32 ? FAT32 : FAT16, 1, FAT_HAS_FAT32 ? 70000 : 60000, 64,
+											   32, 0, 0, 1, 20};
+
+struct index_sync {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static fat_drive drive;
+static struct index_sync index_sync = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void mutex_lock(void *lock_ctx) {
+	pthread_mutex_lock(lock_ctx);
+}
+
+static void mutex_unlock(void *lock_ctx) {
+	pthread_mutex_unlock(lock_ctx);
+}
+
+static void index_wait(void *wait_ctx) {
+	struct index_sync *sync = wait_ctx;
+
+	pthread_cond_wait(&sync->cond, &sync->mutex);
+}
+
+static void index_notify(void *wait_ctx) {
+	pthread_cond_broadcast(&((struct index_sync *) wait_ctx)->cond);
+}
+
+static void *worker(void *arg) {
+	static _Thread_local uint8_t buffer[BUFFER_SIZE];
+	fat_index *index = arg;
+
+	return (void *) (intptr_t) fat_index_work(&drive, index, buffer, BUFFER_SIZE);
+}
+
+//The root directory is read in a cluster at a time, and its subdirectories are never started
+static void test_out_of_memory(uint32_t workers) {
+	static uint8_t memory[SMALL_INDEX_SIZE];
+	uint32_t root_clusters = (params.dirs*32 + drive.cluster_size_bytes - 1)/drive.cluster_size_bytes, i;
+	pthread_t threads[WORKERS];
+	fat_index index;
+	fat_stats stats;
+	void *result;
+
+	TEST_CHECK(fat_index_init(&index, memory, sizeof(memory))==0);
+	fat_index_set_lock(&index, mutex_lock, mutex_unlock, &index_sync.mutex);
+	fat_index_set_wait(&index, index_wait, index_notify, &index_sync);
+
+	fat.attach_stats(&drive, &stats, NULL);
+	for (i = 0; i < workers; i++)
+		TEST_CHECK(pthread_create(&threads[i], NULL, worker, &index)==0);
+	for (i = 0; i < workers; i++) {
+		pthread_join(threads[i], &result);
+		TEST_CHECK(result==(void *) (intptr_t) -1);
+	}
+	TEST_CHECK(fat.stats_get(&drive, &stats)==0);
+	fat.attach_stats(&drive, NULL, NULL);
+
+	TEST_CHECK(index.failed && index.active_workers==0 && index.records_count < params.dirs);
+	TEST_CHECK(stats.reads[FAT_IO_DIR] > 0 && stats.reads[FAT_IO_DIR] <= root_clusters);
+}
+
+int main(void) {
+	static uint8_t memory[INDEX_SIZE], single_memory[INDEX_SIZE], buffer[BUFFER_SIZE];
+	fat_index index, single;
+	struct test_device device;
+	pthread_t threads[WORKERS];
+	void *result;
+	uint32_t i;
+
+	if (test_device_create(&device, IMAGE, &params) ||
+		fat.mount(&drive, IMAGE_GEN_SECTOR_SIZE, test_device_read, &device)) {
+		fprintf(stderr, "Cannot create %s\n", IMAGE);
+		return 1;
+	}
+
+	TEST_CHECK(fat_index_init(&single, single_memory, INDEX_SIZE)==0);
+	TEST_CHECK(fat_index_work(&drive, &single, buffer, BUFFER_SIZE)==0);
+	TEST_CHECK(single.records_count==params.dirs*(params.files_per_dir + 1));
+
+	TEST_CHECK(fat_index_init(&index, memory, INDEX_SIZE)==0);
+	fat_index_set_lock(&index, mutex_lock, mutex_unlock, &index_sync.mutex);
+	fat_index_set_wait(&index, index_wait, index_notify, &index_sync);
+
+	for (i = 0; i < WORKERS; i++)
+		TEST_CHECK(pthread_create(&threads[i], NULL, worker, &index)==0);
+	for (i = 0; i < WORKERS; i++) {
+		pthread_join(threads[i], &result);
+		TEST_CHECK(result==NULL);
+	}
+
+	TEST_CHECK(index.records_count==single.records_count);
+	TEST_CHECK(index.active_workers==0 && !index.failed);
+
+	test_out_of_memory(1);
+	test_out_of_memory(WORKERS);
+
+	reader_close(&device.image);
+	unlink(IMAGE);
+
+	return TEST_RESULT;
+}
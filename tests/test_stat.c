@@ -0,0 +1,121 @@
+#include <string.h>
+#include <unistd.h>
+#include "test.h"
+#include "test_image.h"
+
+/*
+ * fat.stat_many on the files of an image made by image_gen, by long and 8.3 names,
+ * grouped by directory and mixed up, with missing paths and directories among them:
+ * it finds what fat.stat finds, and is timed as a single call. Then the 8.3 name of a file
+ * is made to start with 0xE5, stored as 0x05: both find it by that name.
+ */
+
+#define IMAGE "test_stat.img"
+#define DIRS (3)
+#define FILES_PER_DIR (20)
+#define LONG_NAME_LEN (30)
+#define PATHS (4*DIRS*FILES_PER_DIR)
+
+static const struct image_gen_params params = {FAT_HAS_FAT32 ? FAT32 : FAT16, 1, FAT_HAS_FAT32 ? 70000 : 60000, DIRS,
+											   FILES_PER_DIR, 1000, 0, 1, LONG_NAME_LEN};
+
+static char path_memory[PATHS][IMAGE_GEN_LONG_PATH_SIZE];
+static const char *paths[PATHS];
+static fat_entry_info infos[PATHS];
+static uint8_t found[PATHS];
+
+//Not a time, but monotonic and never 0: every timed call is counted
+static uint64_t ticks(void) {
+	static uint64_t now;
+
+	return ++now;
+}
+
+static uint32_t make_paths(void) {
+	uint32_t count = 0, dir, file;
+
+	//Grouped by directory, as a listing gives them
+	for (dir = 0; dir < DIRS; dir++) {
+		for (file = 0; file < FILES_PER_DIR; file++) {
+			image_gen_long_file_path(path_memory[count++], dir, file, LONG_NAME_LEN);
+			image_gen_file_path(path_memory[count++], dir, file);
+		}
+	}
+
+	//Then jumping from one directory to another, with misses
+	for (file = 0; file < FILES_PER_DIR; file++) {
+		for (dir = 0; dir < DIRS; dir++) {
+			image_gen_long_file_path(path_memory[count], dir, file, LONG_NAME_LEN);
+			if (file%3==0)
+				path_memory[count][strlen(path_memory[count]) - 1] = 'X';
+			count++;
+			if (file%5==0)
+				image_gen_dir_path(path_memory[count], dir);
+			else
+				snprintf(path_memory[count], IMAGE_GEN_LONG_PATH_SIZE, "/DIR%05u/MISSING", dir);
+			count++;
+		}
+	}
+
+	for (file = 0; file < count; file++)
+		paths[file] = path_memory[file];
+
+	return count;
+}
+
+static void test_kanji_name(fat_drive *drive, struct test_device *device) {
+	static const char *const path = "/DIR00001/\xE5" "0000002.BIN";
+	uint8_t kanji = FAT_ENTRY_NAME_KANJI_ENTRY, found_one;
+	char old_path[32];
+	fat_entry_info info, info_many;
+	fat_file file;
+
+	image_gen_file_path(old_path, 1, 2);
+	TEST_CHECK(fat.file_open(drive, old_path, &file)==0);
+	TEST_CHECK(reader_write_bytes(&device->image, file.entry_address, 1, &kanji)==0);
+
+	//A new mount, with nothing of the directory cached
+	TEST_CHECK(test_mount(drive, device)==0);
+	TEST_CHECK(fat.stat(drive, path, &info)==0 && info.first_cluster==file.first_cluster);
+	TEST_CHECK(fat.stat_many(drive, &path, 1, &info_many, &found_one)==1 && found_one);
+	TEST_CHECK(info_many.first_cluster==file.first_cluster);
+	TEST_CHECK(fat.stat(drive, old_path, &info)!=0);
+}
+
+int main(void) {
+	struct test_device device;
+	fat_entry_info info;
+	fat_stats stats;
+	fat_drive drive;
+	uint32_t count, found_count, expected = 0, i;
+	int ret;
+
+	if (test_device_create(&device, IMAGE, &params) || test_mount(&drive, &device)) {
+		fprintf(stderr, "Cannot create %s\n", IMAGE);
+		return 1;
+	}
+
+	count = make_paths();
+	fat.attach_stats(&drive, &stats, ticks);
+	found_count = fat.stat_many(&drive, paths, count, infos, found);
+	TEST_CHECK(fat.stats_get(&drive, &stats)==0);
+	TEST_CHECK(stats.api[FAT_API_STAT_MANY].calls==1 && stats.api[FAT_API_STAT].calls==0);
+	fat.attach_stats(&drive, NULL, NULL);
+
+	for (i = 0; i < count; i++) {
+		ret = fat.stat(&drive, paths[i], &info);
+		expected += ret==0;
+		TEST_CHECK(found[i]==(ret==0));
+		if (ret==0 && found[i])
+			TEST_CHECK(infos[i].attr==info.attr && infos[i].first_cluster==info.first_cluster &&
+					   infos[i].size_bytes==info.size_bytes);
+	}
+	TEST_CHECK(found_count==expected && expected > DIRS*FILES_PER_DIR*2 && expected < count);
+
+	test_kanji_name(&drive, &device);
+
+	reader_close(&device.image);
+	unlink(IMAGE);
+
+	return TEST_RESULT;
+}
@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../fat_index.h"
+#include "../fat_types.h"
+#include "test.h"
+#include "test_image.h"
+
+/*
+ * Write, truncate and delete on images made by image_gen, of each FAT type built:
+ * - filling the volume: the write is short, and what it reports is what the entry records;
+ * - truncating a chain shorter than its size, looping or leaving the volume: it fails and
+ *   the image is left as it was;
+ * - deleting files by long names whose parts are in two clusters of the directory:
+ *   all of them are marked deleted, and none of the other files' parts;
+ * - a device failing after n writes, for every n: the volume stays consistent,
+ *   at most with some lost clusters.
+ */
+
+#define IMAGE "test_write.img"
+#define FILE_SIZE (100*1024u) //200 clusters
+#define BIG_WRITE (300*1024u)
+#define CHUNK (64*1024u)
+#define MAX_FAILING_WRITES (40)
+#define LONG_NAME_LEN (40)
+#define LONG_NAME_PARTS (4) //And the 8.3 entry: with 512 byte clusters, some files span two clusters
+#define LONG_NAME_FILES (20)
+
+static uint8_t data[BIG_WRITE];
+
+static void make_params(struct image_gen_params *params, enum fat_version type) {
+	struct image_gen_params p = {type, 1, type==FAT16 ? 4200 : 65600, 1, 4, FILE_SIZE, 0, 1, 0};
+
+	*params = p;
+}
+
+static uint32_t free_clusters(fat_drive *drive) {
+	uint32_t count = 0;
+
+	TEST_CHECK(fat.free_clusters(drive, &count)==0);
+
+	return count;
+}
+
+static uint32_t file_size(fat_drive *drive, const char *path) {
+	fat_file file;
+
+	if (fat.file_open(drive, path, &file))
+		return UINT32_MAX;
+
+	return file.total_size_bytes;
+}
+
+//Chains longer than the sizes and lost clusters are what an interrupted change may leave
+static int consistent_issue(void *ctx, const fat_check_issue *issue) {
+	const fat_index *index = ctx;
+	uint32_t needed;
+
+	if (issue->problem==FAT_CHECK_SIZE_MISMATCH) {
+		needed = (index->records[issue->record].size_bytes + IMAGE_GEN_SECTOR_SIZE - 1)/IMAGE_GEN_SECTOR_SIZE;
+		TEST_CHECK(issue->count > needed);
+	} else {
+		TEST_CHECK(issue->problem==FAT_CHECK_LOST_CHAIN);
+	}
+
+	return 0;
+}
+
+static void check_clean(fat_drive *drive) {
+	fat_check_report report;
+
+	TEST_CHECK(test_check(drive, &report, NULL)==0);
+	TEST_CHECK(report.cross_linked==0 && report.broken_chains==0 && report.loops==0 && report.size_mismatches==0 &&
+			   report.lost_clusters==0);
+}
+
+static void check_consistent(fat_drive *drive) {
+	fat_check_report report;
+
+	TEST_CHECK(test_check(drive, &report, consistent_issue)==0);
+}
+
+static void test_full_disk(enum fat_version type) {
+	static const char path[] = "/DIR00000/BIG.BIN";
+	struct image_gen_params params;
+	struct test_device device;
+	uint32_t free_before, written, total = 0;
+	uint8_t buffer[IMAGE_GEN_SECTOR_SIZE];
+	fat_drive drive;
+	fat_file file;
+
+	make_params(&params, type);
+	if (test_device_create(&device, IMAGE, &params) || test_mount(&drive, &device)) {
+		TEST_CHECK(!"image");
+		return;
+	}
+
+	free_before = free_clusters(&drive);
+	TEST_CHECK(fat.file_create(&drive, path, &file)==0);
+	do {
+		written = fat.file_write(&drive, &file, data, CHUNK);
+		total += written;
+	} while (written==CHUNK);
+
+	TEST_CHECK(total==free_before*IMAGE_GEN_SECTOR_SIZE);
+	TEST_CHECK(fat.file_write(&drive, &file, data, 1)==0);
+	TEST_CHECK(free_clusters(&drive)==0);
+
+	//As seen by a drive mounted now
+	TEST_CHECK(test_mount(&drive, &device)==0);
+	TEST_CHECK(file_size(&drive, path)==total);
+	TEST_CHECK(fat.file_open(&drive, path, &file)==0 && fat.file_seek(&drive, &file, total - sizeof(buffer))==0 &&
+			   fat.file_read(&drive, &file, buffer, sizeof(buffer))==sizeof(buffer));
+	TEST_CHECK(memcmp(buffer, data + (total - sizeof(buffer))%CHUNK, sizeof(buffer))==0);
+	check_clean(&drive);
+
+	TEST_CHECK(fat.file_open(&drive, path, &file)==0 && fat.file_truncate(&drive, &file, 1000)==0);
+	TEST_CHECK(free_clusters(&drive)==free_before - 2 && file_size(&drive, path)==1000);
+	check_clean(&drive);
+
+	TEST_CHECK(fat.file_delete(&drive, path)==0);
+	TEST_CHECK(free_clusters(&drive)==free_before && file_size(&drive, path)==UINT32_MAX);
+	check_clean(&drive);
+
+	reader_close(&device.image);
+}
+
+static uint8_t *image_snapshot(size_t *size) {
+	FILE *image = fopen(IMAGE, "rb");
+	uint8_t *snapshot = NULL;
+
+	if (image!=NULL && fseek(image, 0, SEEK_END)==0 && (*size = (size_t) ftell(image)) > 0 &&
+		(snapshot = malloc(*size))!=NULL && (fseek(image, 0, SEEK_SET) || fread(snapshot, 1, *size, image)!=*size)) {
+		free(snapshot);
+		snapshot = NULL;
+	}
+
+	if (image!=NULL)
+		fclose(image);
+
+	return snapshot;
+}
+
+static void test_broken_chains(enum fat_version type) {
+	struct image_gen_params params;
+	struct test_device device;
+	uint8_t *before, *after;
+	size_t before_size, after_size;
+	uint32_t first;
+	fat_drive drive;
+	fat_file file;
+	char path[32];
+
+	make_params(&params, type);
+	if (test_device_create(&device, IMAGE, &params) || test_mount(&drive, &device)) {
+		TEST_CHECK(!"image");
+		return;
+	}
+
+	//The files are not fragmented: their clusters follow each other
+	image_gen_file_path(path, 0, 0);
+	TEST_CHECK(fat.file_open(&drive, path, &file)==0);
+	first = file.first_cluster;
+	test_set_link(&drive, &device, first + 9, type==FAT16 ? CLUSTER_EOC_MARK_16 : CLUSTER_EOC_MARK_32);
+	image_gen_file_path(path, 0, 1);
+	TEST_CHECK(fat.file_open(&drive, path, &file)==0);
+	test_set_link(&drive, &device, file.first_cluster + 5, file.first_cluster + 2);
+	image_gen_file_path(path, 0, 2);
+	TEST_CHECK(fat.file_open(&drive, path, &file)==0);
+	test_set_link(&drive, &device, file.first_cluster + 3, drive.clusters_count + 10);
+
+	before = image_snapshot(&before_size);
+	TEST_CHECK(before!=NULL);
+
+	//Short chain: 10 clusters, the size needs 100
+	image_gen_file_path(path, 0, 0);
+	TEST_CHECK(fat.file_open(&drive, path, &file)==0 && fat.file_truncate(&drive, &file, FILE_SIZE/2)!=0);
+
+	//Loop, and a link out of the volume
+	image_gen_file_path(path, 0, 1);
+	TEST_CHECK(fat.file_open(&drive, path, &file)==0 && fat.file_truncate(&drive, &file, 0)!=0);
+	TEST_CHECK(fat.file_delete(&drive, path)!=0);
+	image_gen_file_path(path, 0, 2);
+	TEST_CHECK(fat.file_open(&drive, path, &file)==0 && fat.file_truncate(&drive, &file, 1000)!=0);
+	TEST_CHECK(fat.file_delete(&drive, path)!=0);
+
+	after = image_snapshot(&after_size);
+	TEST_CHECK(after!=NULL && after_size==before_size && memcmp(before, after, before_size)==0);
+
+	//What is there of the short chain can still be cut
+	image_gen_file_path(path, 0, 0);
+	TEST_CHECK(fat.file_open(&drive, path, &file)==0 && fat.file_truncate(&drive, &file, 2000)==0);
+	TEST_CHECK(file_size(&drive, path)==2000);
+
+	free(before);
+	free(after);
+	reader_close(&device.image);
+}
+
+static uint32_t get_link(fat_drive *drive, struct test_device *device, uint32_t cluster) {
+	uint32_t entry_size = drive->type==FAT16 ? 2 : 4, next = 0;
+	uint64_t address = ((uint64_t) drive->first_fat_sector << drive->log_bytes_per_sector) + (uint64_t) cluster*entry_size;
+
+	TEST_CHECK(reader_read_bytes(&device->image, address, entry_size, &next)!=NULL);
+
+	return drive->type==FAT16 ? next : next & 0x0FFFFFFF;
+}
+
+//Long name parts of the directory not marked deleted, read from the device
+static uint32_t live_long_name_parts(fat_drive *drive, struct test_device *device, uint32_t cluster) {
+	uint8_t entries[IMAGE_GEN_SECTOR_SIZE];
+	uint32_t count = 0, i;
+	uint64_t address;
+
+	while (cluster >= 2 && cluster < drive->clusters_count + 2) {
+		address = (uint64_t) (drive->first_data_sector + ((cluster - 2) << drive->log_sectors_per_cluster)) <<
+			drive->log_bytes_per_sector;
+		TEST_CHECK(reader_read_bytes(&device->image, address, sizeof(entries), entries)!=NULL);
+
+		for (i = 0; i < sizeof(entries); i += 32)
+			count += entries[i]!=0 && entries[i]!=FAT_ENTRY_NAME_DELETED_ENTRY && entries[i + 11]==ATTR_LONG_NAME;
+
+		cluster = get_link(drive, device, cluster);
+	}
+
+	return count;
+}
+
+static void test_long_names(enum fat_version type) {
+	struct image_gen_params params = {type, 1, type==FAT16 ? 4200 : 65600, 1, LONG_NAME_FILES, 600, 0, 1,
+									  LONG_NAME_LEN};
+	uint64_t data_start, in_cluster;
+	char path[IMAGE_GEN_LONG_PATH_SIZE];
+	uint32_t file, spanning = 0;
+	struct test_device device;
+	fat_entry_info dir;
+	fat_drive drive;
+	fat_file found;
+
+	if (test_device_create(&device, IMAGE, &params) || test_mount(&drive, &device)) {
+		TEST_CHECK(!"image");
+		return;
+	}
+
+	image_gen_dir_path(path, 0);
+	TEST_CHECK(fat.stat(&drive, path, &dir)==0);
+	TEST_CHECK(live_long_name_parts(&drive, &device, dir.first_cluster)==LONG_NAME_PARTS*LONG_NAME_FILES);
+
+	//The layout is what the test is about
+	data_start = (uint64_t) drive.first_data_sector << drive.log_bytes_per_sector;
+	for (file = 0; file < LONG_NAME_FILES; file++) {
+		image_gen_long_file_path(path, 0, file, LONG_NAME_LEN);
+		TEST_CHECK(fat.file_open(&drive, path, &found)==0);
+		in_cluster = (found.entry_address - data_start)%drive.cluster_size_bytes;
+		spanning += in_cluster < LONG_NAME_PARTS*32;
+	}
+	TEST_CHECK(spanning > 0);
+
+	//Every other file first: the parts of the ones left are untouched
+	for (file = 0; file < LONG_NAME_FILES; file += 2) {
+		image_gen_long_file_path(path, 0, file, LONG_NAME_LEN);
+		TEST_CHECK(fat.file_delete(&drive, path)==0);
+	}
+	TEST_CHECK(live_long_name_parts(&drive, &device, dir.first_cluster)==LONG_NAME_PARTS*LONG_NAME_FILES/2);
+
+	TEST_CHECK(test_mount(&drive, &device)==0);
+	for (file = 1; file < LONG_NAME_FILES; file += 2) {
+		image_gen_long_file_path(path, 0, file, LONG_NAME_LEN);
+		TEST_CHECK(fat.file_delete(&drive, path)==0);
+	}
+	TEST_CHECK(live_long_name_parts(&drive, &device, dir.first_cluster)==0);
+	check_clean(&drive);
+
+	reader_close(&device.image);
+}
+
+static void test_failing_device(enum fat_version type) {
+	struct image_gen_params params;
+	struct test_device device;
+	uint32_t written;
+	int32_t writes;
+	fat_drive drive;
+	fat_file file;
+	char path[32];
+
+	make_params(&params, type);
+
+	for (writes = 0; writes < MAX_FAILING_WRITES; writes++) {
+		if (test_device_create(&device, IMAGE, &params) || test_mount(&drive, &device)) {
+			TEST_CHECK(!"image");
+			return;
+		}
+
+		//Appending: 600 clusters, over a few FAT sectors
+		device.writes_left = writes;
+		image_gen_file_path(path, 0, 1);
+		TEST_CHECK(fat.file_open(&drive, path, &file)==0 && fat.file_seek(&drive, &file, FILE_SIZE)==0);
+		written = fat.file_write(&drive, &file, data, BIG_WRITE);
+
+		device.writes_left = -1;
+		TEST_CHECK(test_mount(&drive, &device)==0 && file_size(&drive, path)==FILE_SIZE + written);
+		check_consistent(&drive);
+
+		//Shrinking a file and deleting another one
+		device.writes_left = writes;
+		image_gen_file_path(path, 0, 2);
+		if (fat.file_open(&drive, path, &file)==0)
+			fat.file_truncate(&drive, &file, 10000);
+		image_gen_file_path(path, 0, 3);
+		fat.file_delete(&drive, path);
+
+		device.writes_left = -1;
+		TEST_CHECK(test_mount(&drive, &device)==0);
+		image_gen_file_path(path, 0, 2);
+		TEST_CHECK(file_size(&drive, path)==FILE_SIZE || file_size(&drive, path)==10000);
+		check_consistent(&drive);
+
+		reader_close(&device.image);
+	}
+}
+
+int main(void) {
+	enum fat_version types[] = {FAT16, FAT32};
+	uint32_t i;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (uint8_t) (i*7 + i/IMAGE_GEN_SECTOR_SIZE);
+
+	for (i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+		if (types[i]==FAT16 ? !FAT_HAS_FAT16 : !FAT_HAS_FAT32)
+			continue;
+
+		test_full_disk(types[i]);
+		test_broken_chains(types[i]);
+		test_long_names(types[i]);
+		test_failing_device(types[i]);
+	}
+
+	unlink(IMAGE);
+
+	return TEST_RESULT;
+}